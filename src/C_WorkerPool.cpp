@@ -0,0 +1,181 @@
+/*==============================================================================
+/ C_WorkerPool.cpp
+/=============================================================================*/
+
+#include "C_WorkerPool.h"
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+    #include <immintrin.h>
+    #define CPU_RELAX() _mm_pause()
+#else
+    #define CPU_RELAX() std::this_thread::yield()
+#endif
+
+// How long an idle worker spins before it goes to sleep.  The solver issues
+// one run() per color batch, so the gaps inside a step are short and should
+// not pay for a wake up, while the gaps between steps are long.
+#define SPIN_COUNT 4000
+
+// Spins past this many rounds give up the core, in case there are more
+// threads than cores and the thread being waited on is not running
+#define PAUSE_COUNT 64
+
+static inline void backOff(unsigned spin)
+{
+    if(spin < PAUSE_COUNT)
+        CPU_RELAX();
+    else
+        std::this_thread::yield();
+}
+
+
+C_WorkerPool::C_WorkerPool() : d_uNumThreads(1), d_generation(0), d_nextItem(0), d_busyWorkers(0),
+    d_uSpinCount(0), d_bQuit(false), d_func(0), d_context(0), d_uCount(0), d_uGrain(1)
+{
+}
+
+C_WorkerPool::~C_WorkerPool()
+{
+    stopThreads();
+}
+
+unsigned C_WorkerPool::hardwareThreads()
+{
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+void C_WorkerPool::setThreadCount(unsigned n)
+{
+    if(n == 0)
+        n = 1;
+    if(n == d_uNumThreads)
+        return;
+
+    stopThreads();
+    startThreads(n);
+}
+
+void C_WorkerPool::startThreads(unsigned n)
+{
+    d_bQuit = false;
+    d_uNumThreads = n;
+
+    // With more threads than cores a spinning thread can hold the core the
+    // thread it waits on needs, so block straight away instead
+    d_uSpinCount = n <= hardwareThreads() ? SPIN_COUNT : 0;
+
+    for(unsigned i = 1; i < n; ++i)
+        d_threads.push_back(std::thread(&C_WorkerPool::workerLoop, this, i,
+                                        d_generation.load(std::memory_order_relaxed)));
+}
+
+void C_WorkerPool::stopThreads()
+{
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_bQuit = true;
+    }
+    d_wake.notify_all();
+    for(unsigned i = 0; i < d_threads.size(); ++i)
+        d_threads[i].join();
+    d_threads.clear();
+    d_uNumThreads = 1;
+}
+
+//------------------------------------------------------------------------------
+// void work()
+//
+// Claims chunks of the current loop until none are left.
+//------------------------------------------------------------------------------
+void C_WorkerPool::work(unsigned thread)
+{
+    for(;;)
+    {
+        unsigned begin = d_nextItem.fetch_add(d_uGrain, std::memory_order_relaxed);
+        if(begin >= d_uCount)
+            break;
+        unsigned end = begin + d_uGrain;
+        if(end > d_uCount || end < begin)
+            end = d_uCount;
+        d_func(d_context, begin, end, thread);
+    }
+}
+
+//------------------------------------------------------------------------------
+// void workerLoop()
+//
+// seen is the generation when the thread was created, a run() started before
+// the thread gets going must still be picked up.
+//------------------------------------------------------------------------------
+void C_WorkerPool::workerLoop(unsigned thread, unsigned seen)
+{
+    for(;;)
+    {
+        unsigned gen = d_generation.load(std::memory_order_acquire);
+        for(unsigned spin = 0; gen == seen && spin < d_uSpinCount; ++spin)
+        {
+            backOff(spin);
+            gen = d_generation.load(std::memory_order_acquire);
+        }
+
+        if(gen == seen)
+        {
+            std::unique_lock<std::mutex> lock(d_mutex);
+            while(d_generation.load(std::memory_order_acquire) == seen && !d_bQuit)
+                d_wake.wait(lock);
+            if(d_bQuit)
+                return;
+            gen = d_generation.load(std::memory_order_acquire);
+        }
+
+        seen = gen;
+        work(thread);
+        if(d_busyWorkers.fetch_sub(1, std::memory_order_acq_rel) == 1 && !d_uSpinCount)
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            d_done.notify_one();
+        }
+    }
+}
+
+void C_WorkerPool::run(unsigned count, unsigned grain, RangeFunc func, void* context)
+{
+    if(count == 0)
+        return;
+    if(grain == 0)
+        grain = 1;
+    if(d_uNumThreads <= 1 || count <= grain)
+    {
+        func(context, 0, count, 0);
+        return;
+    }
+
+    d_func = func;
+    d_context = context;
+    d_uCount = count;
+    d_uGrain = grain;
+    d_nextItem.store(0, std::memory_order_relaxed);
+    d_busyWorkers.store(d_uNumThreads - 1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_generation.fetch_add(1, std::memory_order_release);
+    }
+    d_wake.notify_all();
+
+    work(0);
+
+    // Every worker checks in, even the ones that found no chunk left, so that
+    // none of them can still be reading this loop when the next one starts
+    if(d_uSpinCount)
+    {
+        for(unsigned spin = 0; d_busyWorkers.load(std::memory_order_acquire) != 0; ++spin)
+            backOff(spin);
+    }
+    else
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        while(d_busyWorkers.load(std::memory_order_acquire) != 0)
+            d_done.wait(lock);
+    }
+}
@@ -0,0 +1,76 @@
+/*==============================================================================
+/ C_WorkerPool.h
+/ A small fixed pool of worker threads used to split the simulation's loops
+/ over particles and springs.  The calling thread always takes part in the
+/ work, so a pool of one thread runs everything inline.
+/=============================================================================*/
+
+#ifndef _WORKERPOOL_
+#define _WORKERPOOL_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class C_WorkerPool
+{
+public:
+    // Called for each chunk [begin, end) of a parallel loop.  thread is in
+    // the range [0, getThreadCount()) and is 0 for the calling thread.
+    typedef void (*RangeFunc)(void* context, unsigned begin, unsigned end, unsigned thread);
+
+    C_WorkerPool();
+    ~C_WorkerPool();
+
+    // The number of threads that take part in a loop, including the caller
+    void setThreadCount(unsigned n);
+    unsigned getThreadCount() const { return d_uNumThreads; }
+
+    // The number of hardware threads on this machine, at least 1
+    static unsigned hardwareThreads();
+
+    // Splits [0, count) into chunks of grain items and runs func over them.
+    // Returns once every chunk is done.  Loops of at most grain items run
+    // inline on the calling thread.
+    void run(unsigned count, unsigned grain, RangeFunc func, void* context);
+
+    // Same as run() for any functor with operator()(begin, end, thread)
+    template<class F>
+    void parallelFor(unsigned count, unsigned grain, F& f)
+    {
+        run(count, grain, &invoke<F>, &f);
+    }
+
+private:
+    template<class F>
+    static void invoke(void* context, unsigned begin, unsigned end, unsigned thread)
+    {
+        (*static_cast<F*>(context))(begin, end, thread);
+    }
+
+    void startThreads(unsigned n);
+    void stopThreads();
+    void workerLoop(unsigned thread, unsigned seen);
+    void work(unsigned thread);
+
+    unsigned d_uNumThreads;
+    std::vector<std::thread> d_threads;
+
+    std::mutex d_mutex;
+    std::condition_variable d_wake,         // Signals workers that a loop started
+                            d_done;         // Signals run() that the workers finished
+    std::atomic<unsigned> d_generation,     // Bumped once per run()
+                          d_nextItem,       // The next unclaimed item of the loop
+                          d_busyWorkers;    // Workers still inside the current run()
+    unsigned d_uSpinCount;                  // Rounds to spin before blocking, 0 to never spin
+    bool d_bQuit;
+
+    // The loop being run
+    RangeFunc d_func;
+    void* d_context;
+    unsigned d_uCount, d_uGrain;
+};
+
+#endif
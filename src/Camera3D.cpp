@@ -1,5 +1,6 @@
 #include "Camera3D.h"
-#include <GL/glu.h>
+#include <GL/gl.h>
+#include <math.h>
 
 //------------------------------------------------------------------------------
 // Constructor
@@ -21,6 +22,8 @@ Camera3D::Camera3D()
         vector3f look = d_camTarget - d_camPos;
         d_camSideVector = look.crossProduct(d_camUpVector);
         d_camSideVector.normalize();
+
+        setPerspective(60.0f, 1.0f, 0.1f, 1000.0f);
 }
 
 Camera3D::Camera3D(vector3f pos, vector3f target, vector3f camUp, vector3f sceneUp)
@@ -37,6 +40,118 @@ Camera3D::Camera3D(vector3f pos, vector3f target, vector3f camUp, vector3f scene
         vector3f look = d_camTarget - d_camPos;
         d_camSideVector = look.crossProduct(d_camUpVector);
         d_camSideVector.normalize();
+
+        setPerspective(60.0f, 1.0f, 0.1f, 1000.0f);
+}
+
+
+//------------------------------------------------------------------------------
+// updateView()
+// Builds the view matrix the way gluLookAt() does
+//------------------------------------------------------------------------------
+void Camera3D::updateView()
+{
+        vector3f f = d_camTarget - d_camPos;
+        f.normalize();
+        vector3f s = f.crossProduct(d_camUpVector);
+        s.normalize();
+        vector3f u = s.crossProduct(f);
+
+        float* m = d_view;
+        m[0] = s.x;  m[4] = s.y;  m[8] = s.z;   m[12] = -(s.x*d_camPos.x + s.y*d_camPos.y + s.z*d_camPos.z);
+        m[1] = u.x;  m[5] = u.y;  m[9] = u.z;   m[13] = -(u.x*d_camPos.x + u.y*d_camPos.y + u.z*d_camPos.z);
+        m[2] = -f.x; m[6] = -f.y; m[10] = -f.z; m[14] = f.x*d_camPos.x + f.y*d_camPos.y + f.z*d_camPos.z;
+        m[3] = 0.0f; m[7] = 0.0f; m[11] = 0.0f; m[15] = 1.0f;
+
+        updateFrustum();
+}
+
+
+//------------------------------------------------------------------------------
+// updateProjection()
+// Builds the projection matrix the way gluPerspective() does
+//------------------------------------------------------------------------------
+void Camera3D::updateProjection()
+{
+        const float f = 1.0f / tanf(d_fFov * 0.5f * (float)M_PI / 180.0f);
+        float* m = d_projection;
+        for(unsigned i = 0; i < 16; ++i)
+                m[i] = 0.0f;
+        m[0] = f / d_fAspect;
+        m[5] = f;
+        m[10] = (d_fFar + d_fNear) / (d_fNear - d_fFar);
+        m[11] = -1.0f;
+        m[14] = 2.0f * d_fFar * d_fNear / (d_fNear - d_fFar);
+}
+
+
+//------------------------------------------------------------------------------
+// updateFrustum()
+// Extracts the frustum planes from the rows of projection * view
+//------------------------------------------------------------------------------
+void Camera3D::updateFrustum()
+{
+        float c[16];
+        for(unsigned col = 0; col < 4; ++col)
+                for(unsigned row = 0; row < 4; ++row)
+                        c[col*4 + row] = d_projection[row]      * d_view[col*4]
+                                       + d_projection[4 + row]  * d_view[col*4 + 1]
+                                       + d_projection[8 + row]  * d_view[col*4 + 2]
+                                       + d_projection[12 + row] * d_view[col*4 + 3];
+
+        // Plane 2k is row 3 + row k, plane 2k+1 is row 3 - row k
+        for(unsigned k = 0; k < 3; ++k)
+        {
+                for(unsigned i = 0; i < 4; ++i)
+                {
+                        d_frustum[k*2][i] = c[i*4 + 3] + c[i*4 + k];
+                        d_frustum[k*2 + 1][i] = c[i*4 + 3] - c[i*4 + k];
+                }
+        }
+
+        for(unsigned p = 0; p < 6; ++p)
+        {
+                float* pl = d_frustum[p];
+                float len = sqrtf(pl[0]*pl[0] + pl[1]*pl[1] + pl[2]*pl[2]);
+                if(len > 0.0f)
+                        for(unsigned i = 0; i < 4; ++i)
+                                pl[i] /= len;
+        }
+}
+
+
+//------------------------------------------------------------------------------
+// setPerspective()
+// Sets the projection
+//------------------------------------------------------------------------------
+void Camera3D::setPerspective(float fovY, float aspect, float zNear, float zFar)
+{
+        d_fFov = fovY;
+        d_fAspect = aspect > 0.0f ? aspect : 1.0f;
+        d_fNear = zNear;
+        d_fFar = zFar;
+        updateProjection();
+        updateView();       // Refits the frustum
+}
+
+
+//------------------------------------------------------------------------------
+// isBoxVisible()
+// Tests the corner of the box furthest along each plane's normal, if that
+// one is behind any plane the whole box is
+//------------------------------------------------------------------------------
+bool Camera3D::isBoxVisible(const vector3f& min, const vector3f& max) const
+{
+        for(unsigned p = 0; p < 6; ++p)
+        {
+                const float* pl = d_frustum[p];
+                float x = pl[0] >= 0.0f ? max.x : min.x;
+                float y = pl[1] >= 0.0f ? max.y : min.y;
+                float z = pl[2] >= 0.0f ? max.z : min.z;
+                if(pl[0]*x + pl[1]*y + pl[2]*z + pl[3] < 0.0f)
+                        return false;
+        }
+        return true;
 }
 
 
@@ -47,6 +162,7 @@ Camera3D::Camera3D(vector3f pos, vector3f target, vector3f camUp, vector3f scene
 void Camera3D::setPosition(vector3f& pos)
 {
         d_camPos = pos;
+        updateView();
 }
 
 
@@ -57,6 +173,7 @@ void Camera3D::setPosition(vector3f& pos)
 void Camera3D::setTarget(vector3f& target)
 {
         d_camTarget = target;
+        updateView();
 }
 
 
@@ -67,6 +184,7 @@ void Camera3D::setTarget(vector3f& target)
 void Camera3D::setUpVector(vector3f& up)
 {
         d_camUpVector = up;
+        updateView();
 }
 
 
@@ -122,9 +240,7 @@ vector3f Camera3D::getSceneUpVector()
 //------------------------------------------------------------------------------
 void Camera3D::updateCamera()
 {
-    gluLookAt(d_camPos.X(), d_camPos.Y(), d_camPos.Z(),
-              d_camTarget.X(), d_camTarget.Y(), d_camTarget.Z(),
-              d_camUpVector.X(), d_camUpVector.Y(), d_camUpVector.Z() );
+    glMultMatrixf(d_view);
 }
 
 //------------------------------------------------------------------------------
@@ -135,6 +251,7 @@ void Camera3D::panHorizontal(float x)
 {
         d_camPos += d_camSideVector * x;
         d_camTarget += d_camSideVector * x;
+        updateView();
 }
 
 
@@ -146,6 +263,7 @@ void Camera3D::panVertical(float y)
 {
         d_camPos += d_camUpVector * y;
         d_camTarget += d_camUpVector * y;
+        updateView();
 }
 
 
@@ -169,6 +287,7 @@ void Camera3D::zoomCamera(float amount)
         }
         else
                 d_camPos += temp;
+        updateView();
 }
 
 
@@ -191,6 +310,7 @@ void Camera3D::orbitX(float amount)
         look = d_camTarget - d_camPos;
         d_camSideVector = look.crossProduct(d_camUpVector);
         d_camSideVector.normalize();
+        updateView();
 }
 
 
@@ -213,4 +333,5 @@ void Camera3D::orbitY(float amount)
         look = d_camTarget - d_camPos;
         d_camUpVector = d_camSideVector.crossProduct(look);
         d_camUpVector.normalize();
+        updateView();
 }
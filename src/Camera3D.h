@@ -3,6 +3,10 @@
 / A class for representing the camera in the 3D scene
 / The camera is not free roaming.  It fixed to look at a target.
 / Gives the user the ability to pan, orbit and zoom in relation to a target
+/
+/ The view and projection matrices are kept up to date with every change,
+/ along with the planes of the view frustum so that anything outside the
+/ view can be skipped before it is drawn.
 /==========================================================================*/
 
 #ifndef _CAMERA3D_
@@ -19,6 +23,24 @@ private:
         d_camSideVector,	// The Camera's side direction, the camera's X axis
         d_sceneUpVector;	// The scene's up vector
 
+        float d_fFov,               // Vertical field of view in degrees
+              d_fAspect,            // Width over height
+              d_fNear, d_fFar;      // Distance to the clipping planes
+
+        // Column major, as glLoadMatrixf() takes them
+        float d_view[16],
+              d_projection[16];
+
+        // Left, right, bottom, top, near and far planes as (a, b, c, d) with
+        // the normal pointing into the frustum, a point p is inside a plane
+        // if a*p.x + b*p.y + c*p.z + d >= 0
+        float d_frustum[6][4];
+
+        // Rebuild the cached matrices and planes
+        void updateView();
+        void updateProjection();
+        void updateFrustum();
+
 public:
         Camera3D();
         Camera3D(vector3f pos, vector3f target, vector3f camUp, vector3f sceneUp);
@@ -26,6 +48,18 @@ public:
         // updates the camera for the scene
         void updateCamera();
 
+        // Sets the projection, see gluPerspective()
+        void setPerspective(float fovY, float aspect, float zNear, float zFar);
+        float getFieldOfView() const { return d_fFov; }
+
+        // The cached matrices, column major
+        const float* getViewMatrix() const { return d_view; }
+        const float* getProjectionMatrix() const { return d_projection; }
+
+        // Returns false if the box is entirely outside the view frustum.  May
+        // return true for boxes just outside a corner of it.
+        bool isBoxVisible(const vector3f& min, const vector3f& max) const;
+
         // Set various components of the class
         void setPosition(vector3f& pos);
         void setTarget(vector3f& target);
@@ -1,9 +1,24 @@
 #include "GLViewport.h"
 #include "Camera3D.h"
 #include "cloth.h"
+#include "clothrenderer.h"
+#include "perfprobe.h"
+#include <math.h>
 
-GLViewPort::GLViewPort(QWidget *parent)
-    : QGLWidget(parent)
+// How often the overlay reads the probe buffers, and the window it covers
+#define HUD_REFRESH_MS 250
+#define HUD_WINDOW_SECONDS 1.0
+
+// The sim timer's interval in MainWindow, drawn as the budget in the graph
+#define HUD_STEP_BUDGET_US 5000.0
+
+// Vertical field of view in degrees, and the clipping planes
+#define VIEW_FOV 60.0f
+#define VIEW_NEAR 0.1f
+#define VIEW_FAR 1000.0f
+
+GLViewPort::GLViewPort(QWidget *parent, C_ClothRenderer* renderer, const QGLWidget* shareWidget)
+    : QGLWidget(parent, shareWidget)
 {
     d_camera = new Camera3D(vector3f(10.0f, 10.0f, 0.0f),
                             vector3f(0.0f, 0.0f, 0.0f),
@@ -12,11 +27,36 @@ GLViewPort::GLViewPort(QWidget *parent)
     d_bDrawSpring = false;
     d_bDrawCloth = true;
     d_bDrawParticles = false;
+    d_bDrawStats = false;
+    d_bShading = false;
+    d_uHudGraphCount = 0;
+    d_uLod = 0;
+
+    d_bOwnsRenderer = !renderer || (shareWidget && !isSharing());
+    d_renderer = d_bOwnsRenderer ? new C_ClothRenderer() : renderer;
+
+    // The viewport only repaints when something changes, the overlay is
+    // the exception as its numbers move while the cloth stands still
+    d_qStatsTimer = new QTimer(this);
+    d_qStatsTimer->setInterval(HUD_REFRESH_MS);
+    connect(d_qStatsTimer, SIGNAL(timeout()), this, SLOT(update()));
 }
 
 GLViewPort::~GLViewPort()
 {
+    // The renderer owns GL objects in this widget's context
+    if(d_bOwnsRenderer)
+    {
+        makeCurrent();
+        delete d_renderer;
+    }
+    delete d_camera;
+}
 
+void GLViewPort::setCloth(C_Cloth* c)
+{
+    d_renderer->setCloth(c);
+    update();
 }
 
 QSize GLViewPort::sizeHint() const
@@ -36,13 +76,14 @@ void GLViewPort::initializeGL()
 }
 
 
-// Update viewport and projection matrix
+// Update viewport and projection matrix.  The camera keeps the projection so
+// that it can cull against it.
 void GLViewPort::resizeGL(int w, int h)
 {
     glViewport(0, 0, w, h);
+    d_camera->setPerspective(VIEW_FOV, (GLfloat) w/(GLfloat) (h ? h : 1), VIEW_NEAR, VIEW_FAR);
     glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(60.0, (GLfloat) w/(GLfloat) h, 0.0, 1000.0);
+    glLoadMatrixf(d_camera->getProjectionMatrix());
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
 }
@@ -50,16 +91,145 @@ void GLViewPort::resizeGL(int w, int h)
 
 void GLViewPort::paintGL()
 {
+    PERF_SCOPE(PERF_PAINT);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glPushMatrix();
     d_camera->updateCamera();
-    if(d_bDrawCloth)
-        d_cloth->draw();
-    if(d_bDrawSpring)
-        d_cloth->drawMesh();
-    if(d_bDrawParticles)
-        d_cloth->drawParticles();
+    {
+        PERF_SCOPE(PERF_DRAW);
+        if(d_bDrawCloth)
+        {
+            // Pixels a unit covers at a distance of one
+            float fov = d_camera->getFieldOfView();
+            float pixelsPerUnit = height() / (2.0f * tanf(fov * 0.5f * (float)M_PI / 180.0f));
+            d_uLod = d_renderer->selectLod(d_camera->getPosition(), pixelsPerUnit, d_uLod);
+            d_renderer->draw(d_bShading, d_uLod, d_camera);
+        }
+        if(d_bDrawSpring)
+            d_renderer->drawMesh();
+        if(d_bDrawParticles)
+            d_renderer->drawParticles();
+    }
     glPopMatrix();
+
+    // Nothing is read from the probes while the overlay is hidden
+    if(d_bDrawStats)
+        drawStats();
+}
+
+//------------------------------------------------------------------------------
+// updateStats()
+// Reads the probe buffers into the overlay's text and graph.  The buffers
+// are only read every HUD_REFRESH_MS, not on every paint.
+//------------------------------------------------------------------------------
+void GLViewPort::updateStats()
+{
+    static const PerfStage stages[] = { PERF_STEP, PERF_SUMFORCES, PERF_INTEGRATE,
+                                        PERF_CONSTRAINTS, PERF_CONSTRAINT_ITER, PERF_PAINT };
+    static const char* labels[] = { "step", "  forces", "  integrate", "  constraints",
+                                    "    per iteration", "paint" };
+
+    d_qStatsAge.start();
+    d_qStatsLines.clear();
+
+    const C_Cloth* cloth = d_renderer->getCloth();
+    if(cloth)
+    {
+        d_qStatsLines << QString("particles %1   springs %2   iterations %3")
+                         .arg(cloth->getParticleCount()).arg(cloth->getSpringCount())
+                         .arg(cloth->getSolverIterations());
+        d_qStatsLines << QString("lod %1   tiles drawn %2 of %3").arg(d_uLod)
+                         .arg(d_renderer->getTilesDrawn()).arg(d_renderer->getTileCount());
+    }
+
+#ifdef CLOTH_PROFILING
+    PerfStageStats step, paint;
+    C_PerfProbes::getStats(PERF_STEP, HUD_WINDOW_SECONDS, step);
+    C_PerfProbes::getStats(PERF_PAINT, HUD_WINDOW_SECONDS, paint);
+    d_qStatsLines << QString("steps/s %1   paints/s %2")
+                     .arg(step.perSecond, 0, 'f', 0).arg(paint.perSecond, 0, 'f', 0);
+
+    for(unsigned i = 0; i < sizeof(stages) / sizeof(stages[0]); ++i)
+    {
+        PerfStageStats st;
+        C_PerfProbes::getStats(stages[i], HUD_WINDOW_SECONDS, st);
+        d_qStatsLines << QString("%1 avg %2 ms  p99 %3 ms").arg(labels[i], -18)
+                         .arg(st.meanUs * 1e-3, 6, 'f', 3).arg(st.p99Us * 1e-3, 6, 'f', 3);
+    }
+    d_uHudGraphCount = C_PerfProbes::getRecent(PERF_STEP, d_hudGraph, HUD_GRAPH_SAMPLES);
+#else
+    Q_UNUSED(stages);
+    Q_UNUSED(labels);
+    d_qStatsLines << QString("build with CLOTH_PROFILING for timings");
+    d_uHudGraphCount = 0;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// drawStats()
+// Draws the performance overlay in the top left corner and a graph of recent
+// step times in the bottom left, with the step budget as a red line.
+//------------------------------------------------------------------------------
+void GLViewPort::drawStats()
+{
+    if(d_qStatsLines.isEmpty() || d_qStatsAge.elapsed() >= HUD_REFRESH_MS)
+        updateStats();
+
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_TEXTURE_2D);
+
+    glColor3f(1.0, 1.0, 0.0);
+    QFont font("Monospace", 9);
+    font.setStyleHint(QFont::TypeWriter);
+    for(int i = 0; i < d_qStatsLines.size(); ++i)
+        renderText(8, 16 + i * 14, d_qStatsLines[i], font);
+
+    if(d_uHudGraphCount > 1)
+    {
+        // Pixel coordinates with the origin in the bottom left
+        glMatrixMode(GL_PROJECTION);
+        glPushMatrix();
+        glLoadIdentity();
+        glOrtho(0, width(), 0, height(), -1, 1);
+        glMatrixMode(GL_MODELVIEW);
+        glPushMatrix();
+        glLoadIdentity();
+
+        const float x0 = 8, y0 = 8, w = 240, h = 60;
+        double top = HUD_STEP_BUDGET_US * 1.5;
+        for(unsigned i = 0; i < d_uHudGraphCount; ++i)
+            top = qMax(top, d_hudGraph[i]);
+
+        glColor3f(0.3f, 0.3f, 0.3f);
+        glBegin(GL_LINE_LOOP);
+        glVertex2f(x0, y0);
+        glVertex2f(x0 + w, y0);
+        glVertex2f(x0 + w, y0 + h);
+        glVertex2f(x0, y0 + h);
+        glEnd();
+
+        float budget = y0 + h * (float)(HUD_STEP_BUDGET_US / top);
+        glColor3f(0.8f, 0.0f, 0.0f);
+        glBegin(GL_LINES);
+        glVertex2f(x0, budget);
+        glVertex2f(x0 + w, budget);
+        glEnd();
+
+        glColor3f(0.0f, 1.0f, 0.0f);
+        glBegin(GL_LINE_STRIP);
+        for(unsigned i = 0; i < d_uHudGraphCount; ++i)
+            glVertex2f(x0 + w * i / (HUD_GRAPH_SAMPLES - 1), y0 + h * (float)(d_hudGraph[i] / top));
+        glEnd();
+
+        glPopMatrix();
+        glMatrixMode(GL_PROJECTION);
+        glPopMatrix();
+        glMatrixMode(GL_MODELVIEW);
+    }
+
+    glPopAttrib();
 }
 
 void GLViewPort::mousePressEvent(QMouseEvent *event)
@@ -85,20 +255,42 @@ void GLViewPort::mouseMoveEvent(QMouseEvent *event)
         d_camera->zoomCamera(d_qMouseDeltaPosY*(-.01));
 
     d_qMouselastPos = event->pos();
+    if(event->buttons() & (Qt::LeftButton | Qt::RightButton | Qt::MiddleButton))
+        update();
 }
 
 
 void GLViewPort::setDrawCloth(bool b)
 {
     d_bDrawCloth = b;
+    update();
 }
 
 void GLViewPort::setDrawParticles(bool b)
 {
     d_bDrawParticles = b;
+    update();
 }
 
 void GLViewPort::setDrawSprings(bool b)
 {
     d_bDrawSpring = b;
+    update();
+}
+
+void GLViewPort::setShading(bool b)
+{
+    d_bShading = b;
+    update();
+}
+
+void GLViewPort::setDrawStats(bool b)
+{
+    d_bDrawStats = b;
+    d_qStatsLines.clear();
+    if(b)
+        d_qStatsTimer->start();
+    else
+        d_qStatsTimer->stop();
+    update();
 }
@@ -6,16 +6,20 @@
 
 class Camera3D;
 class C_Cloth;
+class C_ClothRenderer;
 
 class GLViewPort : public QGLWidget
 {
     Q_OBJECT
 
 public:
-    GLViewPort(QWidget *parent);
+    // Viewports created with the same renderer and a shareWidget from the
+    // same group draw one copy of the cloth's buffers.  Without a renderer,
+    // or if the contexts cannot share, the viewport makes its own.
+    GLViewPort(QWidget *parent, C_ClothRenderer* renderer = 0, const QGLWidget* shareWidget = 0);
     ~GLViewPort();
 
-    void setCloth(C_Cloth* c) { d_cloth = c; }
+    void setCloth(C_Cloth* c);
     QSize sizeHint() const;
 
     // Define the Scene in which the display will show
@@ -25,6 +29,8 @@ public slots:
     void setDrawParticles(bool b);
     void setDrawCloth(bool b);
     void setDrawSprings(bool b);
+    void setDrawStats(bool b);
+    void setShading(bool b);
 
 signals:
     void clicked();
@@ -38,12 +44,25 @@ protected:
     //void mouseReleaseEvent(QMouseEvent *event);
 
 private:
+    // Performance overlay
+    void updateStats();
+    void drawStats();
 
-    bool d_bDrawSpring, d_bDrawCloth, d_bDrawParticles;
+    enum { HUD_GRAPH_SAMPLES = 120 };
+
+    bool d_bDrawSpring, d_bDrawCloth, d_bDrawParticles, d_bDrawStats, d_bShading;
+    bool d_bOwnsRenderer;
+    unsigned d_uLod;                // The level of detail last drawn
     int d_qMouseDeltaPosX, d_qMouseDeltaPosY;
     QPoint d_qMouselastPos;
-    C_Cloth* d_cloth;
+    C_ClothRenderer* d_renderer;
     Camera3D* d_camera;
+
+    QTime d_qStatsAge;              // Time since the overlay was last refreshed
+    QTimer* d_qStatsTimer;          // Repaints the overlay while it is shown
+    QStringList d_qStatsLines;
+    double d_hudGraph[HUD_GRAPH_SAMPLES];   // Recent step times in us
+    unsigned d_uHudGraphCount;
 };
 
 
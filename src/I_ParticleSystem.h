@@ -3,12 +3,14 @@
 
 
 #include "C_Vertex.h"
+#include "perfprobe.h"
 
 template<class real>
 class I_ParticleSystem
 {
 public:
-    I_ParticleSystem() : d_dragCoef(0), d_pPositions(0), d_pOldPositions(0), d_pAccel(0)
+    I_ParticleSystem() : d_dragCoef(0), d_uNumParticles(0), d_pPositions(0), d_pOldPositions(0),
+        d_pAccel(0), d_uFrame(0), d_uTopology(0)
     {}
 
     virtual ~I_ParticleSystem()
@@ -16,30 +18,66 @@ public:
         wipeParticleData();
     }
 
-    virtual void draw() = 0;
     virtual void stepSimulation(const real& dt)
     {
+        PERF_SCOPE(PERF_STEP);
         d_dt = dt;
-        sumForces();
-        integrate();
-        applyConstraints();
+        {
+            PERF_SCOPE(PERF_SUMFORCES);
+            sumForces();
+        }
+        {
+            PERF_SCOPE(PERF_INTEGRATE);
+            integrate();
+        }
+        {
+            PERF_SCOPE(PERF_CONSTRAINTS);
+            applyConstraints();
+        }
+        ++d_uFrame;
     }
 
     virtual void setGravity(const vector3f& g) { d_vGravity = g; }
 
+    // Read only access to the particle data, used by renderers and the C API
+    unsigned getParticleCount() const { return d_uNumParticles; }
+    const C_Vertex* getVertices() const { return d_pPositions; }
+
+    // The positions one step ago, which is the state the current frame
+    // was stepped from
+    const vector3f* getPreviousPositions() const { return d_pOldPositions; }
+
+    // Changes whenever the particle data changes, so renderers can tell when
+    // they need to upload it again
+    unsigned getFrame() const { return d_uFrame; }
+
+    // Changes whenever the particles are rebuilt, anything derived from the
+    // mesh's connectivity must be built again
+    unsigned getTopology() const { return d_uTopology; }
+
 protected:
 
     virtual void integrate()
     {
+        integrateRange(0, d_uNumParticles);
+    }
+
+    // Verlet integration of the particles [begin, end), split out so that
+    // derived systems can run it over several threads
+    void integrateRange(unsigned begin, unsigned end)
+    {
+        const real a = 2.0 - d_dragCoef;
+        const real b = 1.0 - d_dragCoef;
+        const real dt2 = d_dt * d_dt;
         vector3f temp;
-        for(unsigned i = 0; i < d_uNumParticles; ++i)
+        for(unsigned i = begin; i < end; ++i)
         {
             vector3f& pos = d_pPositions[i].pos;
             vector3f& oldPos = d_pOldPositions[i];
-            vector3f& a = d_pAccel[i];
+            vector3f& acc = d_pAccel[i];
             temp = pos;
             //pos += pos - oldPos + (a * d_dt * d_dt);
-            pos = (2.0-d_dragCoef)*pos - (1.0-d_dragCoef)*oldPos + (a * d_dt * d_dt);
+            pos = a*pos - b*oldPos + (acc * dt2);
             oldPos = temp;
         }
     }
@@ -49,6 +87,8 @@ protected:
     virtual void initParticleData(unsigned particleCount)
     {
         d_uNumParticles = particleCount;
+        ++d_uFrame;
+        ++d_uTopology;
         d_pPositions = new C_Vertex[particleCount];
         d_pOldPositions = new vector3f[particleCount];
         d_pAccel = new vector3f[particleCount];
@@ -58,17 +98,17 @@ protected:
     {
         if(d_pPositions)
         {
-            delete d_pPositions;
+            delete [] d_pPositions;
             d_pPositions = 0;
         }
         if(d_pOldPositions)
         {
-            delete d_pOldPositions;
+            delete [] d_pOldPositions;
             d_pOldPositions = 0;
         }
         if(d_pAccel)
         {
-            delete d_pAccel;
+            delete [] d_pAccel;
             d_pAccel = 0;
         }
 
@@ -82,6 +122,8 @@ protected:
     vector3f* d_pOldPositions;
     vector3f* d_pAccel;
     vector3f d_vGravity;
+    unsigned d_uFrame;      // Bumped by every step and every new set of particles
+    unsigned d_uTopology;   // Bumped by every new set of particles
 };
 
 #endif // I_PARTICLESYSTEM_H
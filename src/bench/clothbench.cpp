@@ -0,0 +1,518 @@
+/*==============================================================================
+/ clothbench.cpp
+/ Microbenchmarks for C_Cloth::stepSimulation() and each of its stages across
+/ grid sizes, thread counts and solver modes.  Only needs the solver library
+/ (cloth.cpp, collider.cpp, meshcollider.cpp, objfile.cpp, spatialhash.cpp,
+/ clothbvh.cpp, ccd.cpp, C_WorkerPool.cpp), no GL or Qt.
+/
+/ Usage: clothbench [options]
+/   --sizes 32,64,...       Grid edge lengths, each run is size x size particles
+/   --threads 1,2,4         Worker thread counts
+/   --modes gs,colored      Solver modes
+/   --reorder on,off        Runs with the particles and springs reordered for
+/                           locality, without, or both (default on)
+/   --mesh file.obj         Steps the cloth made from this OBJ instead of grids
+/   --iterations n          Constraint iterations per step (default 3)
+/   --bend k                Bend stiffness, above zero adds the bending
+/                           springs to the sweeps (default 0)
+/   --samples n             Timed steps per run, by default scaled to the size
+/   --warmup n              Untimed steps before sampling (default 5)
+/   --out file.json         Write the results here instead of stdout
+/   --compare base.json     Compare against an earlier run, exits with 2 if
+/                           any p50 got slower than the threshold
+/   --threshold pct         Allowed p50 slowdown for --compare (default 10)
+/
+/ On Linux each stage also counts the last level cache misses of the thread
+/ running the benchmark, which is all of them with one worker thread.  The
+/ counts are -1 where the counter cannot be opened.
+/=============================================================================*/
+
+#include "../cloth.h"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+//==============================================================================
+// TYPES
+//==============================================================================
+
+// Gives the benchmark access to the individual stages of a step
+class C_BenchCloth : public C_Cloth
+{
+public:
+    void setTimeStep(float dt) { d_dt = dt; }
+    void runIntegrate() { integrate(); }
+};
+
+struct BenchConfig
+{
+    std::vector<unsigned> sizes, threads;
+    std::vector<C_Cloth::SolverMode> modes;
+    std::vector<bool> reorders;
+    unsigned iterations, samples, warmup;
+    float bend;
+    std::string outPath, comparePath, meshPath;
+    double threshold;
+};
+
+struct BenchResult
+{
+    unsigned size, particles, springs, threads, samples;
+    std::string mode, stage;
+    bool reorder;
+    double meanUs, p50Us, p99Us, particlesPerSec,
+           missesPerStep;       // -1 if they could not be counted
+};
+
+//------------------------------------------------------------------------------
+// Counts the last level cache misses of the calling thread
+//------------------------------------------------------------------------------
+class C_MissCounter
+{
+    int d_fd;
+
+public:
+    C_MissCounter() : d_fd(-1)
+    {
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        d_fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~C_MissCounter()
+    {
+#ifdef __linux__
+        if(d_fd >= 0)
+            close(d_fd);
+#endif
+    }
+
+    bool isOpen() const { return d_fd >= 0; }
+
+    unsigned long long read() const
+    {
+        unsigned long long count = 0;
+#ifdef __linux__
+        if(d_fd >= 0 && ::read(d_fd, &count, sizeof(count)) != sizeof(count))
+            count = 0;
+#endif
+        return count;
+    }
+};
+
+enum Stage { STAGE_FORCES, STAGE_INTEGRATE, STAGE_CONSTRAINTS, STAGE_STEP, NUM_STAGES };
+static const char* s_stageNames[NUM_STAGES] = { "sumForces", "integrate", "applyConstraints", "stepSimulation" };
+
+typedef std::chrono::steady_clock Clock;
+
+static const float TIME_STEP = 0.005f;
+
+//==============================================================================
+// HELPERS
+//==============================================================================
+
+static const char* modeName(C_Cloth::SolverMode m)
+{
+    return m == C_Cloth::SOLVER_GAUSS_SEIDEL ? "gauss_seidel" : "colored";
+}
+
+static double elapsedUs(Clock::time_point a, Clock::time_point b)
+{
+    return std::chrono::duration<double, std::micro>(b - a).count();
+}
+
+static std::vector<unsigned> parseList(const char* s)
+{
+    std::vector<unsigned> v;
+    while(*s)
+    {
+        char* end;
+        unsigned long n = strtoul(s, &end, 10);
+        if(end == s)
+            break;
+        v.push_back((unsigned)n);
+        s = (*end == ',') ? end + 1 : end;
+    }
+    return v;
+}
+
+// Value of the percentile p (0..1) of sorted samples
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if(sorted.empty())
+        return 0;
+    size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+static BenchResult summarize(const std::vector<double>& samplesUs, unsigned size, unsigned particles,
+                             unsigned springs, unsigned threads, const char* mode, const char* stage,
+                             bool reorder, double misses)
+{
+    std::vector<double> sorted(samplesUs);
+    std::sort(sorted.begin(), sorted.end());
+
+    double sum = 0;
+    for(size_t i = 0; i < sorted.size(); ++i)
+        sum += sorted[i];
+
+    BenchResult r;
+    r.size = size;
+    r.particles = particles;
+    r.springs = springs;
+    r.threads = threads;
+    r.samples = (unsigned)sorted.size();
+    r.mode = mode;
+    r.stage = stage;
+    r.reorder = reorder;
+    r.missesPerStep = misses;
+    r.meanUs = sorted.empty() ? 0 : sum / sorted.size();
+    r.p50Us = percentile(sorted, 0.5);
+    r.p99Us = percentile(sorted, 0.99);
+    r.particlesPerSec = r.meanUs > 0 ? particles / (r.meanUs * 1e-6) : 0;
+    return r;
+}
+
+// Builds a square cloth like the one MainWindow uses, pinned at two corners,
+// or with a mesh, the mesh hung by its top like MainWindow's garments
+static bool setupCloth(C_BenchCloth& cloth, unsigned size, const std::string& meshPath)
+{
+    if(!meshPath.empty())
+    {
+        if(!cloth.initializeMesh(meshPath.c_str(), 50, 550.0, 400.0, 0.0005))
+            return false;
+        const ClothBounds& bounds = cloth.getBounds();
+        const float top = bounds.max.y - 0.01f * (bounds.max.y - bounds.min.y);
+        for(unsigned i = 0; i < cloth.getParticleCount(); ++i)
+            if(cloth.getVertices()[i].pos.y >= top)
+                cloth.lockParticle(i);
+    }
+    else
+    {
+        cloth.initialize(10.0f, 10.0f, size, size, 50, 550.0, 400.0, 0.0005, ZAXIS);
+        cloth.lockParticle(0, 0);
+        cloth.lockParticle(0, size - 1);
+    }
+    cloth.setGravity(vector3f(0.0, -32.0, 0));
+    cloth.setTimeStep(TIME_STEP);
+    return true;
+}
+
+//==============================================================================
+// BENCHMARK
+//==============================================================================
+
+static void runConfig(const BenchConfig& cfg, unsigned size, unsigned threads,
+                      C_Cloth::SolverMode mode, bool reorder, std::vector<BenchResult>& results)
+{
+    C_BenchCloth cloth;
+    cloth.setThreadCount(threads);
+    cloth.setSolverMode(mode);
+    cloth.setSolverIterations(cfg.iterations);
+    cloth.setBendStiffness(cfg.bend);
+    cloth.setReordering(reorder);
+    if(!setupCloth(cloth, size, cfg.meshPath))
+    {
+        fprintf(stderr, "clothbench: cannot load %s\n", cfg.meshPath.c_str());
+        return;
+    }
+
+    const unsigned particles = cloth.getParticleCount();
+
+    // Keep the total work of a run roughly constant across sizes
+    unsigned samples = cfg.samples;
+    if(!samples)
+        samples = std::max(5u, std::min(200u, (unsigned)(20000000.0 / particles)));
+
+    for(unsigned i = 0; i < cfg.warmup; ++i)
+        cloth.stepSimulation(TIME_STEP);
+
+    C_MissCounter counter;
+    std::vector<double> times[NUM_STAGES];
+    unsigned long long misses[NUM_STAGES] = { 0 };
+    for(unsigned i = 0; i < samples; ++i)
+    {
+        Clock::time_point t0 = Clock::now();
+        const unsigned long long m0 = counter.read();
+        cloth.sumForces();
+        const unsigned long long m1 = counter.read();
+        Clock::time_point t1 = Clock::now();
+        cloth.runIntegrate();
+        const unsigned long long m2 = counter.read();
+        Clock::time_point t2 = Clock::now();
+        cloth.applyConstraints();
+        const unsigned long long m3 = counter.read();
+        Clock::time_point t3 = Clock::now();
+
+        times[STAGE_FORCES].push_back(elapsedUs(t0, t1));
+        times[STAGE_INTEGRATE].push_back(elapsedUs(t1, t2));
+        times[STAGE_CONSTRAINTS].push_back(elapsedUs(t2, t3));
+        misses[STAGE_FORCES] += m1 - m0;
+        misses[STAGE_INTEGRATE] += m2 - m1;
+        misses[STAGE_CONSTRAINTS] += m3 - m2;
+    }
+
+    for(unsigned i = 0; i < samples; ++i)
+    {
+        Clock::time_point t0 = Clock::now();
+        const unsigned long long m0 = counter.read();
+        cloth.stepSimulation(TIME_STEP);
+        misses[STAGE_STEP] += counter.read() - m0;
+        times[STAGE_STEP].push_back(elapsedUs(t0, Clock::now()));
+    }
+
+    for(unsigned s = 0; s < NUM_STAGES; ++s)
+    {
+        const double perStep = counter.isOpen() ? (double)misses[s] / samples : -1.0;
+        results.push_back(summarize(times[s], size, particles, cloth.getSpringCount(),
+                                    threads, modeName(mode), s_stageNames[s], reorder, perStep));
+        const BenchResult& r = results.back();
+        fprintf(stderr, "%5u^2 %2u threads %-12s %-16s %-10s mean %10.1f us  p50 %10.1f us  p99 %10.1f us  %8.2f Mparticles/s"
+                        "  %10.0f misses/step\n",
+                size, threads, r.mode.c_str(), r.stage.c_str(), reorder ? "reorder" : "no-reorder",
+                r.meanUs, r.p50Us, r.p99Us, r.particlesPerSec * 1e-6, r.missesPerStep);
+    }
+}
+
+//==============================================================================
+// JSON OUTPUT AND COMPARISON
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Writes one result object per line so that --compare can read the file back
+// without a full JSON parser.
+//------------------------------------------------------------------------------
+static void writeJson(FILE* f, const BenchConfig& cfg, const std::vector<BenchResult>& results)
+{
+    fprintf(f, "{\n");
+    fprintf(f, "  \"benchmark\": \"clothbench\",\n");
+    fprintf(f, "  \"hardware_threads\": %u,\n", C_WorkerPool::hardwareThreads());
+    fprintf(f, "  \"iterations\": %u,\n", cfg.iterations);
+    fprintf(f, "  \"bend_stiffness\": %.3f,\n", cfg.bend);
+    fprintf(f, "  \"results\": [\n");
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult& r = results[i];
+        fprintf(f, "    {\"size\": %u, \"particles\": %u, \"springs\": %u, \"threads\": %u, "
+                   "\"mode\": \"%s\", \"stage\": \"%s\", \"reorder\": \"%s\", \"samples\": %u, "
+                   "\"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"particles_per_sec\": %.1f, "
+                   "\"cache_misses_per_step\": %.1f}%s\n",
+                r.size, r.particles, r.springs, r.threads, r.mode.c_str(), r.stage.c_str(),
+                r.reorder ? "on" : "off", r.samples, r.meanUs, r.p50Us, r.p99Us, r.particlesPerSec,
+                r.missesPerStep, (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+// Finds "key": in line and returns a pointer just past it, or 0
+static const char* findKey(const char* line, const char* key)
+{
+    std::string k = std::string("\"") + key + "\":";
+    const char* p = strstr(line, k.c_str());
+    if(!p)
+        return 0;
+    p += k.size();
+    while(*p == ' ')
+        ++p;
+    return p;
+}
+
+static bool readString(const char* line, const char* key, std::string& out)
+{
+    const char* p = findKey(line, key);
+    if(!p || *p != '"')
+        return false;
+    const char* end = strchr(p + 1, '"');
+    if(!end)
+        return false;
+    out.assign(p + 1, end);
+    return true;
+}
+
+static bool readNumber(const char* line, const char* key, double& out)
+{
+    const char* p = findKey(line, key);
+    if(!p)
+        return false;
+    out = strtod(p, 0);
+    return true;
+}
+
+static std::string resultKey(unsigned size, unsigned threads, const std::string& mode, const std::string& stage,
+                             const std::string& reorder)
+{
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%u/%u/%s/%s/%s", size, threads, mode.c_str(), stage.c_str(), reorder.c_str());
+    return buf;
+}
+
+static bool loadBaseline(const char* path, std::map<std::string, double>& p50)
+{
+    FILE* f = fopen(path, "r");
+    if(!f)
+        return false;
+
+    char line[1024];
+    while(fgets(line, sizeof(line), f))
+    {
+        // Runs from before the reordering could be turned off had it on
+        std::string mode, stage, reorder;
+        double size, threads, value;
+        if(!readString(line, "reorder", reorder))
+            reorder = "on";
+        if(readString(line, "mode", mode) && readString(line, "stage", stage) &&
+           readNumber(line, "size", size) && readNumber(line, "threads", threads) &&
+           readNumber(line, "p50_us", value))
+            p50[resultKey((unsigned)size, (unsigned)threads, mode, stage, reorder)] = value;
+    }
+    fclose(f);
+    return true;
+}
+
+// Returns the number of regressions
+static unsigned compareResults(const BenchConfig& cfg, const std::vector<BenchResult>& results)
+{
+    std::map<std::string, double> base;
+    if(!loadBaseline(cfg.comparePath.c_str(), base))
+    {
+        fprintf(stderr, "clothbench: cannot read baseline %s\n", cfg.comparePath.c_str());
+        return 0;
+    }
+
+    unsigned regressions = 0;
+    fprintf(stderr, "\n%-40s %12s %12s %9s\n", "run", "base p50 us", "p50 us", "change");
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult& r = results[i];
+        std::string key = resultKey(r.size, r.threads, r.mode, r.stage, r.reorder ? "on" : "off");
+        std::map<std::string, double>::const_iterator it = base.find(key);
+        if(it == base.end() || it->second <= 0)
+            continue;
+
+        double change = (r.p50Us - it->second) / it->second * 100.0;
+        bool regressed = change > cfg.threshold;
+        regressions += regressed;
+        fprintf(stderr, "%-40s %12.1f %12.1f %+8.1f%%%s\n", key.c_str(), it->second, r.p50Us, change,
+                regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+//==============================================================================
+// MAIN
+//==============================================================================
+
+int main(int argc, char* argv[])
+{
+    BenchConfig cfg;
+    cfg.sizes = parseList("32,64,128,256,512,1024,2048");
+    cfg.threads.push_back(1);
+    if(C_WorkerPool::hardwareThreads() > 1)
+        cfg.threads.push_back(C_WorkerPool::hardwareThreads());
+    cfg.modes.push_back(C_Cloth::SOLVER_GAUSS_SEIDEL);
+    cfg.modes.push_back(C_Cloth::SOLVER_COLORED);
+    cfg.reorders.push_back(true);
+    cfg.iterations = 3;
+    cfg.bend = 0.0f;
+    cfg.samples = 0;
+    cfg.warmup = 5;
+    cfg.threshold = 10.0;
+
+    for(int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        const char* val = (i + 1 < argc) ? argv[i + 1] : 0;
+        if(!val)
+        {
+            fprintf(stderr, "clothbench: %s needs a value\n", arg);
+            return 1;
+        }
+        ++i;
+
+        if(!strcmp(arg, "--sizes"))
+            cfg.sizes = parseList(val);
+        else if(!strcmp(arg, "--threads"))
+            cfg.threads = parseList(val);
+        else if(!strcmp(arg, "--modes"))
+        {
+            cfg.modes.clear();
+            if(strstr(val, "gs"))
+                cfg.modes.push_back(C_Cloth::SOLVER_GAUSS_SEIDEL);
+            if(strstr(val, "colored"))
+                cfg.modes.push_back(C_Cloth::SOLVER_COLORED);
+        }
+        else if(!strcmp(arg, "--reorder"))
+        {
+            cfg.reorders.clear();
+            if(strstr(val, "on"))
+                cfg.reorders.push_back(true);
+            if(strstr(val, "off"))
+                cfg.reorders.push_back(false);
+        }
+        else if(!strcmp(arg, "--mesh"))
+            cfg.meshPath = val;
+        else if(!strcmp(arg, "--iterations"))
+            cfg.iterations = atoi(val);
+        else if(!strcmp(arg, "--bend"))
+            cfg.bend = (float)atof(val);
+        else if(!strcmp(arg, "--samples"))
+            cfg.samples = atoi(val);
+        else if(!strcmp(arg, "--warmup"))
+            cfg.warmup = atoi(val);
+        else if(!strcmp(arg, "--out"))
+            cfg.outPath = val;
+        else if(!strcmp(arg, "--compare"))
+            cfg.comparePath = val;
+        else if(!strcmp(arg, "--threshold"))
+            cfg.threshold = atof(val);
+        else
+        {
+            fprintf(stderr, "clothbench: unknown option %s\n", arg);
+            return 1;
+        }
+    }
+
+    // A mesh is one run per setting, reported as size 0
+    if(!cfg.meshPath.empty())
+        cfg.sizes.assign(1, 0);
+
+    std::vector<BenchResult> results;
+    for(size_t s = 0; s < cfg.sizes.size(); ++s)
+        for(size_t t = 0; t < cfg.threads.size(); ++t)
+            for(size_t m = 0; m < cfg.modes.size(); ++m)
+                for(size_t o = 0; o < cfg.reorders.size(); ++o)
+                    if((cfg.sizes[s] >= 2 || !cfg.meshPath.empty()) && cfg.threads[t] >= 1)
+                        runConfig(cfg, cfg.sizes[s], cfg.threads[t], cfg.modes[m], cfg.reorders[o], results);
+
+    FILE* out = stdout;
+    if(!cfg.outPath.empty() && !(out = fopen(cfg.outPath.c_str(), "w")))
+    {
+        fprintf(stderr, "clothbench: cannot write %s\n", cfg.outPath.c_str());
+        return 1;
+    }
+    writeJson(out, cfg, results);
+    if(out != stdout)
+        fclose(out);
+
+    if(!cfg.comparePath.empty() && compareResults(cfg, results))
+        return 2;
+    return 0;
+}
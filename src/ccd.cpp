@@ -0,0 +1,291 @@
+/*==============================================================================
+/ ccd.cpp
+/ Continuous collision tests between moving points and edges.
+/=============================================================================*/
+
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "ccd.h"
+#include <math.h>
+
+// Halvings of a bracket around a root of the cubic, which leaves it a
+// billionth of the step wide
+#define CCD_BISECTIONS 30
+
+//==============================================================================
+// LOCAL FUNCTIONS
+//==============================================================================
+
+// The cubic is solved in doubles, the cross products of nearly parallel
+// edges lose too much in floats
+struct Vec
+{
+    double x, y, z;
+};
+
+static inline Vec toVec(const vector3f& v)
+{
+    Vec r = { v.x, v.y, v.z };
+    return r;
+}
+
+static inline Vec sub(const Vec& a, const Vec& b)
+{
+    Vec r = { a.x - b.x, a.y - b.y, a.z - b.z };
+    return r;
+}
+
+static inline Vec add(const Vec& a, const Vec& b)
+{
+    Vec r = { a.x + b.x, a.y + b.y, a.z + b.z };
+    return r;
+}
+
+static inline Vec scale(const Vec& a, double s)
+{
+    Vec r = { a.x * s, a.y * s, a.z * s };
+    return r;
+}
+
+static inline Vec cross(const Vec& a, const Vec& b)
+{
+    Vec r = { a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x };
+    return r;
+}
+
+static inline double dot(const Vec& a, const Vec& b)
+{
+    return a.x*b.x + a.y*b.y + a.z*b.z;
+}
+
+//------------------------------------------------------------------------------
+// The squared distance between the segments p0-p1 and q0-q1, from Ericson's
+// Real-Time Collision Detection 5.1.9
+//------------------------------------------------------------------------------
+static double segmentDistance2(const Vec& p0, const Vec& p1, const Vec& q0, const Vec& q1)
+{
+    const Vec d1 = sub(p1, p0), d2 = sub(q1, q0), r = sub(p0, q0);
+    const double a = dot(d1, d1), e = dot(d2, d2), f = dot(d2, r);
+    double s = 0.0, u = 0.0;
+
+    if(a <= 1e-30 && e <= 1e-30)
+        return dot(r, r);
+    if(a <= 1e-30)
+        u = f / e < 0.0 ? 0.0 : (f / e > 1.0 ? 1.0 : f / e);
+    else
+    {
+        const double c = dot(d1, r);
+        if(e <= 1e-30)
+            s = -c / a < 0.0 ? 0.0 : (-c / a > 1.0 ? 1.0 : -c / a);
+        else
+        {
+            const double b = dot(d1, d2), denom = a*e - b*b;
+            if(denom > 0.0)
+            {
+                s = (b*f - c*e) / denom;
+                s = s < 0.0 ? 0.0 : (s > 1.0 ? 1.0 : s);
+            }
+            u = (b*s + f) / e;
+            if(u < 0.0)
+            {
+                u = 0.0;
+                s = -c / a < 0.0 ? 0.0 : (-c / a > 1.0 ? 1.0 : -c / a);
+            }
+            else if(u > 1.0)
+            {
+                u = 1.0;
+                s = (b - c) / a < 0.0 ? 0.0 : ((b - c) / a > 1.0 ? 1.0 : (b - c) / a);
+            }
+        }
+    }
+
+    const Vec d = sub(add(p0, scale(d1, s)), add(q0, scale(d2, u)));
+    return dot(d, d);
+}
+
+// The positions of the four points at time t
+struct Motion
+{
+    Vec x0[4], v[4];
+
+    Vec at(unsigned k, double t) const { return add(x0[k], scale(v[k], t)); }
+};
+
+// Whether point 0 is within the thickness of the triangle of points 1 to 3
+// at time t.  The points are coplanar there, so the point is either inside
+// the triangle or its distance is to one of the edges.
+struct VertexTriangleTest
+{
+    const Motion* m;
+    double thickness2;
+
+    bool operator()(double t) const
+    {
+        const Vec p = m->at(0, t), a = m->at(1, t), b = m->at(2, t), c = m->at(3, t);
+        const Vec n = cross(sub(b, a), sub(c, a));
+        const double n2 = dot(n, n);
+        if(n2 > 1e-30)
+        {
+            // Signed areas of the triangles the point makes with each edge
+            const double u = dot(cross(sub(b, p), sub(c, p)), n);
+            const double v = dot(cross(sub(c, p), sub(a, p)), n);
+            const double w = dot(cross(sub(a, p), sub(b, p)), n);
+            if(u >= 0.0 && v >= 0.0 && w >= 0.0)
+                return true;
+        }
+        return segmentDistance2(p, p, a, b) <= thickness2 || segmentDistance2(p, p, b, c) <= thickness2 ||
+               segmentDistance2(p, p, c, a) <= thickness2;
+    }
+};
+
+// Whether the edge from point 0 to 1 is within the thickness of the edge
+// from point 2 to 3 at time t
+struct EdgeEdgeTest
+{
+    const Motion* m;
+    double thickness2;
+
+    bool operator()(double t) const
+    {
+        return segmentDistance2(m->at(0, t), m->at(1, t), m->at(2, t), m->at(3, t)) <= thickness2;
+    }
+};
+
+//------------------------------------------------------------------------------
+// Fills c with the cubic in t whose roots are the times at which the vector
+// d is in the plane of e1 and e2, each moving from e(0) at t = 0 with a
+// velocity over the step
+//------------------------------------------------------------------------------
+static void coplanarCubic(const Vec& e1, const Vec& e1v, const Vec& e2, const Vec& e2v,
+                          const Vec& d, const Vec& dv, double c[4])
+{
+    const Vec n0 = cross(e1, e2);
+    const Vec n1 = add(cross(e1v, e2), cross(e1, e2v));
+    const Vec n2 = cross(e1v, e2v);
+    c[0] = dot(n0, d);
+    c[1] = dot(n1, d) + dot(n0, dv);
+    c[2] = dot(n2, d) + dot(n1, dv);
+    c[3] = dot(n2, dv);
+}
+
+static inline double cubicAt(const double c[4], double t)
+{
+    return ((c[3]*t + c[2])*t + c[1])*t + c[0];
+}
+
+//------------------------------------------------------------------------------
+// Finds the roots of the cubic c in [0, 1] in order and returns the first
+// one that passes test in t.  The interval is split where the cubic turns,
+// so each piece is monotonic and holds at most one root, which is bracketed
+// by bisection.  The lower end of the bracket is taken so that the time is
+// never past the contact.
+//------------------------------------------------------------------------------
+template<class T>
+static bool firstRoot(const double c[4], const T& test, float& t)
+{
+    double split[4] = { 0.0, 1.0, 1.0, 1.0 };
+    unsigned numSplit = 1;
+
+    // Where the derivative 3 c3 t^2 + 2 c2 t + c1 is zero
+    const double a = 3.0 * c[3], b = 2.0 * c[2];
+    if(fabs(a) > 1e-300)
+    {
+        const double disc = b*b - 4.0*a*c[1];
+        if(disc > 0.0)
+        {
+            const double r = sqrt(disc);
+            double t0 = (-b - r) / (2.0*a), t1 = (-b + r) / (2.0*a);
+            if(t0 > t1)
+            {
+                const double s = t0;
+                t0 = t1;
+                t1 = s;
+            }
+            if(t0 > 0.0 && t0 < 1.0)
+                split[numSplit++] = t0;
+            if(t1 > 0.0 && t1 < 1.0)
+                split[numSplit++] = t1;
+        }
+    }
+    else if(fabs(b) > 1e-300 && -c[1] / b > 0.0 && -c[1] / b < 1.0)
+        split[numSplit++] = -c[1] / b;
+    split[numSplit] = 1.0;
+
+    for(unsigned k = 0; k < numSplit; ++k)
+    {
+        double lo = split[k], hi = split[k + 1];
+        double flo = cubicAt(c, lo), fhi = cubicAt(c, hi);
+        if(flo == 0.0)
+        {
+            if(test(lo))
+            {
+                t = (float)lo;
+                return true;
+            }
+            continue;
+        }
+        if((flo < 0.0) == (fhi < 0.0) && fhi != 0.0)
+            continue;
+
+        for(unsigned i = 0; i < CCD_BISECTIONS; ++i)
+        {
+            const double mid = 0.5 * (lo + hi);
+            const double fmid = cubicAt(c, mid);
+            if((fmid < 0.0) == (flo < 0.0) && fmid != 0.0)
+            {
+                lo = mid;
+                flo = fmid;
+            }
+            else
+                hi = mid;
+        }
+        if(test(hi))
+        {
+            t = (float)lo;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void buildMotion(const vector3f start[4], const vector3f end[4], Motion& m)
+{
+    for(unsigned k = 0; k < 4; ++k)
+    {
+        m.x0[k] = toVec(start[k]);
+        m.v[k] = sub(toVec(end[k]), m.x0[k]);
+    }
+}
+
+
+//==============================================================================
+// FUNCTIONS
+//==============================================================================
+
+bool vertexTriangleImpact(const vector3f start[4], const vector3f end[4], float thickness, float& t)
+{
+    Motion m;
+    buildMotion(start, end, m);
+
+    double c[4];
+    coplanarCubic(sub(m.x0[2], m.x0[1]), sub(m.v[2], m.v[1]), sub(m.x0[3], m.x0[1]), sub(m.v[3], m.v[1]),
+                  sub(m.x0[0], m.x0[1]), sub(m.v[0], m.v[1]), c);
+
+    VertexTriangleTest test = { &m, (double)thickness * thickness };
+    return firstRoot(c, test, t);
+}
+
+bool edgeEdgeImpact(const vector3f start[4], const vector3f end[4], float thickness, float& t)
+{
+    Motion m;
+    buildMotion(start, end, m);
+
+    double c[4];
+    coplanarCubic(sub(m.x0[1], m.x0[0]), sub(m.v[1], m.v[0]), sub(m.x0[3], m.x0[2]), sub(m.v[3], m.v[2]),
+                  sub(m.x0[2], m.x0[0]), sub(m.v[2], m.v[0]), c);
+
+    EdgeEdgeTest test = { &m, (double)thickness * thickness };
+    return firstRoot(c, test, t);
+}
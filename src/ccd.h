@@ -0,0 +1,35 @@
+/*==============================================================================
+/ ccd.h
+/ Continuous collision tests between moving points and edges.  Every point
+/ moves in a straight line from where it was at the start of a step to where
+/ it is at the end, and the tests find the earliest time in the step at which
+/ a point passes through a triangle or one edge passes through another.
+/
+/ Both tests look for the times the four points involved are coplanar, which
+/ are the roots of a cubic in the step's time, and check each root in order
+/ for whether the point is inside the triangle or the edges cross there.
+/=============================================================================*/
+
+#ifndef _CCD_
+#define _CCD_
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "vector3.h"
+
+//==============================================================================
+// FUNCTIONS
+//==============================================================================
+
+// Point 0 against the triangle of points 1 to 3, which move from start to
+// end.  A root counts as a hit if the point is within thickness of the
+// triangle there.  Returns false if they never meet, otherwise sets t to the
+// time of the first contact, from 0 at start to 1 at end.
+bool vertexTriangleImpact(const vector3f start[4], const vector3f end[4], float thickness, float& t);
+
+// The edge from point 0 to 1 against the edge from point 2 to 3, as above
+bool edgeEdgeImpact(const vector3f start[4], const vector3f end[4], float thickness, float& t);
+
+
+#endif
@@ -8,125 +8,2326 @@
 // INCLUDED LIBRARIES AND FILES
 //==============================================================================
 #include "cloth.h"
-#include "glee.h"
-#include <GL/gl.h>
-#include <time.h>
+#include "ccd.h"
+#include "objfile.h"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    #include <xmmintrin.h>
+    #define CLOTH_SSE
+#endif
+
+// Chunk sizes handed to the worker threads
+#define PARTICLE_GRAIN  4096
+#define SPRING_GRAIN    2048
+#define LEAF_GRAIN      64
+
+// Share of the self collision distance the particles may move before the
+// spatial hash must be built again.  The hash cells are grown by twice this
+// so that nothing is missed in between.
+#define SELF_HASH_SLACK 0.25f
+
+// Share of the cell size within which two parts of the cloth count as
+// touching for the continuous collision
+#define CCD_THICKNESS 0.01f
+
+// Passes the continuous collision makes over a step.  Stopping a particle
+// can cause impacts with parts that were clear of it before, so the
+// impacts are looked for again until there are none, and the last pass
+// sends the particles it still finds back to where the step started.
+#define CCD_PASSES 4
+
+// Share of the way to its first impact a stopped particle is let go
+#define CCD_BACKOFF 0.9f
+
+// Two edges out of a vertex of a mesh give a bending spring between their
+// far ends when the cosine of the angle between them is at most this, so
+// when they nearly carry on from each other
+#define BEND_MAX_COS -0.8f
+
+// The room initializeMesh() makes for tearing: a share of the particles
+// more, a share of each color's springs more and a few besides, and spare
+// colors for the springs that fit in no color in use
+#define TEAR_PARTICLE_SHARE 4
+#define TEAR_SPRING_SHARE   4
+#define TEAR_SPRING_ROOM    16
+#define TEAR_SPARE_COLORS   4
+
+// Most triangles around a particle that can be split
+#define TEAR_MAX_FAN 32
+
+// The colors are sorted again by their first particle once the springs
+// moved since they last were come to this share of them
+#define TEAR_COMPACT_SHARE 16
+
+//==============================================================================
+// LOCAL FUNCTIONS
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Hashes a particle index and a step count into 32 random bits.  Used for the
+// wind instead of rand(), which is not safe to call from several threads.
+//------------------------------------------------------------------------------
+static inline unsigned hashRandom(unsigned a, unsigned b)
+{
+    unsigned h = a * 0x9E3779B1u ^ (b + 0x7F4A7C15u) * 0x85EBCA77u;
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return h;
+}
+
+// A random float between 0.0 and 0.999... from a hash
+static inline float hashFloat(unsigned h)
+{
+    return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// The bits of a float.  Positive floats order the same as their bits, so a
+// time can be kept as the least of several with an integer compare.
+static inline unsigned floatBits(float f)
+{
+    unsigned u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+static inline float bitsFloat(unsigned u)
+{
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+// Lowers slot to bits if it is higher.  The result does not depend on the
+// order the threads get here in.
+static inline void atomicMin(std::atomic<unsigned>& slot, unsigned bits)
+{
+    unsigned cur = slot.load(std::memory_order_relaxed);
+    while(bits < cur && !slot.compare_exchange_weak(cur, bits, std::memory_order_relaxed));
+}
+
+// Grows b around a particle's position now and at the start of the step
+static inline void growSwept(ClothBounds& b, const vector3f& p, const vector3f& q)
+{
+    const float lx = p.x < q.x ? p.x : q.x, hx = p.x < q.x ? q.x : p.x;
+    const float ly = p.y < q.y ? p.y : q.y, hy = p.y < q.y ? q.y : p.y;
+    const float lz = p.z < q.z ? p.z : q.z, hz = p.z < q.z ? q.z : p.z;
+    b.min.x = lx < b.min.x ? lx : b.min.x;  b.max.x = hx > b.max.x ? hx : b.max.x;
+    b.min.y = ly < b.min.y ? ly : b.min.y;  b.max.y = hy > b.max.y ? hy : b.max.y;
+    b.min.z = lz < b.min.z ? lz : b.min.z;  b.max.z = hz > b.max.z ? hz : b.max.z;
+}
+
+static inline void emptyBounds(ClothBounds& b)
+{
+    b.min = vector3f(HUGE_VALF, HUGE_VALF, HUGE_VALF);
+    b.max = vector3f(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+}
+
+static inline bool overlaps(const ClothBounds& a, const ClothBounds& b, float margin)
+{
+    return a.min.x <= b.max.x + margin && b.min.x <= a.max.x + margin &&
+           a.min.y <= b.max.y + margin && b.min.y <= a.max.y + margin &&
+           a.min.z <= b.max.z + margin && b.min.z <= a.max.z + margin;
+}
+
+//------------------------------------------------------------------------------
+// Spreads the low 10 bits of v out to every third bit, three of them
+// interleaved make a Morton code
+//------------------------------------------------------------------------------
+static inline unsigned spreadBits(unsigned v)
+{
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// The Morton code of p in the cube from lo with scale cells to a unit
+static inline unsigned mortonCode(const vector3f& p, const vector3f& lo, float scale)
+{
+    const float q[3] = { (p.x - lo.x) * scale, (p.y - lo.y) * scale, (p.z - lo.z) * scale };
+    unsigned code = 0;
+    for(unsigned k = 0; k < 3; ++k)
+        code |= spreadBits(q[k] <= 0.0f ? 0 : (q[k] >= 1023.0f ? 1023 : (unsigned)q[k])) << k;
+    return code;
+}
+
+// A triangle edge between the particles packed into key, lower one in the
+// high half, and the corner of the triangle across from it
+struct MeshEdge
+{
+    unsigned long long key;
+    unsigned opposite;
+
+    bool operator<(const MeshEdge& e) const { return key < e.key || (key == e.key && opposite < e.opposite); }
+};
+
+static inline unsigned long long pairKey(unsigned a, unsigned b)
+{
+    return a < b ? (unsigned long long)a << 32 | b : (unsigned long long)b << 32 | a;
+}
+
+// Orders springs, given by their build index, by their first particle
+struct FirstParticleLess
+{
+    const unsigned* p1;
+    bool operator()(unsigned a, unsigned b) const { return p1[a] < p1[b]; }
+};
+
+static inline bool listed(const unsigned* list, unsigned count, unsigned i)
+{
+    return std::find(list, list + count, i) != list + count;
+}
+
+//==============================================================================
+// WORKER TASKS
+//==============================================================================
+
+struct C_Cloth::ForceTask
+{
+    C_Cloth* cloth;
+    void operator()(unsigned begin, unsigned end, unsigned) { cloth->sumForcesRange(begin, end); }
+};
+
+struct C_Cloth::IntegrateTask
+{
+    C_Cloth* cloth;
+    void operator()(unsigned begin, unsigned end, unsigned) { cloth->integrateAndCollideRange(begin, end); }
+};
+
+struct C_Cloth::SpringTask
+{
+    C_Cloth* cloth;
+    unsigned first;     // The first spring of the color being solved
+    void operator()(unsigned begin, unsigned end, unsigned) { cloth->solveSprings(first + begin, first + end); }
+};
+
+struct C_Cloth::NormalTask
+{
+    C_Cloth* cloth;
+    void operator()(unsigned begin, unsigned end, unsigned)
+    {
+        if(cloth->d_pTriangles)
+            cloth->computeMeshNormalsRange(begin, end);
+        else
+            cloth->computeNormalsRange(begin, end);
+    }
+};
+
+struct C_Cloth::SelfTask
+{
+    enum Pass
+    {
+        SNAPSHOT,       // Copies the positions the hash is built from
+        GATHER,         // Lists the particles near each one from the hash
+        FIND,           // Finds the push on each particle
+        APPLY           // Moves the particles by their push
+    };
+
+    C_Cloth* cloth;
+    Pass pass;
+    void operator()(unsigned begin, unsigned end, unsigned thread)
+    {
+        if(pass == FIND)
+            cloth->selfCollideRange(begin, end, thread);
+        else if(pass == GATHER)
+            cloth->gatherSelfCandidates(begin, end);
+        else if(pass == APPLY)
+        {
+            for(unsigned i = begin; i < end; ++i)
+                cloth->d_pPositions[i].pos += cloth->d_pSelfPush[i];
+        }
+        else
+        {
+            for(unsigned i = begin; i < end; ++i)
+                cloth->d_pHashPositions[i] = cloth->d_pPositions[i].pos;
+        }
+    }
+};
+
+// Lists the particles the hash finds near one particle that are not its
+// grid neighbours, or on a mesh, that are not the particle itself or share
+// a spring with it.  On a mesh that has torn both go by the particles they
+// were split off, so the two halves of a split are left alone too.
+struct C_Cloth::SelfGather
+{
+    const vector3f* positions;
+    unsigned row, col, numCol;
+    const unsigned *neighbours, *neighboursEnd;     // Mesh only
+    const unsigned* origin;
+    unsigned index;
+    vector3f p;
+    float reach2;
+    unsigned* list;
+    unsigned count;
+
+    // The fields of the particle being gathered for are set before each
+    // search by gatherSelfCandidates()
+    SelfGather(const vector3f* hashPositions, unsigned cols, const unsigned* particleOrigin, float reach)
+        : positions(hashPositions), row(0), col(0), numCol(cols), neighbours(0), neighboursEnd(0),
+          origin(particleOrigin), index(0), reach2(reach * reach), list(0), count(0)
+    {
+    }
+
+    void operator()(unsigned j)
+    {
+        vector3f d = p - positions[j];
+        if(count == SELF_CANDIDATES || d.x*d.x + d.y*d.y + d.z*d.z >= reach2)
+            return;
+
+        if(!numCol)
+        {
+            const unsigned o = origin ? origin[j] : j;
+            if(o != index && std::find(neighbours, neighboursEnd, o) == neighboursEnd)
+                list[count++] = j;
+            return;
+        }
+
+        const unsigned jr = j / numCol, jc = j - jr * numCol;
+        if((jr > row ? jr - row : row - jr) > SELF_COLLISION_RING ||
+           (jc > col ? jc - col : col - jc) > SELF_COLLISION_RING)
+            list[count++] = j;
+    }
+};
+
+struct C_Cloth::ContinuousTask
+{
+    C_Cloth* cloth;
+    bool sweep,         // Stops the particles at the colliders
+         apply,         // Stops them at their impacts, else finds the impacts
+         last;          // The last pass, which sends them back to the start
+    void operator()(unsigned begin, unsigned end, unsigned thread)
+    {
+        if(sweep)
+            cloth->sweepRange(begin, end);
+        else if(apply)
+            cloth->applyImpactsRange(begin, end, thread, last);
+        else
+            cloth->findImpactsRange(begin, end);
+    }
+};
+
+// Tests the particles of one leaf of the triangle tree, and the triangle
+// edges they own, against the triangles of the leaves the tree finds near
+// them.  A particle belongs to the leaf of the cell it is the top left
+// corner of, or the nearest cell along the bottom and right of the grid,
+// and owns the edges to its right, below it and across its cell from the
+// right to below, so every particle and edge of the grid has one owner.
+// Edge pairs are only tested from the lower owned edge.  As for the self
+// collision, parts of the cloth that are within SELF_COLLISION_RING of each
+// other on the grid are left to the springs, the cloth has no bending
+// stiffness and folds that tight can cross anyway.
+struct C_Cloth::ImpactGather
+{
+    enum { MAX_PARTICLES = (BVH_LEAF_CELLS + 1) * (BVH_LEAF_CELLS + 1) };
+
+    C_Cloth* cloth;
+    float thickness;
+    unsigned rowLo, rowHi, colLo, colHi;    // The rows and columns of the leaf's particles
+    unsigned numParticles, numEdges;
+    unsigned particles[MAX_PARTICLES], rows[MAX_PARTICLES], cols[MAX_PARTICLES];
+    ClothBounds boxes[MAX_PARTICLES];       // The swept box of each particle
+    unsigned edges[3 * MAX_PARTICLES][2], edgeIds[3 * MAX_PARTICLES],
+             edgeOwners[3 * MAX_PARTICLES]; // The particle of the leaf owning each edge
+    ClothBounds edgeBoxes[3 * MAX_PARTICLES];
+    ClothBounds bounds;                     // Around all of the above
+
+    // The id of the edge of kind k owned by particle p
+    static unsigned edgeId(unsigned p, unsigned k) { return 3 * p + k; }
+
+    // The furthest apart a number in [a0, a1] and one in [b0, b1] can be
+    static unsigned furthest(unsigned a0, unsigned a1, unsigned b0, unsigned b1)
+    {
+        const unsigned d0 = a1 > b0 ? a1 - b0 : b0 - a1, d1 = b1 > a0 ? b1 - a0 : a0 - b1;
+        return d0 > d1 ? d0 : d1;
+    }
+
+    // Whether the cell at row r and column c is far enough on the grid from
+    // the cell of particle k of the leaf, and its edges, to be tested
+    bool outsideRing(unsigned k, unsigned r, unsigned c) const
+    {
+        return (r > rows[k] ? r - rows[k] : rows[k] - r) > SELF_COLLISION_RING + 1 ||
+               (c > cols[k] ? c - cols[k] : cols[k] - c) > SELF_COLLISION_RING + 1;
+    }
+
+    void addEdge(unsigned k, unsigned a, unsigned b, unsigned id)
+    {
+        const C_Vertex* pos = cloth->d_pPositions;
+        const vector3f* old = cloth->d_pOldPositions;
+        edges[numEdges][0] = a;
+        edges[numEdges][1] = b;
+        edgeIds[numEdges] = id;
+        edgeOwners[numEdges] = k;
+        ClothBounds& box = edgeBoxes[numEdges];
+        emptyBounds(box);
+        growSwept(box, pos[a].pos, old[a]);
+        growSwept(box, pos[b].pos, old[b]);
+        growSwept(bounds, box.min, box.max);
+        ++numEdges;
+    }
+
+    // Gathers the particles and edges of leaf l
+    void setLeaf(unsigned l)
+    {
+        const C_Vertex* pos = cloth->d_pPositions;
+        const vector3f* old = cloth->d_pOldPositions;
+        const unsigned numCol = cloth->d_numCol, numRow = cloth->d_numRow;
+        unsigned r0, r1, c0, c1;
+        cloth->d_bvh.getLeafCells(l, r0, r1, c0, c1);
+        rowLo = r0;
+        rowHi = r1 + 1 == numRow ? numRow : r1;
+        colLo = c0;
+        colHi = c1 + 1 == numCol ? numCol : c1;
+
+        numParticles = numEdges = 0;
+        emptyBounds(bounds);
+        for(unsigned r = rowLo; r < rowHi; ++r)
+            for(unsigned c = colLo; c < colHi; ++c)
+            {
+                const unsigned i = r * numCol + c, k = numParticles++;
+                particles[k] = i;
+                rows[k] = r;
+                cols[k] = c;
+                emptyBounds(boxes[k]);
+                growSwept(boxes[k], pos[i].pos, old[i]);
+                growSwept(bounds, boxes[k].min, boxes[k].max);
+                if(c + 1 < numCol)
+                    addEdge(k, i, i + 1, edgeId(i, 0));
+                if(r + 1 < numRow)
+                    addEdge(k, i, i + numCol, edgeId(i, 1));
+                if(c + 1 < numCol && r + 1 < numRow)
+                    addEdge(k, i + 1, i + numCol, edgeId(i, 2));
+            }
+    }
+
+    // Stops the four particles of an impact no later than t
+    void impact(const unsigned* p, float t)
+    {
+        const unsigned bits = floatBits(t);
+        for(unsigned k = 0; k < 4; ++k)
+            atomicMin(cloth->d_pImpactTime[p[k]], bits);
+    }
+
+    // Tests the owned edges against the edge from a to b of the cell at row
+    // r and column c
+    void testEdge(unsigned a, unsigned b, unsigned id, unsigned r, unsigned c)
+    {
+        const C_Vertex* pos = cloth->d_pPositions;
+        const vector3f* old = cloth->d_pOldPositions;
+        ClothBounds box;
+        emptyBounds(box);
+        growSwept(box, pos[a].pos, old[a]);
+        growSwept(box, pos[b].pos, old[b]);
+        if(!overlaps(box, bounds, thickness))
+            return;
+
+        for(unsigned e = 0; e < numEdges; ++e)
+        {
+            if(id <= edgeIds[e] || !overlaps(box, edgeBoxes[e], thickness) || !outsideRing(edgeOwners[e], r, c))
+                continue;
+
+            const unsigned p[4] = { edges[e][0], edges[e][1], a, b };
+            const vector3f start[4] = { old[p[0]], old[p[1]], old[a], old[b] };
+            const vector3f end[4] = { pos[p[0]].pos, pos[p[1]].pos, pos[a].pos, pos[b].pos };
+            float t;
+            if(edgeEdgeImpact(start, end, thickness, t))
+                impact(p, t);
+        }
+    }
+
+    // Tests the leaf's particles and edges against the triangles of leaf l
+    void operator()(unsigned l)
+    {
+        const C_Vertex* pos = cloth->d_pPositions;
+        const vector3f* old = cloth->d_pOldPositions;
+        const unsigned numCol = cloth->d_numCol, numRow = cloth->d_numRow;
+        unsigned r0, r1, c0, c1;
+        cloth->d_bvh.getLeafCells(l, r0, r1, c0, c1);
+
+        // Leaves whose cells are all within the ring of all the particles
+        // are skipped whole, which takes care of the leaf itself and most
+        // of its neighbours
+        if(furthest(rowLo, rowHi - 1, r0, r1 - 1) <= SELF_COLLISION_RING + 1 &&
+           furthest(colLo, colHi - 1, c0, c1 - 1) <= SELF_COLLISION_RING + 1)
+            return;
+
+        for(unsigned ci = r0; ci < r1; ++ci)
+            for(unsigned cj = c0; cj < c1; ++cj)
+                for(unsigned tri = 2 * (ci * (numCol - 1) + cj), half = 0; half < 2; ++half, ++tri)
+                {
+                    unsigned a, b, c;
+                    cloth->d_bvh.getTriangle(tri, a, b, c);
+                    ClothBounds box;
+                    emptyBounds(box);
+                    growSwept(box, pos[a].pos, old[a]);
+                    growSwept(box, pos[b].pos, old[b]);
+                    growSwept(box, pos[c].pos, old[c]);
+                    if(!overlaps(box, bounds, thickness))
+                        continue;
+
+                    for(unsigned k = 0; k < numParticles; ++k)
+                    {
+                        if(!overlaps(box, boxes[k], thickness) || !outsideRing(k, ci, cj))
+                            continue;
+
+                        const unsigned i = particles[k];
+                        const unsigned p[4] = { i, a, b, c };
+                        const vector3f start[4] = { old[i], old[a], old[b], old[c] };
+                        const vector3f end[4] = { pos[i].pos, pos[a].pos, pos[b].pos, pos[c].pos };
+                        float t;
+                        if(vertexTriangleImpact(start, end, thickness, t))
+                            impact(p, t);
+                    }
+
+                    // The even triangle of a cell holds the three edges its
+                    // top left particle owns.  The odd one only adds the
+                    // edges along the bottom and right of the grid, its
+                    // others belong to the cells below and to the right.
+                    const unsigned q = ci * numCol + cj;
+                    if(!half)
+                    {
+                        testEdge(q, q + 1, edgeId(q, 0), ci, cj);
+                        testEdge(q, q + numCol, edgeId(q, 1), ci, cj);
+                        testEdge(q + 1, q + numCol, edgeId(q, 2), ci, cj);
+                    }
+                    else
+                    {
+                        if(ci + 2 == numRow)
+                            testEdge(q + numCol, q + numCol + 1, edgeId(q + numCol, 0), ci, cj);
+                        if(cj + 2 == numCol)
+                            testEdge(q + 1, q + numCol + 1, edgeId(q + 1, 1), ci, cj);
+                    }
+                }
+    }
+};
+
+struct C_Cloth::TileTask
+{
+    C_Cloth* cloth;
+    void operator()(unsigned begin, unsigned end, unsigned) { cloth->computeTileBoundsRange(begin, end); }
+};
+
+// Runs one of the particle stages over the awake tiles [begin, end), a row
+// of each tile at a time
+struct C_Cloth::AwakeTask
+{
+    enum Pass
+    {
+        FORCES,
+        INTEGRATE,
+        SWEEP
+    };
+
+    C_Cloth* cloth;
+    Pass pass;
+    void operator()(unsigned begin, unsigned end, unsigned)
+    {
+        for(unsigned k = begin; k < end; ++k)
+        {
+            unsigned r0, r1, c0, c1;
+            cloth->getTileParticles(cloth->d_awakeTiles[k], r0, r1, c0, c1);
+            for(unsigned r = r0; r < r1; ++r)
+            {
+                const unsigned first = r * cloth->d_numCol;
+                if(pass == FORCES)
+                    cloth->sumForcesRange(first + c0, first + c1);
+                else if(pass == INTEGRATE)
+                    cloth->integrateAndCollideRange(first + c0, first + c1);
+                else
+                    cloth->sweepRange(first + c0, first + c1);
+            }
+        }
+    }
+};
+
+struct C_Cloth::ActiveSpringTask
+{
+    C_Cloth* cloth;
+    const SpringRange* ranges;
+    unsigned numRanges;
+    void operator()(unsigned begin, unsigned end, unsigned) { cloth->solveActiveSprings(ranges, numRanges, begin, end); }
+};
 
 //==============================================================================
 // CONSTRUCTORS / DESTRUCTORS
 //==============================================================================
 
 //------------------------------------------------------------------------------
-// Constructor
-// Initializes the pointers to null.
+// Constructor
+// Initializes the pointers to null.
+//------------------------------------------------------------------------------
+C_Cloth::C_Cloth() : d_particleInfo(0), d_pSpringP1(0), d_pSpringP2(0), d_pSpringOrder(0),
+d_pRestLength(0), d_pSpringFamily(0), d_fBendStiffness(0), d_numColors(0), d_pSpringTileStart(0), d_pTriangles(0), d_pVertexFaceStart(0),
+d_pVertexFaceEnd(0), d_pVertexFaces(0), d_pNeighbourStart(0), d_pNeighbours(0), d_pSourceIndex(0), d_pParticleIndex(0),
+d_numSources(0), d_uParticleCapacity(0), d_fTearStretch(0), d_pSpringRank(0), d_pParticleSprings(0), d_pOrigin(0),
+d_pNumParticleSprings(0), d_pColorMask(0), d_pTears(0), d_uNumTears(0), d_uTornCount(0), d_pEdits(0), d_uNumEdits(0),
+d_uCompactMoves(0), d_uCompactColor(0), d_bReorder(true), d_numShearSprings(0), d_numStructSprings(0), d_numBendSprings(0),
+d_numFaces(0), d_numCol(0), d_numRow(0), d_windFactor(0), d_fCellSize(0), d_uSolverIterations(3),
+d_solverMode(SOLVER_COLORED), d_uStepCount(0), d_uNormalFrame(0), d_numTileRows(0), d_numTileCols(0), d_pTileBounds(0),
+d_bSleeping(false), d_fSleepThreshold(0.001f), d_pTileState(0), d_pTileWake(0), d_uSleepingTiles(0),
+d_uColliderRevision(0), d_bSelfCollision(false), d_bRebuildHash(true), d_fSelfDistance(0.75f), d_pSelfPush(0),
+d_pHashPositions(0), d_pSelfCandidates(0), d_pSelfCandidateCount(0), d_uBVHFrame(0),
+d_bContinuous(false), d_pImpactTime(0), d_uImpacts(0)
+{
+    for(unsigned f = 0; f < SPRING_FAMILIES; ++f)
+    {
+        d_familyStiffness[f] = 1.0f;
+        d_familyTear[f] = INFINITY;
+    }
+    d_colorStart[0] = 0;
+    d_workers.setThreadCount(C_WorkerPool::hardwareThreads());
+}
+
+
+//==============================================================================
+// PRIVATE METHODS
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// void sumForces()
+//
+// Used by the stepSimulation() function to calculate the combined forces acting
+// on the particles.  finds the accelerations for each particle.  While some
+// tiles sleep only the awake ones are visited, a tile to a task.
+//------------------------------------------------------------------------------
+void C_Cloth::sumForces()
+{
+    if(d_uSleepingTiles)
+    {
+        AwakeTask task = { this, AwakeTask::FORCES };
+        d_workers.parallelFor((unsigned)d_awakeTiles.size(), 1, task);
+    }
+    else
+    {
+        ForceTask task = { this };
+        d_workers.parallelFor(d_uNumParticles, PARTICLE_GRAIN, task);
+    }
+    ++d_uStepCount;
+}
+
+void C_Cloth::sumForcesRange(unsigned begin, unsigned end)
+{
+    vector3f wind;
+    const bool windOn = d_windVector != vector3f(0,0,0) && d_windFactor != 0;
+
+    // process the gravity, drag, and wind forces
+    for(unsigned i = begin; i < end; ++i)
+    {
+        if(d_particleInfo[i].locked) continue;
+
+        // Add acceleration due to gravity first
+        d_pAccel[i] = d_vGravity;
+
+        // wind
+        if(windOn)
+        {
+            unsigned h = hashRandom(i, d_uStepCount);
+            wind.X() = hashFloat(h) * d_windVector.X();
+            h = hashRandom(h, d_uStepCount);
+            wind.Y() = hashFloat(h) * d_windVector.Y();
+            h = hashRandom(h, d_uStepCount);
+            wind.Z() = hashFloat(h) * d_windVector.Z();
+            wind.normalize();
+            h = hashRandom(h, d_uStepCount);
+            d_pAccel[i] += d_particleInfo[i].invMass * wind * (float)(h % d_windFactor);
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// void integrate()
+//
+// Runs the base class integration over the worker threads, with the
+// collisions against the colliders done on each chunk of particles straight
+// after it is integrated, while it is still in cache.  Sleeping tiles are
+// left where they are.
+//------------------------------------------------------------------------------
+void C_Cloth::integrate()
+{
+    if(d_uSleepingTiles)
+    {
+        AwakeTask task = { this, AwakeTask::INTEGRATE };
+        d_workers.parallelFor((unsigned)d_awakeTiles.size(), 1, task);
+        return;
+    }
+
+    IntegrateTask task = { this };
+    d_workers.parallelFor(d_uNumParticles, PARTICLE_GRAIN, task);
+}
+
+
+void C_Cloth::integrateAndCollideRange(unsigned begin, unsigned end)
+{
+    integrateRange(begin, end);
+    if(d_colliders.getCount())
+        collideRange(begin, end);
+}
+
+
+//------------------------------------------------------------------------------
+// void collideRange()
+//
+// Pushes the particles [begin, end) out of the colliders, C_ColliderSet::LANES
+// at a time.  The last block is padded with copies of the last particle.
+// Particles that touched a shape lose the friction's share of their sliding
+// motion, which is taken out of their previous position.  Locked particles
+// stay where they are.
+//------------------------------------------------------------------------------
+void C_Cloth::collideRange(unsigned begin, unsigned end)
+{
+    const unsigned LANES = C_ColliderSet::LANES;
+    const float friction = d_colliders.getFriction();
+    C_ColliderSet::Lanes v;
+
+    if(d_bContinuous)
+        sweepRange(begin, end);
+
+    for(unsigned i = begin; i < end; i += LANES)
+    {
+        const unsigned n = end - i < LANES ? end - i : LANES;
+        for(unsigned l = 0; l < LANES; ++l)
+        {
+            const vector3f& p = d_pPositions[i + (l < n ? l : n - 1)].pos;
+            v.x[l] = p.x;
+            v.y[l] = p.y;
+            v.z[l] = p.z;
+        }
+
+        if(!d_colliders.projectLanes(v))
+            continue;
+
+        for(unsigned l = 0; l < n; ++l)
+        {
+            if(d_particleInfo[i + l].locked || (v.nx[l] == 0.0f && v.ny[l] == 0.0f && v.nz[l] == 0.0f))
+                continue;
+
+            vector3f& p = d_pPositions[i + l].pos;
+            vector3f& old = d_pOldPositions[i + l];
+            p.x = v.x[l];
+            p.y = v.y[l];
+            p.z = v.z[l];
+
+            vector3f vel = p - old;
+            float vn = vel.x*v.nx[l] + vel.y*v.ny[l] + vel.z*v.nz[l];
+            old.x += (vel.x - vn*v.nx[l]) * friction;
+            old.y += (vel.y - vn*v.ny[l]) * friction;
+            old.z += (vel.z - vn*v.nz[l]) * friction;
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// void sweepRange()
+//
+// Stops each of the particles [begin, end) whose motion over the step meets
+// a shape where it first does.  It also loses the part of its velocity into
+// the shape, so that it does not go through on the next step instead.
+//------------------------------------------------------------------------------
+void C_Cloth::sweepRange(unsigned begin, unsigned end)
+{
+    for(unsigned i = begin; i < end; ++i)
+    {
+        float t;
+        vector3f n;
+        vector3f& p = d_pPositions[i].pos;
+        vector3f& old = d_pOldPositions[i];
+        if(d_particleInfo[i].locked || !d_colliders.sweep(old, p, t, n))
+            continue;
+
+        p = old + (p - old) * t;
+        const float vn = (p - old) * n;
+        if(vn < 0.0f)
+            old += n * vn;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// void solveSpring()
+//
+// Moves the two particles of spring s towards its rest length, all the way
+// but for the softer families.  Locked and sleeping particles stay where
+// they are.
+//------------------------------------------------------------------------------
+void C_Cloth::solveSpring(unsigned s)
+{
+    unsigned i1 = d_pSpringP1[s], i2 = d_pSpringP2[s];
+    vector3f& x1 = d_pPositions[i1].pos;
+    vector3f& x2 = d_pPositions[i2].pos;
+    vector3f delta = x1 - x2;
+    float deltaLength = delta.magnitude();
+    if(deltaLength <= 0)
+        return;
+    if(deltaLength > d_pRestLength[s] * d_familyTear[d_pSpringFamily[s]])
+        recordTears(s, 1);
+    float diff = (deltaLength - d_pRestLength[s])/deltaLength * d_familyStiffness[d_pSpringFamily[s]];
+    if(!d_particleInfo[i1].locked && !d_particleInfo[i1].asleep)
+        x1 -= delta*0.5f*diff;
+    if(!d_particleInfo[i2].locked && !d_particleInfo[i2].asleep)
+        x2 += delta*0.5f*diff;
+}
+
+
+//------------------------------------------------------------------------------
+// void solveSprings()
+//
+// Projects the springs [begin, end), which must all be of one color.  The
+// springs are handled SOLVER_LANES at a time: the endpoints are gathered into
+// small arrays, the corrections are computed over the lanes, then scattered
+// back.  This is safe because no two springs of a color share a particle.
+// The springs of every family are solved together, each correction scaled by
+// its family's stiffness.  On a tearing pass the lanes stretched past their
+// family's limit are recorded on the way.
+//------------------------------------------------------------------------------
+void C_Cloth::solveSprings(unsigned begin, unsigned end)
+{
+    unsigned s = begin;
+    for(; s + SOLVER_LANES <= end; s += SOLVER_LANES)
+    {
+        float dx[SOLVER_LANES], dy[SOLVER_LANES], dz[SOLVER_LANES];
+        float w1[SOLVER_LANES], w2[SOLVER_LANES], corr[SOLVER_LANES];
+        const unsigned* p1 = d_pSpringP1 + s;
+        const unsigned* p2 = d_pSpringP2 + s;
+        const float* rest = d_pRestLength + s;
+        const unsigned char* family = d_pSpringFamily + s;
+
+        for(unsigned l = 0; l < SOLVER_LANES; ++l)
+        {
+            const vector3f& a = d_pPositions[p1[l]].pos;
+            const vector3f& b = d_pPositions[p2[l]].pos;
+            dx[l] = a.x - b.x;
+            dy[l] = a.y - b.y;
+            dz[l] = a.z - b.z;
+            const ParticleInfo& i1 = d_particleInfo[p1[l]];
+            const ParticleInfo& i2 = d_particleInfo[p2[l]];
+            w1[l] = i1.locked || i1.asleep ? 0.0f : 0.5f;
+            w2[l] = i2.locked || i2.asleep ? 0.0f : 0.5f;
+        }
+
+        unsigned torn = 0;
+        for(unsigned l = 0; l < SOLVER_LANES; ++l)
+        {
+            float len = sqrtf(dx[l]*dx[l] + dy[l]*dy[l] + dz[l]*dz[l]);
+            corr[l] = (len > 0.0f ? (len - rest[l]) / len : 0.0f) * d_familyStiffness[family[l]];
+            torn |= (unsigned)(len > rest[l] * d_familyTear[family[l]]) << l;
+        }
+        if(torn)
+            recordTears(s, torn);
+
+        for(unsigned l = 0; l < SOLVER_LANES; ++l)
+        {
+            vector3f& a = d_pPositions[p1[l]].pos;
+            vector3f& b = d_pPositions[p2[l]].pos;
+            float c1 = corr[l] * w1[l], c2 = corr[l] * w2[l];
+            a.x -= dx[l]*c1;  a.y -= dy[l]*c1;  a.z -= dz[l]*c1;
+            b.x += dx[l]*c2;  b.y += dy[l]*c2;  b.z += dz[l]*c2;
+        }
+    }
+
+    for(; s < end; ++s)
+        solveSpring(s);
+}
+
+
+//------------------------------------------------------------------------------
+// void solveActiveSprings()
+//
+// Finds the run the begin'th spring of the runs falls in, then solves the
+// runs from there up to the end'th spring.
+//------------------------------------------------------------------------------
+void C_Cloth::solveActiveSprings(const SpringRange* ranges, unsigned numRanges, unsigned begin, unsigned end)
+{
+    unsigned lo = 0, hi = numRanges;
+    while(hi - lo > 1)
+    {
+        const unsigned mid = (lo + hi) / 2;
+        if(ranges[mid].offset <= begin)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    for(unsigned r = lo; r < numRanges && begin < end; ++r)
+    {
+        const SpringRange& range = ranges[r];
+        const unsigned first = range.begin + (begin - range.offset);
+        const unsigned count = range.end - first < end - begin ? range.end - first : end - begin;
+        solveSprings(first, first + count);
+        begin += count;
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// void applyConstraints()
+//
+// Relaxes the springs d_uSolverIterations times.  In SOLVER_COLORED mode the
+// color batches are solved one after the other, each split over the workers.
+// While some tiles sleep the colored solver only visits the runs of springs
+// listed by updateActiveLists(), and the Gauss-Seidel one skips the springs
+// with both particles asleep.
+//
+// The bending springs correct the share of their error that, repeated over
+// the iterations, takes out the bend stiffness's share of it over the step.
+// On a cloth that can tear the first iteration records the structural
+// springs stretched past the tear stretch, which stepSimulation() tears.
+//------------------------------------------------------------------------------
+void C_Cloth::applyConstraints()
+{
+    const unsigned numSprings = getSpringCount();
+    const bool tearing = d_pParticleSprings && d_fTearStretch > 0.0f;
+    if(d_uSolverIterations)
+        d_familyStiffness[SPRING_BEND] = 1.0f - powf(1.0f - d_fBendStiffness, 1.0f / d_uSolverIterations);
+
+    if(d_solverMode == SOLVER_GAUSS_SEIDEL)
+    {
+        for(unsigned j = 0; j < d_uSolverIterations; ++j)
+        {
+            PERF_SCOPE_ARG(PERF_CONSTRAINT_ITER, j);
+            d_familyTear[SPRING_STRUCTURAL] = tearing && j == 0 ? d_fTearStretch : INFINITY;
+            for(unsigned i = 0; i < numSprings; ++i)
+            {
+                const unsigned s = d_pSpringOrder[i];
+                if(!d_uSleepingTiles || !d_particleInfo[d_pSpringP1[s]].asleep ||
+                   !d_particleInfo[d_pSpringP2[s]].asleep)
+                    solveSpring(s);
+            }
+            if(d_bSelfCollision)
+                solveSelfCollisions(j == 0);
+        }
+        d_familyTear[SPRING_STRUCTURAL] = INFINITY;
+        return;
+    }
+
+    for(unsigned j = 0; j < d_uSolverIterations; ++j)
+    {
+        PERF_SCOPE_ARG(PERF_CONSTRAINT_ITER, j);
+        d_familyTear[SPRING_STRUCTURAL] = tearing && j == 0 ? d_fTearStretch : INFINITY;
+        for(unsigned c = 0; c < d_numColors; ++c)
+        {
+            if(d_uSleepingTiles)
+            {
+                const SpringRange* ranges = d_activeSprings.empty() ? 0 : &d_activeSprings[0] + d_activeColorStart[c];
+                const unsigned numRanges = d_activeColorStart[c+1] - d_activeColorStart[c];
+                if(!numRanges)
+                    continue;
+
+                if(c == MAX_SPRING_COLORS - 1)
+                {
+                    for(unsigned r = 0; r < numRanges; ++r)
+                        for(unsigned i = ranges[r].begin; i < ranges[r].end; ++i)
+                            solveSpring(i);
+                    continue;
+                }
+
+                const SpringRange& last = ranges[numRanges - 1];
+                ActiveSpringTask task = { this, ranges, numRanges };
+                d_workers.parallelFor(last.offset + last.end - last.begin, SPRING_GRAIN, task);
+                continue;
+            }
+
+            unsigned first = d_colorStart[c];
+            unsigned count = d_colorEnd[c] - first;
+
+            // The overflow batch may share particles, solve it in order
+            if(c == MAX_SPRING_COLORS - 1)
+            {
+                for(unsigned i = first; i < first + count; ++i)
+                    solveSpring(i);
+                continue;
+            }
+
+            SpringTask task = { this, first };
+            d_workers.parallelFor(count, SPRING_GRAIN, task);
+        }
+        if(d_bSelfCollision)
+            solveSelfCollisions(j == 0);
+    }
+    d_familyTear[SPRING_STRUCTURAL] = INFINITY;
+}
+
+
+//------------------------------------------------------------------------------
+// void solveSelfCollisions()
+//
+// Pushes apart every pair of particles closer than the self collision
+// distance, unless they are within SELF_COLLISION_RING of each other on the
+// grid, or share a spring on a mesh.  Runs once per solver iteration.  The
+// pairs are found through a spatial hash whose cells are the collision
+// distance plus a slack on either side.  When the hash is built every particle
+// lists the others within that reach, and the passes after only look through
+// the lists.  The hash is built on the first iteration of a step and then kept
+// for as long as no particle has moved further than the slack from where it
+// was built, as the springs rarely move the particles far within a step.
+//
+// The pushes are found for every particle before any is moved, so the
+// result does not depend on the order the threads run in.
+//------------------------------------------------------------------------------
+void C_Cloth::solveSelfCollisions(bool rebuild)
+{
+    if(!d_uNumParticles)
+        return;
+
+    PERF_SCOPE(PERF_SELF_COLLISION);
+    const float dist = d_fSelfDistance * d_fCellSize;
+    if(!d_pSelfPush)
+    {
+        d_pSelfPush = new vector3f[d_uParticleCapacity];
+        d_pHashPositions = new vector3f[d_uParticleCapacity];
+        d_pSelfCandidates = new unsigned[d_uParticleCapacity * SELF_CANDIDATES];
+        d_pSelfCandidateCount = new unsigned[d_uParticleCapacity];
+        d_selfHash.reserve(d_uParticleCapacity);
+    }
+
+    SelfTask task = { this, SelfTask::SNAPSHOT };
+    if(rebuild || d_bRebuildHash)
+    {
+        d_workers.parallelFor(d_uNumParticles, PARTICLE_GRAIN, task);
+        d_selfHash.build(&d_pHashPositions->x, 3, d_uNumParticles, dist * (1.0f + 2.0f * SELF_HASH_SLACK), d_workers);
+        task.pass = SelfTask::GATHER;
+        d_workers.parallelFor(d_uNumParticles, PARTICLE_GRAIN, task);
+    }
+
+    d_selfMove.assign(d_workers.getThreadCount(), 0.0f);
+    task.pass = SelfTask::FIND;
+    d_workers.parallelFor(d_uNumParticles, PARTICLE_GRAIN, task);
+    task.pass = SelfTask::APPLY;
+    d_workers.parallelFor(d_uNumParticles, PARTICLE_GRAIN, task);
+
+    // Build again before the next pass if the particles have used up half
+    // the slack, the springs will move them further before it
+    float move = 0.0f;
+    for(size_t t = 0; t < d_selfMove.size(); ++t)
+        move = d_selfMove[t] > move ? d_selfMove[t] : move;
+    const float slack = dist * SELF_HASH_SLACK;
+    d_bRebuildHash = move > slack * slack;
+}
+
+//------------------------------------------------------------------------------
+// void gatherSelfCandidates()
+//
+// Lists the particles within reach of each of the particles [begin, end)
+// from the positions the hash was built from.  Two particles that end up
+// closer than the collision distance before the next build were within the
+// collision distance plus twice the slack when it was made.
+//------------------------------------------------------------------------------
+void C_Cloth::gatherSelfCandidates(unsigned begin, unsigned end)
+{
+    const float reach = d_fSelfDistance * d_fCellSize * (1.0f + 2.0f * SELF_HASH_SLACK);
+    SelfGather f(d_pHashPositions, d_numCol, d_pOrigin, reach);
+
+    for(unsigned i = begin; i < end; ++i)
+    {
+        if(d_numCol)
+        {
+            f.row = i / d_numCol;
+            f.col = i - f.row * d_numCol;
+            f.index = i;
+        }
+        else
+        {
+            f.index = d_pOrigin ? d_pOrigin[i] : i;
+            f.neighbours = d_pNeighbours + d_pNeighbourStart[f.index];
+            f.neighboursEnd = d_pNeighbours + d_pNeighbourStart[f.index + 1];
+        }
+        f.p = d_pHashPositions[i];
+        f.list = d_pSelfCandidates + (size_t)i * SELF_CANDIDATES;
+        f.count = 0;
+        if(!d_particleInfo[i].locked && !d_particleInfo[i].asleep)
+            d_selfHash.forEachNear(f.p, f);
+        d_pSelfCandidateCount[i] = f.count;
+    }
+}
+
+//------------------------------------------------------------------------------
+// void selfCollideRange()
+//
+// Finds the self collision push on each of the particles [begin, end) from
+// its candidates, and how far they moved since the hash was built.  A
+// sleeping particle that is hit is held like a locked one and its tile is
+// woken for the next step.
+//------------------------------------------------------------------------------
+void C_Cloth::selfCollideRange(unsigned begin, unsigned end, unsigned thread)
+{
+    const float dist = d_fSelfDistance * d_fCellSize;
+    const float dist2 = dist * dist;
+
+    float move = d_selfMove[thread];
+    for(unsigned i = begin; i < end; ++i)
+    {
+        const vector3f& p = d_pPositions[i].pos;
+        vector3f m = p - d_pHashPositions[i];
+        float m2 = m.x*m.x + m.y*m.y + m.z*m.z;
+        move = m2 > move ? m2 : move;
+
+        vector3f push(0, 0, 0);
+        const unsigned* list = d_pSelfCandidates + (size_t)i * SELF_CANDIDATES;
+        for(unsigned k = 0; k < d_pSelfCandidateCount[i]; ++k)
+        {
+            const unsigned j = list[k];
+            vector3f d = p - d_pPositions[j].pos;
+            float d2 = d.x*d.x + d.y*d.y + d.z*d.z;
+            if(d2 >= dist2 || d2 <= 0.0f)
+                continue;
+
+            // Each particle takes half the push, or all of it if the other is
+            // held
+            const ParticleInfo& other = d_particleInfo[j];
+            if(other.asleep)
+                d_pTileWake[getParticleTile(j)].store(true, std::memory_order_relaxed);
+            float len = sqrtf(d2);
+            push += d * ((dist - len) / len * (other.locked || other.asleep ? 1.0f : 0.5f));
+        }
+        d_pSelfPush[i] = push;
+    }
+    d_selfMove[thread] = move;
+}
+
+
+//------------------------------------------------------------------------------
+// void solveContinuousCollisions()
+//
+// The springs can drag a particle that was stopped at a collider through it
+// after all, so the particles are first swept against the colliders again
+// over the whole step.
+//
+// Then, with self collision on, finds where the particles and the triangle
+// edges first passed through another part of the cloth on their way from
+// the previous positions to the current ones, and stops the particles of
+// each impact short of it.  The broad phase is the triangle tree, whose
+// leaves already hold the triangles over the whole step: each leaf queries
+// it with the box around the motion of its particles and the edges they
+// own, the leaves near it on the grid are skipped whole, and only the pairs
+// whose own boxes overlap are solved for the times they are coplanar, see
+// ccd.h.  The tree is only built over a grid, so a mesh is swept against
+// the colliders alone.
+//
+// Stopping a particle only moves it back along its own motion, so it stays
+// inside the boxes the tree was refit to and the tree does for every pass.
+// The impacts are all found before any particle moves, and each particle
+// keeps the earliest of its impacts, so the result does not depend on the
+// order the threads run in.
+//------------------------------------------------------------------------------
+void C_Cloth::solveContinuousCollisions()
+{
+    d_uImpacts = 0;
+    if(!d_uNumParticles)
+        return;
+
+    PERF_SCOPE(PERF_CCD);
+    ContinuousTask task = { this, true, false, false };
+    if(d_colliders.getCount() && d_uSleepingTiles)
+    {
+        AwakeTask awake = { this, AwakeTask::SWEEP };
+        d_workers.parallelFor((unsigned)d_awakeTiles.size(), 1, awake);
+    }
+    else if(d_colliders.getCount())
+        d_workers.parallelFor(d_uNumParticles, PARTICLE_GRAIN, task);
+    if(!d_bSelfCollision || d_numRow < 2 || d_numCol < 2)
+        return;
+
+    task.sweep = false;
+    if(!d_pImpactTime)
+    {
+        d_pImpactTime = new std::atomic<unsigned>[d_uParticleCapacity];
+        for(unsigned i = 0; i < d_uNumParticles; ++i)
+            d_pImpactTime[i].store(floatBits(1.0f), std::memory_order_relaxed);
+    }
+    updateBVH();
+
+    for(unsigned pass = 0; pass < CCD_PASSES; ++pass)
+    {
+        task.apply = false;
+        d_workers.parallelFor(d_bvh.getLeafCount(), LEAF_GRAIN, task);
+
+        d_impactCount.assign(d_workers.getThreadCount(), 0);
+        task.apply = true;
+        task.last = pass + 1 == CCD_PASSES;
+        d_workers.parallelFor(d_uNumParticles, PARTICLE_GRAIN, task);
+
+        unsigned count = 0;
+        for(size_t t = 0; t < d_impactCount.size(); ++t)
+            count += d_impactCount[t];
+        d_uImpacts += count;
+        if(!count)
+            break;
+    }
+}
+
+//------------------------------------------------------------------------------
+// void findImpactsRange()
+//
+// Tests the particles of the leaves [begin, end) of the tree, and the edges
+// they own, against the triangles the tree finds near them.
+//------------------------------------------------------------------------------
+void C_Cloth::findImpactsRange(unsigned begin, unsigned end)
+{
+    ImpactGather g;
+    g.cloth = this;
+    g.thickness = CCD_THICKNESS * d_fCellSize;
+    const vector3f h(g.thickness, g.thickness, g.thickness);
+
+    for(unsigned l = begin; l < end; ++l)
+    {
+        g.setLeaf(l);
+        d_bvh.queryLeaves(g.bounds.min - h, g.bounds.max + h, g);
+    }
+}
+
+//------------------------------------------------------------------------------
+// void applyImpactsRange()
+//
+// Moves each of the particles [begin, end) that had an impact back along
+// its motion to short of the impact, or to where it started on the last
+// pass, and clears its impact time for the next pass.  Sleeping particles
+// did not move, their tiles are woken for the next step instead.
+//------------------------------------------------------------------------------
+void C_Cloth::applyImpactsRange(unsigned begin, unsigned end, unsigned thread, bool last)
+{
+    const unsigned none = floatBits(1.0f);
+    unsigned count = 0;
+    for(unsigned i = begin; i < end; ++i)
+    {
+        const unsigned bits = d_pImpactTime[i].load(std::memory_order_relaxed);
+        if(bits == none)
+            continue;
+        if(d_particleInfo[i].asleep)
+            d_pTileWake[getParticleTile(i)].store(true, std::memory_order_relaxed);
+
+        const float t = last ? 0.0f : bitsFloat(bits) * CCD_BACKOFF;
+        vector3f& p = d_pPositions[i].pos;
+        const vector3f& old = d_pOldPositions[i];
+        p = old + (p - old) * t;
+        d_pImpactTime[i].store(none, std::memory_order_relaxed);
+        ++count;
+    }
+    d_impactCount[thread] += count;
+}
+
+
+//------------------------------------------------------------------------------
+// Writes the unit normal of the surface spanned by the tangents u and v into n
+//------------------------------------------------------------------------------
+static inline void gridNormal(float ux, float uy, float uz, float vx, float vy, float vz, vector3f& n)
+{
+    float nx = uy*vz - uz*vy;
+    float ny = uz*vx - ux*vz;
+    float nz = ux*vy - uy*vx;
+
+    // The tiny bias keeps a collapsed patch from dividing by zero without a
+    // branch
+    float inv = 1.0f / sqrtf(nx*nx + ny*ny + nz*nz + 1e-30f);
+    n.x = nx*inv;
+    n.y = ny*inv;
+    n.z = nz*inv;
+}
+
+#ifdef CLOTH_SSE
+//------------------------------------------------------------------------------
+// Loads the positions of the four vertices from v on into the lanes of x, y
+// and z.  Each load takes the position and the first float of the normal.
+//------------------------------------------------------------------------------
+static inline void loadPositions4(const C_Vertex* v, __m128& x, __m128& y, __m128& z)
+{
+    __m128 a = _mm_loadu_ps(&v[0].pos.x);
+    __m128 b = _mm_loadu_ps(&v[1].pos.x);
+    __m128 c = _mm_loadu_ps(&v[2].pos.x);
+    __m128 d = _mm_loadu_ps(&v[3].pos.x);
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+    x = a;
+    y = b;
+    z = c;
+}
+
+//------------------------------------------------------------------------------
+// Writes the first three lanes of v into n
+//------------------------------------------------------------------------------
+static inline void storeNormal(vector3f& n, __m128 v)
+{
+    _mm_storel_pi((__m64*)&n.x, v);
+    _mm_store_ss(&n.z, _mm_movehl_ps(v, v));
+}
+#endif
+
+//------------------------------------------------------------------------------
+// void computeNormalsRange()
+//
+// Computes the normals of the grid rows [begin, end) from the central
+// differences across each particle's row and column neighbours, clamped at
+// the edges of the grid.  A cloth lying flat along ZAXIS faces up the y axis.
+// Only the first and last columns need one sided differences, so the inner
+// loop over the columns has no clamps.
+//
+// With SSE the columns are done four at a time.  The positions are loaded
+// straight from the vertices and transposed into lanes, and the row's next
+// four are carried over to the next group, so each is loaded once.  The
+// reciprocal square root is the hardware estimate with a Newton step, which
+// stays within 3e-7 of the scalar loop.  The columns left over at the end of
+// the row go through the scalar loop.
+//------------------------------------------------------------------------------
+void C_Cloth::computeNormalsRange(unsigned begin, unsigned end)
+{
+    const unsigned cols = d_numCol;
+    if(cols < 2)
+        return;
+
+    for(unsigned i = begin; i < end; ++i)
+    {
+        C_Vertex* row = d_pPositions + i*cols;
+        const C_Vertex* up = d_pPositions + (i > 0 ? i - 1 : i)*cols;
+        const C_Vertex* down = d_pPositions + (i + 1 < d_numRow ? i + 1 : i)*cols;
+
+        unsigned j = 1;
+#ifdef CLOTH_SSE
+        const __m128 bias = _mm_set1_ps(1e-30f);
+        const __m128 half = _mm_set1_ps(0.5f);
+        const __m128 three = _mm_set1_ps(3.0f);
+
+        if(cols > 7)
+        {
+            // Columns j-1 to j+2, the next group's are j+3 to j+6
+            __m128 px, py, pz;
+            loadPositions4(row, px, py, pz);
+            for(; j + 6 < cols; j += 4)
+            {
+                __m128 qx, qy, qz;
+                loadPositions4(row + j + 3, qx, qy, qz);
+
+                // Columns j+1 to j+4 less columns j-1 to j+2
+                __m128 ux = _mm_sub_ps(_mm_shuffle_ps(px, qx, _MM_SHUFFLE(1, 0, 3, 2)), px);
+                __m128 uy = _mm_sub_ps(_mm_shuffle_ps(py, qy, _MM_SHUFFLE(1, 0, 3, 2)), py);
+                __m128 uz = _mm_sub_ps(_mm_shuffle_ps(pz, qz, _MM_SHUFFLE(1, 0, 3, 2)), pz);
+
+                __m128 ax, ay, az, bx, by, bz;
+                loadPositions4(up + j, ax, ay, az);
+                loadPositions4(down + j, bx, by, bz);
+                __m128 vx = _mm_sub_ps(bx, ax);
+                __m128 vy = _mm_sub_ps(by, ay);
+                __m128 vz = _mm_sub_ps(bz, az);
+
+                __m128 nx = _mm_sub_ps(_mm_mul_ps(uy, vz), _mm_mul_ps(uz, vy));
+                __m128 ny = _mm_sub_ps(_mm_mul_ps(uz, vx), _mm_mul_ps(ux, vz));
+                __m128 nz = _mm_sub_ps(_mm_mul_ps(ux, vy), _mm_mul_ps(uy, vx));
+
+                __m128 len = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)),
+                                        _mm_add_ps(_mm_mul_ps(nz, nz), bias));
+                __m128 inv = _mm_rsqrt_ps(len);
+                inv = _mm_mul_ps(_mm_mul_ps(half, inv),
+                                 _mm_sub_ps(three, _mm_mul_ps(_mm_mul_ps(len, inv), inv)));
+                nx = _mm_mul_ps(nx, inv);
+                ny = _mm_mul_ps(ny, inv);
+                nz = _mm_mul_ps(nz, inv);
+
+                __m128 nw = _mm_setzero_ps();
+                _MM_TRANSPOSE4_PS(nx, ny, nz, nw);
+                storeNormal(row[j].norm, nx);
+                storeNormal(row[j+1].norm, ny);
+                storeNormal(row[j+2].norm, nz);
+                storeNormal(row[j+3].norm, nw);
+
+                px = qx;
+                py = qy;
+                pz = qz;
+            }
+        }
+#endif
+
+        for(; j + 1 < cols; ++j)
+        {
+            gridNormal(row[j+1].pos.x - row[j-1].pos.x,
+                       row[j+1].pos.y - row[j-1].pos.y,
+                       row[j+1].pos.z - row[j-1].pos.z,
+                       down[j].pos.x - up[j].pos.x,
+                       down[j].pos.y - up[j].pos.y,
+                       down[j].pos.z - up[j].pos.z, row[j].norm);
+        }
+
+        // The first and last columns use one sided differences
+        const unsigned last = cols - 1;
+        gridNormal(row[1].pos.x - row[0].pos.x,
+                   row[1].pos.y - row[0].pos.y,
+                   row[1].pos.z - row[0].pos.z,
+                   down[0].pos.x - up[0].pos.x,
+                   down[0].pos.y - up[0].pos.y,
+                   down[0].pos.z - up[0].pos.z, row[0].norm);
+        gridNormal(row[last].pos.x - row[last-1].pos.x,
+                   row[last].pos.y - row[last-1].pos.y,
+                   row[last].pos.z - row[last-1].pos.z,
+                   down[last].pos.x - up[last].pos.x,
+                   down[last].pos.y - up[last].pos.y,
+                   down[last].pos.z - up[last].pos.z, row[last].norm);
+    }
+}
+
+//------------------------------------------------------------------------------
+// void computeMeshNormalsRange()
+//
+// Sums the normals of the triangles around each of the particles [begin,
+// end), weighted by their areas, which the length of the cross product of
+// two edges already is.  Each particle gathers from its own triangles so
+// the threads never write to the same normal.
+//------------------------------------------------------------------------------
+void C_Cloth::computeMeshNormalsRange(unsigned begin, unsigned end)
+{
+    for(unsigned i = begin; i < end; ++i)
+    {
+        float nx = 0.0f, ny = 0.0f, nz = 0.0f;
+        for(unsigned k = d_pVertexFaceStart[i]; k < d_pVertexFaceEnd[i]; ++k)
+        {
+            const unsigned* t = d_pTriangles + 3 * d_pVertexFaces[k];
+            const vector3f& a = d_pPositions[t[0]].pos;
+            const vector3f& b = d_pPositions[t[1]].pos;
+            const vector3f& c = d_pPositions[t[2]].pos;
+            const float ux = b.x - a.x, uy = b.y - a.y, uz = b.z - a.z;
+            const float vx = c.x - a.x, vy = c.y - a.y, vz = c.z - a.z;
+            nx += uy*vz - uz*vy;
+            ny += uz*vx - ux*vz;
+            nz += ux*vy - uy*vx;
+        }
+        const float inv = 1.0f / sqrtf(nx*nx + ny*ny + nz*nz + 1e-30f);
+        d_pPositions[i].norm = vector3f(nx*inv, ny*inv, nz*inv);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// void computeTileBoundsRange()
+//
+// Fits the boxes of the rows of tiles [begin, end) around their particles'
+// current and previous positions, and finds how far they moved.  Tiles that
+// sleep with no awake neighbour have not changed and are skipped.
+//------------------------------------------------------------------------------
+void C_Cloth::computeTileBoundsRange(unsigned begin, unsigned end)
+{
+    for(unsigned tr = begin; tr < end; ++tr)
+    {
+        const unsigned r0 = tr * CLOTH_TILE_CELLS;
+        const unsigned r1 = r0 + CLOTH_TILE_CELLS < d_numRow - 1 ? r0 + CLOTH_TILE_CELLS : d_numRow - 1;
+        for(unsigned tc = 0; tc < d_numTileCols; ++tc)
+        {
+            TileState& state = d_pTileState[tr*d_numTileCols + tc];
+            if(!state.active)
+                continue;
+
+            const unsigned c0 = tc * CLOTH_TILE_CELLS;
+            const unsigned c1 = c0 + CLOTH_TILE_CELLS < d_numCol - 1 ? c0 + CLOTH_TILE_CELLS : d_numCol - 1;
+
+            float motion = 0.0f;
+            vector3f lo = d_pPositions[getIndex2D(r0, c0)].pos, hi = lo;
+            for(unsigned i = r0; i <= r1; ++i)
+            {
+                const C_Vertex* row = d_pPositions + getIndex2D(i, 0);
+                const vector3f* old = d_pOldPositions + getIndex2D(i, 0);
+                for(unsigned j = c0; j <= c1; ++j)
+                {
+                    const vector3f& p = row[j].pos;
+                    const vector3f& q = old[j];
+                    lo.x = fminf(lo.x, fminf(p.x, q.x));
+                    lo.y = fminf(lo.y, fminf(p.y, q.y));
+                    lo.z = fminf(lo.z, fminf(p.z, q.z));
+                    hi.x = fmaxf(hi.x, fmaxf(p.x, q.x));
+                    hi.y = fmaxf(hi.y, fmaxf(p.y, q.y));
+                    hi.z = fmaxf(hi.z, fmaxf(p.z, q.z));
+
+                    const float dx = p.x - q.x, dy = p.y - q.y, dz = p.z - q.z;
+                    const float m = dx*dx + dy*dy + dz*dz;
+                    motion = m > motion ? m : motion;
+                }
+            }
+            d_pTileBounds[tr*d_numTileCols + tc].min = lo;
+            d_pTileBounds[tr*d_numTileCols + tc].max = hi;
+            state.motion = motion;
+        }
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// Tile lookups.  A tile's particles are the top left corners of its cells,
+// and those of the last row and column of tiles also take the bottom and
+// right of the grid.  Without tiles everything is in tile 0.
+//------------------------------------------------------------------------------
+unsigned C_Cloth::getParticleTile(unsigned i) const
+{
+    if(!d_numTileRows)
+        return 0;
+    const unsigned r = i / d_numCol, c = i - r * d_numCol;
+    const unsigned tr = r / CLOTH_TILE_CELLS, tc = c / CLOTH_TILE_CELLS;
+    return (tr < d_numTileRows ? tr : d_numTileRows - 1) * d_numTileCols + (tc < d_numTileCols ? tc : d_numTileCols - 1);
+}
+
+void C_Cloth::getTileParticles(unsigned t, unsigned& r0, unsigned& r1, unsigned& c0, unsigned& c1) const
+{
+    const unsigned tr = t / d_numTileCols, tc = t - tr * d_numTileCols;
+    r0 = tr * CLOTH_TILE_CELLS;
+    r1 = tr + 1 == d_numTileRows ? d_numRow : r0 + CLOTH_TILE_CELLS;
+    c0 = tc * CLOTH_TILE_CELLS;
+    c1 = tc + 1 == d_numTileCols ? d_numCol : c0 + CLOTH_TILE_CELLS;
+}
+
+
+//------------------------------------------------------------------------------
+// void updateSleep()
+//
+// Runs after the tile boxes were refit, which found how far each active
+// tile's particles moved over the step, its border with the neighbours
+// included.  A tile that moved CLOTH_WAKE_FACTOR times the threshold, or
+// was hit by another part of the cloth, wakes itself and its neighbours.  An
+// awake tile that moved less than the threshold for CLOTH_SLEEP_FRAMES steps
+// in a row, with no neighbour waking it, is put to sleep.
+//------------------------------------------------------------------------------
+void C_Cloth::updateSleep()
+{
+    if(!d_bSleeping || !d_pTileState)
+        return;
+
+    const unsigned numTiles = d_numTileRows * d_numTileCols;
+    const float still = d_fSleepThreshold * d_fCellSize, wake = still * CLOTH_WAKE_FACTOR;
+    for(unsigned t = 0; t < numTiles; ++t)
+    {
+        TileState& state = d_pTileState[t];
+        state.moving = (state.active && state.motion >= wake * wake) ||
+                       d_pTileWake[t].exchange(false, std::memory_order_relaxed);
+        if(!state.asleep)
+            state.stillSteps = state.motion < still * still ? state.stillSteps + 1 : 0;
+    }
+
+    bool changed = false;
+    for(unsigned tr = 0; tr < d_numTileRows; ++tr)
+        for(unsigned tc = 0; tc < d_numTileCols; ++tc)
+        {
+            bool moved = false;
+            for(unsigned r = tr ? tr - 1 : 0; r <= tr + 1 && r < d_numTileRows; ++r)
+                for(unsigned c = tc ? tc - 1 : 0; c <= tc + 1 && c < d_numTileCols; ++c)
+                    moved = moved || d_pTileState[r*d_numTileCols + c].moving;
+
+            const unsigned t = tr*d_numTileCols + tc;
+            TileState& state = d_pTileState[t];
+            if(moved)
+            {
+                state.stillSteps = 0;
+                if(state.asleep)
+                {
+                    wakeTile(t);
+                    changed = true;
+                }
+            }
+            else if(!state.asleep && state.stillSteps >= CLOTH_SLEEP_FRAMES)
+            {
+                sleepTile(t);
+                changed = true;
+            }
+        }
+
+    if(changed)
+        updateActiveLists();
+}
+
+//------------------------------------------------------------------------------
+// Puts tile t to sleep.  Its particles lose what is left of their velocity,
+// so they are still when it wakes.
+//------------------------------------------------------------------------------
+void C_Cloth::sleepTile(unsigned t)
+{
+    unsigned r0, r1, c0, c1;
+    getTileParticles(t, r0, r1, c0, c1);
+    for(unsigned r = r0; r < r1; ++r)
+        for(unsigned c = c0; c < c1; ++c)
+        {
+            const unsigned i = getIndex2D(r, c);
+            d_particleInfo[i].asleep = true;
+            d_pOldPositions[i] = d_pPositions[i].pos;
+        }
+    d_pTileState[t].asleep = true;
+    ++d_uSleepingTiles;
+}
+
+void C_Cloth::wakeTile(unsigned t)
+{
+    unsigned r0, r1, c0, c1;
+    getTileParticles(t, r0, r1, c0, c1);
+    for(unsigned r = r0; r < r1; ++r)
+        for(unsigned c = c0; c < c1; ++c)
+            d_particleInfo[getIndex2D(r, c)].asleep = false;
+    d_pTileState[t].asleep = false;
+    d_pTileState[t].stillSteps = 0;
+    --d_uSleepingTiles;
+}
+
+//------------------------------------------------------------------------------
+// Wakes the sleeping tiles whose boxes come within a cell of box
+//------------------------------------------------------------------------------
+void C_Cloth::wakeOverlapping(const ClothBounds& box)
+{
+    if(!d_uSleepingTiles)
+        return;
+
+    const unsigned numTiles = d_numTileRows * d_numTileCols;
+    for(unsigned t = 0; t < numTiles; ++t)
+        if(d_pTileState[t].asleep && overlaps(d_pTileBounds[t], box, d_fCellSize))
+            wakeTile(t);
+}
+
+//------------------------------------------------------------------------------
+// void wakeForColliders()
+//
+// Wakes the sleeping tiles near every shape that changed since the last
+// call, both where the shape was and where it is now, so cloth resting on a
+// shape that moved away falls.  Removing shapes wakes everything.
+//------------------------------------------------------------------------------
+void C_Cloth::wakeForColliders()
+{
+    const unsigned revision = d_colliders.getRevision();
+    if(revision == d_uColliderRevision)
+        return;
+
+    const unsigned count = d_colliders.getCount();
+    const unsigned known = (unsigned)d_colliderBoxes.size();
+    const unsigned sleeping = d_uSleepingTiles;
+    if(count < known)
+        wakeAll();
+
+    d_colliderBoxes.resize(count);
+    for(unsigned i = 0; i < count; ++i)
+    {
+        if(i < known && d_colliders.getShapeRevision(i) <= d_uColliderRevision)
+            continue;
+
+        ClothBounds box;
+        d_colliders.getShapeBounds(i, box.min, box.max);
+        if(i < known)
+            wakeOverlapping(d_colliderBoxes[i]);
+        wakeOverlapping(box);
+        d_colliderBoxes[i] = box;
+    }
+    d_uColliderRevision = revision;
+    if(d_uSleepingTiles != sleeping)
+        updateActiveLists();
+}
+
+//------------------------------------------------------------------------------
+// void updateActiveLists()
+//
+// Marks the tiles that are awake or next to an awake tile active and lists
+// the awake ones, then lists the runs of springs each color solves: those
+// of the awake tiles, and those reaching out of the active ones.  Groups
+// that follow each other in memory are merged into one run, so with every
+// tile awake each color is a single run.
+//------------------------------------------------------------------------------
+void C_Cloth::updateActiveLists()
+{
+    const unsigned numTiles = d_numTileRows * d_numTileCols;
+    d_awakeTiles.clear();
+    for(unsigned tr = 0; tr < d_numTileRows; ++tr)
+        for(unsigned tc = 0; tc < d_numTileCols; ++tc)
+        {
+            bool active = false;
+            for(unsigned r = tr ? tr - 1 : 0; r <= tr + 1 && r < d_numTileRows; ++r)
+                for(unsigned c = tc ? tc - 1 : 0; c <= tc + 1 && c < d_numTileCols; ++c)
+                    active = active || !d_pTileState[r*d_numTileCols + c].asleep;
+
+            const unsigned t = tr*d_numTileCols + tc;
+            d_pTileState[t].active = active;
+            if(!d_pTileState[t].asleep)
+                d_awakeTiles.push_back(t);
+        }
+
+    d_activeSprings.clear();
+    for(unsigned c = 0; c < d_numColors; ++c)
+    {
+        d_activeColorStart[c] = (unsigned)d_activeSprings.size();
+        unsigned offset = 0;
+        for(unsigned t = 0; t < numTiles; ++t)
+            for(unsigned out = 0; out < 2; ++out)
+            {
+                const unsigned g = (c * numTiles + t) * 2 + out;
+                const unsigned begin = d_pSpringTileStart[g], end = d_pSpringTileStart[g + 1];
+                if(begin == end || (out ? !d_pTileState[t].active : d_pTileState[t].asleep))
+                    continue;
+
+                if(d_activeSprings.size() > d_activeColorStart[c] && d_activeSprings.back().end == begin)
+                    d_activeSprings.back().end = end;
+                else
+                {
+                    SpringRange range = { begin, end, offset };
+                    d_activeSprings.push_back(range);
+                }
+                offset += end - begin;
+            }
+    }
+    d_activeColorStart[d_numColors] = (unsigned)d_activeSprings.size();
+}
+
+void C_Cloth::wakeAll()
+{
+    if(!d_uSleepingTiles)
+        return;
+
+    const unsigned numTiles = d_numTileRows * d_numTileCols;
+    for(unsigned t = 0; t < numTiles; ++t)
+        if(d_pTileState[t].asleep)
+            wakeTile(t);
+    updateActiveLists();
+}
+
+//------------------------------------------------------------------------------
+// void buildColorBatches()
+//
+// Greedily gives each spring the lowest color not already used by a spring on
+// either of its particles, then stores the springs sorted by color, and by
+// tile within a color, see d_pSpringTileStart.  With reordering on, the
+// springs of each group go in the order of their first particle, which is a
+// different particle for every spring of a color.  The springs of a color are
+// independent so their order within it does not change the result, but the
+// overflow batch is solved in order and keeps build order.  p1, p2, rest and
+// family hold the springs in build order.
+//------------------------------------------------------------------------------
+void C_Cloth::buildColorBatches(const unsigned* p1, const unsigned* p2, const float* rest,
+                                const unsigned char* family)
+{
+    const unsigned numSprings = getSpringCount();
+    const unsigned long long freeMask = (1ull << (MAX_SPRING_COLORS - 1)) - 1;
+
+    unsigned long long* used = new unsigned long long[d_uNumParticles];
+    unsigned char* color = new unsigned char[numSprings];
+    unsigned* group = new unsigned[numSprings];
+    unsigned count[MAX_SPRING_COLORS] = { 0 };
+
+    for(unsigned i = 0; i < d_uNumParticles; ++i)
+        used[i] = 0;
+
+    for(unsigned s = 0; s < numSprings; ++s)
+    {
+        unsigned long long avail = ~(used[p1[s]] | used[p2[s]]) & freeMask;
+        unsigned c = MAX_SPRING_COLORS - 1;
+        if(avail)
+            for(c = 0; !(avail & (1ull << c)); ++c);
+
+        used[p1[s]] |= 1ull << c;
+        used[p2[s]] |= 1ull << c;
+        color[s] = (unsigned char)c;
+        count[c]++;
+    }
+
+    // Colors are handed out lowest first, so the used ones are contiguous
+    // apart from the overflow batch which always comes last
+    d_numColors = 0;
+    while(d_numColors < MAX_SPRING_COLORS - 1 && count[d_numColors])
+        d_numColors++;
+    if(count[MAX_SPRING_COLORS - 1])
+        d_numColors = MAX_SPRING_COLORS;
+
+    // Count the springs of each group, then turn the counts into the first
+    // spring of each group
+    const unsigned numTiles = d_numTileRows ? d_numTileRows * d_numTileCols : 1;
+    const unsigned numGroups = d_numColors * numTiles * 2;
+    d_pSpringTileStart = new unsigned[numGroups + 1];
+    for(unsigned g = 0; g <= numGroups; ++g)
+        d_pSpringTileStart[g] = 0;
+
+    for(unsigned s = 0; s < numSprings; ++s)
+    {
+        const unsigned tile = getParticleTile(p1[s]);
+        group[s] = (color[s] * numTiles + tile) * 2 + (getParticleTile(p2[s]) != tile);
+        d_pSpringTileStart[group[s] + 1]++;
+    }
+    for(unsigned g = 0; g < numGroups; ++g)
+        d_pSpringTileStart[g + 1] += d_pSpringTileStart[g];
+    for(unsigned c = 0; c <= MAX_SPRING_COLORS; ++c)
+        d_colorStart[c] = d_pSpringTileStart[(c < d_numColors ? c : d_numColors) * numTiles * 2];
+    for(unsigned c = 0; c < MAX_SPRING_COLORS; ++c)
+        d_colorEnd[c] = d_colorStart[c + 1];
+
+    d_pSpringP1 = new unsigned[numSprings];
+    d_pSpringP2 = new unsigned[numSprings];
+    d_pRestLength = new float[numSprings];
+    d_pSpringFamily = new unsigned char[numSprings];
+    d_pSpringOrder = new unsigned[numSprings];
+
+    // The build index of the spring stored at each place
+    unsigned* next = new unsigned[numGroups];
+    unsigned* source = new unsigned[numSprings];
+    for(unsigned g = 0; g < numGroups; ++g)
+        next[g] = d_pSpringTileStart[g];
+    for(unsigned s = 0; s < numSprings; ++s)
+        source[next[group[s]]++] = s;
+
+    if(d_bReorder)
+    {
+        const unsigned sorted = (MAX_SPRING_COLORS - 1) * numTiles * 2;
+        FirstParticleLess less = { p1 };
+        for(unsigned g = 0; g < numGroups && g < sorted; ++g)
+            std::sort(source + d_pSpringTileStart[g], source + d_pSpringTileStart[g + 1], less);
+    }
+
+    for(unsigned dst = 0; dst < numSprings; ++dst)
+    {
+        const unsigned s = source[dst];
+        d_pSpringP1[dst] = p1[s];
+        d_pSpringP2[dst] = p2[s];
+        d_pRestLength[dst] = rest[s];
+        d_pSpringFamily[dst] = family[s];
+        d_pSpringOrder[s] = dst;
+    }
+
+    delete [] source;
+    delete [] next;
+    delete [] group;
+    delete [] color;
+    delete [] used;
+}
+
+
+//------------------------------------------------------------------------------
+// void reserveTearing()
+//
+// Makes the room tearing needs once the springs of a mesh are in their
+// colors, see setTearStretch().  Each color is moved up to leave free places
+// after it, a few empty colors are added while there are colors to spare,
+// and every particle lists its springs and their colors.  The build order is
+// kept with its inverse, so a spring can be taken out of it in place.  The
+// cloth is left unable to tear if a particle has more springs than its list
+// holds.
 //------------------------------------------------------------------------------
-C_Cloth::C_Cloth() : d_particleInfo(0), d_structuralSprings(0), d_shearSprings(0),
-d_uVertexBufferID(0)
+void C_Cloth::reserveTearing()
 {
+    const unsigned numSprings = getSpringCount();
+    d_pNumParticleSprings = new unsigned char[d_uParticleCapacity];
+    memset(d_pNumParticleSprings, 0, d_uParticleCapacity);
+    for(unsigned s = 0; s < numSprings; ++s)
+        if(d_pNumParticleSprings[d_pSpringP1[s]]++ == CLOTH_PARTICLE_SPRINGS ||
+           d_pNumParticleSprings[d_pSpringP2[s]]++ == CLOTH_PARTICLE_SPRINGS)
+        {
+            delete [] d_pNumParticleSprings;
+            d_pNumParticleSprings = 0;
+            return;
+        }
+
+    // The new first place of each color, with its springs and their share
+    // of room after them
+    const unsigned numUsed = d_numColors;
+    unsigned numColors = numUsed;
+    if(numColors < MAX_SPRING_COLORS - 1)
+        numColors = numColors + TEAR_SPARE_COLORS < MAX_SPRING_COLORS - 1 ? numColors + TEAR_SPARE_COLORS : MAX_SPRING_COLORS - 1;
+    unsigned start[MAX_SPRING_COLORS + 1], largest = 0;
+    start[0] = 0;
+    for(unsigned c = 0; c < numColors; ++c)
+    {
+        const unsigned count = c < numUsed ? d_colorStart[c + 1] - d_colorStart[c] : 0;
+        const unsigned room = count + count / TEAR_SPRING_SHARE + TEAR_SPRING_ROOM;
+        start[c + 1] = start[c] + room;
+        largest = room > largest ? room : largest;
+    }
+    const unsigned numSlots = start[numColors];
+
+    unsigned* p1 = new unsigned[numSlots];
+    unsigned* p2 = new unsigned[numSlots];
+    float* rest = new float[numSlots];
+    unsigned char* family = new unsigned char[numSlots];
+    for(unsigned c = 0; c < numColors; ++c)
+    {
+        const unsigned count = c < numUsed ? d_colorStart[c + 1] - d_colorStart[c] : 0;
+        for(unsigned k = 0; k < start[c + 1] - start[c]; ++k)
+        {
+            const unsigned dst = start[c] + k, src = d_colorStart[c] + k;
+            p1[dst] = k < count ? d_pSpringP1[src] : 0;
+            p2[dst] = k < count ? d_pSpringP2[src] : 0;
+            rest[dst] = k < count ? d_pRestLength[src] : 0.0f;
+            family[dst] = k < count ? d_pSpringFamily[src] : (unsigned char)SPRING_STRUCTURAL;
+        }
+    }
+
+    unsigned* order = new unsigned[numSlots];
+    d_pSpringRank = new unsigned[numSlots];
+    for(unsigned b = 0; b < numSprings; ++b)
+    {
+        const unsigned src = d_pSpringOrder[b];
+        const unsigned c = (unsigned)(std::upper_bound(d_colorStart, d_colorStart + numUsed + 1, src) - d_colorStart) - 1;
+        order[b] = src - d_colorStart[c] + start[c];
+        d_pSpringRank[order[b]] = b;
+    }
+
+    delete [] d_pSpringP1;
+    delete [] d_pSpringP2;
+    delete [] d_pRestLength;
+    delete [] d_pSpringFamily;
+    delete [] d_pSpringOrder;
+    delete [] d_pSpringTileStart;
+    d_pSpringP1 = p1;
+    d_pSpringP2 = p2;
+    d_pRestLength = rest;
+    d_pSpringFamily = family;
+    d_pSpringOrder = order;
+
+    // A mesh has one tile, so a color is one group of springs in use and
+    // an empty one
+    d_pSpringTileStart = new unsigned[numColors * 2 + 1];
+    for(unsigned c = 0; c < numColors; ++c)
+    {
+        const unsigned count = c < numUsed ? d_colorStart[c + 1] - d_colorStart[c] : 0;
+        d_pSpringTileStart[c * 2] = start[c];
+        d_pSpringTileStart[c * 2 + 1] = d_pSpringTileStart[c * 2 + 2] = start[c] + count;
+    }
+    d_pSpringTileStart[numColors * 2] = numSlots;
+    for(unsigned c = 0; c <= MAX_SPRING_COLORS; ++c)
+        d_colorStart[c] = start[c < numColors ? c : numColors];
+    for(unsigned c = 0; c < numColors; ++c)
+        d_colorEnd[c] = d_pSpringTileStart[c * 2 + 1];
+    for(unsigned c = numColors; c < MAX_SPRING_COLORS; ++c)
+        d_colorEnd[c] = numSlots;
+    d_numColors = numColors;
+
+    d_pParticleSprings = new unsigned[(size_t)d_uParticleCapacity * CLOTH_PARTICLE_SPRINGS];
+    d_pColorMask = new unsigned long long[d_uParticleCapacity];
+    d_pOrigin = new unsigned[d_uParticleCapacity];
+    memset(d_pNumParticleSprings, 0, d_uParticleCapacity);
+    for(unsigned i = 0; i < d_uNumParticles; ++i)
+    {
+        d_pColorMask[i] = 0;
+        d_pOrigin[i] = i;
+    }
+    for(unsigned c = 0; c < d_numColors; ++c)
+        for(unsigned s = d_colorStart[c]; s < d_colorEnd[c]; ++s)
+        {
+            listSpring(d_pSpringP1[s], s);
+            listSpring(d_pSpringP2[s], s);
+            d_pColorMask[d_pSpringP1[s]] |= 1ull << c;
+            d_pColorMask[d_pSpringP2[s]] |= 1ull << c;
+        }
+
+    d_pTears = new unsigned long long[CLOTH_MAX_TEARS];
+    d_pEdits = new Edit[CLOTH_EDIT_LOG];
+    d_compactOrder.resize(largest);
+    d_compactSlots.resize(largest);
+    d_uCompactColor = d_numColors;
 }
 
 
-//==============================================================================
-// PRIVATE METHODS
-//==============================================================================
+//------------------------------------------------------------------------------
+// void recordTears()
+//
+// Records the springs s + l for the bits l set in lanes as torn.  Called by
+// the solver threads, the springs are torn by tearSprings().
+//------------------------------------------------------------------------------
+void C_Cloth::recordTears(unsigned s, unsigned lanes)
+{
+    for(unsigned l = 0; lanes; ++l, lanes >>= 1)
+    {
+        if(!(lanes & 1))
+            continue;
+        const unsigned k = d_uNumTears.fetch_add(1, std::memory_order_relaxed);
+        if(k < CLOTH_MAX_TEARS)
+            d_pTears[k] = pairKey(d_pSpringP1[s + l], d_pSpringP2[s + l]);
+    }
+}
+
 
 //------------------------------------------------------------------------------
-// void sumForces()
+// void tearSprings()
 //
-// Used by the stepSimulation() function to calculate the combined forces acting
-// on the particles.  finds the accelerations for each particle
+// Tears the springs the last constraint pass recorded, in the order of their
+// particles so the result does not depend on the threads.  A spring an
+// earlier split already parted is skipped.  One of its particles is split,
+// the first if it can be, see splitParticle().  Then, once enough springs
+// have moved, one color is sorted again a step.
 //------------------------------------------------------------------------------
-void C_Cloth::sumForces()
+void C_Cloth::tearSprings()
 {
-    vector3f wind, d, f;
+    unsigned numTears = d_uNumTears.exchange(0, std::memory_order_relaxed);
+    if(!numTears && d_uCompactColor == d_numColors)
+        return;
+
+    PERF_SCOPE(PERF_TEARING);
+    numTears = numTears < CLOTH_MAX_TEARS ? numTears : CLOTH_MAX_TEARS;
+    std::sort(d_pTears, d_pTears + numTears);
+    for(unsigned t = 0; t < numTears; ++t)
+    {
+        const unsigned a = (unsigned)(d_pTears[t] >> 32), b = (unsigned)d_pTears[t];
+        if(findSpring(a, b, SPRING_STRUCTURAL) != ~0u && !splitParticle(a, b))
+            splitParticle(b, a);
+    }
 
-    // seed for rand
-    srand((unsigned int)time(0));
+    if(d_uCompactColor == d_numColors && d_bReorder &&
+       d_uCompactMoves * TEAR_COMPACT_SHARE >= getSpringCount())
+    {
+        d_uCompactMoves = 0;
+        d_uCompactColor = 0;
+    }
+    if(d_uCompactColor < d_numColors)
+        compactColor(d_uCompactColor++);
+}
 
-    // process the gravity, drag, and wind forces
-    for(unsigned i = 0; i < d_uNumParticles; ++i)
+
+//------------------------------------------------------------------------------
+// bool splitParticle()
+//
+// Splits particle v along the plane through it facing the other particle.
+// The triangles around v whose middle is on the other's side go to a new
+// particle, and with them the springs to particles only they touch.  Of the
+// springs to the particles along the cut, that both sides' triangles touch,
+// a structural one is given to both particles and any other goes with the
+// side its far end is on.  The springs other than structural ones from one
+// side to the other, that went across v, go.  The two particles share v's
+// mass by their share of its triangles and start where v was.
+//
+// Returns false, and leaves v as it was, if all of v's triangles are on one
+// side, it has too many, or the room for particles or in the lists of
+// springs is used up.  A structural spring along the cut that fits in no
+// color is left out.
+//------------------------------------------------------------------------------
+bool C_Cloth::splitParticle(unsigned v, unsigned other)
+{
+    const unsigned first = d_pVertexFaceStart[v], fan = d_pVertexFaceEnd[v] - first;
+    if(d_uNumParticles == d_uParticleCapacity || fan < 2 || fan > TEAR_MAX_FAN)
+        return false;
+
+    const vector3f x = d_pPositions[v].pos;
+    const vector3f dir = d_pPositions[other].pos - x;
+    unsigned* faces = d_pVertexFaces + first;
+    bool away[TEAR_MAX_FAN];
+    unsigned numAway = 0;
+    for(unsigned k = 0; k < fan; ++k)
     {
-        if(d_particleInfo[i].locked) continue;
+        const unsigned* t = d_pTriangles + 3 * faces[k];
+        const vector3f mid = (d_pPositions[t[0]].pos + d_pPositions[t[1]].pos + d_pPositions[t[2]].pos) * (1.0f / 3.0f);
+        away[k] = (mid - x) * dir > 0.0f;
+        numAway += away[k];
+    }
+    if(!numAway || numAway == fan)
+        return false;
 
-        // Add acceleration due to gravity first
-        d_pAccel[i] = d_vGravity;
+    // The particles around either side
+    unsigned ringKept[TEAR_MAX_FAN * 2], ringAway[TEAR_MAX_FAN * 2];
+    unsigned numKept = 0, numFar = 0;
+    for(unsigned k = 0; k < fan; ++k)
+    {
+        const unsigned* t = d_pTriangles + 3 * faces[k];
+        for(unsigned c = 0; c < 3; ++c)
+        {
+            if(t[c] == v)
+                continue;
+            if(away[k] && !listed(ringAway, numFar, t[c]))
+                ringAway[numFar++] = t[c];
+            else if(!away[k] && !listed(ringKept, numKept, t[c]))
+                ringKept[numKept++] = t[c];
+        }
+    }
 
-        // wind
-        if(d_windVector != vector3f(0,0,0) && d_windFactor != 0)
+    // Sort out v's springs before anything changes
+    const unsigned* springs = d_pParticleSprings + (size_t)v * CLOTH_PARTICLE_SPRINGS;
+    unsigned moved[CLOTH_PARTICLE_SPRINGS], shared[CLOTH_PARTICLE_SPRINGS];
+    float sharedRest[CLOTH_PARTICLE_SPRINGS];
+    unsigned numMoved = 0, numShared = 0;
+    for(unsigned k = 0; k < d_pNumParticleSprings[v]; ++k)
+    {
+        const unsigned s = springs[k];
+        const unsigned y = d_pSpringP1[s] == v ? d_pSpringP2[s] : d_pSpringP1[s];
+        const bool kept = listed(ringKept, numKept, y), far = listed(ringAway, numFar, y);
+        if(kept && far && d_pSpringFamily[s] == SPRING_STRUCTURAL)
         {
-            wind.X() = randFloat(0.0, d_windVector.X());
-            wind.Y() = randFloat(0.0, d_windVector.Y());
-            wind.Z() = randFloat(0.0, d_windVector.Z());
-            wind.normalize();
-            d_pAccel[i] += d_particleInfo[i].invMass * wind * (float)(rand() % d_windFactor);
+            if(d_pNumParticleSprings[y] == CLOTH_PARTICLE_SPRINGS)
+                return false;
+            sharedRest[numShared] = d_pRestLength[s];
+            shared[numShared++] = y;
+        }
+        else if(far != kept ? far : (d_pPositions[y].pos - x) * dir > 0.0f)
+            moved[numMoved++] = s;
+    }
+    if(numMoved + numShared > CLOTH_PARTICLE_SPRINGS)
+        return false;
+
+    const unsigned w = d_uNumParticles++;
+    const float share = (float)numAway / fan;
+    d_pPositions[w] = d_pPositions[v];
+    d_pOldPositions[w] = d_pOldPositions[v];
+    d_pAccel[w] = d_pAccel[v];
+    d_particleInfo[w] = d_particleInfo[v];
+    d_particleInfo[w].invMass = d_particleInfo[v].invMass / share;
+    d_particleInfo[v].invMass /= 1.0f - share;
+    d_pSourceIndex[w] = d_pSourceIndex[v];
+    d_pOrigin[w] = d_pOrigin[v];
+    d_pNumParticleSprings[w] = 0;
+    d_pColorMask[w] = 0;
+    if(d_pSelfCandidateCount)
+        d_pSelfCandidateCount[w] = 0;
+    d_bRebuildHash = true;
+    logEdit(EDIT_PARTICLE, w, 1);
+
+    // v keeps the front of its triangles and w takes the rest
+    unsigned awayFaces[TEAR_MAX_FAN], numKeptFaces = 0;
+    for(unsigned k = 0, m = 0; k < fan; ++k)
+    {
+        if(!away[k])
+        {
+            faces[numKeptFaces++] = faces[k];
+            continue;
         }
+        awayFaces[m++] = faces[k];
+        unsigned* t = d_pTriangles + 3 * faces[k];
+        for(unsigned c = 0; c < 3; ++c)
+            if(t[c] == v)
+                t[c] = w;
+        logEdit(EDIT_TRIANGLE, faces[k], 1);
     }
+    for(unsigned k = 0; k < numAway; ++k)
+        faces[numKeptFaces + k] = awayFaces[k];
+    d_pVertexFaceEnd[v] = d_pVertexFaceStart[w] = first + numKeptFaces;
+    d_pVertexFaceEnd[w] = first + fan;
 
-    // Process the forces from the shear springs
-//    for(int i = 0; i < d_numShearSprings; ++i)
-//    {
-//        d = (*d_shearSprings[i].p1) - (*d_shearSprings[i].p2);
+    for(unsigned k = 0; k < numMoved; ++k)
+        moveSpringEnd(moved[k], v, w);
+
+    // Taking a spring out changes the list being walked, its place is
+    // taken by the last
+    for(unsigned r = 0; r < numKept; ++r)
+    {
+        const unsigned p = ringKept[r];
+        if(listed(ringAway, numFar, p))
+            continue;
+        const unsigned* list = d_pParticleSprings + (size_t)p * CLOTH_PARTICLE_SPRINGS;
+        for(unsigned k = 0; k < d_pNumParticleSprings[p]; )
+        {
+            const unsigned s = list[k];
+            const unsigned q = d_pSpringP1[s] == p ? d_pSpringP2[s] : d_pSpringP1[s];
+            if(d_pSpringFamily[s] != SPRING_STRUCTURAL && listed(ringAway, numFar, q) && !listed(ringKept, numKept, q))
+                removeSpring(s);
+            else
+                ++k;
+        }
+    }
 
-//        f = -(d_shearSpringConst * (d.magnitude() - d_shearSprings[i].restLength));
+    for(unsigned k = 0; k < numShared; ++k)
+        addSpring(w, shared[k], sharedRest[k], SPRING_STRUCTURAL);
 
-//        if(!d_shearSprings[i].info1->locked)
-//            (*d_shearSprings[i].acel1) += (f * d_shearSprings[i].info1->invMass);
+    ++d_uTornCount;
+    return true;
+}
 
-//        if(!d_shearSprings[i].info2->locked)
-//            (*d_shearSprings[i].acel2) -= (f * d_shearSprings[i].info2->invMass);
-//    }
 
-//    // Process the forces from the structural springs
-//    for(int i = 0; i < d_numStructSprings; i++)
-//    {
-//        d = (*d_structuralSprings[i].p1) - (*d_structuralSprings[i].p2);
+//------------------------------------------------------------------------------
+// Looks through a's springs for one of the family to b, ~0u if there is none
+//------------------------------------------------------------------------------
+unsigned C_Cloth::findSpring(unsigned a, unsigned b, unsigned family) const
+{
+    const unsigned* list = d_pParticleSprings + (size_t)a * CLOTH_PARTICLE_SPRINGS;
+    for(unsigned k = 0; k < d_pNumParticleSprings[a]; ++k)
+    {
+        const unsigned s = list[k];
+        if(d_pSpringFamily[s] == family && (d_pSpringP1[s] == b || d_pSpringP2[s] == b))
+            return s;
+    }
+    return ~0u;
+}
 
-//        f = -(d_structSpringConst * (d.magnitude() - d_structuralSprings[i].restLength));
+unsigned C_Cloth::getSpringColor(unsigned s) const
+{
+    return (unsigned)(std::upper_bound(d_colorStart, d_colorStart + d_numColors + 1, s) - d_colorStart) - 1;
+}
 
-//        if(!d_structuralSprings[i].info1->locked)
-//            (*d_structuralSprings[i].acel1) += (f * d_shearSprings[i].info1->invMass);
+void C_Cloth::listSpring(unsigned i, unsigned s)
+{
+    d_pParticleSprings[(size_t)i * CLOTH_PARTICLE_SPRINGS + d_pNumParticleSprings[i]++] = s;
+}
 
-//        if(!d_structuralSprings[i].info2->locked)
-//            (*d_structuralSprings[i].acel2) -= (f * d_shearSprings[i].info1->invMass);
-//    }
+void C_Cloth::unlistSpring(unsigned i, unsigned s)
+{
+    unsigned* list = d_pParticleSprings + (size_t)i * CLOTH_PARTICLE_SPRINGS;
+    unsigned* last = list + --d_pNumParticleSprings[i];
+    *std::find(list, last, s) = *last;
 }
 
 
-void C_Cloth::applyConstraints()
+//------------------------------------------------------------------------------
+// bool addSpring()
+//
+// Puts a spring in the first free place of the lowest color neither
+// particle has a spring of yet, or of the overflow batch, which may share
+// particles.  Returns false if there is no such place, or no room in the
+// particles' lists.
+//------------------------------------------------------------------------------
+bool C_Cloth::addSpring(unsigned a, unsigned b, float rest, unsigned char family)
 {
-    for(int j = 0; j < 3; ++j)
+    if(d_pNumParticleSprings[a] == CLOTH_PARTICLE_SPRINGS || d_pNumParticleSprings[b] == CLOTH_PARTICLE_SPRINGS)
+        return false;
+
+    const unsigned long long busy = d_pColorMask[a] | d_pColorMask[b];
+    unsigned c = 0;
+    while(c < d_numColors && (d_colorEnd[c] == d_colorStart[c + 1] ||
+                              (c < MAX_SPRING_COLORS - 1 && (busy >> c & 1))))
+        ++c;
+    if(c == d_numColors)
+        return false;
+
+    const unsigned s = d_colorEnd[c]++;
+    d_pSpringP1[s] = a;
+    d_pSpringP2[s] = b;
+    d_pRestLength[s] = rest;
+    d_pSpringFamily[s] = family;
+    d_pColorMask[a] |= 1ull << c;
+    d_pColorMask[b] |= 1ull << c;
+    listSpring(a, s);
+    listSpring(b, s);
+    if(family == SPRING_STRUCTURAL)
+        d_numStructSprings++;
+    else if(family == SPRING_SHEAR)
+        d_numShearSprings++;
+    else
+        d_numBendSprings++;
+
+    const unsigned rank = getSpringCount() - 1;
+    d_pSpringOrder[rank] = s;
+    d_pSpringRank[s] = rank;
+    ++d_uCompactMoves;
+    logEdit(EDIT_SPRINGS, s, 1);
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+// void removeSpring()
+//
+// Takes spring s out.  The last spring of its color fills its place and the
+// last in the build order its place there, so both stay without holes, and
+// the freed place at the end of the color is left with both ends on one
+// particle.
+//------------------------------------------------------------------------------
+void C_Cloth::removeSpring(unsigned s)
+{
+    const unsigned c = getSpringColor(s), last = --d_colorEnd[c];
+    const unsigned a = d_pSpringP1[s], b = d_pSpringP2[s];
+    d_pColorMask[a] &= ~(1ull << c);
+    d_pColorMask[b] &= ~(1ull << c);
+    unlistSpring(a, s);
+    unlistSpring(b, s);
+    if(d_pSpringFamily[s] == SPRING_STRUCTURAL)
+        d_numStructSprings--;
+    else if(d_pSpringFamily[s] == SPRING_SHEAR)
+        d_numShearSprings--;
+    else
+        d_numBendSprings--;
+
+    const unsigned numSprings = getSpringCount(), rank = d_pSpringRank[s];
+    d_pSpringOrder[rank] = d_pSpringOrder[numSprings];
+    d_pSpringRank[d_pSpringOrder[rank]] = rank;
+
+    if(last != s)
     {
-        for(int i = 0; i < d_numStructSprings; ++i)
-        {
-            Spring& s = d_structuralSprings[i];
-            vector3f& x1 = *s.p1;
-            vector3f& x2 = *s.p2;
-            vector3f delta = x1 - x2;
-            float deltaLength = delta.magnitude();
-            float diff = (deltaLength - s.restLength)/deltaLength;
-            if(!s.info1->locked)
-                x1 -= delta*0.5*diff;
-            if(!s.info2->locked)
-                x2 += delta*0.5*diff;
-        }
+        d_pSpringP1[s] = d_pSpringP1[last];
+        d_pSpringP2[s] = d_pSpringP2[last];
+        d_pRestLength[s] = d_pRestLength[last];
+        d_pSpringFamily[s] = d_pSpringFamily[last];
+        d_pSpringRank[s] = d_pSpringRank[last];
+        d_pSpringOrder[d_pSpringRank[s]] = s;
+        unlistSpring(d_pSpringP1[s], last);
+        listSpring(d_pSpringP1[s], s);
+        unlistSpring(d_pSpringP2[s], last);
+        listSpring(d_pSpringP2[s], s);
+        logEdit(EDIT_SPRINGS, s, 1);
+    }
+    d_pSpringP1[last] = d_pSpringP2[last] = a;
+    d_pRestLength[last] = 0.0f;
+    d_pSpringFamily[last] = SPRING_STRUCTURAL;
+    ++d_uCompactMoves;
+    logEdit(EDIT_SPRINGS, last, 1);
+}
+
+
+//------------------------------------------------------------------------------
+// void moveSpringEnd()
+//
+// Moves the end of spring s at particle from to particle to, which has no
+// spring of its color yet
+//------------------------------------------------------------------------------
+void C_Cloth::moveSpringEnd(unsigned s, unsigned from, unsigned to)
+{
+    if(d_pSpringP1[s] == from)
+        d_pSpringP1[s] = to;
+    else
+        d_pSpringP2[s] = to;
+
+    const unsigned long long bit = 1ull << getSpringColor(s);
+    d_pColorMask[from] &= ~bit;
+    d_pColorMask[to] |= bit;
+    unlistSpring(from, s);
+    listSpring(to, s);
+    ++d_uCompactMoves;
+    logEdit(EDIT_SPRINGS, s, 1);
+}
+
+
+//------------------------------------------------------------------------------
+// void compactColor()
+//
+// Sorts the springs of color c by their first particle again, as
+// buildColorBatches() left them, after tearing moved and replaced some.  A
+// particle has one spring of the color at most, so the one place of its
+// list within the color is the one to change.  The overflow batch keeps its
+// order.
+//------------------------------------------------------------------------------
+void C_Cloth::compactColor(unsigned c)
+{
+    const unsigned first = d_colorStart[c], count = d_colorEnd[c] - first;
+    if(c == MAX_SPRING_COLORS - 1 || count < 2)
+        return;
 
-        for(int i = 0; i < d_numShearSprings; ++i)
+    unsigned* order = &d_compactOrder[0];
+    SpringSlot* slots = &d_compactSlots[0];
+    for(unsigned k = 0; k < count; ++k)
+    {
+        const unsigned s = first + k;
+        order[k] = s;
+        slots[k].p1 = d_pSpringP1[s];
+        slots[k].p2 = d_pSpringP2[s];
+        slots[k].rank = d_pSpringRank[s];
+        slots[k].rest = d_pRestLength[s];
+        slots[k].family = d_pSpringFamily[s];
+    }
+    FirstParticleLess less = { d_pSpringP1 };
+    std::sort(order, order + count, less);
+
+    for(unsigned k = 0; k < count; ++k)
+    {
+        const unsigned dst = first + k;
+        if(order[k] == dst)
+            continue;
+
+        const SpringSlot& slot = slots[order[k] - first];
+        d_pSpringP1[dst] = slot.p1;
+        d_pSpringP2[dst] = slot.p2;
+        d_pRestLength[dst] = slot.rest;
+        d_pSpringFamily[dst] = slot.family;
+        d_pSpringRank[dst] = slot.rank;
+        d_pSpringOrder[slot.rank] = dst;
+
+        const unsigned ends[2] = { slot.p1, slot.p2 };
+        for(unsigned e = 0; e < 2; ++e)
         {
-            Spring& s = d_shearSprings[i];
-            vector3f& x1 = *s.p1;
-            vector3f& x2 = *s.p2;
-            vector3f delta = x1 - x2;
-            float deltaLength = delta.magnitude();
-            float diff = (deltaLength - s.restLength)/deltaLength;
-            if(!s.info1->locked)
-                x1 -= delta*0.5*diff;
-            if(!s.info2->locked)
-                x2 += delta*0.5*diff;
+            unsigned* list = d_pParticleSprings + (size_t)ends[e] * CLOTH_PARTICLE_SPRINGS;
+            unsigned* l = list;
+            while(*l < first || *l >= first + count)
+                ++l;
+            *l = dst;
         }
     }
+    logEdit(EDIT_SPRINGS, first, count);
 }
 
-
+void C_Cloth::logEdit(EditKind kind, unsigned first, unsigned count)
+{
+    Edit& e = d_pEdits[d_uNumEdits++ % CLOTH_EDIT_LOG];
+    e.kind = kind;
+    e.first = first;
+    e.count = count;
+}
 
 
 
@@ -142,69 +2343,192 @@ void C_Cloth::applyConstraints()
 //------------------------------------------------------------------------------
 void C_Cloth::clear()
 {
-    glDeleteBuffers(1, &d_uVertexBufferID);
-
     if(d_particleInfo)
     {
-        delete d_particleInfo;
+        delete [] d_particleInfo;
         d_particleInfo = 0;
     }
-    if(d_structuralSprings)
-    {
-        delete d_structuralSprings;
-        d_structuralSprings = 0;
-    }
-    if(d_shearSprings)
-    {
-        delete d_shearSprings;
-        d_shearSprings = 0;
-    }
+    delete [] d_pSpringP1;
+    delete [] d_pSpringP2;
+    delete [] d_pSpringOrder;
+    delete [] d_pRestLength;
+    delete [] d_pSpringFamily;
+    delete [] d_pTileBounds;
+    delete [] d_pSelfPush;
+    delete [] d_pHashPositions;
+    delete [] d_pSelfCandidates;
+    delete [] d_pSelfCandidateCount;
+    delete [] d_pImpactTime;
+    delete [] d_pSpringTileStart;
+    delete [] d_pTileState;
+    delete [] d_pTileWake;
+    delete [] d_pTriangles;
+    delete [] d_pVertexFaceStart;
+    delete [] d_pVertexFaces;
+    delete [] d_pNeighbourStart;
+    delete [] d_pNeighbours;
+    delete [] d_pSourceIndex;
+    delete [] d_pParticleIndex;
+    delete [] d_pVertexFaceEnd;
+    delete [] d_pSpringRank;
+    delete [] d_pParticleSprings;
+    delete [] d_pOrigin;
+    delete [] d_pNumParticleSprings;
+    delete [] d_pColorMask;
+    delete [] d_pTears;
+    delete [] d_pEdits;
+    d_pTriangles = d_pVertexFaceStart = d_pVertexFaceEnd = d_pVertexFaces = 0;
+    d_pNeighbourStart = d_pNeighbours = 0;
+    d_pSourceIndex = d_pParticleIndex = 0;
+    d_numSources = 0;
+    d_uParticleCapacity = 0;
+    d_pSpringRank = d_pParticleSprings = d_pOrigin = 0;
+    d_pNumParticleSprings = 0;
+    d_pColorMask = d_pTears = 0;
+    d_pEdits = 0;
+    d_uNumTears.store(0, std::memory_order_relaxed);
+    d_uTornCount = d_uNumEdits = 0;
+    d_uCompactMoves = d_uCompactColor = 0;
+    d_compactOrder.clear();
+    d_compactSlots.clear();
+    d_pImpactTime = 0;
+    d_pSpringTileStart = 0;
+    d_pTileState = 0;
+    d_pTileWake = 0;
+    d_uSleepingTiles = 0;
+    d_awakeTiles.clear();
+    d_activeSprings.clear();
+    d_pSelfPush = d_pHashPositions = 0;
+    d_pSelfCandidates = d_pSelfCandidateCount = 0;
+    d_bvh.clear();
+    d_pSpringP1 = d_pSpringP2 = d_pSpringOrder = 0;
+    d_pRestLength = 0;
+    d_pSpringFamily = 0;
+    d_pTileBounds = 0;
+    d_numTileRows = d_numTileCols = 0;
+    d_numColors = 0;
+    d_numStructSprings = d_numShearSprings = d_numBendSprings = 0;
 }
 
 
 
 //------------------------------------------------------------------------------
-// void draw()
+// void updateNormals()
 //
-// Draws the cloth.
+// Recomputes the vertex normals over the worker threads, unless they are
+// already up to date with the particle positions.
 //------------------------------------------------------------------------------
-void C_Cloth::draw()
+void C_Cloth::updateNormals()
 {
-
+    if(d_uNormalFrame == d_uFrame || !d_uNumParticles)
+        return;
+
+    PERF_SCOPE(PERF_NORMALS);
+    NormalTask task = { this };
+    if(d_pTriangles)
+        d_workers.parallelFor(d_uNumParticles, PARTICLE_GRAIN, task);
+    else
+    {
+        unsigned rowGrain = PARTICLE_GRAIN / d_numCol;
+        d_workers.parallelFor(d_numRow, rowGrain ? rowGrain : 1, task);
+    }
+    d_uNormalFrame = d_uFrame;
 }
 
 
+//------------------------------------------------------------------------------
+// const C_ClothBVH& updateBVH()
+//
+// Builds the tree from the grid the first time it is asked for after the
+// cloth was initialized, and refits it at most once per frame after that.
+//------------------------------------------------------------------------------
+const C_ClothBVH& C_Cloth::updateBVH()
+{
+    if(!d_uNumParticles)
+        return d_bvh;
+
+    const bool built = d_bvh.getTopology() != d_uTopology;
+    if(built)
+        d_bvh.build(d_numRow, d_numCol, d_uTopology);
+    if(built || d_uBVHFrame != d_uFrame)
+    {
+        PERF_SCOPE(PERF_BVH);
+        d_bvh.refit(d_pPositions, d_pOldPositions, 0.0f, d_workers);
+        d_uBVHFrame = d_uFrame;
+    }
+    return d_bvh;
+}
 
+bool C_Cloth::raycast(const vector3f& origin, const vector3f& dir, float maxT, C_ClothBVH::RayHit& hit)
+{
+    return updateBVH().raycast(d_pPositions, origin, dir, maxT, hit);
+}
 
 
 //------------------------------------------------------------------------------
-// void drawParticles()
+// void updateTileBounds()
 //
-// Draws the particles as red points.  Locked particles are displayed as green
+// Refits the tile boxes over the worker threads, a row of tiles at a time,
+// then merges them into the box of the whole cloth.  A mesh has no tiles and
+// only the box of the whole cloth is fitted.
 //------------------------------------------------------------------------------
-void C_Cloth::drawParticles()
+void C_Cloth::updateTileBounds()
 {
-    glColor3f(1.0, 0.0, 0.0);
-    glEnableClientState(GL_VERTEX_ARRAY);
-    //glBindBuffer(GL_ARRAY_BUFFER, d_uVertexBufferID);
-    glVertexPointer(3, GL_FLOAT, sizeof(C_Vertex), &d_pPositions[0]);
-    glDrawArrays(GL_POINTS, 0, d_uNumParticles);
-    glDisableClientState(GL_VERTEX_ARRAY);
-    glColor3f(1.0, 1.0, 1.0);
-}
+    if(d_pTriangles)
+    {
+        PERF_SCOPE(PERF_BOUNDS);
+        emptyBounds(d_bounds);
+        for(unsigned i = 0; i < d_uNumParticles; ++i)
+            growSwept(d_bounds, d_pPositions[i].pos, d_pOldPositions[i]);
+        return;
+    }
+    if(!d_pTileBounds)
+        return;
 
+    PERF_SCOPE(PERF_BOUNDS);
+    TileTask task = { this };
+    d_workers.parallelFor(d_numTileRows, 1, task);
+
+    const unsigned numTiles = d_numTileRows * d_numTileCols;
+    d_bounds = d_pTileBounds[0];
+    for(unsigned t = 1; t < numTiles; ++t)
+    {
+        const ClothBounds& b = d_pTileBounds[t];
+        d_bounds.min.x = fminf(d_bounds.min.x, b.min.x);
+        d_bounds.min.y = fminf(d_bounds.min.y, b.min.y);
+        d_bounds.min.z = fminf(d_bounds.min.z, b.min.z);
+        d_bounds.max.x = fmaxf(d_bounds.max.x, b.max.x);
+        d_bounds.max.y = fmaxf(d_bounds.max.y, b.max.y);
+        d_bounds.max.z = fmaxf(d_bounds.max.z, b.max.z);
+    }
+}
 
 
 //------------------------------------------------------------------------------
-// void drawMesh()
+// void stepSimulation()
 //
-// Draws the springs as blue lines.
+// Takes one step, the tile boxes are kept up to date with every frame.  The
+// springs the constraints found overstretched are torn straight after
+// them, and the continuous collision runs after that, as it needs the final
+// positions of the step.  With sleeping on, the tiles near colliders that
+// changed are woken first, and if every tile still sleeps nothing is done.
 //------------------------------------------------------------------------------
-void C_Cloth::drawMesh()
+void C_Cloth::stepSimulation(const float& dt)
 {
-    glColor3f(0.0, 0.0, 1.0);
+    if(d_bSleeping && d_pTileState)
+    {
+        wakeForColliders();
+        if(d_uSleepingTiles == d_numTileRows * d_numTileCols)
+            return;
+    }
 
-    glColor3f(1.0, 1.0, 1.0);
+    I_ParticleSystem<float>::stepSimulation(dt);
+    if(d_pParticleSprings)
+        tearSprings();
+    if(d_bContinuous)
+        solveContinuousCollisions();
+    updateTileBounds();
+    updateSleep();
 }
 
 
@@ -215,11 +2539,47 @@ void C_Cloth::drawMesh()
 //------------------------------------------------------------------------------
 void C_Cloth::setWindVector(float x, float y, float z)
 {
+    if(d_windVector != vector3f(x, y, z))
+        wakeAll();
     d_windVector.X() = x;
     d_windVector.Y() = y;
     d_windVector.Z() = z;
 }
 
+void C_Cloth::setWindFactor(float w)
+{
+    if(d_windFactor != (unsigned)w)
+        wakeAll();
+    d_windFactor = w;
+}
+
+void C_Cloth::setGravity(const vector3f& g)
+{
+    if(d_vGravity != g)
+        wakeAll();
+    I_ParticleSystem<float>::setGravity(g);
+}
+
+//------------------------------------------------------------------------------
+// void setSleeping()
+//
+// Turning sleeping off wakes every tile.  Turning it on starts from the
+// colliders as they are now.
+//------------------------------------------------------------------------------
+void C_Cloth::setSleeping(bool on)
+{
+    if(on && !d_bSleeping)
+    {
+        d_uColliderRevision = d_colliders.getRevision();
+        d_colliderBoxes.resize(d_colliders.getCount());
+        for(unsigned i = 0; i < d_colliders.getCount(); ++i)
+            d_colliders.getShapeBounds(i, d_colliderBoxes[i].min, d_colliderBoxes[i].max);
+    }
+    if(!on)
+        wakeAll();
+    d_bSleeping = on;
+}
+
 
 //------------------------------------------------------------------------------
 // void initialize()
@@ -268,6 +2628,7 @@ void C_Cloth::initialize(float width, float height, int numRow, int numCol, floa
 
     // Initialize the wind factor to 0
     d_windFactor = 0;
+    d_uStepCount = 0;
 
     // Calculate the total number of faces
     d_numFaces = (numCol - 1) * (numRow - 1) * 2;
@@ -285,6 +2646,7 @@ void C_Cloth::initialize(float width, float height, int numRow, int numCol, floa
     // Calculate the yStep and xStep
     wStep = width / (numCol-1);
     hStep = height / (numRow-1);
+    d_fCellSize = wStep > hStep ? wStep : hStep;
 
     // Calculate the variables used for texture mapping
     float wTexStep = wStep / width;
@@ -292,6 +2654,7 @@ void C_Cloth::initialize(float width, float height, int numRow, int numCol, floa
 
     // Calculate the total number of particles
     initParticleData(numCol * numRow);
+    d_uParticleCapacity = d_uNumParticles;
 
     // Allocate the memory for the particles
     d_particleInfo = new ParticleInfo[d_uNumParticles];
@@ -346,6 +2709,7 @@ void C_Cloth::initialize(float width, float height, int numRow, int numCol, floa
 
             // Make them all false to begin with
             d_particleInfo[index].locked = false;
+            d_particleInfo[index].asleep = false;
         }
     }
 
@@ -353,14 +2717,22 @@ void C_Cloth::initialize(float width, float height, int numRow, int numCol, floa
     // Calculate the total number of springs
     d_numShearSprings = ((numCol - 1) * (numRow - 1)) * 2;
     d_numStructSprings = (numCol * (numRow - 1)) + (numRow * (numCol - 1));
-
-    // Allocate memory for the springs
-    d_shearSprings = new Spring[d_numShearSprings];
-    d_structuralSprings = new Spring[d_numStructSprings];
+    d_numBendSprings = 0;
+    if(d_fBendStiffness > 0.0f)
+        d_numBendSprings = (numRow * (numCol > 2 ? numCol - 2 : 0)) + (numCol * (numRow > 2 ? numRow - 2 : 0));
+
+    // The springs are built in order, structural first, then shear, then
+    // bending, then sorted into color batches
+    unsigned numSprings = getSpringCount();
+    unsigned* p1 = new unsigned[numSprings];
+    unsigned* p2 = new unsigned[numSprings];
+    float* rest = new float[numSprings];
+    unsigned char* family = new unsigned char[numSprings];
 
     // Set up the springs
-    unsigned shearCount(0);
+    unsigned shearCount(d_numStructSprings);
     unsigned structCount(0);
+    unsigned bendCount(d_numStructSprings + d_numShearSprings);
     for(int i = 0; i < numRow; i++)
     {
         for(int j = 0; j < numCol; j++)
@@ -368,74 +2740,448 @@ void C_Cloth::initialize(float width, float height, int numRow, int numCol, floa
             // The structural spring going across the col
             if(j <= (numCol - 2))
             {
-                d_structuralSprings[structCount].p1 = &d_pPositions[getIndex2D(i, j)].pos;
-                d_structuralSprings[structCount].info1 = &d_particleInfo[getIndex2D(i, j)];
-                d_structuralSprings[structCount].acel1 = &d_pAccel[getIndex2D(i, j)];
-                d_structuralSprings[structCount].p2 = &d_pPositions[getIndex2D(i, j+1)].pos;
-                d_structuralSprings[structCount].info2 = &d_particleInfo[getIndex2D(i, j+1)];
-                d_structuralSprings[structCount].acel2 = &d_pAccel[getIndex2D(i, j+1)];
-                length = (*d_structuralSprings[structCount].p1) -
-                                 (*d_structuralSprings[structCount].p2);
-                d_structuralSprings[structCount].restLength = length.magnitude();
+                p1[structCount] = getIndex2D(i, j);
+                p2[structCount] = getIndex2D(i, j+1);
                 structCount++;
             }
 
             // The structural spring going down a column
             if(i <= (numRow - 2))
             {
-                d_structuralSprings[structCount].p1 = &d_pPositions[getIndex2D(i, j)].pos;
-                d_structuralSprings[structCount].info1 = &d_particleInfo[getIndex2D(i, j)];
-                d_structuralSprings[structCount].acel1 = &d_pAccel[getIndex2D(i, j)];
-                d_structuralSprings[structCount].p2 = &d_pPositions[getIndex2D(i+1, j)].pos;
-                d_structuralSprings[structCount].info2 = &d_particleInfo[getIndex2D(i+1, j)];
-                d_structuralSprings[structCount].acel2 = &d_pAccel[getIndex2D(i+1, j)];
-                length = (*d_structuralSprings[structCount].p1) -
-                                 (*d_structuralSprings[structCount].p2);
-                d_structuralSprings[structCount].restLength = length.magnitude();
+                p1[structCount] = getIndex2D(i, j);
+                p2[structCount] = getIndex2D(i+1, j);
                 structCount++;
             }
 
             // The shear spring going diagonal from left to right
             if((j <= (numCol - 2)) && (i <= (numRow - 2)))
             {
-                d_shearSprings[shearCount].p1 = &d_pPositions[getIndex2D(i, j)].pos;
-                d_shearSprings[shearCount].info1 = &d_particleInfo[getIndex2D(i, j)];
-                d_shearSprings[shearCount].acel1 = &d_pAccel[getIndex2D(i, j)];
-                d_shearSprings[shearCount].p2 = &d_pPositions[getIndex2D(i+1, j+1)].pos;
-                d_shearSprings[shearCount].info2 = &d_particleInfo[getIndex2D(i+1, j+1)];
-                d_shearSprings[shearCount].acel2 = &d_pAccel[getIndex2D(i+1, j+1)];
-                length = (*d_shearSprings[shearCount].p1) -
-                                 (*d_shearSprings[shearCount].p2);
-                d_shearSprings[shearCount].restLength = length.magnitude();
+                p1[shearCount] = getIndex2D(i, j);
+                p2[shearCount] = getIndex2D(i+1, j+1);
                 shearCount++;
             }
 
             // The shear spring going diagonal from right to left
             if(j > 0 && i <= (numRow - 2))
             {
-                d_shearSprings[shearCount].p1 = &d_pPositions[getIndex2D(i, j)].pos;
-                d_shearSprings[shearCount].info1 = &d_particleInfo[getIndex2D(i, j)];
-                d_shearSprings[shearCount].acel1 = &d_pAccel[getIndex2D(i, j)];
-                d_shearSprings[shearCount].p2 = &d_pPositions[getIndex2D(i+1, j-1)].pos;
-                d_shearSprings[shearCount].info2 = &d_particleInfo[getIndex2D(i+1, j-1)];
-                d_shearSprings[shearCount].acel2 = &d_pAccel[getIndex2D(i+1, j-1)];
-                length = (*d_shearSprings[shearCount].p1) -
-                                 (*d_shearSprings[shearCount].p2);
-                d_shearSprings[shearCount].restLength = length.magnitude();
+                p1[shearCount] = getIndex2D(i, j);
+                p2[shearCount] = getIndex2D(i+1, j-1);
                 shearCount++;
             }
+
+            if(!d_numBendSprings)
+                continue;
+
+            // The bending spring going across two columns
+            if(j <= (numCol - 3))
+            {
+                p1[bendCount] = getIndex2D(i, j);
+                p2[bendCount] = getIndex2D(i, j+2);
+                bendCount++;
+            }
+
+            // The bending spring going down two rows
+            if(i <= (numRow - 3))
+            {
+                p1[bendCount] = getIndex2D(i, j);
+                p2[bendCount] = getIndex2D(i+2, j);
+                bendCount++;
+            }
         }
     }
 
+    for(unsigned s = 0; s < numSprings; ++s)
+    {
+        length = d_pPositions[p1[s]].pos - d_pPositions[p2[s]].pos;
+        rest[s] = length.magnitude();
+        family[s] = s < d_numStructSprings ? SPRING_STRUCTURAL :
+                    (s < d_numStructSprings + d_numShearSprings ? SPRING_SHEAR : SPRING_BEND);
+    }
+
+    // Split the grid into tiles, the springs are grouped by them
+    if(numRow > 1 && numCol > 1)
+    {
+        d_numTileRows = (numRow - 2) / CLOTH_TILE_CELLS + 1;
+        d_numTileCols = (numCol - 2) / CLOTH_TILE_CELLS + 1;
+    }
+
+    buildColorBatches(p1, p2, rest, family);
+
+    delete [] p1;
+    delete [] p2;
+    delete [] rest;
+    delete [] family;
 
     // Finally initialize the wind vector
     d_windVector.X() = 0;
     d_windVector.Y() = 0;
     d_windVector.Z() = 0;
 
-    // init GL
-    //glEnableClientState(GL_VERTEX_ARRAY);
-//    glGenBuffers(1, &d_uVertexBufferID);
-//    glBindBuffer(GL_ARRAY_BUFFER, d_uVertexBufferID);
-//    glBufferData(GL_ARRAY_BUFFER, d_uNumParticles * sizeof(vector3f), 0, GL_STREAM_DRAW);
+    // Fit the tiles' boxes to the flat cloth, every tile starts awake.  The
+    // lists the sleeping fills are sized for the worst case up front, so
+    // tiles falling asleep and waking never allocate.
+    if(d_numTileRows)
+    {
+        const unsigned numTiles = d_numTileRows * d_numTileCols;
+        d_pTileBounds = new ClothBounds[numTiles];
+        d_pTileState = new TileState[numTiles];
+        d_pTileWake = new std::atomic<bool>[numTiles];
+        for(unsigned t = 0; t < numTiles; ++t)
+        {
+            d_pTileState[t].stillSteps = 0;
+            d_pTileState[t].motion = 0.0f;
+            d_pTileState[t].asleep = d_pTileState[t].moving = false;
+            d_pTileState[t].active = true;
+            d_pTileWake[t].store(false, std::memory_order_relaxed);
+        }
+        d_awakeTiles.reserve(numTiles);
+        d_activeSprings.reserve(d_numColors * numTiles * 2);
+        updateActiveLists();
+        updateTileBounds();
+    }
+}
+
+
+//------------------------------------------------------------------------------
+// bool initializeMesh()
+//
+// Builds the cloth from the triangles of an OBJ file, where and as large as
+// they were modelled.  Triangles with no area are dropped, and with them
+// any vertex no triangle uses.  The particles are the OBJ's positions, so
+// the cloth stays joined along the seams of its texture, and each particle
+// takes the texture coordinates of the first corner in the file that gives
+// it any.
+//
+// Each particle takes a third of the area of the triangles around it, with
+// the mass spread evenly over the surface.  Every edge is a structural
+// spring, and the two corners across an edge from each other get a shear
+// spring.  On quads split in two that is the quad's other diagonal, and
+// across the quads' own edges it spans two cells, which keeps the cloth
+// from folding flat along them.  With a bend stiffness above zero two edges
+// out of a particle that nearly carry on from each other give a bending
+// spring between their far ends.
+//
+// With reordering on the particles are put in the Morton order of where
+// they start, so particles near each other on the cloth are near each other
+// in memory, and the triangles follow in the order of their first particle.
+// Otherwise both keep the order of the file.  The springs are built in the
+// order of their first particle and sorted into color batches as for the
+// grid.  A mesh has no grid, so it has no tiles and no triangle tree, see
+// cloth.h.  With a tear stretch set the room for tearing is made too, see
+// setTearStretch().
+//
+// Input:   objPath - The OBJ file to read.
+//          mass - The mass of the cloth.
+//          structural - The spring constant for the structual springs.
+//          shear - The spring constant for the shear springs.
+//          damp - the dampening constant for the springs.
+//------------------------------------------------------------------------------
+bool C_Cloth::initializeMesh(const char* objPath, float mass, float structural, float shear, float damp)
+{
+    std::vector<char> text;
+    ObjMesh obj;
+    if(!readTextFile(objPath, text) || !parseOBJ(&text[0], text.size() - 1, obj))
+        return false;
+
+    // Keep the triangles with an area, and the vertices they use in the
+    // order they are first met
+    std::vector<size_t> kept;               // First corner of each triangle kept
+    std::vector<float> areas;
+    std::vector<unsigned> particleOf(obj.positions.size(), ~0u), vertexOf;
+    float totalArea = 0.0f;
+    for(size_t t = 0; t + 2 < obj.indices.size(); t += 3)
+    {
+        const uint32_t* v = &obj.indices[t];
+        const vector3f e1 = obj.positions[v[1]] - obj.positions[v[0]];
+        const vector3f e2 = obj.positions[v[2]] - obj.positions[v[0]];
+        const float area = 0.5f * e1.crossProduct(e2).magnitude();
+        if(!(area > 0.0f))
+            continue;
+
+        kept.push_back(t);
+        areas.push_back(area);
+        totalArea += area;
+        for(unsigned k = 0; k < 3; ++k)
+        {
+            if(particleOf[v[k]] != ~0u)
+                continue;
+            particleOf[v[k]] = (unsigned)vertexOf.size();
+            vertexOf.push_back(v[k]);
+        }
+    }
+    if(kept.empty())
+        return false;
+
+    // Morton order over the cube around the vertices, ties keep the order
+    // they were met in, or the order of the file
+    const unsigned n = (unsigned)vertexOf.size();
+    vector3f lo = obj.positions[vertexOf[0]], hi = lo;
+    for(unsigned p = 1; p < n; ++p)
+    {
+        const vector3f& v = obj.positions[vertexOf[p]];
+        lo.x = fminf(lo.x, v.x);  hi.x = fmaxf(hi.x, v.x);
+        lo.y = fminf(lo.y, v.y);  hi.y = fmaxf(hi.y, v.y);
+        lo.z = fminf(lo.z, v.z);  hi.z = fmaxf(hi.z, v.z);
+    }
+    const float extent = fmaxf(hi.x - lo.x, fmaxf(hi.y - lo.y, hi.z - lo.z));
+    const float scale = extent > 0.0f ? 1023.0f / extent : 0.0f;
+    std::vector<unsigned long long> order(n);
+    for(unsigned p = 0; p < n; ++p)
+        order[p] = (unsigned long long)(d_bReorder ? mortonCode(obj.positions[vertexOf[p]], lo, scale) : vertexOf[p]) << 32 | p;
+    std::sort(order.begin(), order.end());
+    std::vector<unsigned> newIndex(n);
+    for(unsigned k = 0; k < n; ++k)
+        newIndex[(unsigned)order[k]] = k;
+
+    // Clear out any memory that may have been allocated, nothing can fail
+    // from here on
+    clear();
+    wipeParticleData();
+
+    d_dragCoef = damp;
+    d_shearSpringConst = shear;
+    d_structSpringConst = structural;
+    d_numCol = d_numRow = 0;
+    d_windFactor = 0;
+    d_uStepCount = 0;
+    d_numFaces = (unsigned)kept.size();
+
+    // A cloth that can tear has room for the particles it splits off
+    const unsigned capacity = d_fTearStretch > 0.0f ? n + n / TEAR_PARTICLE_SHARE : n;
+    initParticleData(capacity);
+    d_uNumParticles = n;
+    d_uParticleCapacity = capacity;
+    d_particleInfo = new ParticleInfo[capacity];
+    d_numSources = (unsigned)obj.positions.size();
+    d_pSourceIndex = new unsigned[capacity];
+    d_pParticleIndex = new unsigned[d_numSources];
+    for(unsigned v = 0; v < d_numSources; ++v)
+        d_pParticleIndex[v] = ~0u;
+    for(unsigned p = 0; p < n; ++p)
+    {
+        const unsigned i = newIndex[p];
+        d_pSourceIndex[i] = vertexOf[p];
+        d_pParticleIndex[vertexOf[p]] = i;
+        d_pPositions[i].pos = obj.positions[vertexOf[p]];
+        d_pPositions[i].norm = vector3f(0, 0, 0);
+        d_pPositions[i].s0 = d_pPositions[i].t0 = 0.0f;
+        d_pOldPositions[i] = d_pPositions[i].pos;
+        d_pAccel[i] = vector3f(0, 0, 0);
+        d_particleInfo[i].locked = false;
+        d_particleInfo[i].asleep = false;
+    }
+
+    // The masses and texture coordinates, then the triangles in the order
+    // of their first particle
+    std::vector<float> particleArea(n, 0.0f);
+    std::vector<bool> textured(n, false);
+    std::vector<unsigned long long> triangleOrder(d_numFaces);
+    for(unsigned t = 0; t < d_numFaces; ++t)
+    {
+        unsigned first = ~0u;
+        for(unsigned k = 0; k < 3; ++k)
+        {
+            const unsigned i = newIndex[particleOf[obj.indices[kept[t] + k]]];
+            const uint32_t tex = obj.texIndices[kept[t] + k];
+            particleArea[i] += areas[t] / 3.0f;
+            if(!textured[i] && tex != OBJ_NO_TEXCOORD)
+            {
+                d_pPositions[i].s0 = obj.texCoords[tex * 2];
+                d_pPositions[i].t0 = obj.texCoords[tex * 2 + 1];
+                textured[i] = true;
+            }
+            first = i < first ? i : first;
+        }
+        triangleOrder[t] = (unsigned long long)(d_bReorder ? first : 0) << 32 | t;
+    }
+    std::sort(triangleOrder.begin(), triangleOrder.end());
+
+    const float density = mass / totalArea;
+    for(unsigned i = 0; i < n; ++i)
+        d_particleInfo[i].invMass = 1.0f / (particleArea[i] * density);
+
+    d_pTriangles = new unsigned[d_numFaces * 3];
+    d_pVertexFaceStart = new unsigned[capacity + 1];
+    d_pVertexFaceEnd = new unsigned[capacity];
+    d_pVertexFaces = new unsigned[d_numFaces * 3];
+    for(unsigned i = 0; i <= n; ++i)
+        d_pVertexFaceStart[i] = 0;
+    for(unsigned t = 0; t < d_numFaces; ++t)
+    {
+        const size_t corner = kept[(unsigned)triangleOrder[t]];
+        for(unsigned k = 0; k < 3; ++k)
+        {
+            d_pTriangles[t*3 + k] = newIndex[particleOf[obj.indices[corner + k]]];
+            d_pVertexFaceStart[d_pTriangles[t*3 + k] + 1]++;
+        }
+    }
+    for(unsigned i = 0; i < n; ++i)
+        d_pVertexFaceStart[i + 1] += d_pVertexFaceStart[i];
+    for(unsigned i = 0; i < n; ++i)
+        d_pVertexFaceEnd[i] = d_pVertexFaceStart[i + 1];
+    std::vector<unsigned> next(d_pVertexFaceStart, d_pVertexFaceStart + n);
+    for(unsigned t = 0; t < d_numFaces * 3; ++t)
+        d_pVertexFaces[next[d_pTriangles[t]]++] = t / 3;
+
+    // Sorting the edges by their particles brings the triangles sharing an
+    // edge together, each run is one structural spring and its opposite
+    // corners give the shear springs
+    std::vector<MeshEdge> edges(d_numFaces * 3);
+    for(unsigned t = 0; t < d_numFaces; ++t)
+    {
+        const unsigned* v = d_pTriangles + t*3;
+        for(unsigned k = 0; k < 3; ++k)
+        {
+            edges[t*3 + k].key = pairKey(v[k], v[(k + 1) % 3]);
+            edges[t*3 + k].opposite = v[(k + 2) % 3];
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+
+    std::vector<unsigned long long> structSprings, shearSprings;
+    for(size_t e = 0; e < edges.size(); )
+    {
+        size_t end = e + 1;
+        while(end < edges.size() && edges[end].key == edges[e].key)
+            ++end;
+        structSprings.push_back(edges[e].key);
+
+        // More than two triangles only meet at an edge of a non manifold
+        // mesh, every pair of them is joined then
+        for(size_t a = e; a < end; ++a)
+            for(size_t b = a + 1; b < end; ++b)
+                if(edges[a].opposite != edges[b].opposite)
+                    shearSprings.push_back(pairKey(edges[a].opposite, edges[b].opposite));
+        e = end;
+    }
+
+    // The corners across one edge may be across another too, or already be
+    // joined by an edge
+    std::sort(shearSprings.begin(), shearSprings.end());
+    shearSprings.erase(std::unique(shearSprings.begin(), shearSprings.end()), shearSprings.end());
+    size_t numShear = 0;
+    for(size_t s = 0; s < shearSprings.size(); ++s)
+        if(!std::binary_search(structSprings.begin(), structSprings.end(), shearSprings[s]))
+            shearSprings[numShear++] = shearSprings[s];
+    shearSprings.resize(numShear);
+
+    // Each edge out of a particle gets a bending spring from its far end to
+    // that of the edge that carries on from it most nearly straight, if any
+    // is straight enough.  The edges out of each particle are listed first.
+    std::vector<unsigned long long> bendSprings;
+    if(d_fBendStiffness > 0.0f)
+    {
+        std::vector<unsigned> edgeStart(n + 1, 0), edgeEnds(structSprings.size() * 2);
+        for(size_t e = 0; e < structSprings.size(); ++e)
+        {
+            edgeStart[(unsigned)(structSprings[e] >> 32) + 1]++;
+            edgeStart[(unsigned)structSprings[e] + 1]++;
+        }
+        for(unsigned i = 0; i < n; ++i)
+            edgeStart[i + 1] += edgeStart[i];
+        next.assign(edgeStart.begin(), edgeStart.end() - 1);
+        for(size_t e = 0; e < structSprings.size(); ++e)
+        {
+            const unsigned a = (unsigned)(structSprings[e] >> 32), b = (unsigned)structSprings[e];
+            edgeEnds[next[a]++] = b;
+            edgeEnds[next[b]++] = a;
+        }
+
+        for(unsigned i = 0; i < n; ++i)
+            for(unsigned a = edgeStart[i]; a < edgeStart[i + 1]; ++a)
+            {
+                vector3f da = d_pPositions[edgeEnds[a]].pos - d_pPositions[i].pos;
+                da.normalize();
+                float straightest = BEND_MAX_COS;
+                unsigned far = ~0u;
+                for(unsigned b = edgeStart[i]; b < edgeStart[i + 1]; ++b)
+                {
+                    vector3f db = d_pPositions[edgeEnds[b]].pos - d_pPositions[i].pos;
+                    db.normalize();
+                    const float c = da * db;
+                    if(b != a && c <= straightest)
+                    {
+                        straightest = c;
+                        far = edgeEnds[b];
+                    }
+                }
+                if(far != ~0u)
+                    bendSprings.push_back(pairKey(edgeEnds[a], far));
+            }
+
+        // Both ends of a line find it, and on a coarse mesh its ends may
+        // already be joined
+        std::sort(bendSprings.begin(), bendSprings.end());
+        bendSprings.erase(std::unique(bendSprings.begin(), bendSprings.end()), bendSprings.end());
+        size_t numBend = 0;
+        for(size_t s = 0; s < bendSprings.size(); ++s)
+            if(!std::binary_search(structSprings.begin(), structSprings.end(), bendSprings[s]) &&
+               !std::binary_search(shearSprings.begin(), shearSprings.end(), bendSprings[s]))
+                bendSprings[numBend++] = bendSprings[s];
+        bendSprings.resize(numBend);
+    }
+
+    d_numStructSprings = (unsigned)structSprings.size();
+    d_numShearSprings = (unsigned)shearSprings.size();
+    d_numBendSprings = (unsigned)bendSprings.size();
+    const unsigned numSprings = getSpringCount();
+    unsigned* p1 = new unsigned[numSprings];
+    unsigned* p2 = new unsigned[numSprings];
+    float* rest = new float[numSprings];
+    unsigned char* family = new unsigned char[numSprings];
+
+    float edgeLength = 0.0f;
+    d_pNeighbourStart = new unsigned[n + 1];
+    d_pNeighbours = new unsigned[numSprings * 2];
+    for(unsigned i = 0; i <= n; ++i)
+        d_pNeighbourStart[i] = 0;
+    for(unsigned s = 0; s < numSprings; ++s)
+    {
+        unsigned long long key;
+        if(s < d_numStructSprings)
+        {
+            key = structSprings[s];
+            family[s] = SPRING_STRUCTURAL;
+        }
+        else if(s < d_numStructSprings + d_numShearSprings)
+        {
+            key = shearSprings[s - d_numStructSprings];
+            family[s] = SPRING_SHEAR;
+        }
+        else
+        {
+            key = bendSprings[s - d_numStructSprings - d_numShearSprings];
+            family[s] = SPRING_BEND;
+        }
+        p1[s] = (unsigned)(key >> 32);
+        p2[s] = (unsigned)key;
+        rest[s] = (d_pPositions[p1[s]].pos - d_pPositions[p2[s]].pos).magnitude();
+        if(s < d_numStructSprings)
+            edgeLength += rest[s];
+        d_pNeighbourStart[p1[s] + 1]++;
+        d_pNeighbourStart[p2[s] + 1]++;
+    }
+    d_fCellSize = edgeLength / d_numStructSprings;
+
+    for(unsigned i = 0; i < n; ++i)
+        d_pNeighbourStart[i + 1] += d_pNeighbourStart[i];
+    next.assign(d_pNeighbourStart, d_pNeighbourStart + n);
+    for(unsigned s = 0; s < numSprings; ++s)
+    {
+        d_pNeighbours[next[p1[s]]++] = p2[s];
+        d_pNeighbours[next[p2[s]]++] = p1[s];
+    }
+
+    buildColorBatches(p1, p2, rest, family);
+    if(capacity > n)
+        reserveTearing();
+
+    delete [] p1;
+    delete [] p2;
+    delete [] rest;
+    delete [] family;
+
+    d_windVector = vector3f(0, 0, 0);
+    updateTileBounds();
+    return true;
 }
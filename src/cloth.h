@@ -1,7 +1,7 @@
 /*==============================================================================
 / James McCormick - cloth.h
 / A class to simulate cloth in real time.
-/ Uses openGL to for drawing.
+/ The simulation has no GL or Qt dependencies, see clothrenderer.h for drawing.
 /=============================================================================*/
 
 #ifndef _CLOTH_
@@ -11,7 +11,11 @@
 // INCLUDED LIBRARIES AND FILES
 //==============================================================================
 #include "I_ParticleSystem.h"
-#include <stdlib.h>
+#include "C_WorkerPool.h"
+#include "collider.h"
+#include "spatialhash.h"
+#include "clothbvh.h"
+#include <atomic>
 
 //==============================================================================
 // GLOBALS
@@ -20,46 +24,92 @@
 #define ZAXIS 	1
 #define YAXIS 	2
 
-//==============================================================================
-// ADDITIONAL FUNCTIONS USED BY THE CLASS
-//==============================================================================
+// The most colors the spring batches may use.  Springs that cannot be given a
+// free color are put in one last batch that is solved on a single thread.
+#define MAX_SPRING_COLORS 64
 
-//------------------------------------------------------------------------------
-// Generates a random float between 0.0 and 0.999...
-// Assumes rand() as been seeded
-//------------------------------------------------------------------------------
-inline float randFloat()
-{
-    return ((float)rand() / 1.999);
-}
-
-//------------------------------------------------------------------------------
-// Generates a random float between 0.0 and max
-// Assumes rand() as been seeded
-//------------------------------------------------------------------------------
-inline float randFloat(float max)
-{
-    return (randFloat() * max);
-}
-
-//------------------------------------------------------------------------------
-// Generates a random float between min and max
-// Assumes rand() as been seeded
-//------------------------------------------------------------------------------
-inline float randFloat(float min, float max)
-{
-    if(min > max)
-        return (randFloat() * (min - max) + max);
-    else
-        return (randFloat() * (max - min) + min);
-}
+// Number of springs or particles processed together by the solver's inner
+// loops, which gather each block into small arrays, work over the lanes, then
+// scatter the results back.  The lane loops are not vectorized: sqrtf() keeps
+// its errno branch, and a branch free version that did vectorize ran slower,
+// since most of the time goes to the indexed gather and scatter.
+#define SOLVER_LANES 8
+
+// Cells along each side of a tile.  The grid is split into tiles that keep a
+// bounding box each, so a renderer can skip the ones out of view.  Must be
+// a multiple of the coarsest level of detail the renderer draws.
+#define CLOTH_TILE_CELLS 32
+
+// Steps in a row a tile's particles must all move less than the sleep
+// threshold before the tile is put to sleep
+#define CLOTH_SLEEP_FRAMES 30
+
+// Times the sleep threshold a tile must move to wake its neighbours.  Tiles
+// in between stay as they are, so the jitter along the border of a sleeping
+// region does not keep waking it.
+#define CLOTH_WAKE_FACTOR 4.0f
+
+// Particles this many rows and columns apart or closer are never pushed
+// apart by the self collision, they are kept in place by the springs
+#define SELF_COLLISION_RING 2
+
+// Particles near enough to collide with one particle that are kept from a
+// hash build, any more are left out
+#define SELF_CANDIDATES 16
 
+// Springs a particle of a cloth that can tear keeps a list of.  A mesh
+// with a particle that has more cannot tear, see setTearStretch().
+#define CLOTH_PARTICLE_SPRINGS 48
+
+// Torn springs recorded in one step, any more are found again next step
+#define CLOTH_MAX_TEARS 256
+
+// Changes tearing made that are kept for the renderer, see getEdit()
+#define CLOTH_EDIT_LOG 4096
+
+// An axis aligned bounding box
+struct ClothBounds
+{
+    vector3f min, max;
+};
 
 //==============================================================================
 // CLASS DEFINITION
 //==============================================================================
 class C_Cloth : public I_ParticleSystem<float>
 {
+public:
+    // How applyConstraints() visits the springs
+    enum SolverMode
+    {
+        SOLVER_GAUSS_SEIDEL,    // One thread, springs in the order they were built
+        SOLVER_COLORED          // Springs grouped into independent color batches,
+                                // each batch split over the worker threads
+    };
+
+    // The kinds of spring, each with a stiffness of its own
+    enum SpringFamily
+    {
+        SPRING_STRUCTURAL,      // Along the edges
+        SPRING_SHEAR,           // Across the cells
+        SPRING_BEND,            // Two edges apart in a line, see setBendStiffness()
+        SPRING_FAMILIES
+    };
+
+    // What a change made by tearing touched, see getEdit()
+    enum EditKind
+    {
+        EDIT_TRIANGLE,          // The corners of triangle first
+        EDIT_SPRINGS,           // The particles of count springs from first on
+        EDIT_PARTICLE           // Particle first was added
+    };
+
+    struct Edit
+    {
+        EditKind kind;
+        unsigned first, count;
+    };
+
 private:
     //==============================================================================
     // STRUCTURES
@@ -69,38 +119,172 @@ private:
     {
         float invMass;
         bool locked;        // If this is true, then the particle does not move
+        bool asleep;        // Its tile is asleep, it is held like a locked one
     };
 
-    struct Spring
+    // The sleep state of a tile, see updateSleep()
+    struct TileState
     {
-        vector3f *p1, *p2;
-        vector3f *acel1, *acel2;
-        ParticleInfo *info1, *info2;
-        float restLength;
+        unsigned stillSteps;    // Steps in a row its particles moved less than the threshold
+        float motion;           // Furthest squared move of its particles over the last step
+        bool asleep,
+             active,            // Awake or next to an awake tile, so its box
+                                // and the springs it shares with its
+                                // neighbours are kept up
+             moving;            // Moved enough in the last step to wake its neighbours
     };
 
+    // A run of springs of one color the solver visits while some tiles sleep
+    struct SpringRange
+    {
+        unsigned begin, end,
+                 offset;        // Springs of the color's runs before this one
+    };
+
+    // A spring as compactColor() copies it
+    struct SpringSlot
+    {
+        unsigned p1, p2, rank;
+        float rest;
+        unsigned char family;
+    };
+
+    // Loop bodies handed to the worker pool, defined in cloth.cpp
+    struct ForceTask;
+    struct IntegrateTask;
+    struct SpringTask;
+    struct NormalTask;
+    struct TileTask;
+    struct SelfTask;
+    struct SelfGather;
+    struct ContinuousTask;
+    struct ImpactGather;
+    struct AwakeTask;
+    struct ActiveSpringTask;
+
 
     //----------------------------------------------------------------------
     // Private Members
     //----------------------------------------------------------------------
     ParticleInfo *d_particleInfo;
 
-    Spring *d_structuralSprings,	// The array of structural springs
-            *d_shearSprings;
+    // The springs are stored as parallel arrays sorted by color, so that no
+    // two springs of a color share a particle.  The structural springs come
+    // first in build order, followed by the shear springs, then the bending
+    // springs.
+    unsigned *d_pSpringP1,          // Index of the first particle of each spring
+             *d_pSpringP2,          // Index of the second particle
+             *d_pSpringOrder;       // Springs in build order, for SOLVER_GAUSS_SEIDEL
+    float *d_pRestLength;           // Rest length of each spring
+    unsigned char *d_pSpringFamily; // SpringFamily of each spring
+
+    float d_fBendStiffness;         // See setBendStiffness()
+    float d_familyStiffness[SPRING_FAMILIES];   // Share of each family's error a pass corrects
+
+    unsigned d_colorStart[MAX_SPRING_COLORS + 1];   // First spring of each color
+    unsigned d_colorEnd[MAX_SPRING_COLORS];         // One past its last spring in use
+    unsigned d_numColors;
+
+    // Within a color the springs are grouped by the tile of their first
+    // particle, those whose second particle is in the same tile first, then
+    // those that reach into a neighbouring tile.  This is the first spring of
+    // each group, (color * tiles + tile) * 2 + reaches out.
+    unsigned *d_pSpringTileStart;
+
+    // A cloth built by initializeMesh() has no grid, d_numRow and d_numCol are
+    // zero and d_numFaces triangles are kept instead
+    unsigned *d_pTriangles,         // Three particles a triangle
+             *d_pVertexFaceStart,   // The triangles around particle i are
+             *d_pVertexFaceEnd,     // d_pVertexFaces[start[i]] to [end[i]]
+             *d_pVertexFaces,
+             *d_pNeighbourStart,    // The particles sharing a spring with each
+             *d_pNeighbours,        // one, which the self collision leaves alone
+             *d_pSourceIndex,       // The OBJ vertex of each particle
+             *d_pParticleIndex;     // and the particle of each OBJ vertex, ~0u if none
+    unsigned d_numSources;          // Vertices in the OBJ file
+    unsigned d_uParticleCapacity;   // Particles the arrays have room for
+
+    // Tearing, see setTearStretch().  The springs of each color are followed
+    // by the free places new springs of that color go in.
+    float d_fTearStretch;
+    float d_familyTear[SPRING_FAMILIES];    // Stretch past which a spring is recorded as torn
+    unsigned *d_pSpringRank,        // Place of each spring in d_pSpringOrder
+             *d_pParticleSprings,   // CLOTH_PARTICLE_SPRINGS springs of each particle
+             *d_pOrigin;            // The particle each one was split off, or itself
+    unsigned char *d_pNumParticleSprings;
+    unsigned long long *d_pColorMask;   // The colors of each particle's springs
+    unsigned long long *d_pTears;   // Both particles of each spring recorded as torn
+    std::atomic<unsigned> d_uNumTears;
+    unsigned d_uTornCount;          // Particles split since the cloth was built
+    Edit *d_pEdits;                 // The last CLOTH_EDIT_LOG changes
+    unsigned d_uNumEdits;
+    unsigned d_uCompactMoves,       // Springs moved since the last compaction
+             d_uCompactColor;       // Next color to compact, d_numColors when done
+    std::vector<unsigned> d_compactOrder;
+    std::vector<SpringSlot> d_compactSlots;
+
+    bool d_bReorder;                // See setReordering()
 
     unsigned d_numShearSprings,		// The number of Shear springs in the simulation
         d_numStructSprings,		// The number of Structual springs in the simulation
+        d_numBendSprings,       // The number of bending springs
         d_numFaces,			// The number of faces in the cloths geometry
         d_numCol,			// The number of columns
         d_numRow,
         d_windFactor;
 
     float   d_shearSpringConst,		// The spring constant for the shear springs
-            d_structSpringConst;	// The spring constant for the structural springs
+            d_structSpringConst,	// The spring constant for the structural springs
+            d_fCellSize;            // The larger side of a grid cell at rest
 
     vector3f d_windVector;		// The vector for the wind effecting the cloth
 
-    unsigned d_uVertexBufferID;     // ID for the vertex buffer object
+    unsigned d_uSolverIterations;   // Constraint passes per step
+    SolverMode d_solverMode;
+    unsigned d_uStepCount;          // Steps taken since initialize(), seeds the wind
+    unsigned d_uNormalFrame;        // The frame the vertex normals were computed for
+
+    // Tiles of CLOTH_TILE_CELLS x CLOTH_TILE_CELLS cells in row major order,
+    // the last row and column of tiles may be smaller.  Neighbouring tiles
+    // share their border particles.
+    unsigned d_numTileRows, d_numTileCols;
+    ClothBounds *d_pTileBounds,     // The box of each tile
+                d_bounds;           // and of the whole cloth
+
+    // Sleeping, see updateSleep()
+    bool d_bSleeping;
+    float d_fSleepThreshold;        // Move per step below which a tile is still, in cells
+    TileState *d_pTileState;
+    std::atomic<bool> *d_pTileWake; // Set by the collisions to wake a sleeping tile
+    unsigned d_uSleepingTiles;
+    std::vector<unsigned> d_awakeTiles;
+    std::vector<SpringRange> d_activeSprings;   // The springs of the active tiles, by color
+    unsigned d_activeColorStart[MAX_SPRING_COLORS + 1];  // First run of each color
+    unsigned d_uColliderRevision;   // The colliders' revision the tiles were last woken for
+    std::vector<ClothBounds> d_colliderBoxes;   // and the boxes of the shapes then
+
+    C_WorkerPool d_workers;
+    C_ColliderSet d_colliders;      // Shapes the particles are kept out of
+
+    // Self collision, see solveSelfCollisions()
+    bool d_bSelfCollision,
+         d_bRebuildHash;            // The particles moved too far since the hash was built
+    float d_fSelfDistance;          // Closest two unconnected particles get, in cells
+    C_SpatialHash d_selfHash;
+    vector3f *d_pSelfPush,          // Each particle's push in the current pass
+             *d_pHashPositions;     // The positions the hash was built from
+    unsigned *d_pSelfCandidates,    // SELF_CANDIDATES particles near each one when the hash was built
+             *d_pSelfCandidateCount;
+    std::vector<float> d_selfMove;  // Furthest squared move from the hash per thread
+
+    C_ClothBVH d_bvh;               // The triangles, see updateBVH()
+    unsigned d_uBVHFrame;           // The frame the tree was refit for
+
+    // Continuous collision, see solveContinuousCollisions()
+    bool d_bContinuous;
+    std::atomic<unsigned> *d_pImpactTime;   // Bits of each particle's first impact time
+    std::vector<unsigned> d_impactCount;    // Particles stopped per thread
+    unsigned d_uImpacts;            // Particles stopped over the last step
 
     //----------------------------------------------------------------------
     // Private Methods
@@ -109,6 +293,89 @@ private:
     // Uses row major order to create a 1D index from a 2D index
     unsigned getIndex2D(unsigned i, unsigned j)   { return i*d_numCol + j; }
 
+    // The tile a particle belongs to.  Particles on the border between two
+    // tiles belong to the one below or to the right, except along the
+    // bottom and right of the grid.
+    unsigned getParticleTile(unsigned i) const;
+
+    // The rows [r0, r1) and columns [c0, c1) of the particles of tile t
+    void getTileParticles(unsigned t, unsigned& r0, unsigned& r1, unsigned& c0, unsigned& c1) const;
+
+    // Sorts the springs into color batches
+    void buildColorBatches(const unsigned* p1, const unsigned* p2, const float* rest,
+                           const unsigned char* family);
+
+    // Projects the springs [begin, end) of one color
+    void solveSprings(unsigned begin, unsigned end);
+
+    // Projects the springs [begin, end) of those in the numRanges runs of
+    // one color, counted across the runs
+    void solveActiveSprings(const SpringRange* ranges, unsigned numRanges, unsigned begin, unsigned end);
+
+    // Projects a single spring
+    void solveSpring(unsigned s);
+
+    // Tearing, see setTearStretch()
+    void reserveTearing();
+    void recordTears(unsigned s, unsigned lanes);
+    void tearSprings();
+    bool splitParticle(unsigned v, unsigned other);
+    unsigned findSpring(unsigned a, unsigned b, unsigned family) const;
+    unsigned getSpringColor(unsigned s) const;
+    bool addSpring(unsigned a, unsigned b, float rest, unsigned char family);
+    void removeSpring(unsigned s);
+    void moveSpringEnd(unsigned s, unsigned from, unsigned to);
+    void listSpring(unsigned i, unsigned s);
+    void unlistSpring(unsigned i, unsigned s);
+    void compactColor(unsigned c);
+    void logEdit(EditKind kind, unsigned first, unsigned count);
+
+    // Computes the forces on the particles [begin, end)
+    void sumForcesRange(unsigned begin, unsigned end);
+
+    // Integrates the particles [begin, end), then pushes them out of the
+    // colliders
+    void integrateAndCollideRange(unsigned begin, unsigned end);
+    void collideRange(unsigned begin, unsigned end);
+
+    // Stops the particles [begin, end) where their motion first meets a
+    // collider
+    void sweepRange(unsigned begin, unsigned end);
+
+    // Computes the vertex normals of the grid rows [begin, end), or of the
+    // particles [begin, end) of a mesh
+    void computeNormalsRange(unsigned begin, unsigned end);
+    void computeMeshNormalsRange(unsigned begin, unsigned end);
+
+    // Pushes apart particles of different parts of the cloth that came too
+    // close, over the particles [begin, end) for the tasks
+    void solveSelfCollisions(bool rebuild);
+    void gatherSelfCandidates(unsigned begin, unsigned end);
+    void selfCollideRange(unsigned begin, unsigned end, unsigned thread);
+
+    // Stops the particles that passed through a collider or another part of
+    // the cloth during the step at their first impact, over the leaves of
+    // the tree or the particles [begin, end) for the tasks
+    void solveContinuousCollisions();
+    void findImpactsRange(unsigned begin, unsigned end);
+    void applyImpactsRange(unsigned begin, unsigned end, unsigned thread, bool last);
+
+    // Refits the boxes of the tiles, and of the rows of tiles [begin, end)
+    void updateTileBounds();
+    void computeTileBoundsRange(unsigned begin, unsigned end);
+
+    // Puts the tiles that stayed still to sleep and wakes the ones that
+    // were moved, then lists what the solver visits
+    void updateSleep();
+    void sleepTile(unsigned t);
+    void wakeTile(unsigned t);
+    void wakeOverlapping(const ClothBounds& box);
+    void wakeForColliders();
+    void wakeAll();
+    void updateActiveLists();
+
+protected:
+    void integrate();
 
 public:
         //----------------------------------------------------------------------
@@ -125,14 +392,42 @@ public:
         // Clear the cloth
         void clear();
 
-        // Draw the cloth
-        void draw();
-
-        // Draws the mesh
-        void drawMesh();
-
-        // Draws the particles
-        void drawParticles();
+        // The shapes the cloth collides with, see collider.h
+        C_ColliderSet& getColliders() { return d_colliders; }
+
+        // Keeps the cloth from passing through itself.  distance is how close
+        // two particles that are not neighbours on the grid, or do not share
+        // a spring on a mesh, may get, as a share of the rest length of a cell.
+        void setSelfCollision(bool on) { d_bSelfCollision = on; }
+        bool getSelfCollision() const { return d_bSelfCollision; }
+        void setSelfCollisionDistance(float distance) { d_fSelfDistance = distance; }
+        float getSelfCollisionDistance() const { return d_fSelfDistance; }
+
+        // Follows each particle's motion over the step, from its previous
+        // position to its new one, instead of only testing where it ends up,
+        // so fast cloth cannot pass through thin colliders, or through itself
+        // when self collision is on.  The latter needs the grid's triangle
+        // tree, a mesh is only swept against the colliders and is kept apart
+        // from itself by the self collision distance alone.
+        void setContinuousCollision(bool on) { d_bContinuous = on; }
+        bool getContinuousCollision() const { return d_bContinuous; }
+
+        // The particles the continuous collision stopped short during the
+        // last step
+        unsigned getImpactCount() const { return d_uImpacts; }
+
+        // The tree over the cloth's triangles, refit to the current frame if
+        // the particles moved since the last call.  Each leaf box holds its
+        // triangles both now and one step ago.  The tree is built from the
+        // grid, for a mesh it stays empty.
+        const C_ClothBVH& updateBVH();
+
+        // Finds the nearest point of the cloth hit by the ray from origin
+        // along dir, at most maxT times dir away.  Returns false on a miss.
+        bool raycast(const vector3f& origin, const vector3f& dir, float maxT, C_ClothBVH::RayHit& hit);
+
+        // Steps the particles, then refits the tile bounding boxes
+        void stepSimulation(const float& dt);
 
         // sum the forces
         void sumForces();
@@ -140,17 +435,164 @@ public:
         // apply the cloth constraints
         void applyConstraints();
 
-        void setWindFactor(float w) { d_windFactor = w; }
+        void setWindFactor(float w);
 
         // Modify the wind vector effecting the cloth
         void setWindVector(float x, float y, float z);
 
-        // Sets the passed particle as locked
+        // Changing the gravity or the wind wakes the whole cloth
+        void setGravity(const vector3f& g);
+
+        // Puts the tiles whose particles all moved less than threshold cells
+        // a step for CLOTH_SLEEP_FRAMES steps in a row to sleep.  A sleeping
+        // tile is not integrated and its springs are not solved, the rest of
+        // the cloth treats its particles as locked.  It wakes when a
+        // neighbouring tile moves, the wind or gravity change, a collider
+        // near it changes, or another part of the cloth hits it.  A step
+        // with every tile asleep does nothing and leaves the frame as it was.
+        // A mesh has no tiles and never sleeps.
+        void setSleeping(bool on);
+        bool getSleeping() const { return d_bSleeping; }
+        void setSleepThreshold(float threshold) { d_fSleepThreshold = threshold; }
+        float getSleepThreshold() const { return d_fSleepThreshold; }
+        unsigned getSleepingTileCount() const { return d_uSleepingTiles; }
+        bool isTileAsleep(unsigned t) const { return d_pTileState[t].asleep; }
+
+        // Fills in the vertex normals if the particles moved since the last
+        // call.  Only needed for shaded drawing, the simulation never reads
+        // them.
+        void updateNormals();
+
+        // Sets the passed particle as locked, by row and column of the grid
+        // or by index
         void lockParticle(unsigned i, unsigned j) { if(i < d_numRow && j < d_numCol) d_particleInfo[getIndex2D(i,j)].locked = true; }
+        void lockParticle(unsigned i) { if(i < d_uNumParticles) d_particleInfo[i].locked = true; }
+
+        // Returns true if the passed particle is locked
+        bool isParticleLocked(unsigned i) const { return d_particleInfo[i].locked; }
+
+        // The dimensions of the cloth's particle grid, zero for a mesh
+        unsigned getNumRows() const { return d_numRow; }
+        unsigned getNumCols() const { return d_numCol; }
+
+        // The triangles of a mesh, three particles each, none for a grid
+        unsigned getTriangleCount() const { return d_pTriangles ? d_numFaces : 0; }
+        const unsigned* getTriangles() const { return d_pTriangles; }
+
+        // The rest length of the longer side of a grid cell, or the mean
+        // edge of a mesh
+        float getCellSize() const { return d_fCellSize; }
+
+        // The tiles the grid is split into, see CLOTH_TILE_CELLS.  Each box
+        // holds the tile's particles both now and one step ago, so it also
+        // holds anything drawn between the two frames.
+        unsigned getTileRows() const { return d_numTileRows; }
+        unsigned getTileCols() const { return d_numTileCols; }
+        const ClothBounds* getTileBounds() const { return d_pTileBounds; }
+        const ClothBounds& getBounds() const { return d_bounds; }
+
+        // Returns the total number of springs
+        unsigned getSpringCount() const { return d_numStructSprings + d_numShearSprings + d_numBendSprings; }
+        unsigned getBendSpringCount() const { return d_numBendSprings; }
+
+        // The places in the spring arrays, the same as the springs but for a
+        // cloth that can tear, whose free places have both ends on one particle
+        unsigned getSpringSlotCount() const { return d_colorStart[d_numColors]; }
+
+        // The particles at either end of each spring and its SpringFamily,
+        // in color order
+        const unsigned* getSpringP1() const { return d_pSpringP1; }
+        const unsigned* getSpringP2() const { return d_pSpringP2; }
+        const unsigned char* getSpringFamilies() const { return d_pSpringFamily; }
+
+        // How much the cloth resists bending, from 0 to 1, the share of a
+        // bend the bending springs take out over one step whatever the
+        // number of solver iterations.  The structural and shear springs are
+        // always fully stiff.  The bending springs join particles two edges
+        // apart in a straight line, on the grid two rows or two columns
+        // apart, and are solved in the same color batches and sweeps as the
+        // others, so they cost their share of the springs and no pass of
+        // their own: on a grid about a third of them, which makes a sweep
+        // about half as long again.  They are only built by initialize() or
+        // initializeMesh() while the stiffness is above zero, after that it
+        // can be changed at any time.
+        void setBendStiffness(float k) { d_fBendStiffness = k < 0.0f ? 0.0f : (k > 1.0f ? 1.0f : k); }
+        float getBendStiffness() const { return d_fBendStiffness; }
+
+        // Lets a mesh tear.  A structural spring stretched past stretch
+        // times its rest length when a step's constraints start is torn at
+        // the end of the step: one of its particles is split in two along
+        // the plane facing the other, each taking the triangles on its side,
+        // and the springs that crossed the cut go.  Up to CLOTH_MAX_TEARS
+        // springs tear a step.
+        //
+        // Room for a quarter as many particles again and a quarter as many
+        // springs again in each color is made by initializeMesh() while the
+        // stretch is set, so tearing never allocates; a cloth that has used
+        // it up stops tearing.  A freed place is filled from the end of its
+        // color at once, so the solver never visits a hole, and once enough
+        // springs have moved the colors are sorted again by their first
+        // particle, one a step.  A grid cannot tear, its strips and tiles
+        // are laid out for a fixed grid.  0, or anything up to 1, is off.
+        void setTearStretch(float stretch) { d_fTearStretch = stretch > 1.0f ? stretch : 0.0f; }
+        float getTearStretch() const { return d_fTearStretch; }
+        bool canTear() const { return d_pParticleSprings != 0; }
+        unsigned getTornCount() const { return d_uTornCount; }
+
+        // The particles the arrays have room for, more than there are on a
+        // cloth that can tear
+        unsigned getParticleCapacity() const { return d_uParticleCapacity; }
+
+        // The changes tearing made to the triangles, springs and particles,
+        // numbered from 0 since the cloth was built.  Only the last
+        // CLOTH_EDIT_LOG are kept, a renderer further behind than that
+        // starts again from the cloth as it is.
+        unsigned getEditCount() const { return d_uNumEdits; }
+        const Edit& getEdit(unsigned e) const { return d_pEdits[e % CLOTH_EDIT_LOG]; }
+
+        // Returns the number of color batches the springs were sorted into
+        unsigned getColorCount() const { return d_numColors; }
+
+        // Lays the particles and springs out in memory so that the solver
+        // walks them front to back.  Within each color batch the springs go
+        // in the order of their first particle, and the particles of a mesh
+        // are put in the Morton order of where they start, so particles near
+        // each other on the cloth are near each other in memory.  A grid
+        // keeps its row major order, which its rows and tiles are addressed
+        // by.  Takes effect at the next initialize() or initializeMesh(), the
+        // colored solver gives the same result either way.
+        void setReordering(bool on) { d_bReorder = on; }
+        bool getReordering() const { return d_bReorder; }
+
+        // The index each particle had in its source, its row major index on
+        // the grid or its vertex in the OBJ file of a mesh, and the particle
+        // of a source index, ~0u for a vertex the mesh dropped.  Anything read
+        // or written in the source's order goes through these.
+        unsigned getSourceCount() const { return d_pSourceIndex ? d_numSources : d_uNumParticles; }
+        unsigned getSourceIndex(unsigned i) const { return d_pSourceIndex ? d_pSourceIndex[i] : i; }
+        unsigned findParticle(unsigned source) const
+        {
+            if(d_pSourceIndex)
+                return source < d_numSources ? d_pParticleIndex[source] : ~0u;
+            return source < d_uNumParticles ? source : ~0u;
+        }
+
+        // Solver settings
+        void setSolverMode(SolverMode m) { d_solverMode = m; }
+        SolverMode getSolverMode() const { return d_solverMode; }
+        void setSolverIterations(unsigned n) { d_uSolverIterations = n; }
+        unsigned getSolverIterations() const { return d_uSolverIterations; }
+        void setThreadCount(unsigned n) { d_workers.setThreadCount(n); }
+        unsigned getThreadCount() const { return d_workers.getThreadCount(); }
 
         // Inililize the cloth's particles
         void initialize(float width, float height, int numRow, int numCol, float mass,
                                         float tension, float shear, float damp, int axis);
+
+        // Builds the cloth from the triangles of an OBJ file, see the source.
+        // Returns false, and keeps the cloth as it was, if the file could not
+        // be read or had no triangles.
+        bool initializeMesh(const char* objPath, float mass, float tension, float shear, float damp);
 };
 
 
@@ -0,0 +1,373 @@
+/*==============================================================================
+/ clothapi.cpp
+/ The C interface to C_Cloth.
+/=============================================================================*/
+
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "clothapi.h"
+#include "cloth.h"
+#include <new>
+
+// The handle is the cloth itself, the struct only exists for type safety in C
+struct cloth_handle : public C_Cloth
+{
+};
+
+
+unsigned cloth_api_version(void)
+{
+    return CLOTH_API_VERSION;
+}
+
+cloth_handle* cloth_create(void)
+{
+    return new (std::nothrow) cloth_handle();
+}
+
+void cloth_destroy(cloth_handle* cloth)
+{
+    delete cloth;
+}
+
+int cloth_initialize(cloth_handle* cloth, float width, float height,
+                     int numRow, int numCol, float mass,
+                     float structural, float shear, float damp, int axis)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    // A cloth needs at least one face and a positive mass
+    if(numRow < 2 || numCol < 2 || width <= 0 || height <= 0 || mass <= 0)
+        return CLOTH_ERROR_ARGUMENT;
+    if(axis != CLOTH_AXIS_Z && axis != CLOTH_AXIS_Y)
+        return CLOTH_ERROR_ARGUMENT;
+
+    cloth->initialize(width, height, numRow, numCol, mass, structural, shear, damp, axis);
+    return CLOTH_OK;
+}
+
+int cloth_initialize_mesh(cloth_handle* cloth, const char* objPath, float mass,
+                          float structural, float shear, float damp)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(!objPath || mass <= 0)
+        return CLOTH_ERROR_ARGUMENT;
+
+    if(!cloth->initializeMesh(objPath, mass, structural, shear, damp))
+        return CLOTH_ERROR_FILE;
+    return CLOTH_OK;
+}
+
+int cloth_step(cloth_handle* cloth, float dt)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(dt <= 0)
+        return CLOTH_ERROR_ARGUMENT;
+    if(cloth->getParticleCount())
+        cloth->stepSimulation(dt);
+    return CLOTH_OK;
+}
+
+int cloth_lock_particle(cloth_handle* cloth, unsigned i, unsigned j)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(i >= cloth->getNumRows() || j >= cloth->getNumCols())
+        return CLOTH_ERROR_ARGUMENT;
+
+    cloth->lockParticle(i, j);
+    return CLOTH_OK;
+}
+
+int cloth_lock_index(cloth_handle* cloth, unsigned index)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(index >= cloth->getParticleCount())
+        return CLOTH_ERROR_ARGUMENT;
+
+    cloth->lockParticle(index);
+    return CLOTH_OK;
+}
+
+int cloth_set_gravity(cloth_handle* cloth, float x, float y, float z)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    cloth->setGravity(vector3f(x, y, z));
+    return CLOTH_OK;
+}
+
+int cloth_set_wind(cloth_handle* cloth, float x, float y, float z, unsigned factor)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    cloth->setWindVector(x, y, z);
+    cloth->setWindFactor(factor);
+    return CLOTH_OK;
+}
+
+int cloth_set_thread_count(cloth_handle* cloth, unsigned threads)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(threads == 0)
+        return CLOTH_ERROR_ARGUMENT;
+    cloth->setThreadCount(threads);
+    return CLOTH_OK;
+}
+
+int cloth_set_solver_mode(cloth_handle* cloth, int mode)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(mode == CLOTH_SOLVER_GAUSS_SEIDEL)
+        cloth->setSolverMode(C_Cloth::SOLVER_GAUSS_SEIDEL);
+    else if(mode == CLOTH_SOLVER_COLORED)
+        cloth->setSolverMode(C_Cloth::SOLVER_COLORED);
+    else
+        return CLOTH_ERROR_ARGUMENT;
+    return CLOTH_OK;
+}
+
+int cloth_set_solver_iterations(cloth_handle* cloth, unsigned iterations)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    cloth->setSolverIterations(iterations);
+    return CLOTH_OK;
+}
+
+int cloth_set_reordering(cloth_handle* cloth, int enabled)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    cloth->setReordering(enabled != 0);
+    return CLOTH_OK;
+}
+
+int cloth_set_bend_stiffness(cloth_handle* cloth, float stiffness)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(!(stiffness >= 0.0f && stiffness <= 1.0f))
+        return CLOTH_ERROR_ARGUMENT;
+    cloth->setBendStiffness(stiffness);
+    return CLOTH_OK;
+}
+
+int cloth_set_tear_stretch(cloth_handle* cloth, float stretch)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(!(stretch == 0.0f || stretch > 1.0f))
+        return CLOTH_ERROR_ARGUMENT;
+    cloth->setTearStretch(stretch);
+    return CLOTH_OK;
+}
+
+unsigned cloth_torn_count(const cloth_handle* cloth)
+{
+    return cloth ? cloth->getTornCount() : 0;
+}
+
+int cloth_add_plane(cloth_handle* cloth, float nx, float ny, float nz, float offset)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(nx == 0 && ny == 0 && nz == 0)
+        return CLOTH_ERROR_ARGUMENT;
+    return (int)cloth->getColliders().addPlane(vector3f(nx, ny, nz), offset);
+}
+
+int cloth_add_sphere(cloth_handle* cloth, float x, float y, float z, float radius)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(radius <= 0)
+        return CLOTH_ERROR_ARGUMENT;
+    return (int)cloth->getColliders().addSphere(vector3f(x, y, z), radius);
+}
+
+int cloth_add_capsule(cloth_handle* cloth, const float* start, const float* end, float radius)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(!start || !end || radius <= 0)
+        return CLOTH_ERROR_ARGUMENT;
+    return (int)cloth->getColliders().addCapsule(vector3f(start[0], start[1], start[2]),
+                                                 vector3f(end[0], end[1], end[2]), radius);
+}
+
+int cloth_add_box(cloth_handle* cloth, const float* center, const float* xAxis,
+                  const float* yAxis, const float* halfSize)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(!center || !xAxis || !yAxis || !halfSize)
+        return CLOTH_ERROR_ARGUMENT;
+
+    // The axes must span a plane
+    vector3f x(xAxis[0], xAxis[1], xAxis[2]), y(yAxis[0], yAxis[1], yAxis[2]);
+    if(x.crossProduct(y).magnitude() <= 0)
+        return CLOTH_ERROR_ARGUMENT;
+    return (int)cloth->getColliders().addBox(vector3f(center[0], center[1], center[2]), x, y,
+                                             vector3f(halfSize[0], halfSize[1], halfSize[2]));
+}
+
+int cloth_add_mesh(cloth_handle* cloth, const char* objPath, float voxelSize,
+                   const char* cachePath, float x, float y, float z)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(!objPath || voxelSize < 0)
+        return CLOTH_ERROR_ARGUMENT;
+
+    C_MeshCollider* mesh = new C_MeshCollider();
+    if(!mesh->load(objPath, voxelSize, cachePath))
+    {
+        delete mesh;
+        return CLOTH_ERROR_FILE;
+    }
+    return (int)cloth->getColliders().addMesh(mesh, vector3f(x, y, z));
+}
+
+int cloth_move_collider(cloth_handle* cloth, unsigned index, float x, float y, float z)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(index >= cloth->getColliders().getCount())
+        return CLOTH_ERROR_ARGUMENT;
+    cloth->getColliders().moveShape(index, vector3f(x, y, z));
+    return CLOTH_OK;
+}
+
+int cloth_clear_colliders(cloth_handle* cloth)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    cloth->getColliders().clear();
+    return CLOTH_OK;
+}
+
+int cloth_set_collision(cloth_handle* cloth, float thickness, float friction)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(thickness < 0 || friction < 0 || friction > 1)
+        return CLOTH_ERROR_ARGUMENT;
+    cloth->getColliders().setThickness(thickness);
+    cloth->getColliders().setFriction(friction);
+    return CLOTH_OK;
+}
+
+int cloth_set_self_collision(cloth_handle* cloth, int enabled, float distance)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(distance <= 0)
+        return CLOTH_ERROR_ARGUMENT;
+    cloth->setSelfCollision(enabled != 0);
+    cloth->setSelfCollisionDistance(distance);
+    return CLOTH_OK;
+}
+
+int cloth_set_continuous_collision(cloth_handle* cloth, int enabled)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    cloth->setContinuousCollision(enabled != 0);
+    return CLOTH_OK;
+}
+
+unsigned cloth_impact_count(const cloth_handle* cloth)
+{
+    return cloth ? cloth->getImpactCount() : 0;
+}
+
+int cloth_set_sleeping(cloth_handle* cloth, int enabled, float threshold)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(threshold <= 0)
+        return CLOTH_ERROR_ARGUMENT;
+    cloth->setSleeping(enabled != 0);
+    cloth->setSleepThreshold(threshold);
+    return CLOTH_OK;
+}
+
+unsigned cloth_sleeping_tile_count(const cloth_handle* cloth)
+{
+    return cloth ? cloth->getSleepingTileCount() : 0;
+}
+
+int cloth_raycast(cloth_handle* cloth, const float* origin, const float* dir, float maxT,
+                  float* t, unsigned* particle)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(!origin || !dir || maxT < 0)
+        return CLOTH_ERROR_ARGUMENT;
+
+    C_ClothBVH::RayHit hit;
+    if(!cloth->raycast(vector3f(origin[0], origin[1], origin[2]), vector3f(dir[0], dir[1], dir[2]),
+                       maxT, hit))
+        return 0;
+
+    if(t)
+        *t = hit.t;
+    if(particle)
+    {
+        unsigned a, b, c;
+        cloth->updateBVH().getTriangle(hit.triangle, a, b, c);
+        const float w = 1.0f - hit.u - hit.v;
+        *particle = w >= hit.u && w >= hit.v ? a : (hit.u >= hit.v ? b : c);
+    }
+    return 1;
+}
+
+unsigned cloth_particle_count(const cloth_handle* cloth)
+{
+    return cloth ? cloth->getParticleCount() : 0;
+}
+
+const float* cloth_positions(const cloth_handle* cloth, unsigned* strideBytes)
+{
+    if(strideBytes)
+        *strideBytes = sizeof(C_Vertex);
+    if(!cloth || !cloth->getParticleCount())
+        return 0;
+    return &cloth->getVertices()[0].pos.x;
+}
+
+int cloth_find_particle(const cloth_handle* cloth, unsigned source)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    const unsigned i = cloth->findParticle(source);
+    return i == ~0u ? CLOTH_ERROR_ARGUMENT : (int)i;
+}
+
+int cloth_copy_positions(const cloth_handle* cloth, float* out, unsigned count)
+{
+    if(!cloth)
+        return CLOTH_ERROR_HANDLE;
+    if(!out && count)
+        return CLOTH_ERROR_ARGUMENT;
+
+    const C_Vertex* v = cloth->getVertices();
+    for(unsigned i = 0; i < cloth->getParticleCount(); ++i)
+    {
+        const unsigned source = cloth->getSourceIndex(i);
+        if(source >= count || cloth->findParticle(source) != i)
+            continue;
+        out[source*3] = v[i].pos.x;
+        out[source*3 + 1] = v[i].pos.y;
+        out[source*3 + 2] = v[i].pos.z;
+    }
+    return (int)cloth->getSourceCount();
+}
@@ -0,0 +1,172 @@
+/*==============================================================================
+/ clothapi.h
+/ A plain C interface to the cloth solver so it can be driven from other
+/ processes and tools without the GUI.  Only I_ParticleSystem, C_Cloth,
+/ C_ColliderSet, C_MeshCollider, C_SpatialHash, C_ClothBVH, the tests in
+/ ccd.h, the OBJ reader in objfile.h and vector3 are needed to build it,
+/ none of which depend on GL or Qt.
+/
+/ The handle is opaque.  Positions are returned as a pointer straight into
+/ the solver's vertex array (no copy); the x, y, z floats of a particle are
+/ at byte offset (index * stride).  The pointer stays valid until the next
+/ cloth_initialize(), cloth_initialize_mesh() or cloth_destroy() on the same
+/ handle.
+/=============================================================================*/
+
+#ifndef _CLOTHAPI_
+#define _CLOTHAPI_
+
+#if defined(_WIN32) && defined(CLOTH_BUILD_DLL)
+    #define CLOTH_API __declspec(dllexport)
+#elif defined(_WIN32) && defined(CLOTH_USE_DLL)
+    #define CLOTH_API __declspec(dllimport)
+#else
+    #define CLOTH_API
+#endif
+
+// Bumped whenever a function is added or a signature changes
+#define CLOTH_API_VERSION 12
+
+// Axis values for cloth_initialize(), match ZAXIS and YAXIS in cloth.h
+#define CLOTH_AXIS_Z 1
+#define CLOTH_AXIS_Y 2
+
+// Solver modes for cloth_set_solver_mode(), match C_Cloth::SolverMode
+#define CLOTH_SOLVER_GAUSS_SEIDEL 0
+#define CLOTH_SOLVER_COLORED      1
+
+// Return codes
+#define CLOTH_OK             0
+#define CLOTH_ERROR_HANDLE  -1
+#define CLOTH_ERROR_ARGUMENT -2
+#define CLOTH_ERROR_FILE     -3
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cloth_handle cloth_handle;
+
+CLOTH_API unsigned cloth_api_version(void);
+
+// Create and destroy a cloth.  A new cloth has no particles.
+CLOTH_API cloth_handle* cloth_create(void);
+CLOTH_API void cloth_destroy(cloth_handle* cloth);
+
+// Build a rectangular cloth of numRow x numCol particles, see
+// C_Cloth::initialize()
+CLOTH_API int cloth_initialize(cloth_handle* cloth, float width, float height,
+                               int numRow, int numCol, float mass,
+                               float structural, float shear, float damp, int axis);
+
+// Build a cloth from the triangles of an OBJ file, see
+// C_Cloth::initializeMesh().  The particles are in an order of their own,
+// not the file's.  Returns CLOTH_ERROR_FILE, and keeps the cloth as it was,
+// if the file could not be read or had no triangles.
+CLOTH_API int cloth_initialize_mesh(cloth_handle* cloth, const char* objPath, float mass,
+                                    float structural, float shear, float damp);
+
+// Advance the simulation by dt seconds
+CLOTH_API int cloth_step(cloth_handle* cloth, float dt);
+
+// Pin the particle at row i, column j in place
+CLOTH_API int cloth_lock_particle(cloth_handle* cloth, unsigned i, unsigned j);
+// Pin a particle by its index, for a cloth of any shape
+CLOTH_API int cloth_lock_index(cloth_handle* cloth, unsigned index);
+
+CLOTH_API int cloth_set_gravity(cloth_handle* cloth, float x, float y, float z);
+CLOTH_API int cloth_set_wind(cloth_handle* cloth, float x, float y, float z, unsigned factor);
+
+// Solver settings.  threads counts the calling thread, 1 runs everything
+// inline.
+CLOTH_API int cloth_set_thread_count(cloth_handle* cloth, unsigned threads);
+CLOTH_API int cloth_set_solver_mode(cloth_handle* cloth, int mode);
+CLOTH_API int cloth_set_solver_iterations(cloth_handle* cloth, unsigned iterations);
+// Orders the particles and springs of the next initialize for locality when
+// enabled is non zero, the default, see C_Cloth::setReordering()
+CLOTH_API int cloth_set_reordering(cloth_handle* cloth, int enabled);
+// How much the cloth resists bending, from 0 to 1, see
+// C_Cloth::setBendStiffness().  The bending springs are only built by the
+// next initialize if it is above zero.
+CLOTH_API int cloth_set_bend_stiffness(cloth_handle* cloth, float stiffness);
+// Lets a mesh cloth tear where a structural spring is stretched past stretch
+// times its rest length, see C_Cloth::setTearStretch().  0 turns it off,
+// anything else must be above 1.  The room for tearing is made by the next
+// cloth_initialize_mesh().  cloth_torn_count() returns the particles split
+// off since then, each of which adds one to cloth_particle_count().
+CLOTH_API int cloth_set_tear_stretch(cloth_handle* cloth, float stretch);
+CLOTH_API unsigned cloth_torn_count(const cloth_handle* cloth);
+
+// Colliders the particles are kept out of, see collider.h.  Each add
+// returns the collider's index, or a negative error code.  A plane keeps
+// the particles on the side its normal points to, at offset along it.
+CLOTH_API int cloth_add_plane(cloth_handle* cloth, float nx, float ny, float nz, float offset);
+CLOTH_API int cloth_add_sphere(cloth_handle* cloth, float x, float y, float z, float radius);
+CLOTH_API int cloth_add_capsule(cloth_handle* cloth, const float* start, const float* end, float radius);
+CLOTH_API int cloth_add_box(cloth_handle* cloth, const float* center, const float* xAxis,
+                            const float* yAxis, const float* halfSize);
+// Adds the triangles of an OBJ file at position x, y, z.  A voxelSize above
+// zero bakes a distance field for faster lookups.  With a cachePath the
+// tree and field are kept in that file and reused while the OBJ and the
+// voxel size stay the same.  Returns CLOTH_ERROR_FILE if the OBJ could not
+// be read.
+CLOTH_API int cloth_add_mesh(cloth_handle* cloth, const char* objPath, float voxelSize,
+                             const char* cachePath, float x, float y, float z);
+CLOTH_API int cloth_move_collider(cloth_handle* cloth, unsigned index, float x, float y, float z);
+CLOTH_API int cloth_clear_colliders(cloth_handle* cloth);
+
+// Distance kept from the colliders, and the share of sliding motion a contact
+// takes away, from 0 to 1
+CLOTH_API int cloth_set_collision(cloth_handle* cloth, float thickness, float friction);
+
+// Keeps the cloth from passing through itself when enabled is non zero.
+// distance is how close two particles may get, as a share of the grid
+// spacing.
+CLOTH_API int cloth_set_self_collision(cloth_handle* cloth, int enabled, float distance);
+
+// Follows each particle's motion over a step when enabled is non zero, so
+// fast cloth cannot pass through thin colliders, or through itself when
+// self collision is on.  Only a grid is followed against itself: a cloth
+// from cloth_initialize_mesh() is swept against the colliders, and is kept
+// apart from itself by the self collision distance alone.
+// cloth_impact_count() returns how many particles it stopped short during
+// the last step.
+CLOTH_API int cloth_set_continuous_collision(cloth_handle* cloth, int enabled);
+CLOTH_API unsigned cloth_impact_count(const cloth_handle* cloth);
+
+// Puts the tiles of the cloth that stay still to sleep when enabled is non
+// zero, see C_Cloth::setSleeping().  threshold is the move per step below
+// which a tile counts as still, as a share of the grid spacing.
+// cloth_sleeping_tile_count() returns how many tiles sleep now.
+CLOTH_API int cloth_set_sleeping(cloth_handle* cloth, int enabled, float threshold);
+CLOTH_API unsigned cloth_sleeping_tile_count(const cloth_handle* cloth);
+
+// Casts a ray from origin along dir at the cloth's triangles, at most maxT
+// times dir.  On a hit returns 1, sets t to the distance in units of dir and
+// particle to the corner of the hit triangle nearest the hit, either may be
+// null.  Returns 0 on a miss, and always for a mesh cloth, which has no
+// triangle tree.
+CLOTH_API int cloth_raycast(cloth_handle* cloth, const float* origin, const float* dir, float maxT,
+                            float* t, unsigned* particle);
+
+// Particle data access
+CLOTH_API unsigned cloth_particle_count(const cloth_handle* cloth);
+CLOTH_API const float* cloth_positions(const cloth_handle* cloth, unsigned* strideBytes);
+
+// The solver keeps the particles in an order of its own, see
+// C_Cloth::setReordering().  A source index is a particle's vertex in the OBJ
+// file of a mesh cloth, or its row major index on a grid.
+// cloth_find_particle() returns the particle of a source index, or
+// CLOTH_ERROR_ARGUMENT for a vertex the mesh dropped.  cloth_copy_positions()
+// writes the x, y, z of every source index to out, which holds count of
+// them, and leaves those of dropped vertices as they were.  A vertex split
+// by tearing gives the position of the particle it started as.  It returns
+// the number of source indices, which may be more than count.
+CLOTH_API int cloth_find_particle(const cloth_handle* cloth, unsigned source);
+CLOTH_API int cloth_copy_positions(const cloth_handle* cloth, float* out, unsigned count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
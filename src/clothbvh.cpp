@@ -0,0 +1,528 @@
+/*==============================================================================
+/ clothbvh.cpp
+/ A bounding volume hierarchy over the triangles of a cloth grid.
+/=============================================================================*/
+
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "clothbvh.h"
+#include <algorithm>
+#include <math.h>
+
+// Depth of the nodes whose subtrees are refit in parallel, up to 4^depth of
+// them are handed to the workers
+#define BVH_SPLIT_DEPTH 3
+
+//==============================================================================
+// LOCAL FUNCTIONS
+//==============================================================================
+
+static float axisOf(const vector3f& v, unsigned axis)
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// Orders leaves by their centers along one axis
+struct CenterLess
+{
+    const vector3f* centers;
+    unsigned axis;
+    bool operator()(unsigned a, unsigned b) const
+    {
+        return axisOf(centers[a], axis) < axisOf(centers[b], axis);
+    }
+};
+
+// The axis the centers of leaves [begin, end) are spread furthest along
+static unsigned longestAxis(const vector3f* centers, const unsigned* leaves, unsigned begin, unsigned end)
+{
+    vector3f lo = centers[leaves[begin]], hi = lo;
+    for(unsigned i = begin + 1; i < end; ++i)
+    {
+        const vector3f& c = centers[leaves[i]];
+        lo.x = fminf(lo.x, c.x);  hi.x = fmaxf(hi.x, c.x);
+        lo.y = fminf(lo.y, c.y);  hi.y = fmaxf(hi.y, c.y);
+        lo.z = fminf(lo.z, c.z);  hi.z = fmaxf(hi.z, c.z);
+    }
+    const vector3f d = hi - lo;
+    return d.x >= d.y && d.x >= d.z ? 0 : (d.y >= d.z ? 1 : 2);
+}
+
+// Splits leaves [begin, end) at their median center along the longest axis
+static unsigned splitMedian(const vector3f* centers, unsigned* leaves, unsigned begin, unsigned end)
+{
+    const unsigned mid = begin + (end - begin) / 2;
+    CenterLess less = { centers, longestAxis(centers, leaves, begin, end) };
+    std::nth_element(leaves + begin, leaves + mid, leaves + end, less);
+    return mid;
+}
+
+//==============================================================================
+// WORKER TASKS
+//==============================================================================
+
+struct C_ClothBVH::RefitTask
+{
+    C_ClothBVH* bvh;
+    const C_Vertex* positions;
+    const vector3f* previous;
+    float margin;
+    void operator()(unsigned begin, unsigned end, unsigned)
+    {
+        bvh->refitRange(begin, end, positions, previous, margin);
+    }
+};
+
+//==============================================================================
+// CONSTRUCTORS / DESTRUCTORS
+//==============================================================================
+
+C_ClothBVH::C_ClothBVH() : d_numCol(0), d_numCellRows(0), d_numCellCols(0), d_numLeafRows(0),
+    d_numLeafCols(0), d_uTopology(0), d_uRebuilds(0), d_fBuiltRatio(0), d_fRatio(0), d_oldRatio(0)
+{
+}
+
+
+//==============================================================================
+// PRIVATE METHODS
+//==============================================================================
+
+float C_ClothBVH::area(const Node& n)
+{
+    const float dx = n.hi[0] - n.lo[0], dy = n.hi[1] - n.lo[1], dz = n.hi[2] - n.lo[2];
+    return 2.0f * (dx*dy + dy*dz + dz*dx);
+}
+
+//------------------------------------------------------------------------------
+// void buildGrid()
+//
+// Halves the block of leaves along both sides, or along the one side longer
+// than a leaf, and makes a child of each part.
+//------------------------------------------------------------------------------
+void C_ClothBVH::buildGrid(unsigned n, unsigned r0, unsigned r1, unsigned c0, unsigned c1)
+{
+    if(r1 - r0 == 1 && c1 - c0 == 1)
+    {
+        d_nodes[n].first = r0 * d_numLeafCols + c0;
+        d_nodes[n].count = 0;
+        return;
+    }
+
+    const unsigned rm = r1 - r0 > 1 ? r0 + (r1 - r0 + 1) / 2 : r1;
+    const unsigned cm = c1 - c0 > 1 ? c0 + (c1 - c0 + 1) / 2 : c1;
+    unsigned rows[3] = { r0, rm, r1 }, cols[3] = { c0, cm, c1 };
+    const unsigned numRows = rm < r1 ? 2 : 1, numCols = cm < c1 ? 2 : 1;
+
+    const unsigned first = (unsigned)d_nodes.size();
+    d_nodes[n].first = first;
+    d_nodes[n].count = numRows * numCols;
+    d_nodes.resize(first + numRows * numCols);
+
+    for(unsigned i = 0; i < numRows; ++i)
+        for(unsigned j = 0; j < numCols; ++j)
+            buildGrid(first + i * numCols + j, rows[i], rows[i + 1], cols[j], cols[j + 1]);
+}
+
+//------------------------------------------------------------------------------
+// void buildSpatial()
+//
+// Splits the leaves in two at the median of their centers, then each half in
+// two again the same way, and makes a child of each quarter.  Four leaves or
+// less each become a child.
+//------------------------------------------------------------------------------
+void C_ClothBVH::buildSpatial(unsigned n, const vector3f* centers, unsigned* leaves, unsigned begin, unsigned end)
+{
+    const unsigned count = end - begin;
+    if(count == 1)
+    {
+        d_nodes[n].first = leaves[begin];
+        d_nodes[n].count = 0;
+        return;
+    }
+
+    unsigned bounds[5], numChildren;
+    if(count <= 4)
+    {
+        numChildren = count;
+        for(unsigned k = 0; k <= count; ++k)
+            bounds[k] = begin + k;
+    }
+    else
+    {
+        numChildren = 4;
+        bounds[0] = begin;
+        bounds[2] = splitMedian(centers, leaves, begin, end);
+        bounds[1] = splitMedian(centers, leaves, begin, bounds[2]);
+        bounds[3] = splitMedian(centers, leaves, bounds[2], end);
+        bounds[4] = end;
+    }
+
+    const unsigned first = (unsigned)d_nodes.size();
+    d_nodes[n].first = first;
+    d_nodes[n].count = numChildren;
+    d_nodes.resize(first + numChildren);
+
+    for(unsigned k = 0; k < numChildren; ++k)
+        buildSpatial(first + k, centers, leaves, bounds[k], bounds[k + 1]);
+}
+
+//------------------------------------------------------------------------------
+// void splitSubtrees()
+//
+// The nodes BVH_SPLIT_DEPTH down, and the leaves above them, are the roots of
+// the subtrees.  The nodes above are kept in the order they are reached, so
+// every node comes before its children.
+//------------------------------------------------------------------------------
+void C_ClothBVH::splitSubtrees()
+{
+    d_subtreeRoots.clear();
+    d_subtreeEnds.clear();
+    d_upperNodes.clear();
+    if(d_nodes.empty())
+        return;
+
+    unsigned stack[BVH_STACK_SIZE], depth[BVH_STACK_SIZE], top = 0;
+    stack[top] = 0;
+    depth[top++] = 0;
+    while(top)
+    {
+        --top;
+        const unsigned n = stack[top], d = depth[top];
+        if(d == BVH_SPLIT_DEPTH || !d_nodes[n].count)
+        {
+            // The descendants of a node follow its children's block, and the
+            // last ones added are below the last child with children
+            unsigned end = n + 1, m = n;
+            while(d_nodes[m].count)
+            {
+                const Node& node = d_nodes[m];
+                unsigned k = node.first + node.count;
+                end = k;
+                while(k > node.first && !d_nodes[k - 1].count)
+                    --k;
+                if(k == node.first)
+                    break;
+                m = k - 1;
+            }
+            d_subtreeRoots.push_back(n);
+            d_subtreeEnds.push_back(end);
+            continue;
+        }
+
+        d_upperNodes.push_back(n);
+        for(unsigned k = d_nodes[n].count; k-- > 0; )
+        {
+            stack[top] = d_nodes[n].first + k;
+            depth[top++] = d + 1;
+        }
+    }
+    d_subtreeArea.assign(d_subtreeRoots.size(), 0.0f);
+}
+
+//------------------------------------------------------------------------------
+// void refitNode()
+//
+// A leaf is fit around the particles at the corners of its cells.
+//------------------------------------------------------------------------------
+void C_ClothBVH::refitNode(unsigned n, const C_Vertex* positions, const vector3f* previous, float margin)
+{
+    Node& node = d_nodes[n];
+    vector3f lo, hi;
+    if(node.count)
+    {
+        const Node* c = &d_nodes[node.first];
+        lo = vector3f(c->lo[0], c->lo[1], c->lo[2]);
+        hi = vector3f(c->hi[0], c->hi[1], c->hi[2]);
+        for(unsigned k = 1; k < node.count; ++k)
+        {
+            ++c;
+            lo.x = fminf(lo.x, c->lo[0]);  hi.x = fmaxf(hi.x, c->hi[0]);
+            lo.y = fminf(lo.y, c->lo[1]);  hi.y = fmaxf(hi.y, c->hi[1]);
+            lo.z = fminf(lo.z, c->lo[2]);  hi.z = fmaxf(hi.z, c->hi[2]);
+        }
+    }
+    else
+    {
+        const unsigned lr = node.first / d_numLeafCols, lc = node.first - lr * d_numLeafCols;
+        const unsigned r0 = lr * BVH_LEAF_CELLS, c0 = lc * BVH_LEAF_CELLS;
+        const unsigned r1 = r0 + BVH_LEAF_CELLS < d_numCellRows ? r0 + BVH_LEAF_CELLS : d_numCellRows;
+        const unsigned c1 = c0 + BVH_LEAF_CELLS < d_numCellCols ? c0 + BVH_LEAF_CELLS : d_numCellCols;
+
+        // Plain compares rather than fminf(), which is a library call unless
+        // NaNs are ruled out
+        lo = hi = positions[r0 * d_numCol + c0].pos;
+        for(unsigned i = r0; i <= r1; ++i)
+            for(unsigned j = c0; j <= c1; ++j)
+            {
+                const vector3f& p = positions[i * d_numCol + j].pos;
+                const vector3f& q = previous ? previous[i * d_numCol + j] : p;
+                lo.x = p.x < lo.x ? p.x : lo.x;  hi.x = p.x > hi.x ? p.x : hi.x;
+                lo.y = p.y < lo.y ? p.y : lo.y;  hi.y = p.y > hi.y ? p.y : hi.y;
+                lo.z = p.z < lo.z ? p.z : lo.z;  hi.z = p.z > hi.z ? p.z : hi.z;
+                lo.x = q.x < lo.x ? q.x : lo.x;  hi.x = q.x > hi.x ? q.x : hi.x;
+                lo.y = q.y < lo.y ? q.y : lo.y;  hi.y = q.y > hi.y ? q.y : hi.y;
+                lo.z = q.z < lo.z ? q.z : lo.z;  hi.z = q.z > hi.z ? q.z : hi.z;
+            }
+        lo -= vector3f(margin, margin, margin);
+        hi += vector3f(margin, margin, margin);
+    }
+
+    node.lo[0] = lo.x;  node.lo[1] = lo.y;  node.lo[2] = lo.z;
+    node.hi[0] = hi.x;  node.hi[1] = hi.y;  node.hi[2] = hi.z;
+}
+
+//------------------------------------------------------------------------------
+// void refitRange()
+//
+// Walks each subtree's range from the back, so every child is refit before
+// its parent, and sums the area of the subtree's inner boxes.
+//------------------------------------------------------------------------------
+void C_ClothBVH::refitRange(unsigned begin, unsigned end, const C_Vertex* positions,
+                            const vector3f* previous, float margin)
+{
+    for(unsigned s = begin; s < end; ++s)
+    {
+        const unsigned root = d_subtreeRoots[s];
+        float inner = 0.0f;
+        if(d_nodes[root].count)
+        {
+            for(unsigned n = d_subtreeEnds[s]; n-- > d_nodes[root].first; )
+            {
+                refitNode(n, positions, previous, margin);
+                if(d_nodes[n].count)
+                    inner += area(d_nodes[n]);
+            }
+            refitNode(root, positions, previous, margin);
+            inner += area(d_nodes[root]);
+        }
+        else
+            refitNode(root, positions, previous, margin);
+        d_subtreeArea[s] = inner;
+    }
+}
+
+//------------------------------------------------------------------------------
+// void rebuild()
+//
+// Takes the center of every leaf box from the last refit and splits them
+// again from the top.
+//------------------------------------------------------------------------------
+void C_ClothBVH::rebuild()
+{
+    const unsigned numLeaves = d_numLeafRows * d_numLeafCols;
+    std::vector<unsigned> leaves;
+    std::vector<vector3f> centers(numLeaves);
+    leaves.reserve(numLeaves);
+    for(size_t n = 0; n < d_nodes.size(); ++n)
+    {
+        const Node& node = d_nodes[n];
+        if(node.count)
+            continue;
+        centers[node.first] = vector3f(node.lo[0] + node.hi[0], node.lo[1] + node.hi[1],
+                                       node.lo[2] + node.hi[2]) * 0.5f;
+        leaves.push_back(node.first);
+    }
+
+    d_nodes.resize(1);
+    buildSpatial(0, &centers[0], &leaves[0], 0, (unsigned)leaves.size());
+    splitSubtrees();
+}
+
+
+//==============================================================================
+// PUBLIC METHODS
+//==============================================================================
+
+void C_ClothBVH::clear()
+{
+    d_nodes.clear();
+    d_oldNodes.clear();
+    d_subtreeRoots.clear();
+    d_subtreeEnds.clear();
+    d_upperNodes.clear();
+    d_numCol = d_numCellRows = d_numCellCols = d_numLeafRows = d_numLeafCols = 0;
+    d_uTopology = d_uRebuilds = 0;
+    d_fBuiltRatio = d_fRatio = d_oldRatio = 0;
+}
+
+void C_ClothBVH::build(unsigned numRow, unsigned numCol, unsigned topology)
+{
+    clear();
+    d_uTopology = topology;
+    if(numRow < 2 || numCol < 2)
+        return;
+
+    d_numCol = numCol;
+    d_numCellRows = numRow - 1;
+    d_numCellCols = numCol - 1;
+    d_numLeafRows = (d_numCellRows + BVH_LEAF_CELLS - 1) / BVH_LEAF_CELLS;
+    d_numLeafCols = (d_numCellCols + BVH_LEAF_CELLS - 1) / BVH_LEAF_CELLS;
+
+    // Each split at least halves the leaves, so the inner nodes are fewer
+    // than the leaves
+    d_nodes.reserve(2 * d_numLeafRows * d_numLeafCols);
+    d_nodes.resize(1);
+    buildGrid(0, 0, d_numLeafRows, 0, d_numLeafCols);
+    splitSubtrees();
+}
+
+//------------------------------------------------------------------------------
+// void refit()
+//
+// The subtrees are refit over the workers and the few nodes above them on
+// the calling thread.  The quality is the surface area heuristic's cost of
+// a ray through the tree: the chance of a ray through the root also passing
+// through each inner node, summed.  The first refit after a build sets the
+// quality the later ones are held to.
+//------------------------------------------------------------------------------
+void C_ClothBVH::refit(const C_Vertex* positions, const vector3f* previous, float margin,
+                       C_WorkerPool& workers)
+{
+    if(d_nodes.empty())
+        return;
+
+    for(unsigned pass = 0; pass < 2; ++pass)
+    {
+        RefitTask task = { this, positions, previous, margin };
+        workers.parallelFor((unsigned)d_subtreeRoots.size(), 1, task);
+
+        float inner = 0.0f;
+        for(size_t s = 0; s < d_subtreeRoots.size(); ++s)
+            inner += d_subtreeArea[s];
+        for(size_t k = d_upperNodes.size(); k-- > 0; )
+        {
+            refitNode(d_upperNodes[k], positions, previous, margin);
+            inner += area(d_nodes[d_upperNodes[k]]);
+        }
+        const float rootArea = area(d_nodes[0]);
+        d_fRatio = rootArea > 0.0f ? inner / rootArea : 0.0f;
+
+        if(d_fBuiltRatio <= 0.0f)
+            d_fBuiltRatio = d_fRatio;
+        if(pass == 1)
+        {
+            // Go back to the refit tree if the new one is no better, and
+            // hold it to its current quality from now on
+            if(d_fRatio >= d_oldRatio)
+            {
+                d_nodes.swap(d_oldNodes);
+                d_fRatio = d_oldRatio;
+                splitSubtrees();
+            }
+            else
+                ++d_uRebuilds;
+            d_fBuiltRatio = d_fRatio;
+            return;
+        }
+        if(d_fRatio <= d_fBuiltRatio * BVH_REBUILD_RATIO)
+            return;
+
+        d_oldNodes = d_nodes;
+        d_oldRatio = d_fRatio;
+        rebuild();
+    }
+}
+
+//------------------------------------------------------------------------------
+// bool raycast()
+//
+// Visits the nodes nearest first along the ray and skips any that start
+// beyond the nearest hit so far.  The triangles are tested with the
+// Moller-Trumbore test, from either side.
+//------------------------------------------------------------------------------
+bool C_ClothBVH::raycast(const C_Vertex* positions, const vector3f& origin, const vector3f& dir,
+                         float maxT, RayHit& hit) const
+{
+    if(d_nodes.empty())
+        return false;
+
+    const float inv[3] = { 1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z };
+    const float org[3] = { origin.x, origin.y, origin.z };
+    float best = maxT;
+    bool found = false;
+
+    unsigned stack[BVH_STACK_SIZE], top = 0;
+    float entry[BVH_STACK_SIZE];
+    stack[top] = 0;
+    entry[top++] = 0.0f;
+    while(top)
+    {
+        --top;
+        if(entry[top] > best)
+            continue;
+        const Node& n = d_nodes[stack[top]];
+
+        if(n.count)
+        {
+            // Push the farther children first so the nearest is taken next
+            unsigned order[4], numHit = 0;
+            float tNear[4];
+            for(unsigned k = 0; k < n.count; ++k)
+            {
+                const Node& c = d_nodes[n.first + k];
+                float t0 = 0.0f, t1 = best;
+                for(unsigned a = 0; a < 3; ++a)
+                {
+                    float ta = (c.lo[a] - org[a]) * inv[a], tb = (c.hi[a] - org[a]) * inv[a];
+                    t0 = fmaxf(t0, fminf(ta, tb));
+                    t1 = fminf(t1, fmaxf(ta, tb));
+                }
+                if(t0 > t1)
+                    continue;
+                unsigned j = numHit++;
+                for(; j > 0 && tNear[j - 1] < t0; --j)
+                {
+                    tNear[j] = tNear[j - 1];
+                    order[j] = order[j - 1];
+                }
+                tNear[j] = t0;
+                order[j] = n.first + k;
+            }
+            for(unsigned k = 0; k < numHit && top < BVH_STACK_SIZE; ++k)
+            {
+                stack[top] = order[k];
+                entry[top++] = tNear[k];
+            }
+            continue;
+        }
+
+        const unsigned lr = n.first / d_numLeafCols, lc = n.first - lr * d_numLeafCols;
+        const unsigned r0 = lr * BVH_LEAF_CELLS, c0 = lc * BVH_LEAF_CELLS;
+        const unsigned r1 = r0 + BVH_LEAF_CELLS < d_numCellRows ? r0 + BVH_LEAF_CELLS : d_numCellRows;
+        const unsigned c1 = c0 + BVH_LEAF_CELLS < d_numCellCols ? c0 + BVH_LEAF_CELLS : d_numCellCols;
+        for(unsigned i = r0; i < r1; ++i)
+            for(unsigned j = c0; j < c1; ++j)
+                for(unsigned t = 2 * (i * d_numCellCols + j), k = 0; k < 2; ++k, ++t)
+                {
+                    unsigned ia, ib, ic;
+                    getTriangle(t, ia, ib, ic);
+                    const vector3f& a = positions[ia].pos;
+                    const vector3f e1 = positions[ib].pos - a, e2 = positions[ic].pos - a;
+                    const vector3f p = dir.crossProduct(e2);
+                    const float det = e1 * p;
+                    if(fabsf(det) < 1e-12f)
+                        continue;
+                    const float invDet = 1.0f / det;
+                    const vector3f s = origin - a;
+                    const float u = (s * p) * invDet;
+                    if(u < 0.0f || u > 1.0f)
+                        continue;
+                    const vector3f q = s.crossProduct(e1);
+                    const float v = (dir * q) * invDet;
+                    if(v < 0.0f || u + v > 1.0f)
+                        continue;
+                    const float tHit = (e2 * q) * invDet;
+                    if(tHit < 0.0f || tHit > best)
+                        continue;
+                    best = tHit;
+                    hit.t = tHit;
+                    hit.u = u;
+                    hit.v = v;
+                    hit.triangle = t;
+                    found = true;
+                }
+    }
+    return found;
+}
@@ -0,0 +1,242 @@
+/*==============================================================================
+/ clothbvh.h
+/ A bounding volume hierarchy over the triangles of a cloth grid, for the
+/ queries that need the surface rather than the particles: collisions
+/ against the cloth, picking and ray casts from outside the solver.
+/
+/ Each grid cell is split into two triangles.  The leaves hold blocks of up
+/ to BVH_LEAF_CELLS x BVH_LEAF_CELLS cells and the tree is first built from
+/ the grid alone: every node splits its block of leaves into four, so a flat
+/ cloth gets a tight quad tree without looking at a single position.  After
+/ that the tree is only refit, the boxes are recomputed bottom up from the
+/ particles over the worker threads.  A refit tree can get loose when the
+/ cloth crumples and far apart parts of the grid end up side by side, so the
+/ refit compares the total area of the inner boxes over that of the root
+/ with what it was at the last build, and past BVH_REBUILD_RATIO times it
+/ the tree is rebuilt from the leaves' positions.  The new tree is kept only
+/ if it is tighter than the refit one.
+/
+/ The nodes are 32 bytes, two to a cache line, and the children of a node
+/ sit next to each other, so a traversal tests them all from one line or two.
+/ Every node's descendants come after it in one unbroken range, so a subtree
+/ can be refit by walking its range backwards.
+/=============================================================================*/
+
+#ifndef _CLOTHBVH_
+#define _CLOTHBVH_
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "C_Vertex.h"
+#include "C_WorkerPool.h"
+#include <vector>
+
+// Cells along each side of a leaf
+#define BVH_LEAF_CELLS 2
+
+// The tree is rebuilt when its inner boxes grow this much larger against
+// its root than they were at the last build
+#define BVH_REBUILD_RATIO 1.5f
+
+// Deepest a traversal can go, the trees are at most log4 of the leaves deep
+// on a grid and about twice that after a rebuild
+#define BVH_STACK_SIZE 64
+
+//==============================================================================
+// CLASS DEFINITION
+//==============================================================================
+class C_ClothBVH
+{
+public:
+    // An inner node has count children from first on, a leaf has a count of
+    // zero and first is its block of cells
+    struct Node
+    {
+        float lo[3];
+        unsigned first;
+        float hi[3];
+        unsigned count;
+    };
+
+    // The nearest triangle a ray hit, pos = a + u*(b - a) + v*(c - a)
+    struct RayHit
+    {
+        float t, u, v;
+        unsigned triangle;
+    };
+
+private:
+    // Loop bodies handed to the worker pool, defined in clothbvh.cpp
+    struct RefitTask;
+
+    // Hands the triangles of each leaf query() finds on to its functor
+    template<class F>
+    struct LeafTriangles
+    {
+        const C_ClothBVH* bvh;
+        F* f;
+        void operator()(unsigned leaf)
+        {
+            unsigned r0, r1, c0, c1;
+            bvh->getLeafCells(leaf, r0, r1, c0, c1);
+            for(unsigned i = r0; i < r1; ++i)
+                for(unsigned j = c0; j < c1; ++j)
+                {
+                    (*f)(2 * (i * bvh->d_numCellCols + j));
+                    (*f)(2 * (i * bvh->d_numCellCols + j) + 1);
+                }
+        }
+    };
+
+    //----------------------------------------------------------------------
+    // Private Members
+    //----------------------------------------------------------------------
+    std::vector<Node> d_nodes;      // The root is node 0
+    unsigned d_numCol,              // Particles along each row of the grid
+             d_numCellRows, d_numCellCols,
+             d_numLeafRows, d_numLeafCols,
+             d_uTopology,           // The cloth topology the tree was made for
+             d_uRebuilds;           // Rebuilds kept since the grid was set
+
+    // Subtrees that are refit in parallel, each from its root's first child
+    // to the end of its range, and the nodes above them, deepest first
+    std::vector<unsigned> d_subtreeRoots, d_subtreeEnds, d_upperNodes;
+    std::vector<float> d_subtreeArea;   // Area of each subtree's inner boxes
+
+    float d_fBuiltRatio,            // Inner to root area right after the last build
+          d_fRatio;                 // and after the last refit
+
+    // The refit tree while a rebuild is tried, kept if the new one is worse
+    std::vector<Node> d_oldNodes;
+    float d_oldRatio;
+
+    //----------------------------------------------------------------------
+    // Private Methods
+    //----------------------------------------------------------------------
+
+    // Adds the children of node n over the leaf rows [r0, r1) and columns
+    // [c0, c1), then their own children
+    void buildGrid(unsigned n, unsigned r0, unsigned r1, unsigned c0, unsigned c1);
+
+    // Adds the children of node n over the leaves [begin, end) of leaves,
+    // grouped by their centers along the longest axes
+    void buildSpatial(unsigned n, const vector3f* centers, unsigned* leaves, unsigned begin, unsigned end);
+
+    // Finds the subtrees refit() splits over the threads
+    void splitSubtrees();
+
+    // Refits node n from its children, or from the particles for a leaf
+    void refitNode(unsigned n, const C_Vertex* positions, const vector3f* previous, float margin);
+
+    // Refits the subtrees [begin, end), summing the area of their inner boxes
+    void refitRange(unsigned begin, unsigned end, const C_Vertex* positions,
+                    const vector3f* previous, float margin);
+
+    // Rebuilds the tree from the leaf boxes of the last refit
+    void rebuild();
+
+    static float area(const Node& n);
+
+public:
+        //----------------------------------------------------------------------
+        // Public Methods
+        //----------------------------------------------------------------------
+        C_ClothBVH();
+
+        void clear();
+
+        // Builds the tree for a grid of numRow x numCol particles.  The boxes
+        // are empty until the first refit().
+        void build(unsigned numRow, unsigned numCol, unsigned topology);
+
+        // Refits the boxes around the triangles' positions, and around their
+        // previous positions too if previous is not null, grown by margin.
+        // Rebuilds the tree if it got too loose.
+        void refit(const C_Vertex* positions, const vector3f* previous, float margin,
+                   C_WorkerPool& workers);
+
+        bool isBuilt() const { return !d_nodes.empty(); }
+        unsigned getTopology() const { return d_uTopology; }
+        const Node* getNodes() const { return d_nodes.empty() ? 0 : &d_nodes[0]; }
+        unsigned getNodeCount() const { return (unsigned)d_nodes.size(); }
+        unsigned getTriangleCount() const { return d_numCellRows * d_numCellCols * 2; }
+        unsigned getRebuildCount() const { return d_uRebuilds; }
+
+        // The total area of the inner boxes over that of the root, lower is
+        // tighter
+        float getQuality() const { return d_fRatio; }
+
+        // The particles at the corners of triangle t.  Triangle 2k and 2k + 1
+        // split cell k, counted in rows of the grid's cells.
+        void getTriangle(unsigned t, unsigned& a, unsigned& b, unsigned& c) const
+        {
+            const unsigned cell = t >> 1;
+            const unsigned i = cell / d_numCellCols, j = cell - i * d_numCellCols;
+            const unsigned p = i * d_numCol + j;
+            if(t & 1)
+            {
+                a = p + d_numCol;  b = p + d_numCol + 1;  c = p + 1;
+            }
+            else
+            {
+                a = p;  b = p + d_numCol;  c = p + 1;
+            }
+        }
+
+        unsigned getLeafCount() const { return d_numLeafRows * d_numLeafCols; }
+
+        // The cell rows [r0, r1) and columns [c0, c1) of leaf l
+        void getLeafCells(unsigned l, unsigned& r0, unsigned& r1, unsigned& c0, unsigned& c1) const
+        {
+            const unsigned lr = l / d_numLeafCols, lc = l - lr * d_numLeafCols;
+            r0 = lr * BVH_LEAF_CELLS;
+            c0 = lc * BVH_LEAF_CELLS;
+            r1 = r0 + BVH_LEAF_CELLS < d_numCellRows ? r0 + BVH_LEAF_CELLS : d_numCellRows;
+            c1 = c0 + BVH_LEAF_CELLS < d_numCellCols ? c0 + BVH_LEAF_CELLS : d_numCellCols;
+        }
+
+        // Calls f(l) for every leaf l whose box overlaps the box from lo to hi
+        template<class F>
+        void queryLeaves(const vector3f& lo, const vector3f& hi, F& f) const
+        {
+            if(d_nodes.empty())
+                return;
+
+            unsigned stack[BVH_STACK_SIZE], top = 0;
+            stack[top++] = 0;
+            while(top)
+            {
+                const Node& n = d_nodes[stack[--top]];
+                if(lo.x > n.hi[0] || hi.x < n.lo[0] || lo.y > n.hi[1] || hi.y < n.lo[1] ||
+                   lo.z > n.hi[2] || hi.z < n.lo[2])
+                    continue;
+
+                if(n.count)
+                {
+                    for(unsigned k = n.count; k-- > 0; )
+                        if(top < BVH_STACK_SIZE)
+                            stack[top++] = n.first + k;
+                    continue;
+                }
+                f(n.first);
+            }
+        }
+
+        // Calls f(t) for every triangle t in a leaf whose box overlaps the
+        // box from lo to hi.  The triangles themselves are not tested.
+        template<class F>
+        void query(const vector3f& lo, const vector3f& hi, F& f) const
+        {
+            LeafTriangles<F> leaves = { this, &f };
+            queryLeaves(lo, hi, leaves);
+        }
+
+        // Finds the nearest triangle hit by the ray from origin along dir, no
+        // further than maxT times dir.  Returns false if there is none.
+        bool raycast(const C_Vertex* positions, const vector3f& origin, const vector3f& dir,
+                     float maxT, RayHit& hit) const;
+};
+
+
+#endif
@@ -0,0 +1,941 @@
+/*==============================================================================
+/ clothrenderer.cpp
+/ Draws a C_Cloth with openGL.
+/=============================================================================*/
+
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "clothrenderer.h"
+#include "cloth.h"
+#include "Camera3D.h"
+#include "perfprobe.h"
+#include "glee.h"
+#include <GL/gl.h>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+
+// The vertex attributes of the shaders.  The quantized position takes slot
+// 0 in place of gl_Vertex, the others are kept clear of the slots drivers
+// alias to the fixed function arrays.
+#define POSITION_ATTRIB 0
+#define OCT_NORMAL_ATTRIB 5
+#define PREVIOUS_ATTRIB 6
+
+// Bytes a vertex takes in the quantized stream, four 16 bit position
+// components, the last unused to keep the vertices 4 byte aligned, and a
+// normal in two 16 bit components
+#define QUANT_POSITION_SIZE 8
+#define QUANT_NORMAL_SIZE 4
+
+//==============================================================================
+// CONSTRUCTORS / DESTRUCTORS
+//==============================================================================
+
+C_ClothRenderer::C_ClothRenderer() : d_cloth(0), d_uCurrent(0), d_uStaticBufferID(0),
+    d_uIndexBufferID(0), d_uSpringBufferID(0), d_fBlend(1.0f), d_bQuantize(false),
+    d_bInitialized(false), d_bUseBuffers(false), d_bPrimitiveRestart(false), d_bTriangles(false),
+    d_uNormalsFrame(0), d_uTopology(0), d_uEditCount(0), d_uIndexCount(0), d_uSpringIndexCount(0),
+    d_uTileCount(0), d_uTilesDrawn(0)
+{
+    for(unsigned b = 0; b < 2; ++b)
+    {
+        d_uStreamBufferID[b] = d_uStreamFrame[b] = 0;
+        d_bStreamNormals[b] = d_bStreamValid[b] = d_bStreamQuantized[b] = false;
+    }
+    d_blendProgram.id = d_quantProgram.id = 0;
+}
+
+//------------------------------------------------------------------------------
+// Destructor
+// Must be called with a GL context that shares the buffers current.
+//------------------------------------------------------------------------------
+C_ClothRenderer::~C_ClothRenderer()
+{
+    if(d_uStreamBufferID[0])
+        glDeleteBuffers(2, d_uStreamBufferID);
+    if(d_uStaticBufferID)
+        glDeleteBuffers(1, &d_uStaticBufferID);
+    if(d_uIndexBufferID)
+        glDeleteBuffers(1, &d_uIndexBufferID);
+    if(d_uSpringBufferID)
+        glDeleteBuffers(1, &d_uSpringBufferID);
+    if(d_blendProgram.id)
+        glDeleteProgram(d_blendProgram.id);
+    if(d_quantProgram.id)
+        glDeleteProgram(d_quantProgram.id);
+}
+
+
+//==============================================================================
+// ADDITIONAL FUNCTIONS
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Blends the previous and current positions, and lights the cloth the way
+// the fixed function pipeline would with GL_LIGHT0 and two sided lighting.
+// The fragments are left to the fixed function pipeline.
+//
+// Built a second time with QUANTIZED defined, where the positions arrive as
+// normalized 16 bit fractions of each state's bounding box and the normals
+// octahedral encoded.
+//------------------------------------------------------------------------------
+static const char* s_blendShader =
+    "uniform float blend;\n"
+    "uniform bool lighting;\n"
+    "attribute vec3 previous;\n"
+    "#ifdef QUANTIZED\n"
+    "uniform vec3 posMin, posExtent, prevMin, prevExtent;\n"
+    "attribute vec3 position;\n"
+    "attribute vec2 octNormal;\n"
+    "vec3 currentPosition() { return posMin + position * posExtent; }\n"
+    "vec3 previousPosition() { return prevMin + previous * prevExtent; }\n"
+    "vec3 vertexNormal()\n"
+    "{\n"
+    "    vec3 n = vec3(octNormal, 1.0 - abs(octNormal.x) - abs(octNormal.y));\n"
+    "    if(n.z < 0.0)\n"
+    "    {\n"
+    "        vec2 s = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);\n"
+    "        n.xy = (1.0 - abs(n.yx)) * s;\n"
+    "    }\n"
+    "    return n;\n"
+    "}\n"
+    "#else\n"
+    "vec3 currentPosition() { return gl_Vertex.xyz; }\n"
+    "vec3 previousPosition() { return previous; }\n"
+    "vec3 vertexNormal() { return gl_Normal; }\n"
+    "#endif\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 pos = vec4(mix(previousPosition(), currentPosition(), blend), 1.0);\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * pos;\n"
+    "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+    "    gl_FrontColor = gl_BackColor = gl_Color;\n"
+    "    if(lighting)\n"
+    "    {\n"
+    "        vec3 eye = vec3(gl_ModelViewMatrix * pos);\n"
+    "        vec4 lp = gl_LightSource[0].position;\n"
+    "        vec3 l = normalize(lp.w == 0.0 ? lp.xyz : lp.xyz - eye);\n"
+    "        float d = dot(normalize(gl_NormalMatrix * vertexNormal()), l);\n"
+    "        vec4 ambient = gl_LightModel.ambient + gl_LightSource[0].ambient;\n"
+    "        gl_FrontColor = gl_Color * (ambient + gl_LightSource[0].diffuse * max(d, 0.0));\n"
+    "        gl_BackColor = gl_Color * (ambient + gl_LightSource[0].diffuse * max(-d, 0.0));\n"
+    "        gl_FrontColor.a = gl_BackColor.a = gl_Color.a;\n"
+    "    }\n"
+    "}\n";
+
+//------------------------------------------------------------------------------
+// Writes n positions, read every stride floats from src, as 16 bit fractions
+// of their bounding box, which is returned in min and extent.
+//------------------------------------------------------------------------------
+static void quantizePositions(const float* src, unsigned stride, unsigned n, unsigned short* dst,
+                              float* min, float* extent)
+{
+    float max[3];
+    for(unsigned k = 0; k < 3; ++k)
+        min[k] = max[k] = src[k];
+    for(unsigned i = 0; i < n; ++i)
+    {
+        const float* p = src + i*stride;
+        for(unsigned k = 0; k < 3; ++k)
+        {
+            min[k] = p[k] < min[k] ? p[k] : min[k];
+            max[k] = p[k] > max[k] ? p[k] : max[k];
+        }
+    }
+
+    float scale[3];
+    for(unsigned k = 0; k < 3; ++k)
+    {
+        extent[k] = max[k] - min[k];
+        scale[k] = extent[k] > 0.0f ? 65535.0f / extent[k] : 0.0f;
+    }
+
+    for(unsigned i = 0; i < n; ++i, dst += 4)
+    {
+        const float* p = src + i*stride;
+        dst[0] = (unsigned short)((p[0] - min[0]) * scale[0] + 0.5f);
+        dst[1] = (unsigned short)((p[1] - min[1]) * scale[1] + 0.5f);
+        dst[2] = (unsigned short)((p[2] - min[2]) * scale[2] + 0.5f);
+        dst[3] = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Octahedral encodes the normals of n vertices into pairs of 16 bit snorms.
+// The unit sphere is projected onto an octahedron and the lower half folded
+// over the upper, so the pair covers every direction evenly.
+//------------------------------------------------------------------------------
+static void encodeNormals(const C_Vertex* v, unsigned n, short* dst)
+{
+    for(unsigned i = 0; i < n; ++i, dst += 2)
+    {
+        const vector3f& nv = v[i].norm;
+        float sum = fabsf(nv.x) + fabsf(nv.y) + fabsf(nv.z);
+        float inv = sum > 0.0f ? 1.0f / sum : 0.0f;
+        float x = nv.x * inv, y = nv.y * inv;
+        if(nv.z < 0.0f)
+        {
+            float fx = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+            float fy = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+            x = fx;
+            y = fy;
+        }
+        dst[0] = (short)(x * 32767.0f + (x >= 0.0f ? 0.5f : -0.5f));
+        dst[1] = (short)(y * 32767.0f + (y >= 0.0f ? 0.5f : -0.5f));
+    }
+}
+
+// Marks the end of a strip when primitive restart is available
+#define STRIP_RESTART_INDEX 0xFFFFFFFFu
+
+// Size on screen, in pixels, a grid cell of the drawn level should not grow
+// past, and how far past a level boundary the camera must move before the
+// level changes, in levels
+#define LOD_CELL_PIXELS 6.0f
+#define LOD_HYSTERESIS 0.25f
+
+// Every level must keep the rows and columns on the tile borders
+#if CLOTH_TILE_CELLS % (1 << (LOD_LEVELS - 1))
+#error CLOTH_TILE_CELLS must be a multiple of the coarsest level of detail step
+#endif
+
+//------------------------------------------------------------------------------
+// Appends triangle strips over every step'th row and column of the vertex
+// rows [r0, r1] and columns [c0, c1] of a grid stored in row major order with
+// cols columns, one strip per row of quads.  The last row and column are
+// always kept, so every level of detail covers the whole rectangle and
+// shares its outline with the others.
+//
+// The strips are separated by the restart index if restart is true,
+// otherwise they are joined into a single strip by repeating the last index
+// of one row and the first of the next, which adds degenerate triangles the
+// GPU throws away.  Each row has an even number of indices so the winding is
+// the same in every row.
+//
+// The triangles match the ones the springs were built around, quad (i, j)
+// is split along the diagonal from (i, j+1) to (i+1, j).
+//------------------------------------------------------------------------------
+static void appendGridStrips(unsigned cols, unsigned r0, unsigned r1, unsigned c0, unsigned c1,
+                             unsigned step, bool restart, std::vector<unsigned>& out)
+{
+    if(r1 <= r0 || c1 <= c0)
+        return;
+
+    const size_t first = out.size();
+    for(unsigned i = r0; i < r1; )
+    {
+        unsigned next = i + step < r1 ? i + step : r1;
+        if(out.size() > first)
+        {
+            if(restart)
+                out.push_back(STRIP_RESTART_INDEX);
+            else
+            {
+                out.push_back(out.back());
+                out.push_back(i * cols + c0);
+            }
+        }
+        for(unsigned j = c0; ; )
+        {
+            out.push_back(i * cols + j);
+            out.push_back(next * cols + j);
+            if(j == c1)
+                break;
+            j = j + step < c1 ? j + step : c1;
+        }
+        i = next;
+    }
+}
+
+
+//==============================================================================
+// PRIVATE METHODS
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// void initGL()
+//
+// Creates the buffers the first time something is drawn, when a context is
+// current.  Drivers without vertex buffers fall back to client side arrays.
+//------------------------------------------------------------------------------
+void C_ClothRenderer::initGL()
+{
+    d_bInitialized = true;
+    d_bUseBuffers = GLEE_VERSION_1_5 || GLEE_ARB_vertex_buffer_object;
+    d_bPrimitiveRestart = GLEE_NV_primitive_restart;
+    if(!d_bUseBuffers)
+        return;
+
+    glGenBuffers(2, d_uStreamBufferID);
+    glGenBuffers(1, &d_uStaticBufferID);
+    glGenBuffers(1, &d_uIndexBufferID);
+    glGenBuffers(1, &d_uSpringBufferID);
+
+    if(GLEE_VERSION_2_0)
+    {
+        initProgram(d_blendProgram, false);
+        initProgram(d_quantProgram, true);
+    }
+}
+
+//------------------------------------------------------------------------------
+// bool initProgram()
+//
+// Builds one of the shaders.  If it fails to build the renderer carries on
+// without it, drawing the current frame from floats.
+//------------------------------------------------------------------------------
+bool C_ClothRenderer::initProgram(ShaderProgram& p, bool quantized)
+{
+    const char* source[2] = { quantized ? "#define QUANTIZED\n" : "", s_blendShader };
+
+    GLint ok = 0;
+    GLuint shader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(shader, 2, source, 0);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if(!ok)
+    {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), 0, log);
+        fprintf(stderr, "cloth shader: %s\n", log);
+        glDeleteShader(shader);
+        return false;
+    }
+
+    p.id = glCreateProgram();
+    glAttachShader(p.id, shader);
+    glBindAttribLocation(p.id, PREVIOUS_ATTRIB, "previous");
+    if(quantized)
+    {
+        glBindAttribLocation(p.id, POSITION_ATTRIB, "position");
+        glBindAttribLocation(p.id, OCT_NORMAL_ATTRIB, "octNormal");
+    }
+    glLinkProgram(p.id);
+    glDeleteShader(shader);     // Freed with the program
+    glGetProgramiv(p.id, GL_LINK_STATUS, &ok);
+    if(!ok)
+    {
+        glDeleteProgram(p.id);
+        p.id = 0;
+        return false;
+    }
+
+    p.blendLoc = glGetUniformLocation(p.id, "blend");
+    p.lightingLoc = glGetUniformLocation(p.id, "lighting");
+    p.posMinLoc = glGetUniformLocation(p.id, "posMin");
+    p.posExtentLoc = glGetUniformLocation(p.id, "posExtent");
+    p.prevMinLoc = glGetUniformLocation(p.id, "prevMin");
+    p.prevExtentLoc = glGetUniformLocation(p.id, "prevExtent");
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// void buildStatic()
+//
+// Builds everything that only depends on the cloth's topology, the texture
+// coordinates, the strip indices of every tile and level and the spring
+// lines.  Runs once per initialize() of the cloth.  A mesh cloth is drawn
+// from its own triangles as one tile, and every level of detail is the whole
+// mesh.  The texture coordinates and spring lines are made for all the room
+// the cloth has.
+//------------------------------------------------------------------------------
+void C_ClothRenderer::buildStatic()
+{
+    const unsigned n = d_cloth->getParticleCount();
+    const unsigned capacity = d_cloth->getParticleCapacity();
+
+    d_bTriangles = d_cloth->getTriangleCount() != 0;
+    if(d_bTriangles)
+    {
+        const unsigned count = d_cloth->getTriangleCount() * 3;
+        d_indices.assign(d_cloth->getTriangles(), d_cloth->getTriangles() + count);
+        d_uTileCount = 1;
+        d_tileFirst.assign(LOD_LEVELS, 0);
+        d_tileCount.assign(LOD_LEVELS, count);
+    }
+    else
+    {
+        // Every level goes into the one index buffer, finest first, and within
+        // a level the tiles follow each other in row major order.  The tiles of
+        // a level are joined the same way as the rows of a tile, so a run of
+        // neighbouring tiles can be drawn as one range.
+        const unsigned rows = d_cloth->getNumRows(), cols = d_cloth->getNumCols();
+        const unsigned tileRows = d_cloth->getTileRows(), tileCols = d_cloth->getTileCols();
+        d_uTileCount = tileRows * tileCols;
+        d_tileFirst.resize(LOD_LEVELS * d_uTileCount);
+        d_tileCount.resize(LOD_LEVELS * d_uTileCount);
+        d_indices.clear();
+        for(unsigned l = 0; l < LOD_LEVELS; ++l)
+        {
+            const size_t levelStart = d_indices.size();
+            for(unsigned t = 0; t < d_uTileCount; ++t)
+            {
+                const unsigned r0 = (t / tileCols) * CLOTH_TILE_CELLS, c0 = (t % tileCols) * CLOTH_TILE_CELLS;
+                const unsigned r1 = r0 + CLOTH_TILE_CELLS < rows - 1 ? r0 + CLOTH_TILE_CELLS : rows - 1;
+                const unsigned c1 = c0 + CLOTH_TILE_CELLS < cols - 1 ? c0 + CLOTH_TILE_CELLS : cols - 1;
+                if(d_indices.size() > levelStart)
+                {
+                    if(d_bPrimitiveRestart)
+                        d_indices.push_back(STRIP_RESTART_INDEX);
+                    else
+                    {
+                        d_indices.push_back(d_indices.back());
+                        d_indices.push_back(r0 * cols + c0);
+                    }
+                }
+                const unsigned k = l * d_uTileCount + t;
+                d_tileFirst[k] = (unsigned)d_indices.size();
+                appendGridStrips(cols, r0, r1, c0, c1, 1u << l, d_bPrimitiveRestart, d_indices);
+                d_tileCount[k] = (unsigned)d_indices.size() - d_tileFirst[k];
+            }
+        }
+    }
+    d_uIndexCount = (unsigned)d_indices.size();
+
+    const unsigned numSprings = d_cloth->getSpringSlotCount();
+    const unsigned* p1 = d_cloth->getSpringP1();
+    const unsigned* p2 = d_cloth->getSpringP2();
+    d_springIndices.resize(numSprings * 2);
+    for(unsigned s = 0; s < numSprings; ++s)
+    {
+        d_springIndices[s*2] = p1[s];
+        d_springIndices[s*2+1] = p2[s];
+    }
+    d_uSpringIndexCount = numSprings * 2;
+    if(d_cloth->canTear())
+        d_springEdit.reserve(d_uSpringIndexCount);
+
+    // Any states in the stream buffers belong to the old cloth
+    d_uTopology = d_cloth->getTopology();
+    d_uEditCount = d_cloth->getEditCount();
+    d_bStreamValid[0] = d_bStreamValid[1] = false;
+    if(!d_bUseBuffers)
+        return;
+
+    std::vector<float> tex(capacity * 2, 0.0f);
+    const C_Vertex* v = d_cloth->getVertices();
+    for(unsigned i = 0; i < n; ++i)
+    {
+        tex[i*2] = v[i].s0;
+        tex[i*2+1] = v[i].t0;
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, d_uStaticBufferID);
+    glBufferData(GL_ARRAY_BUFFER, tex.size() * sizeof(float), &tex[0], GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, d_uIndexBufferID);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, d_uIndexCount * sizeof(unsigned),
+                 d_uIndexCount ? &d_indices[0] : 0, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, d_uSpringBufferID);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, d_uSpringIndexCount * sizeof(unsigned),
+                 d_uSpringIndexCount ? &d_springIndices[0] : 0, GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    // The GPU has its own copy now
+    std::vector<unsigned>().swap(d_indices);
+    std::vector<unsigned>().swap(d_springIndices);
+}
+
+//------------------------------------------------------------------------------
+// void applyEdits()
+//
+// Catches up with the changes tearing made since the buffers were last
+// written, each read from the cloth as it is now.  A renderer that fell
+// more than the cloth's log behind builds everything again.  A new particle
+// changes the layout of the stream buffers, so the states in them are
+// dropped and uploaded again.
+//------------------------------------------------------------------------------
+void C_ClothRenderer::applyEdits()
+{
+    const unsigned count = d_cloth->getEditCount();
+    if(count - d_uEditCount > CLOTH_EDIT_LOG)
+    {
+        buildStatic();
+        return;
+    }
+
+    const unsigned* triangles = d_cloth->getTriangles();
+    const unsigned* p1 = d_cloth->getSpringP1();
+    const unsigned* p2 = d_cloth->getSpringP2();
+    const C_Vertex* v = d_cloth->getVertices();
+    for(; d_uEditCount != count; ++d_uEditCount)
+    {
+        const C_Cloth::Edit& e = d_cloth->getEdit(d_uEditCount);
+        if(e.kind == C_Cloth::EDIT_PARTICLE)
+        {
+            d_bStreamValid[0] = d_bStreamValid[1] = false;
+            if(!d_bUseBuffers)
+                continue;
+            const float tex[2] = { v[e.first].s0, v[e.first].t0 };
+            glBindBuffer(GL_ARRAY_BUFFER, d_uStaticBufferID);
+            glBufferSubData(GL_ARRAY_BUFFER, e.first * sizeof(tex), sizeof(tex), tex);
+        }
+        else if(e.kind == C_Cloth::EDIT_TRIANGLE)
+        {
+            const unsigned* t = triangles + e.first * 3;
+            if(!d_bUseBuffers)
+            {
+                std::copy(t, t + 3, d_indices.begin() + e.first * 3);
+                continue;
+            }
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, d_uIndexBufferID);
+            glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, e.first * 3 * sizeof(unsigned), 3 * sizeof(unsigned), t);
+        }
+        else
+        {
+            unsigned* lines = &d_springIndices[0] + e.first * 2;
+            if(d_bUseBuffers)
+            {
+                d_springEdit.resize(e.count * 2);
+                lines = &d_springEdit[0];
+            }
+            for(unsigned s = 0; s < e.count; ++s)
+            {
+                lines[s*2] = p1[e.first + s];
+                lines[s*2+1] = p2[e.first + s];
+            }
+            if(!d_bUseBuffers)
+                continue;
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, d_uSpringBufferID);
+            glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, e.first * 2 * sizeof(unsigned), e.count * 2 * sizeof(unsigned), lines);
+        }
+    }
+    if(d_bUseBuffers)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+}
+
+void C_ClothRenderer::packVertices(void* dst, unsigned b, bool previous, bool normals)
+{
+    const C_Vertex* v = d_cloth->getVertices();
+    const unsigned n = d_cloth->getParticleCount();
+
+    if(d_bStreamQuantized[b])
+    {
+        unsigned short* pos = static_cast<unsigned short*>(dst);
+        if(previous)
+            quantizePositions(&d_cloth->getPreviousPositions()->x, 3, n, pos, d_streamMin[b], d_streamExtent[b]);
+        else
+            quantizePositions(&v->pos.x, sizeof(C_Vertex) / sizeof(float), n, pos, d_streamMin[b], d_streamExtent[b]);
+        if(normals)
+            encodeNormals(v, n, reinterpret_cast<short*>(pos + n*4));
+        return;
+    }
+
+    float* out = static_cast<float*>(dst);
+    if(previous)
+    {
+        memcpy(out, d_cloth->getPreviousPositions(), n * sizeof(vector3f));
+        out += n * 3;
+    }
+    else
+    {
+        for(unsigned i = 0; i < n; ++i, out += 3)
+        {
+            out[0] = v[i].pos.x;
+            out[1] = v[i].pos.y;
+            out[2] = v[i].pos.z;
+        }
+    }
+    if(normals)
+    {
+        for(unsigned i = 0; i < n; ++i, out += 3)
+        {
+            out[0] = v[i].norm.x;
+            out[1] = v[i].norm.y;
+            out[2] = v[i].norm.z;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// void writeStream()
+//
+// Fills stream buffer b.  The old storage is orphaned with glBufferData so
+// the driver never waits for draws still reading it, then the new data is
+// written through a mapping.
+//------------------------------------------------------------------------------
+void C_ClothRenderer::writeStream(unsigned b, bool previous, bool normals)
+{
+    PERF_SCOPE(PERF_UPLOAD);
+    const unsigned n = d_cloth->getParticleCount();
+
+    d_bStreamQuantized[b] = isQuantized();
+    const GLsizeiptr size = d_bStreamQuantized[b] ?
+                n * (QUANT_POSITION_SIZE + (normals ? QUANT_NORMAL_SIZE : 0)) :
+                n * 3 * sizeof(float) * (normals ? 2 : 1);
+
+    glBindBuffer(GL_ARRAY_BUFFER, d_uStreamBufferID[b]);
+    glBufferData(GL_ARRAY_BUFFER, size, 0, GL_STREAM_DRAW);
+
+    // The storage was just orphaned, so mapping it does not wait on the GPU
+    void* dst = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
+
+    if(dst)
+    {
+        packVertices(dst, b, previous, normals);
+        if(!glUnmapBuffer(GL_ARRAY_BUFFER))
+            dst = 0;    // The storage was lost, write it again below
+    }
+    if(!dst)
+    {
+        d_staging.resize(size / sizeof(float));
+        packVertices(&d_staging[0], b, previous, normals);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, &d_staging[0]);
+    }
+    d_bStreamNormals[b] = normals;
+    d_bStreamValid[b] = true;
+}
+
+//------------------------------------------------------------------------------
+// bool upload()
+//
+// Streams the cloth's current frame into the older of the two stream
+// buffers if it has stepped since the last upload.  When the frames are
+// drawn one after the other the other buffer already holds the previous
+// frame, otherwise, and only if blending, the previous positions are
+// uploaded into it as well.
+//------------------------------------------------------------------------------
+bool C_ClothRenderer::upload(bool normals)
+{
+    if(!d_cloth || !d_cloth->getParticleCount())
+        return false;
+    if(!d_bInitialized)
+        initGL();
+    if(d_uTopology != d_cloth->getTopology())
+        buildStatic();
+    else if(d_uEditCount != d_cloth->getEditCount())
+        applyEdits();
+    if(!d_bUseBuffers)
+    {
+        if(normals)
+            d_cloth->updateNormals();
+        return true;
+    }
+
+    const unsigned frame = d_cloth->getFrame();
+    const unsigned cur = d_uCurrent;
+
+    // States in the other format are of no use
+    for(unsigned b = 0; b < 2; ++b)
+        if(d_bStreamQuantized[b] != isQuantized())
+            d_bStreamValid[b] = false;
+
+    // Several viewports may draw the same frame, some shaded and some not.
+    // If any of them wanted normals for the last frame they are sent with
+    // the first upload of this one, rather than uploading twice.
+    const bool wantedNormals = d_bStreamValid[cur] && d_uNormalsFrame == d_uStreamFrame[cur];
+    if(normals)
+        d_uNormalsFrame = frame;
+
+    if(d_bStreamValid[cur] && d_uStreamFrame[cur] == frame)
+    {
+        // Only the normals are missing, the frame is written again in place
+        if(normals && !d_bStreamNormals[cur])
+        {
+            d_cloth->updateNormals();
+            writeStream(cur, false, true);
+        }
+        return true;
+    }
+
+    normals = normals || wantedNormals;
+    if(normals)
+        d_cloth->updateNormals();
+
+    if(canBlend() && (!d_bStreamValid[cur] || d_uStreamFrame[cur] != frame - 1))
+    {
+        writeStream(cur, true, false);
+        d_uStreamFrame[cur] = frame - 1;
+    }
+
+    d_uCurrent = cur ^ 1;
+    writeStream(d_uCurrent, false, normals);
+    d_uStreamFrame[d_uCurrent] = frame;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// void bindPositions()
+//
+// Points the vertex arrays at the current state, with its normals if
+// lighting.  Float states go through the fixed function arrays and only use
+// the blending shader when the blend is below 1 and the previous frame is
+// uploaded.  Quantized states always go through their shader.
+//------------------------------------------------------------------------------
+void C_ClothRenderer::bindPositions(bool lighting)
+{
+    if(!d_bUseBuffers)
+    {
+        const C_Vertex* v = d_cloth->getVertices();
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, sizeof(C_Vertex), v);
+        if(lighting)
+        {
+            glEnableClientState(GL_NORMAL_ARRAY);
+            glNormalPointer(GL_FLOAT, sizeof(C_Vertex), &v->norm);
+        }
+        return;
+    }
+
+    const unsigned cur = d_uCurrent, prev = cur ^ 1;
+    const unsigned n = d_cloth->getParticleCount();
+    const bool quantized = d_bStreamQuantized[cur];
+    const bool blend = d_fBlend < 1.0f && d_bStreamValid[prev] &&
+                       d_uStreamFrame[prev] == d_uStreamFrame[cur] - 1;
+
+    glBindBuffer(GL_ARRAY_BUFFER, d_uStreamBufferID[cur]);
+    if(quantized)
+    {
+        glEnableVertexAttribArray(POSITION_ATTRIB);
+        glVertexAttribPointer(POSITION_ATTRIB, 3, GL_UNSIGNED_SHORT, GL_TRUE, QUANT_POSITION_SIZE, BUFFER_OFFSET(0));
+        if(lighting)
+        {
+            glEnableVertexAttribArray(OCT_NORMAL_ATTRIB);
+            glVertexAttribPointer(OCT_NORMAL_ATTRIB, 2, GL_SHORT, GL_TRUE, 0, BUFFER_OFFSET(n * QUANT_POSITION_SIZE));
+        }
+    }
+    else
+    {
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, BUFFER_OFFSET(0));
+        if(lighting)
+        {
+            glEnableClientState(GL_NORMAL_ARRAY);
+            glNormalPointer(GL_FLOAT, 0, BUFFER_OFFSET(n * 3 * sizeof(float)));
+        }
+    }
+
+    const ShaderProgram* p = quantized ? &d_quantProgram : (blend && canBlend() ? &d_blendProgram : 0);
+    if(!p)
+        return;
+
+    glUseProgram(p->id);
+    glUniform1f(p->blendLoc, blend ? d_fBlend : 1.0f);
+    glUniform1i(p->lightingLoc, lighting);
+    if(lighting)
+        glEnable(GL_VERTEX_PROGRAM_TWO_SIDE);
+    if(quantized)
+    {
+        glUniform3fv(p->posMinLoc, 1, d_streamMin[cur]);
+        glUniform3fv(p->posExtentLoc, 1, d_streamExtent[cur]);
+        glUniform3fv(p->prevMinLoc, 1, d_streamMin[prev]);
+        glUniform3fv(p->prevExtentLoc, 1, d_streamExtent[prev]);
+    }
+
+    if(blend)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, d_uStreamBufferID[prev]);
+        glEnableVertexAttribArray(PREVIOUS_ATTRIB);
+        if(quantized)
+            glVertexAttribPointer(PREVIOUS_ATTRIB, 3, GL_UNSIGNED_SHORT, GL_TRUE, QUANT_POSITION_SIZE, BUFFER_OFFSET(0));
+        else
+            glVertexAttribPointer(PREVIOUS_ATTRIB, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+        glBindBuffer(GL_ARRAY_BUFFER, d_uStreamBufferID[cur]);
+    }
+}
+
+void C_ClothRenderer::releasePositions()
+{
+    if(d_blendProgram.id || d_quantProgram.id)
+    {
+        glDisableVertexAttribArray(POSITION_ATTRIB);
+        glDisableVertexAttribArray(OCT_NORMAL_ATTRIB);
+        glDisableVertexAttribArray(PREVIOUS_ATTRIB);
+        glDisable(GL_VERTEX_PROGRAM_TWO_SIDE);
+        glUseProgram(0);
+    }
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if(d_bUseBuffers)
+    {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+
+//==============================================================================
+// PUBLIC METHODS
+//==============================================================================
+
+void C_ClothRenderer::setCloth(C_Cloth* c)
+{
+    d_cloth = c;
+    d_bStreamValid[0] = d_bStreamValid[1] = false;
+    d_uNormalsFrame = 0;
+    d_uTopology = 0;
+}
+
+
+//------------------------------------------------------------------------------
+// unsigned selectLod()
+//
+// Picks the coarsest level whose cells stay below LOD_CELL_PIXELS on screen
+// at the point of the cloth nearest the eye.  pixelsPerUnit is the size on
+// screen of one unit at a distance of one, the viewport height over twice
+// the tangent of half the vertical field of view.  The level only moves
+// away from current once the camera is LOD_HYSTERESIS of a level past the
+// boundary, so it does not flicker when the camera rests on one.
+//
+// The whole cloth is drawn at the one level, so neighbouring triangles
+// always share their edges and the surface never cracks.
+//------------------------------------------------------------------------------
+unsigned C_ClothRenderer::selectLod(const vector3f& eye, float pixelsPerUnit, unsigned current) const
+{
+    if(!d_cloth || !d_cloth->getParticleCount() || pixelsPerUnit <= 0.0f)
+        return 0;
+
+    // Distance from the eye to the bounding box, zero inside it
+    float d[3];
+    const float* e = &eye.x;
+    const float* lo = &d_cloth->getBounds().min.x;
+    const float* hi = &d_cloth->getBounds().max.x;
+    for(unsigned k = 0; k < 3; ++k)
+        d[k] = e[k] < lo[k] ? lo[k] - e[k] : (e[k] > hi[k] ? e[k] - hi[k] : 0.0f);
+    const float dist = sqrtf(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+
+    const float cellPixels = d_cloth->getCellSize() * pixelsPerUnit / (dist > 1e-6f ? dist : 1e-6f);
+    if(cellPixels >= LOD_CELL_PIXELS)
+        return 0;
+
+    // Levels of decimation the screen can afford, fractional
+    const float level = log2f(LOD_CELL_PIXELS / cellPixels);
+    if(current < LOD_LEVELS && level >= current - LOD_HYSTERESIS && level < current + 1 + LOD_HYSTERESIS)
+        return current;
+    return level >= LOD_LEVELS - 1 ? LOD_LEVELS - 1 : (unsigned)level;
+}
+
+
+//------------------------------------------------------------------------------
+// void draw()
+//
+// Draws the cloth as triangle strips at the given level of detail, or a
+// mesh cloth as its triangles.  If a camera is given only the tiles whose
+// boxes touch its view frustum are drawn, each run of neighbouring tiles as
+// one range of the index buffer, all of them with one glMultiDrawElements()
+// call.  With every tile in view that is a single range.  If shading is true
+// the cloth is lit from both sides by GL_LIGHT0.
+//------------------------------------------------------------------------------
+void C_ClothRenderer::draw(bool shading, unsigned lod, const Camera3D* camera)
+{
+    if(!upload(shading) || !d_uIndexCount)
+        return;
+    if(lod >= LOD_LEVELS)
+        lod = LOD_LEVELS - 1;
+
+    const char* indices = d_bUseBuffers ? BUFFER_OFFSET(0) : (const char*)&d_indices[0];
+    const ClothBounds* bounds = d_bTriangles ? &d_cloth->getBounds() : d_cloth->getTileBounds();
+    const unsigned base = lod * d_uTileCount;
+    d_drawCount.clear();
+    d_drawOffset.clear();
+    d_uTilesDrawn = 0;
+    for(unsigned t = 0, last = ~0u; t < d_uTileCount; ++t)
+    {
+        if(camera && !camera->isBoxVisible(bounds[t].min, bounds[t].max))
+            continue;
+        const unsigned first = d_tileFirst[base + t], end = first + d_tileCount[base + t];
+        if(last + 1 == t)
+            d_drawCount.back() = end - (unsigned)((d_drawOffset.back() - indices) / sizeof(unsigned));
+        else
+        {
+            d_drawCount.push_back(d_tileCount[base + t]);
+            d_drawOffset.push_back(indices + first * sizeof(unsigned));
+        }
+        last = t;
+        ++d_uTilesDrawn;
+    }
+    if(d_drawCount.empty())
+        return;
+
+    bindPositions(shading);
+    if(shading)
+    {
+        glPushAttrib(GL_ENABLE_BIT | GL_LIGHTING_BIT);
+        glEnable(GL_LIGHTING);
+        glEnable(GL_LIGHT0);
+        glEnable(GL_COLOR_MATERIAL);
+        glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+    }
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    if(d_bUseBuffers)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, d_uStaticBufferID);
+        glTexCoordPointer(2, GL_FLOAT, 0, BUFFER_OFFSET(0));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, d_uIndexBufferID);
+    }
+    else
+        glTexCoordPointer(2, GL_FLOAT, sizeof(C_Vertex), &d_cloth->getVertices()->s0);
+
+    const bool restart = d_bPrimitiveRestart && !d_bTriangles;
+    if(restart)
+    {
+        glEnableClientState(GL_PRIMITIVE_RESTART_NV);
+        glPrimitiveRestartIndexNV(STRIP_RESTART_INDEX);
+    }
+
+    const GLenum mode = d_bTriangles ? GL_TRIANGLES : GL_TRIANGLE_STRIP;
+    const GLsizei runs = (GLsizei)d_drawCount.size();
+    if(runs > 1 && GLEE_VERSION_1_4)
+        glMultiDrawElements(mode, &d_drawCount[0], GL_UNSIGNED_INT,
+                            (const GLvoid**)&d_drawOffset[0], runs);
+    else
+    {
+        for(GLsizei r = 0; r < runs; ++r)
+            glDrawElements(mode, d_drawCount[r], GL_UNSIGNED_INT, d_drawOffset[r]);
+    }
+
+    if(restart)
+        glDisableClientState(GL_PRIMITIVE_RESTART_NV);
+    if(shading)
+        glPopAttrib();
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    releasePositions();
+}
+
+
+//------------------------------------------------------------------------------
+// void drawParticles()
+//
+// Draws the particles as red points.  Locked particles are displayed as green
+//------------------------------------------------------------------------------
+void C_ClothRenderer::drawParticles()
+{
+    if(!upload(false))
+        return;
+
+    glColor3f(1.0, 0.0, 0.0);
+    bindPositions(false);
+    glDrawArrays(GL_POINTS, 0, d_cloth->getParticleCount());
+    releasePositions();
+    glColor3f(1.0, 1.0, 1.0);
+}
+
+
+//------------------------------------------------------------------------------
+// void drawMesh()
+//
+// Draws the springs as blue lines with one glDrawElements() call over the
+// spring index buffer.
+//------------------------------------------------------------------------------
+void C_ClothRenderer::drawMesh()
+{
+    if(!upload(false) || !d_uSpringIndexCount)
+        return;
+
+    glColor3f(0.0, 0.0, 1.0);
+    bindPositions(false);
+    if(d_bUseBuffers)
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, d_uSpringBufferID);
+
+    const void* indices = d_bUseBuffers ? BUFFER_OFFSET(0) : (const char*)&d_springIndices[0];
+    glDrawElements(GL_LINES, d_uSpringIndexCount, GL_UNSIGNED_INT, indices);
+
+    releasePositions();
+    glColor3f(1.0, 1.0, 1.0);
+}
@@ -0,0 +1,194 @@
+/*==============================================================================
+/ clothrenderer.h
+/ Draws a C_Cloth with openGL.  Kept apart from the simulation so that the
+/ solver can be built without any GL or Qt dependency.
+/
+/ The particle data is streamed into a vertex buffer once per simulation
+/ frame, no matter how many of the draw functions use it.  Positions, and
+/ normals when a draw needs them, are packed tightly into the stream buffer;
+/ the texture coordinates never change and live in a static buffer.
+/
+/ For large cloths the stream can be quantized: positions become 16 bit
+/ fractions of the frame's bounding box and normals are octahedral encoded in
+/ 32 bits, 12 bytes a vertex instead of 24.  The shader decodes them.
+/
+/ The renderer keeps the last two simulation frames and can draw the cloth
+/ anywhere between them, so the display is smooth when it runs at a
+/ different rate to the simulation.  The blend is done by a vertex shader.
+/
+/ One renderer can serve several viewports as long as their GL contexts
+/ share objects, the cloth is then uploaded once per frame for all of them.
+/
+/ The cloth surface is drawn from a static index buffer of triangle strips
+/ that is built once per cloth topology, so drawing it is one glDrawElements()
+/ call whatever the size of the grid.  The buffer holds the grid at several
+/ levels of detail, every 2nd, 4th and 8th row and column, over the same
+/ vertices, and a far away cloth is drawn from a coarser level.  Each level
+/ is laid out tile by tile following the cloth's tiles, so the tiles outside
+/ a camera's view can be left out of the draw.  The springs are drawn the
+/ same way from a GL_LINES index buffer over the same positions.
+/
+/ A cloth built from a mesh has no grid, its own triangles are drawn as they
+/ are at every level of detail, as a single tile.  When such a cloth tears
+/ the triangles, springs and texture coordinates it changed are written over
+/ in place with glBufferSubData(), see C_Cloth::getEdit().  The static
+/ buffers are made for all the particles and springs the cloth has room
+/ for, so a tear never makes them grow.
+/=============================================================================*/
+
+#ifndef _CLOTHRENDERER_
+#define _CLOTHRENDERER_
+
+#include "vector3.h"
+#include <vector>
+
+class C_Cloth;
+class Camera3D;
+
+// Levels of detail of the cloth surface, level l draws every 2^l'th row and
+// column of the grid
+#define LOD_LEVELS 4
+
+//==============================================================================
+// CLASS DEFINITION
+//==============================================================================
+class C_ClothRenderer
+{
+private:
+    //----------------------------------------------------------------------
+    // Private Members
+    //----------------------------------------------------------------------
+    C_Cloth *d_cloth;               // The cloth being drawn, its normals are
+                                    // filled in on demand
+
+    // A vertex shader and the locations of its uniforms
+    struct ShaderProgram
+    {
+        unsigned id;
+        int blendLoc, lightingLoc;
+        int posMinLoc, posExtentLoc, prevMinLoc, prevExtentLoc;    // Quantized only
+    };
+
+    // The last two simulation states, d_uCurrent is the newest.  Each holds
+    // positions, then normals if a draw needed them.
+    unsigned d_uStreamBufferID[2],
+             d_uStreamFrame[2];     // The cloth frame each one holds
+    bool d_bStreamNormals[2],       // Each one holds normals
+         d_bStreamValid[2],         // Each one holds a state of the current cloth
+         d_bStreamQuantized[2];     // Each one is in the quantized format
+    float d_streamMin[2][3],        // Bounding box each quantized state is relative to
+          d_streamExtent[2][3];
+    unsigned d_uCurrent;
+
+    unsigned d_uStaticBufferID,     // Texture coordinates
+             d_uIndexBufferID,      // Triangle strips over the grid
+             d_uSpringBufferID;     // Line pairs, one per spring
+
+    // Blends the two float states, and decodes and blends the quantized
+    // ones.  Their ids are zero without GLSL.
+    ShaderProgram d_blendProgram, d_quantProgram;
+    float d_fBlend;                 // 0 draws the previous state, 1 the current
+    bool d_bQuantize;               // Stream the quantized format if the shader built
+
+    bool d_bInitialized,            // GL objects created
+         d_bUseBuffers,             // False if the driver has no vertex buffers
+         d_bPrimitiveRestart,       // Strips are split with a restart index
+         d_bTriangles;              // The cloth is a mesh, drawn as GL_TRIANGLES
+
+    unsigned d_uNormalsFrame,       // The last frame a draw asked for normals
+             d_uTopology,           // The cloth topology the static buffers were made for
+             d_uEditCount,          // The cloth's edits they hold
+             d_uIndexCount,         // Indices in the strip buffer
+             d_uSpringIndexCount,   // Indices in the spring buffer
+             d_uTileCount,          // Tiles of the cloth
+             d_uTilesDrawn;         // Tiles in view at the last draw
+
+    // Where the strips of each tile start in the strip buffer and the
+    // indices they take, all the tiles of level 0 then of level 1 and so on
+    std::vector<unsigned> d_tileFirst, d_tileCount;
+
+    // The ranges of the strip buffer the current draw is made of
+    std::vector<int> d_drawCount;
+    std::vector<const char*> d_drawOffset;
+
+    std::vector<float> d_staging;   // Used when the buffer cannot be mapped
+    // The strips and springs, kept only without vertex buffers
+    std::vector<unsigned> d_indices, d_springIndices;
+    std::vector<unsigned> d_springEdit;     // Line pairs of the springs being written over
+
+    //----------------------------------------------------------------------
+    // Private Methods
+    //----------------------------------------------------------------------
+    void initGL();
+    bool initProgram(ShaderProgram& p, bool quantized);
+
+    bool isQuantized() const { return d_bQuantize && d_quantProgram.id; }
+
+    // Makes sure the stream buffers hold the cloth's current frame, and the
+    // one before it when blending.  Returns false if there is nothing to draw.
+    bool upload(bool normals);
+
+    // Writes the current state, or the previous positions, into stream
+    // buffer b
+    void writeStream(unsigned b, bool previous, bool normals);
+
+    // Packs the particle positions, and normals if asked, into dst in the
+    // format of stream buffer b
+    void packVertices(void* dst, unsigned b, bool previous, bool normals);
+
+    // Rebuilds the texture coordinates and indices after the cloth changed
+    void buildStatic();
+
+    // Writes the changes the cloth made by tearing into them
+    void applyEdits();
+
+    // Points the GL vertex array at the uploaded positions, and turns on the
+    // blending program if the two states should be blended
+    void bindPositions(bool lighting);
+    void releasePositions();
+
+public:
+        //----------------------------------------------------------------------
+        // Public Methods
+        //----------------------------------------------------------------------
+        C_ClothRenderer();
+        ~C_ClothRenderer();
+
+        void setCloth(C_Cloth* c);
+        const C_Cloth* getCloth() const { return d_cloth; }
+
+        // Where to draw between the previous simulation frame and the current
+        // one, from 0 to 1.  Anything below 1 needs GLSL, without it the
+        // current frame is drawn.
+        void setBlend(float t) { d_fBlend = t < 0 ? 0 : (t > 1 ? 1 : t); }
+        float getBlend() const { return d_fBlend; }
+        bool canBlend() const { return d_blendProgram.id != 0; }
+
+        // Streams 16 bit positions and 32 bit normals instead of floats.
+        // Needs GLSL, without it the float format is kept.
+        void setQuantized(bool b) { d_bQuantize = b; }
+        bool getQuantized() const { return d_bQuantize; }
+
+        // The level of detail to draw the cloth at when seen from eye, see
+        // selectLod() in the source.  current is the level last drawn by the
+        // same view.
+        unsigned selectLod(const vector3f& eye, float pixelsPerUnit, unsigned current) const;
+
+        // Draw the cloth, lit if shading is true which needs vertex normals,
+        // at one of the levels of detail.  With a camera the tiles out of its
+        // view are skipped.
+        void draw(bool shading = false, unsigned lod = 0, const Camera3D* camera = 0);
+
+        // Tiles of the cloth, and how many were in view at the last draw
+        unsigned getTileCount() const { return d_uTileCount; }
+        unsigned getTilesDrawn() const { return d_uTilesDrawn; }
+
+        // Draws the mesh
+        void drawMesh();
+
+        // Draws the particles
+        void drawParticles();
+};
+
+
+#endif
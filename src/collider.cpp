@@ -0,0 +1,523 @@
+/*==============================================================================
+/ collider.cpp
+/ Shapes the cloth collides with.
+/=============================================================================*/
+
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "collider.h"
+#include "lanemath.h"
+#include <math.h>
+
+// How far inside a mesh, in thicknesses, a particle is still found when the
+// mesh has no distance field
+#define MESH_SEARCH_THICKNESSES 4.0f
+
+//==============================================================================
+// CONSTRUCTORS / DESTRUCTORS
+//==============================================================================
+
+C_ColliderSet::C_ColliderSet() : d_fThickness(0.02f), d_fFriction(0.5f), d_uRevision(0)
+{
+}
+
+
+//==============================================================================
+// PRIVATE METHODS
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// void updateBounds()
+//
+// Fits the box the lanes are tested against before the shape itself.  Planes
+// are tested against their half space instead and are left unbounded.  Every
+// change to a shape ends here, so this is also where it takes a new revision.
+//------------------------------------------------------------------------------
+void C_ColliderSet::updateBounds(Shape& s)
+{
+    const float t = d_fThickness;
+    s.revision = ++d_uRevision;
+    switch(s.type)
+    {
+    case COLLIDER_PLANE:
+        s.lo = vector3f(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+        s.hi = vector3f(HUGE_VALF, HUGE_VALF, HUGE_VALF);
+        break;
+    case COLLIDER_SPHERE:
+        s.lo = s.a - vector3f(s.radius + t, s.radius + t, s.radius + t);
+        s.hi = s.a + vector3f(s.radius + t, s.radius + t, s.radius + t);
+        break;
+    case COLLIDER_CAPSULE:
+        s.lo = vector3f(fminf(s.a.x, s.b.x), fminf(s.a.y, s.b.y), fminf(s.a.z, s.b.z)) -
+               vector3f(s.radius + t, s.radius + t, s.radius + t);
+        s.hi = vector3f(fmaxf(s.a.x, s.b.x), fmaxf(s.a.y, s.b.y), fmaxf(s.a.z, s.b.z)) +
+               vector3f(s.radius + t, s.radius + t, s.radius + t);
+        break;
+    case COLLIDER_BOX:
+    {
+        vector3f r(t, t, t);
+        for(unsigned k = 0; k < 3; ++k)
+        {
+            r.x += fabsf(s.axis[k].x) * s.extent[k];
+            r.y += fabsf(s.axis[k].y) * s.extent[k];
+            r.z += fabsf(s.axis[k].z) * s.extent[k];
+        }
+        s.lo = s.a - r;
+        s.hi = s.a + r;
+        break;
+    }
+    case COLLIDER_MESH:
+        s.lo = s.a + s.mesh->getMin() - vector3f(t, t, t);
+        s.hi = s.a + s.mesh->getMax() + vector3f(t, t, t);
+        break;
+    }
+}
+
+
+//==============================================================================
+// PUBLIC METHODS
+//==============================================================================
+
+unsigned C_ColliderSet::addPlane(const vector3f& normal, float offset)
+{
+    Shape s;
+    s.type = COLLIDER_PLANE;
+    s.mesh = 0;
+    s.a = normal.normalVector();
+    s.b = s.a;
+    s.radius = offset;
+    updateBounds(s);
+    d_shapes.push_back(s);
+    return (unsigned)d_shapes.size() - 1;
+}
+
+unsigned C_ColliderSet::addSphere(const vector3f& center, float radius)
+{
+    Shape s;
+    s.type = COLLIDER_SPHERE;
+    s.mesh = 0;
+    s.a = s.b = center;
+    s.radius = radius;
+    updateBounds(s);
+    d_shapes.push_back(s);
+    return (unsigned)d_shapes.size() - 1;
+}
+
+unsigned C_ColliderSet::addCapsule(const vector3f& start, const vector3f& end, float radius)
+{
+    Shape s;
+    s.type = COLLIDER_CAPSULE;
+    s.mesh = 0;
+    s.a = start;
+    s.b = end;
+    s.radius = radius;
+    updateBounds(s);
+    d_shapes.push_back(s);
+    return (unsigned)d_shapes.size() - 1;
+}
+
+//------------------------------------------------------------------------------
+// unsigned addBox()
+//
+// Adds a box around center.  The z axis is the cross product of the other
+// two, and the y axis is made square to the x axis.
+//------------------------------------------------------------------------------
+unsigned C_ColliderSet::addBox(const vector3f& center, const vector3f& xAxis, const vector3f& yAxis,
+                               const vector3f& halfSize)
+{
+    Shape s;
+    s.type = COLLIDER_BOX;
+    s.mesh = 0;
+    s.a = s.b = center;
+    s.axis[0] = xAxis.normalVector();
+    s.axis[2] = s.axis[0].crossProduct(yAxis).normalVector();
+    s.axis[1] = s.axis[2].crossProduct(s.axis[0]);
+    s.extent[0] = halfSize.x;
+    s.extent[1] = halfSize.y;
+    s.extent[2] = halfSize.z;
+    s.radius = 0.0f;
+    updateBounds(s);
+    d_shapes.push_back(s);
+    return (unsigned)d_shapes.size() - 1;
+}
+
+unsigned C_ColliderSet::addMesh(C_MeshCollider* mesh, const vector3f& position)
+{
+    Shape s;
+    s.type = COLLIDER_MESH;
+    s.a = s.b = position;
+    s.radius = 0.0f;
+    s.mesh = mesh;
+    updateBounds(s);
+    d_shapes.push_back(s);
+    d_meshes.push_back(mesh);
+    return (unsigned)d_shapes.size() - 1;
+}
+
+void C_ColliderSet::clear()
+{
+    for(size_t i = 0; i < d_meshes.size(); ++i)
+        delete d_meshes[i];
+    d_meshes.clear();
+    d_shapes.clear();
+    ++d_uRevision;
+}
+
+void C_ColliderSet::moveShape(unsigned i, const vector3f& position)
+{
+    if(i >= d_shapes.size())
+        return;
+
+    Shape& s = d_shapes[i];
+    if(s.type == COLLIDER_PLANE)
+        s.radius = s.a.x*position.x + s.a.y*position.y + s.a.z*position.z;
+    else
+    {
+        s.b += position - s.a;
+        s.a = position;
+    }
+    updateBounds(s);
+}
+
+void C_ColliderSet::setThickness(float t)
+{
+    d_fThickness = t > 0 ? t : 0;
+    for(size_t i = 0; i < d_shapes.size(); ++i)
+        updateBounds(d_shapes[i]);
+}
+
+
+//------------------------------------------------------------------------------
+// Takes the box face along axis a as the nearest so far if the point p is
+// less deep behind it than best.  The faces are tried by three calls rather
+// than a loop, and the sign of the side is picked apart from the axis, which
+// keeps the lane loop free of branches at -O2.
+//------------------------------------------------------------------------------
+static inline void nearestFace(float px, float py, float pz, const float* a, float depth,
+                               float& best, float* axis, float& side)
+{
+    const float c = px*a[0] + py*a[1] + pz*a[2];
+    const float d = depth - fabsf(c);
+    const bool take = d < best;
+    best = take ? d : best;
+    axis[0] = take ? a[0] : axis[0];
+    axis[1] = take ? a[1] : axis[1];
+    axis[2] = take ? a[2] : axis[2];
+    side = take ? copysignf(1.0f, c) : side;
+}
+
+//------------------------------------------------------------------------------
+// bool projectLanes()
+//
+// Each shape is first tested against the box around all the lanes, and only
+// the shapes it touches are run over the lanes.  The loops for the planes,
+// spheres, capsules and boxes have no branches and are vectorized: a lane
+// outside the shape is moved by zero, its normal is blended in by a hit
+// factor of 0 or 1, and the maxima and square roots come from lanemath.h.
+// Picking the normal with a select instead lets g++ turn the loop back into
+// branches.  Each loop reads the shape from locals, since a store to the
+// lanes could otherwise change it.  Meshes look each lane up in their
+// distance field one at a time.
+//------------------------------------------------------------------------------
+bool C_ColliderSet::projectLanes(Lanes& v) const
+{
+    float lo[3] = { v.x[0], v.y[0], v.z[0] }, hi[3] = { v.x[0], v.y[0], v.z[0] };
+    for(unsigned l = 0; l < LANES; ++l)
+    {
+        lo[0] = laneMin(lo[0], v.x[l]);  hi[0] = laneMax(hi[0], v.x[l]);
+        lo[1] = laneMin(lo[1], v.y[l]);  hi[1] = laneMax(hi[1], v.y[l]);
+        lo[2] = laneMin(lo[2], v.z[l]);  hi[2] = laneMax(hi[2], v.z[l]);
+        v.nx[l] = v.ny[l] = v.nz[l] = 0.0f;
+    }
+
+    const float t = d_fThickness;
+    bool touched = false;
+    for(size_t i = 0; i < d_shapes.size(); ++i)
+    {
+        const Shape& s = d_shapes[i];
+        if(s.type == COLLIDER_PLANE)
+        {
+            // The corner of the lanes' box furthest behind the plane
+            float d = s.a.x * (s.a.x >= 0 ? lo[0] : hi[0]) +
+                      s.a.y * (s.a.y >= 0 ? lo[1] : hi[1]) +
+                      s.a.z * (s.a.z >= 0 ? lo[2] : hi[2]);
+            if(d >= s.radius + t)
+                continue;
+        }
+        else if(lo[0] > s.hi.x || hi[0] < s.lo.x || lo[1] > s.hi.y || hi[1] < s.lo.y ||
+                lo[2] > s.hi.z || hi[2] < s.lo.z)
+            continue;
+
+        const float ax = s.a.x, ay = s.a.y, az = s.a.z;
+        float pen[LANES];
+        switch(s.type)
+        {
+        case COLLIDER_PLANE:
+        {
+            const float offset = s.radius + t;
+            for(unsigned l = 0; l < LANES; ++l)
+            {
+                const float p = laneMax(offset - (ax*v.x[l] + ay*v.y[l] + az*v.z[l]), 0.0f);
+                const float hit = p > 0.0f ? 1.0f : 0.0f;
+                const float nx = v.nx[l] + hit * (ax - v.nx[l]);
+                const float ny = v.ny[l] + hit * (ay - v.ny[l]);
+                const float nz = v.nz[l] + hit * (az - v.nz[l]);
+                v.x[l] += ax * p;
+                v.y[l] += ay * p;
+                v.z[l] += az * p;
+                v.nx[l] = nx;
+                v.ny[l] = ny;
+                v.nz[l] = nz;
+                pen[l] = p;
+            }
+            break;
+        }
+
+        case COLLIDER_SPHERE:
+        case COLLIDER_CAPSULE:
+        {
+            // A sphere is a capsule whose segment has no length
+            const float sx = s.b.x - ax, sy = s.b.y - ay, sz = s.b.z - az;
+            const float segLen2 = s.type == COLLIDER_CAPSULE ? sx*sx + sy*sy + sz*sz : 0.0f;
+            const float invSegLen2 = segLen2 > 0.0f ? 1.0f / segLen2 : 0.0f;
+            const float reach = s.radius + t;
+            for(unsigned l = 0; l < LANES; ++l)
+            {
+                float px = v.x[l] - ax, py = v.y[l] - ay, pz = v.z[l] - az;
+
+                // The closest point's place along the segment, clamped to
+                // [0, 1] with absolute values, which unlike two selects in a
+                // row does not stop the loop from vectorizing
+                float w = (px*sx + py*sy + pz*sz) * invSegLen2;
+                float u = 0.5f * (fabsf(w) - fabsf(w - 1.0f) + 1.0f);
+                float dx = px - u*sx, dy = py - u*sy, dz = pz - u*sz;
+
+                // The bias keeps the inverse finite for a lane on the segment,
+                // whose zero difference then moves it by nothing
+                const float len2 = dx*dx + dy*dy + dz*dz;
+                const float inv = laneInvSqrt(len2 + 1e-30f);
+                const float p = laneMax(reach - len2 * inv, 0.0f);
+                const float hit = p > 0.0f ? 1.0f : 0.0f;
+                dx *= inv;
+                dy *= inv;
+                dz *= inv;
+                const float nx = v.nx[l] + hit * (dx - v.nx[l]);
+                const float ny = v.ny[l] + hit * (dy - v.ny[l]);
+                const float nz = v.nz[l] + hit * (dz - v.nz[l]);
+                v.x[l] += dx * p;
+                v.y[l] += dy * p;
+                v.z[l] += dz * p;
+                v.nx[l] = nx;
+                v.ny[l] = ny;
+                v.nz[l] = nz;
+                pen[l] = p;
+            }
+            break;
+        }
+
+        case COLLIDER_BOX:
+        {
+            float axes[3][3], depth[3];
+            for(unsigned k = 0; k < 3; ++k)
+            {
+                axes[k][0] = s.axis[k].x;
+                axes[k][1] = s.axis[k].y;
+                axes[k][2] = s.axis[k].z;
+                depth[k] = s.extent[k] + t;
+            }
+
+            for(unsigned l = 0; l < LANES; ++l)
+            {
+                float px = v.x[l] - ax, py = v.y[l] - ay, pz = v.z[l] - az;
+
+                // Push out through the face the lane is least deep behind
+                float best = 1e30f, axis[3] = { 0.0f, 0.0f, 0.0f }, side = 0.0f;
+                nearestFace(px, py, pz, axes[0], depth[0], best, axis, side);
+                nearestFace(px, py, pz, axes[1], depth[1], best, axis, side);
+                nearestFace(px, py, pz, axes[2], depth[2], best, axis, side);
+                const float bx = axis[0] * side, by = axis[1] * side, bz = axis[2] * side;
+
+                // Outside when any of the depths is negative
+                const float p = laneMax(best, 0.0f);
+                const float hit = p > 0.0f ? 1.0f : 0.0f;
+                const float nx = v.nx[l] + hit * (bx - v.nx[l]);
+                const float ny = v.ny[l] + hit * (by - v.ny[l]);
+                const float nz = v.nz[l] + hit * (bz - v.nz[l]);
+                v.x[l] += bx * p;
+                v.y[l] += by * p;
+                v.z[l] += bz * p;
+                v.nx[l] = nx;
+                v.ny[l] = ny;
+                v.nz[l] = nz;
+                pen[l] = p;
+            }
+            break;
+        }
+
+        case COLLIDER_MESH:
+            for(unsigned l = 0; l < LANES; ++l)
+            {
+                float d;
+                vector3f n;
+                pen[l] = 0.0f;
+                if(!s.mesh->distance(vector3f(v.x[l], v.y[l], v.z[l]) - s.a, t * MESH_SEARCH_THICKNESSES, d, n) || d >= t)
+                    continue;
+                pen[l] = t - d;
+                v.x[l] += n.x * pen[l];
+                v.y[l] += n.y * pen[l];
+                v.z[l] += n.z * pen[l];
+                v.nx[l] = n.x;
+                v.ny[l] = n.y;
+                v.nz[l] = n.z;
+            }
+            break;
+        }
+
+        for(unsigned l = 0; l < LANES; ++l)
+            touched = touched || pen[l] > 0.0f;
+    }
+    return touched;
+}
+
+
+//------------------------------------------------------------------------------
+// Where the segment from o along d first comes within r of the point c, or a
+// negative time if it starts within r or never does
+//------------------------------------------------------------------------------
+static float sweepSphere(const vector3f& o, const vector3f& d, const vector3f& c, float r)
+{
+    const vector3f oc = o - c;
+    const float a = d * d, b = oc * d, k = oc * oc - r*r;
+    const float disc = b*b - a*k;
+    if(k <= 0.0f || b >= 0.0f || disc < 0.0f || a <= 0.0f)
+        return -1.0f;
+    return (-b - sqrtf(disc)) / a;
+}
+
+//------------------------------------------------------------------------------
+// bool sweep()
+//
+// Tests the segment's box against each shape's box first.  Spheres and the
+// ends of capsules are solved as quadratics, the side of a capsule as a
+// cylinder around its segment, boxes as slabs, and meshes through
+// C_MeshCollider::raycast(), counting only triangles the point meets from
+// the front.  The point is stopped the thickness short of where it meets the
+// shape itself, rather than where it meets the shape grown by the thickness,
+// so a point left resting within the thickness is still swept the step
+// after.  A point that starts inside a shape is left to the projection.
+//------------------------------------------------------------------------------
+bool C_ColliderSet::sweep(const vector3f& start, const vector3f& end, float& t, vector3f& normal) const
+{
+    const vector3f d = end - start;
+    const vector3f lo(fminf(start.x, end.x), fminf(start.y, end.y), fminf(start.z, end.z));
+    const vector3f hi(fmaxf(start.x, end.x), fmaxf(start.y, end.y), fmaxf(start.z, end.z));
+    const float len = d.magnitude();
+    if(len <= 0.0f)
+        return false;
+    const float back = d_fThickness / len;
+
+    float best = HUGE_VALF;
+    for(size_t i = 0; i < d_shapes.size(); ++i)
+    {
+        const Shape& s = d_shapes[i];
+        if(s.type == COLLIDER_PLANE || lo.x > s.hi.x || hi.x < s.lo.x || lo.y > s.hi.y || hi.y < s.lo.y ||
+           lo.z > s.hi.z || hi.z < s.lo.z)
+            continue;
+
+        float hit = -1.0f;
+        vector3f n(0, 0, 0);
+        const float r = s.radius;
+        switch(s.type)
+        {
+        case COLLIDER_SPHERE:
+        case COLLIDER_CAPSULE:
+        {
+            // A sphere is a capsule whose segment has no length
+            const vector3f axis = s.b - s.a, oa = start - s.a;
+            const float aa = s.type == COLLIDER_CAPSULE ? axis * axis : 0.0f;
+            const float u0 = aa > 0.0f ? fminf(fmaxf((oa * axis) / aa, 0.0f), 1.0f) : 0.0f;
+            const vector3f out = oa - axis * u0;
+            if(out * out <= r*r)
+                break;
+
+            // The side, the parts of d and oa square to the axis give a
+            // quadratic
+            const float ad = axis * d, ao = axis * oa;
+            const float a = aa * (d * d) - ad*ad;
+            const float b = aa * (oa * d) - ao*ad;
+            const float c = aa * (oa * oa) - ao*ao - r*r*aa;
+            const float disc = b*b - a*c;
+            if(aa > 0.0f && a > 0.0f && disc >= 0.0f)
+            {
+                const float tSide = (-b - sqrtf(disc)) / a;
+                const float y = ao + tSide * ad;
+                if(tSide >= 0.0f && y > 0.0f && y < aa)
+                    hit = tSide;
+            }
+            if(hit < 0.0f)
+            {
+                const float t0 = sweepSphere(start, d, s.a, r);
+                const float t1 = aa > 0.0f ? sweepSphere(start, d, s.b, r) : -1.0f;
+                hit = t0 >= 0.0f && (t1 < 0.0f || t0 < t1) ? t0 : t1;
+            }
+
+            const vector3f h = oa + d * hit;
+            const float u = aa > 0.0f ? fminf(fmaxf((h * axis) / aa, 0.0f), 1.0f) : 0.0f;
+            n = (h - axis * u).normalVector();
+            break;
+        }
+
+        case COLLIDER_BOX:
+        {
+            float t0 = 0.0f, t1 = 1.0f;
+            bool inside = true;
+            const vector3f o = start - s.a;
+            for(unsigned k = 0; k < 3 && t0 <= t1; ++k)
+            {
+                const float c = o * s.axis[k], v = d * s.axis[k], e = s.extent[k];
+                inside = inside && fabsf(c) < e;
+                if(v == 0.0f)
+                {
+                    if(fabsf(c) > e)
+                        t1 = -1.0f;
+                    continue;
+                }
+
+                // The face the point enters through faces against its motion
+                const float ta = (-e - c) / v, tb = (e - c) / v;
+                const float tEnter = fminf(ta, tb);
+                if(tEnter > t0)
+                {
+                    t0 = tEnter;
+                    n = s.axis[k] * (v > 0.0f ? -1.0f : 1.0f);
+                }
+                t1 = fminf(t1, fmaxf(ta, tb));
+            }
+            if(!inside && t0 <= t1)
+                hit = t0;
+            break;
+        }
+
+        case COLLIDER_MESH:
+            if(!s.mesh->raycast(start - s.a, d, 1.0f, hit, n) || n * d >= 0.0f)
+                hit = -1.0f;
+            break;
+
+        default:
+            break;
+        }
+
+        if(hit >= 0.0f && hit <= 1.0f && hit < best)
+        {
+            best = hit;
+            normal = n;
+        }
+    }
+
+    if(best > 1.0f)
+        return false;
+    t = fmaxf(best - back, 0.0f);
+    return true;
+}
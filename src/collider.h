@@ -0,0 +1,139 @@
+/*==============================================================================
+/ collider.h
+/ Shapes the cloth collides with: planes, spheres, capsules, oriented boxes
+/ and static triangle meshes, see meshcollider.h.
+/
+/ The particles are tested LANES at a time.  The caller gathers their
+/ positions into a Lanes struct, projectLanes() pushes every lane that is
+/ inside a shape, or closer to it than the thickness, out to its surface and
+/ reports the contact normal, and the caller scatters the lanes back.  Each
+/ shape keeps a bounding box so the lanes can skip the shapes they are
+/ nowhere near with one box test.  The analytic shapes are tested without
+/ branches; a mesh is looked up one lane at a time.
+/
+/ A point that moves further in a step than a shape is thick can end up on
+/ its far side, where the projection pushes it out the wrong way.  sweep()
+/ follows the point's motion over the step instead and finds where it first
+/ met a shape, so the caller can stop it there before it is projected.
+/=============================================================================*/
+
+#ifndef _COLLIDER_
+#define _COLLIDER_
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "vector3.h"
+#include "meshcollider.h"
+#include <vector>
+
+//==============================================================================
+// CLASS DEFINITION
+//==============================================================================
+class C_ColliderSet
+{
+public:
+    // Points handled together by projectLanes()
+    enum { LANES = 8 };
+
+    // The positions of LANES points and the normals of their contacts.  The
+    // arrays are kept in one struct so the compiler can tell they do not
+    // overlap, which it needs to vectorize the loops over them.
+    struct Lanes
+    {
+        float x[LANES], y[LANES], z[LANES];
+        float nx[LANES], ny[LANES], nz[LANES];
+    };
+
+    enum ColliderType
+    {
+        COLLIDER_PLANE,         // The solid side is behind the normal
+        COLLIDER_SPHERE,
+        COLLIDER_CAPSULE,       // A segment grown by a radius
+        COLLIDER_BOX,           // An oriented box
+        COLLIDER_MESH           // A C_MeshCollider moved to a position
+    };
+
+private:
+    //----------------------------------------------------------------------
+    // Private Members
+    //----------------------------------------------------------------------
+    struct Shape
+    {
+        ColliderType type;
+        vector3f a,             // Plane normal, sphere and box center, capsule start, mesh position
+                 b;             // Capsule end
+        vector3f axis[3];       // Box axes, unit length
+        float extent[3];        // Box half sizes
+        float radius;           // Sphere and capsule radius, plane offset along its normal
+        vector3f lo, hi;        // Bounding box, grown by the thickness
+        const C_MeshCollider* mesh;
+        unsigned revision;      // The set's revision when the shape last changed
+    };
+
+    std::vector<Shape> d_shapes;
+    std::vector<C_MeshCollider*> d_meshes;  // Owned by the set
+    float d_fThickness,         // Distance the particles are kept from the surfaces
+          d_fFriction;          // Share of the sliding motion a contact takes away
+    unsigned d_uRevision;       // Bumped whenever a shape is added, moved or removed
+
+    // Fits shape s's bounding box and marks it changed
+    void updateBounds(Shape& s);
+
+    // Not copyable, the set owns its meshes
+    C_ColliderSet(const C_ColliderSet&);
+    C_ColliderSet& operator=(const C_ColliderSet&);
+
+public:
+        //----------------------------------------------------------------------
+        // Public Methods
+        //----------------------------------------------------------------------
+        C_ColliderSet();
+        ~C_ColliderSet() { clear(); }
+
+        // Adding a shape returns its index.  Vectors that should be unit
+        // length are normalized.
+        unsigned addPlane(const vector3f& normal, float offset);
+        unsigned addSphere(const vector3f& center, float radius);
+        unsigned addCapsule(const vector3f& start, const vector3f& end, float radius);
+        unsigned addBox(const vector3f& center, const vector3f& xAxis, const vector3f& yAxis,
+                        const vector3f& halfSize);
+
+        // Adds a loaded mesh with its origin at position.  The set takes
+        // ownership of the mesh and deletes it in clear().
+        unsigned addMesh(C_MeshCollider* mesh, const vector3f& position);
+
+        // Moves shape i to a new position, keeping its size and orientation.
+        // Planes move along their normal to pass through the point.
+        void moveShape(unsigned i, const vector3f& position);
+
+        void clear();
+        unsigned getCount() const { return (unsigned)d_shapes.size(); }
+
+        void setThickness(float t);
+        float getThickness() const { return d_fThickness; }
+        void setFriction(float f) { d_fFriction = f < 0 ? 0 : (f > 1 ? 1 : f); }
+        float getFriction() const { return d_fFriction; }
+
+        // Changes whenever a shape is added, moved, grown or removed, so the
+        // cloth can tell when to wake the parts of it that were resting.
+        // Each shape keeps the revision it last changed in.
+        unsigned getRevision() const { return d_uRevision; }
+        unsigned getShapeRevision(unsigned i) const { return d_shapes[i].revision; }
+        void getShapeBounds(unsigned i, vector3f& lo, vector3f& hi) const { lo = d_shapes[i].lo; hi = d_shapes[i].hi; }
+
+        // Pushes the points in lanes.x, y and z out of every shape.  The
+        // normal of each lane's last contact is written to lanes.nx, ny and
+        // nz, or zero if the lane touched nothing.  Returns true if any did.
+        bool projectLanes(Lanes& lanes) const;
+
+        // Finds the earliest time the point moving from start to end meets
+        // a shape it started outside of, from 0 at start to 1 at end, less
+        // the time it takes to move the thickness, and the shape's normal
+        // there.  Planes are left out, a point cannot pass through their
+        // half space.  Returns false if it meets none.
+        bool sweep(const vector3f& start, const vector3f& end, float& t, vector3f& normal) const;
+};
+
+
+#endif
@@ -0,0 +1,51 @@
+/*==============================================================================
+/ lanemath.h
+/ Helpers for the loops that work over fixed size blocks of lanes.  The
+/ standard functions they stand in for either keep a branch to set errno or
+/ are library calls on x86, and a loop that uses them is not vectorized
+/ unless it is built with -fno-math-errno or -ffinite-math-only.  These are
+/ plain arithmetic and selects, so the lane loops can vectorize at -O2 and -O3
+/ without extra flags.
+/=============================================================================*/
+
+#ifndef _LANEMATH_
+#define _LANEMATH_
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include <string.h>
+
+//==============================================================================
+// FUNCTIONS
+//==============================================================================
+
+// Returns 1/sqrt(x) for a positive x to within about an ulp.  The estimate
+// read off the exponent bits is refined by three Newton steps.
+static inline float laneInvSqrt(float x)
+{
+    int i;
+    memcpy(&i, &x, sizeof(i));
+    i = 0x5f375a86 - (i >> 1);
+    float y;
+    memcpy(&y, &i, sizeof(y));
+    y *= 1.5f - 0.5f*x*y*y;
+    y *= 1.5f - 0.5f*x*y*y;
+    y *= 1.5f - 0.5f*x*y*y;
+    return y;
+}
+
+// The larger and the smaller of a and b.  Unlike fmaxf() and fminf() they
+// do not promise to skip a NaN, so they compile to one instruction.
+static inline float laneMax(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+static inline float laneMin(float a, float b)
+{
+    return a < b ? a : b;
+}
+
+
+#endif
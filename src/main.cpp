@@ -1,11 +1,27 @@
 #include <QtGui/QApplication>
 #include "mainwindow.h"
+#include "perfprobe.h"
+#include <stdlib.h>
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+
+    // CLOTH_TRACE=file.json records a trace of the whole session
+    C_PerfProbes::setThreadName("gui");
+    const char* tracePath = getenv("CLOTH_TRACE");
+    if(tracePath)
+        C_PerfProbes::startTracing();
+
     MainWindow w;
     w.createViewPort();
     w.show();
-    return a.exec();
+    int ret = a.exec();
+
+    if(tracePath)
+    {
+        C_PerfProbes::stopTracing();
+        C_PerfProbes::writeChromeTrace(tracePath);
+    }
+    return ret;
 }
@@ -1,19 +1,30 @@
 #include "mainwindow.h"
 #include "GLViewport.h"
 #include "cloth.h"
+#include "clothrenderer.h"
 #include "button.h"
+#include "perfprobe.h"
 #include <QString>
 #include <QDockWidget>
+#include <QFileDialog>
+#include <QMessageBox>
+
+// The simulation's fixed time step.  It may be longer than the display's
+// refresh, the viewports blend between steps.
+#define SIM_STEP_MS 5
+
+// Most steps taken at once when the simulation falls behind
+#define SIM_MAX_CATCHUP_STEPS 8
 
 MainWindow::MainWindow(QWidget *parent)
-    : QMainWindow(parent), d_numViewPorts(0)
+    : QMainWindow(parent), d_numViewPorts(0), d_shareView(0), d_uPublishedFrame(0),
+      d_iSimLagMs(0), d_fPublishedBlend(1.0f)
 {
     d_qSimTimer = new QTimer(this);
     connect(d_qSimTimer, SIGNAL(timeout()), this, SLOT(updateSim()));
 
     d_qDrawTimer = new QTimer(this);
     connect(d_qDrawTimer, SIGNAL(timeout()), this, SLOT(drawViewPorts()));
-    d_qDrawTimer->start(30);
 
     QDockWidget *dock = new QDockWidget("Simulation Commands", this);
     QGridLayout *mainLayout = new QGridLayout;
@@ -23,12 +34,43 @@ MainWindow::MainWindow(QWidget *parent)
     Button *startButton = createButton(tr("Start"), SLOT(startSim()));
     Button *stopButton = createButton(tr("Stop"), SLOT(stopSim()));
     Button *initButton = createButton(tr("Initialize"), SLOT(initializeSim()));
+    Button *garmentButton = createButton(tr("Load Garment"), SLOT(loadGarment()));
 
     QGroupBox *controlGroupBox = new QGroupBox(tr("Simulation Control"));
     QVBoxLayout *vControlBox = new QVBoxLayout;
     vControlBox->addWidget(startButton);
     vControlBox->addWidget(stopButton);
     vControlBox->addWidget(initButton);
+    vControlBox->addWidget(garmentButton);
+#ifdef CLOTH_PROFILING
+    // Records a trace while down, asks where to save it when released
+    Button *traceButton = new Button(tr("Trace"));
+    traceButton->setCheckable(true);
+    traceButton->setChecked(C_PerfProbes::isTracing());
+    connect(traceButton, SIGNAL(toggled(bool)), this, SLOT(setTracing(bool)));
+    vControlBox->addWidget(traceButton);
+#endif
+    // Halves the bytes uploaded per frame, worth it for large cloths
+    QCheckBox *quantizeBox = new QCheckBox(tr("Compact vertices"));
+    connect(quantizeBox, SIGNAL(toggled(bool)), this, SLOT(setQuantized(bool)));
+    vControlBox->addWidget(quantizeBox);
+    // Keeps the cloth from folding through itself, at some cost per step
+    QCheckBox *selfBox = new QCheckBox(tr("Self collision"));
+    connect(selfBox, SIGNAL(toggled(bool)), this, SLOT(setSelfCollision(bool)));
+    vControlBox->addWidget(selfBox);
+    // Follows the particles over each step so fast cloth cannot pass
+    // through thin colliders, or itself with self collision on
+    QCheckBox *continuousBox = new QCheckBox(tr("Continuous collision"));
+    connect(continuousBox, SIGNAL(toggled(bool)), this, SLOT(setContinuousCollision(bool)));
+    vControlBox->addWidget(continuousBox);
+    // Stops simulating the parts of the cloth that have come to rest
+    QCheckBox *sleepBox = new QCheckBox(tr("Sleep when still"));
+    connect(sleepBox, SIGNAL(toggled(bool)), this, SLOT(setSleeping(bool)));
+    vControlBox->addWidget(sleepBox);
+    // Garments loaded after this tear where they are pulled too far
+    QCheckBox *tearBox = new QCheckBox(tr("Tear garments"));
+    connect(tearBox, SIGNAL(toggled(bool)), this, SLOT(setTearing(bool)));
+    vControlBox->addWidget(tearBox);
     vControlBox->addStretch(1);
     controlGroupBox->setLayout(vControlBox);
     mainLayout->addWidget(controlGroupBox, 0, 0);
@@ -44,6 +86,10 @@ MainWindow::MainWindow(QWidget *parent)
     setWindowTitle("Cloth Simulation");
 
     d_cloth = new C_Cloth();
+    d_renderer = new C_ClothRenderer();
+    // Enough to keep the cloth from creasing like paper, every cloth built
+    // from here on gets the bending springs
+    d_cloth->setBendStiffness(0.1f);
     d_cloth->initialize(10.0f, 10.0f, 30, 30, 200, 550.0, 400.0, 0.005, ZAXIS);
     d_cloth->lockParticle(0, 0);
     d_cloth->lockParticle(0, 19);
@@ -52,6 +98,11 @@ MainWindow::MainWindow(QWidget *parent)
 
 MainWindow::~MainWindow()
 {
+    // The shared buffers must go while a context of their group is current,
+    // before the viewports are destroyed with the window's children
+    if(d_shareView)
+        d_shareView->makeCurrent();
+    delete d_renderer;
     delete d_cloth;
 }
 
@@ -69,8 +120,12 @@ void MainWindow::createViewPort()
     // The main layout for the dock
     QVBoxLayout *mainLayout = new QVBoxLayout;
 
-    GLViewPort *glView = new GLViewPort(this);
+    // Every viewport shares the first one's context, so the cloth is
+    // uploaded once per frame however many viewports draw it
+    GLViewPort *glView = new GLViewPort(this, d_renderer, d_shareView);
     glView->setCloth(d_cloth);
+    if(!d_shareView)
+        d_shareView = glView;
 
     // Add the viewport on top
     mainLayout->addWidget(glView);
@@ -81,14 +136,20 @@ void MainWindow::createViewPort()
     QCheckBox *checkBox1 = new QCheckBox(tr("Cloth"));
     QCheckBox *checkBox2 = new QCheckBox(tr("Springs"));
     QCheckBox *checkBox3 = new QCheckBox(tr("Particles"));
+    QCheckBox *checkBox4 = new QCheckBox(tr("Stats"));
+    QCheckBox *checkBox5 = new QCheckBox(tr("Shaded"));
     connect(checkBox1, SIGNAL(toggled(bool)), glView, SLOT(setDrawCloth(bool)));
     connect(checkBox2, SIGNAL(toggled(bool)), glView, SLOT(setDrawSprings(bool)));
     connect(checkBox3, SIGNAL(toggled(bool)), glView, SLOT(setDrawParticles(bool)));
+    connect(checkBox4, SIGNAL(toggled(bool)), glView, SLOT(setDrawStats(bool)));
+    connect(checkBox5, SIGNAL(toggled(bool)), glView, SLOT(setShading(bool)));
 
     QHBoxLayout *hbox = new QHBoxLayout;
     hbox->addWidget(checkBox1);
+    hbox->addWidget(checkBox5);
     hbox->addWidget(checkBox2);
     hbox->addWidget(checkBox3);
+    hbox->addWidget(checkBox4);
     checkBox1->setChecked(true);
     hbox->addStretch(1);
     renderGroupBox->setLayout(hbox);
@@ -103,7 +164,9 @@ void MainWindow::createViewPort()
     else
         addDockWidget(Qt::RightDockWidgetArea, dock);
 
-    connect(this, SIGNAL(updateViewPorts()), glView, SLOT(updateGL()));
+    // update() rather than updateGL() so that a new frame arriving with a
+    // camera move is only painted once
+    connect(this, SIGNAL(updateViewPorts()), glView, SLOT(update()));
 }
 
 Button* MainWindow::createButton(const QString &text, const char *member)
@@ -116,30 +179,146 @@ Button* MainWindow::createButton(const QString &text, const char *member)
 
 void MainWindow::startSim()
 {
-    d_qSimTimer->start(5);
+    d_iSimLagMs = 0;
+    d_qSimClock.start();
+    d_qSimTimer->start(SIM_STEP_MS);
+    d_qDrawTimer->start(30);
 }
 
 void MainWindow::stopSim()
 {
     d_qSimTimer->stop();
+    d_qDrawTimer->stop();
+    drawViewPorts();
 }
 
+//------------------------------------------------------------------------------
+// updateSim()
+// Takes as many fixed steps as the wall clock has moved on by.  Any time
+// left over is kept for the next call.
+//------------------------------------------------------------------------------
 void MainWindow::updateSim()
 {
-    d_cloth->stepSimulation(0.005f);
+    d_iSimLagMs += d_qSimClock.restart();
+
+    int steps = 0;
+    while(d_iSimLagMs >= SIM_STEP_MS && steps < SIM_MAX_CATCHUP_STEPS)
+    {
+        d_cloth->stepSimulation(SIM_STEP_MS * 0.001f);
+        d_iSimLagMs -= SIM_STEP_MS;
+        ++steps;
+    }
+
+    // Too far behind to catch up, drop the time rather than spiral
+    if(steps == SIM_MAX_CATCHUP_STEPS)
+        d_iSimLagMs = 0;
 }
 
 void MainWindow::initializeSim()
 {
     d_qSimTimer->stop();
+    d_qDrawTimer->stop();
     d_cloth->initialize(10.0f, 10.0f, 60, 60, 50, 550.0, 400.0, 0.0005, ZAXIS);
     d_cloth->lockParticle(0, 0);
     d_cloth->lockParticle(0, 59);
     d_cloth->lockParticle(59, 0);
     d_cloth->lockParticle(59, 59);
+    drawViewPorts();
 }
 
+//------------------------------------------------------------------------------
+// loadGarment()
+// Replaces the cloth with the triangles of an OBJ file, hung by the particles
+// along its top
+//------------------------------------------------------------------------------
+void MainWindow::loadGarment()
+{
+    QString path = QFileDialog::getOpenFileName(this, tr("Load Garment"), QString(),
+                                                tr("Wavefront OBJ (*.obj)"));
+    if(path.isEmpty())
+        return;
+
+    // A file that cannot be read leaves the cloth as it was, running or not
+    if(!d_cloth->initializeMesh(QFile::encodeName(path).constData(), 50, 550.0, 400.0, 0.0005))
+    {
+        QMessageBox::warning(this, tr("Load Garment"), tr("Could not read %1").arg(path));
+        return;
+    }
+    d_qSimTimer->stop();
+    d_qDrawTimer->stop();
+
+    const ClothBounds& bounds = d_cloth->getBounds();
+    const float top = bounds.max.y - 0.01f * (bounds.max.y - bounds.min.y);
+    const C_Vertex* v = d_cloth->getVertices();
+    for(unsigned i = 0; i < d_cloth->getParticleCount(); ++i)
+        if(v[i].pos.y >= top)
+            d_cloth->lockParticle(i);
+    drawViewPorts();
+}
+
+//------------------------------------------------------------------------------
+// drawViewPorts()
+// Asks the viewports to repaint if the cloth has a frame they have not seen,
+// or while running, if time has moved on between two steps.  The viewports
+// draw one step behind, blended by how far the clock is into the next step.
+// Camera moves and option changes repaint a viewport on their own, so with
+// the simulation stopped nothing is drawn at all.
+//------------------------------------------------------------------------------
 void MainWindow::drawViewPorts()
 {
+    float blend = 1.0f;
+    if(d_qSimTimer->isActive() && d_renderer->canBlend())
+    {
+        blend = (d_iSimLagMs + d_qSimClock.elapsed()) / (float)SIM_STEP_MS;
+        if(blend > 1.0f)
+            blend = 1.0f;
+    }
+
+    if(d_cloth->getFrame() == d_uPublishedFrame && blend == d_fPublishedBlend)
+        return;
+    d_uPublishedFrame = d_cloth->getFrame();
+    d_fPublishedBlend = blend;
+    d_renderer->setBlend(blend);
+    emit updateViewPorts();
+}
+
+void MainWindow::setQuantized(bool on)
+{
+    d_renderer->setQuantized(on);
     emit updateViewPorts();
 }
+
+void MainWindow::setSelfCollision(bool on)
+{
+    d_cloth->setSelfCollision(on);
+}
+
+void MainWindow::setContinuousCollision(bool on)
+{
+    d_cloth->setContinuousCollision(on);
+}
+
+void MainWindow::setSleeping(bool on)
+{
+    d_cloth->setSleeping(on);
+}
+
+void MainWindow::setTearing(bool on)
+{
+    d_cloth->setTearStretch(on ? 1.5f : 0.0f);
+}
+
+void MainWindow::setTracing(bool on)
+{
+    if(on)
+    {
+        C_PerfProbes::startTracing();
+        return;
+    }
+
+    C_PerfProbes::stopTracing();
+    QString path = QFileDialog::getSaveFileName(this, tr("Save Trace"), "cloth_trace.json",
+                                                tr("Chrome trace (*.json)"));
+    if(!path.isEmpty() && !C_PerfProbes::writeChromeTrace(QFile::encodeName(path).constData()))
+        QMessageBox::warning(this, tr("Save Trace"), tr("Could not write %1").arg(path));
+}
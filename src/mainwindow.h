@@ -2,10 +2,13 @@
 #define MAINWINDOW_H
 
 #include <QtGui/QMainWindow>
+#include <QTime>
 
 
 class QTimer;
 class C_Cloth;
+class C_ClothRenderer;
+class GLViewPort;
 class Button;
 
 class MainWindow : public QMainWindow
@@ -25,15 +28,31 @@ private:
 
     unsigned short d_numViewPorts;
     QTimer *d_qSimTimer;
-    QTimer *d_qDrawTimer;
+    QTimer *d_qDrawTimer;           // Runs only while the simulation does
     C_Cloth* d_cloth;
+    C_ClothRenderer* d_renderer;    // Shared by the viewports
+    GLViewPort* d_shareView;        // The first viewport, the others share its context
+    unsigned d_uPublishedFrame;     // The cloth frame the viewports were last told about
+
+    // The simulation takes fixed steps to keep up with the wall clock, the
+    // time it is behind by sets how far the viewports blend to the newest step
+    QTime d_qSimClock;
+    int d_iSimLagMs;
+    float d_fPublishedBlend;
 
 public slots:
     void startSim();
     void stopSim();
     void initializeSim();
+    void loadGarment();
     void updateSim();
     void drawViewPorts();
+    void setTracing(bool on);
+    void setQuantized(bool on);
+    void setSelfCollision(bool on);
+    void setContinuousCollision(bool on);
+    void setSleeping(bool on);
+    void setTearing(bool on);
 
 signals:
     void updateViewPorts();
@@ -0,0 +1,963 @@
+/*==============================================================================
+/ meshcollider.cpp
+/ A static triangle mesh the cloth collides with.
+/=============================================================================*/
+
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "meshcollider.h"
+#include "objfile.h"
+#include "C_WorkerPool.h"
+#include <algorithm>
+#include <map>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// Bumped whenever the layout of the cache file changes
+#define MESH_CACHE_VERSION 1
+
+// Deepest the tree can be walked, the SAH tree of any real mesh is far
+// shallower
+#define MESH_STACK_SIZE 64
+
+// Samples along each side of a brick
+#define SDF_BRICK_SAMPLES (SDF_BRICK_CELLS + 1)
+
+// Bricks handed to a worker at a time while baking
+#define BAKE_GRAIN 4
+
+//==============================================================================
+// LOCAL FUNCTIONS
+//==============================================================================
+
+static float axisOf(const vector3f& v, unsigned axis)
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// FNV-1a over a block of bytes, continuing from hash
+static uint64_t hashBytes(const void* data, size_t size, uint64_t hash)
+{
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for(size_t i = 0; i < size; ++i)
+        hash = (hash ^ p[i]) * 1099511628211ull;
+    return hash;
+}
+
+// The SAH bucket a center falls in along an axis whose centers start at lo
+static unsigned binOf(float c, float lo, float extent)
+{
+    unsigned b = (unsigned)((c - lo) / extent * MESH_SAH_BINS);
+    return b < MESH_SAH_BINS ? b : MESH_SAH_BINS - 1;
+}
+
+// True for the triangles left of a split after bucket bin
+struct BinBelow
+{
+    const vector3f* centers;
+    unsigned axis, bin;
+    float lo, extent;
+    bool operator()(uint32_t t) const { return binOf(axisOf(centers[t], axis), lo, extent) <= bin; }
+};
+
+static size_t alignUp(size_t n)
+{
+    return (n + 15) & ~(size_t)15;
+}
+
+// A box grown to hold points
+struct Box
+{
+    vector3f lo, hi;
+
+    void empty()
+    {
+        lo = vector3f(HUGE_VALF, HUGE_VALF, HUGE_VALF);
+        hi = vector3f(-HUGE_VALF, -HUGE_VALF, -HUGE_VALF);
+    }
+    void grow(const vector3f& p)
+    {
+        lo.x = p.x < lo.x ? p.x : lo.x;  hi.x = p.x > hi.x ? p.x : hi.x;
+        lo.y = p.y < lo.y ? p.y : lo.y;  hi.y = p.y > hi.y ? p.y : hi.y;
+        lo.z = p.z < lo.z ? p.z : lo.z;  hi.z = p.z > hi.z ? p.z : hi.z;
+    }
+    void grow(const Box& b)
+    {
+        if(b.lo.x <= b.hi.x)
+        {
+            grow(b.lo);
+            grow(b.hi);
+        }
+    }
+    float area() const
+    {
+        if(lo.x > hi.x)
+            return 0.0f;
+        const vector3f d = hi - lo;
+        return 2.0f * (d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+};
+
+//------------------------------------------------------------------------------
+// closestOnTriangle()
+//
+// The closest point of triangle t to p, from Ericson's Real-Time Collision
+// Detection.  feature is 0 for the face, 1 + k for vertex k and 4 + k for
+// edge k.
+//------------------------------------------------------------------------------
+static vector3f closestOnTriangle(const C_MeshCollider::Triangle& t, const vector3f& p, unsigned& feature)
+{
+    const vector3f& a = t.v[0];
+    const vector3f& b = t.v[1];
+    const vector3f& c = t.v[2];
+    const vector3f ab = b - a, ac = c - a, ap = p - a;
+
+    const float d1 = ab * ap, d2 = ac * ap;
+    if(d1 <= 0.0f && d2 <= 0.0f)
+    {
+        feature = 1;
+        return a;
+    }
+
+    const vector3f bp = p - b;
+    const float d3 = ab * bp, d4 = ac * bp;
+    if(d3 >= 0.0f && d4 <= d3)
+    {
+        feature = 2;
+        return b;
+    }
+
+    const float vc = d1*d4 - d3*d2;
+    if(vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+    {
+        feature = 4;
+        return a + ab * (d1 / (d1 - d3));
+    }
+
+    const vector3f cp = p - c;
+    const float d5 = ab * cp, d6 = ac * cp;
+    if(d6 >= 0.0f && d5 <= d6)
+    {
+        feature = 3;
+        return c;
+    }
+
+    const float vb = d5*d2 - d1*d6;
+    if(vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+    {
+        feature = 6;
+        return a + ac * (d2 / (d2 - d6));
+    }
+
+    const float va = d3*d6 - d5*d4;
+    if(va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f)
+    {
+        feature = 5;
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+
+    feature = 0;
+    const float denom = 1.0f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// The squared distance from p to a node's box
+static float boxDistance2(const C_MeshCollider::Node& n, const vector3f& p)
+{
+    const float pc[3] = { p.x, p.y, p.z };
+    float d2 = 0.0f;
+    for(unsigned a = 0; a < 3; ++a)
+    {
+        float d = pc[a] < n.lo[a] ? n.lo[a] - pc[a] : (pc[a] > n.hi[a] ? pc[a] - n.hi[a] : 0.0f);
+        d2 += d * d;
+    }
+    return d2;
+}
+
+// The time the ray from org along the inverse direction inv enters a node's
+// box, or past maxT if it misses it before then
+static float boxEntry(const C_MeshCollider::Node& n, const float org[3], const float inv[3], float maxT)
+{
+    float t0 = 0.0f, t1 = maxT;
+    for(unsigned a = 0; a < 3; ++a)
+    {
+        const float ta = (n.lo[a] - org[a]) * inv[a], tb = (n.hi[a] - org[a]) * inv[a];
+        const float tmin = ta < tb ? ta : tb, tmax = ta < tb ? tb : ta;
+        t0 = tmin > t0 ? tmin : t0;
+        t1 = tmax < t1 ? tmax : t1;
+    }
+    return t0 <= t1 ? t0 : HUGE_VALF;
+}
+
+//==============================================================================
+// CACHE FILE
+//==============================================================================
+
+// The cache file starts with this, the arrays follow at 16 byte aligned
+// offsets
+struct C_MeshCollider::CacheHeader
+{
+    char magic[8];
+    uint32_t version, headerSize;
+    uint64_t key;
+    uint32_t numNodes, numTriangles, numBricks, triangleSize;
+    float voxelSize, band;
+    float origin[3];
+    uint32_t dims[3];
+    uint64_t nodeOffset, triangleOffset, indexOffset, brickOffset, fileSize;
+};
+
+static const char s_cacheMagic[8] = { 'C', 'L', 'O', 'T', 'H', 'M', 'S', 'H' };
+
+//==============================================================================
+// WORKER TASKS
+//==============================================================================
+
+struct C_MeshCollider::BakeTask
+{
+    C_MeshCollider* mesh;
+    void operator()(unsigned begin, unsigned end, unsigned) { mesh->bakeBricks(begin, end); }
+};
+
+//==============================================================================
+// CONSTRUCTORS / DESTRUCTORS
+//==============================================================================
+
+C_MeshCollider::C_MeshCollider() : d_pNodes(0), d_pTriangles(0), d_pBrickIndex(0), d_pBricks(0),
+    d_uNumNodes(0), d_uNumTriangles(0), d_uNumBricks(0), d_fVoxelSize(0), d_fBand(0),
+    d_pMapping(0), d_mappingSize(0)
+{
+    d_dims[0] = d_dims[1] = d_dims[2] = 0;
+#ifdef _WIN32
+    d_hFile = d_hMap = 0;
+#endif
+}
+
+C_MeshCollider::~C_MeshCollider()
+{
+    unmap();
+}
+
+
+//==============================================================================
+// PRIVATE METHODS
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// void buildTriangles()
+//
+// Drops the triangles with no area and works out the normals each feature
+// is signed by: an edge uses the sum of its faces' normals and a vertex the
+// sum of its faces' normals weighted by the angle they make at it, which
+// gives the right sign everywhere around a closed mesh.
+//------------------------------------------------------------------------------
+void C_MeshCollider::buildTriangles(const std::vector<vector3f>& vertices, const std::vector<uint32_t>& indices)
+{
+    std::vector<vector3f> vertexNormals(vertices.size());
+    std::map<uint64_t, vector3f> edgeNormals;
+    std::vector<uint32_t> kept;
+
+    for(size_t f = 0; f + 2 < indices.size(); f += 3)
+    {
+        const uint32_t* id = &indices[f];
+        const vector3f& a = vertices[id[0]];
+        const vector3f& b = vertices[id[1]];
+        const vector3f& c = vertices[id[2]];
+        vector3f n = (b - a).crossProduct(c - a);
+        const float len = n.magnitude();
+        if(len <= 0.0f)
+            continue;
+        n /= len;
+        kept.push_back((uint32_t)f);
+
+        for(unsigned k = 0; k < 3; ++k)
+        {
+            const vector3f& v = vertices[id[k]];
+            vector3f e1 = vertices[id[(k + 1) % 3]] - v, e2 = vertices[id[(k + 2) % 3]] - v;
+            float cosAngle = (e1 * e2) / (e1.magnitude() * e2.magnitude());
+            cosAngle = cosAngle < -1.0f ? -1.0f : (cosAngle > 1.0f ? 1.0f : cosAngle);
+            vertexNormals[id[k]] += n * acosf(cosAngle);
+
+            uint32_t i0 = id[k], i1 = id[(k + 1) % 3];
+            uint64_t key = i0 < i1 ? ((uint64_t)i0 << 32) | i1 : ((uint64_t)i1 << 32) | i0;
+            edgeNormals[key] += n;
+        }
+    }
+
+    d_triangles.resize(kept.size());
+    for(size_t t = 0; t < kept.size(); ++t)
+    {
+        const uint32_t* id = &indices[kept[t]];
+        Triangle& tri = d_triangles[t];
+        for(unsigned k = 0; k < 3; ++k)
+        {
+            tri.v[k] = vertices[id[k]];
+            tri.vertexNormal[k] = vertexNormals[id[k]].normalVector();
+            uint32_t i0 = id[k], i1 = id[(k + 1) % 3];
+            uint64_t key = i0 < i1 ? ((uint64_t)i0 << 32) | i1 : ((uint64_t)i1 << 32) | i0;
+            tri.edgeNormal[k] = edgeNormals[key].normalVector();
+        }
+        tri.normal = (tri.v[1] - tri.v[0]).crossProduct(tri.v[2] - tri.v[0]).normalVector();
+    }
+}
+
+//------------------------------------------------------------------------------
+// void buildTree()
+//
+// Builds the tree over the triangles' centers, then puts the triangles in
+// the order of the leaves.
+//------------------------------------------------------------------------------
+void C_MeshCollider::buildTree()
+{
+    const uint32_t n = (uint32_t)d_triangles.size();
+    std::vector<uint32_t> order(n);
+    std::vector<vector3f> centers(n);
+    for(uint32_t t = 0; t < n; ++t)
+    {
+        order[t] = t;
+        centers[t] = (d_triangles[t].v[0] + d_triangles[t].v[1] + d_triangles[t].v[2]) / 3.0f;
+    }
+
+    d_nodes.clear();
+    d_nodes.reserve(2 * n / MESH_LEAF_TRIANGLES + 1);
+    if(n)
+        buildNode(&order[0], &centers[0], 0, n);
+
+    std::vector<Triangle> sorted(n);
+    for(uint32_t t = 0; t < n; ++t)
+        sorted[t] = d_triangles[order[t]];
+    d_triangles.swap(sorted);
+}
+
+//------------------------------------------------------------------------------
+// uint32_t buildNode()
+//
+// Sorts the triangles [begin, end) into MESH_SAH_BINS buckets along each
+// axis and splits them between the buckets where the summed area of the two
+// sides, each times its triangles, is least.  Stops at a leaf when that
+// costs more than testing every triangle here.
+//------------------------------------------------------------------------------
+uint32_t C_MeshCollider::buildNode(uint32_t* order, const vector3f* centers, uint32_t begin, uint32_t end)
+{
+    const uint32_t index = (uint32_t)d_nodes.size();
+    d_nodes.push_back(Node());
+
+    Box box, centerBox;
+    box.empty();
+    centerBox.empty();
+    for(uint32_t i = begin; i < end; ++i)
+    {
+        const Triangle& t = d_triangles[order[i]];
+        box.grow(t.v[0]);
+        box.grow(t.v[1]);
+        box.grow(t.v[2]);
+        centerBox.grow(centers[order[i]]);
+    }
+    Node& node = d_nodes[index];
+    node.lo[0] = box.lo.x;  node.lo[1] = box.lo.y;  node.lo[2] = box.lo.z;
+    node.hi[0] = box.hi.x;  node.hi[1] = box.hi.y;  node.hi[2] = box.hi.z;
+
+    const uint32_t count = end - begin;
+    unsigned bestAxis = 3, bestBin = 0;
+    float bestCost = box.area() * count;
+    if(count > 1)
+    {
+        for(unsigned axis = 0; axis < 3; ++axis)
+        {
+            const float lo = axisOf(centerBox.lo, axis), extent = axisOf(centerBox.hi, axis) - lo;
+            if(extent <= 0.0f)
+                continue;
+
+            Box bins[MESH_SAH_BINS];
+            uint32_t counts[MESH_SAH_BINS] = { 0 };
+            for(unsigned b = 0; b < MESH_SAH_BINS; ++b)
+                bins[b].empty();
+            for(uint32_t i = begin; i < end; ++i)
+            {
+                const unsigned b = binOf(axisOf(centers[order[i]], axis), lo, extent);
+                const Triangle& t = d_triangles[order[i]];
+                bins[b].grow(t.v[0]);
+                bins[b].grow(t.v[1]);
+                bins[b].grow(t.v[2]);
+                ++counts[b];
+            }
+
+            // The cost of the right side of every split, then sweep the left
+            float rightCost[MESH_SAH_BINS];
+            Box side;
+            side.empty();
+            uint32_t sideCount = 0;
+            for(unsigned b = MESH_SAH_BINS - 1; b > 0; --b)
+            {
+                side.grow(bins[b]);
+                sideCount += counts[b];
+                rightCost[b] = side.area() * sideCount;
+            }
+            side.empty();
+            sideCount = 0;
+            for(unsigned b = 0; b + 1 < MESH_SAH_BINS; ++b)
+            {
+                side.grow(bins[b]);
+                sideCount += counts[b];
+                const float cost = side.area() * sideCount + rightCost[b + 1];
+                if(sideCount && sideCount < count && cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = b;
+                }
+            }
+        }
+    }
+
+    uint32_t mid;
+    if(bestAxis < 3)
+    {
+        const float lo = axisOf(centerBox.lo, bestAxis);
+        BinBelow below = { centers, bestAxis, bestBin, lo, axisOf(centerBox.hi, bestAxis) - lo };
+        mid = (uint32_t)(std::partition(order + begin, order + end, below) - order);
+    }
+    else if(count > MESH_LEAF_TRIANGLES)
+        mid = begin + count / 2;    // All the centers coincide, split anyhow
+    else
+    {
+        d_nodes[index].first = begin;
+        d_nodes[index].count = count;
+        return index;
+    }
+
+    buildNode(order, centers, begin, mid);
+    const uint32_t right = buildNode(order, centers, mid, end);
+    d_nodes[index].first = right;
+    d_nodes[index].count = 0;
+    return index;
+}
+
+//------------------------------------------------------------------------------
+// void bake()
+//
+// Covers the mesh's box, grown by the band, with bricks and keeps the ones
+// a triangle's box grown by the band touches, then samples them over the
+// worker threads.
+//------------------------------------------------------------------------------
+void C_MeshCollider::bake(float voxelSize)
+{
+    d_fVoxelSize = voxelSize;
+    d_fBand = voxelSize * SDF_BAND_CELLS;
+    const float brickSize = voxelSize * SDF_BRICK_CELLS;
+    const vector3f band(d_fBand, d_fBand, d_fBand);
+
+    d_origin = getMin() - band;
+    const vector3f extent = getMax() + band - d_origin;
+    d_dims[0] = (uint32_t)ceilf(extent.x / brickSize);
+    d_dims[1] = (uint32_t)ceilf(extent.y / brickSize);
+    d_dims[2] = (uint32_t)ceilf(extent.z / brickSize);
+    for(unsigned a = 0; a < 3; ++a)
+        d_dims[a] = d_dims[a] ? d_dims[a] : 1;
+
+    d_brickIndex.assign((size_t)d_dims[0] * d_dims[1] * d_dims[2], -1);
+    for(size_t t = 0; t < d_triangles.size(); ++t)
+    {
+        Box box;
+        box.empty();
+        for(unsigned k = 0; k < 3; ++k)
+            box.grow(d_triangles[t].v[k]);
+        const vector3f lo = (box.lo - band - d_origin) / brickSize, hi = (box.hi + band - d_origin) / brickSize;
+        const int x0 = (int)lo.x, y0 = (int)lo.y, z0 = (int)lo.z;
+        const int x1 = std::min((int)hi.x, (int)d_dims[0] - 1);
+        const int y1 = std::min((int)hi.y, (int)d_dims[1] - 1);
+        const int z1 = std::min((int)hi.z, (int)d_dims[2] - 1);
+        for(int z = std::max(z0, 0); z <= z1; ++z)
+            for(int y = std::max(y0, 0); y <= y1; ++y)
+                for(int x = std::max(x0, 0); x <= x1; ++x)
+                    d_brickIndex[((size_t)z * d_dims[1] + y) * d_dims[0] + x] = 0;
+    }
+
+    d_uNumBricks = 0;
+    for(size_t b = 0; b < d_brickIndex.size(); ++b)
+        if(d_brickIndex[b] == 0)
+            d_brickIndex[b] = (int32_t)d_uNumBricks++;
+    d_bricks.resize((size_t)d_uNumBricks * SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES);
+
+    useOwnData();
+    C_WorkerPool workers;
+    workers.setThreadCount(C_WorkerPool::hardwareThreads());
+    BakeTask task = { this };
+    workers.parallelFor((unsigned)d_brickIndex.size(), BAKE_GRAIN, task);
+}
+
+//------------------------------------------------------------------------------
+// void bakeBricks()
+//
+// Samples the bricks of the grid blocks [begin, end).  The samples are
+// stored as a share of the band in 16 bits, the ones further away than the
+// band are clamped to it.
+//------------------------------------------------------------------------------
+void C_MeshCollider::bakeBricks(unsigned begin, unsigned end)
+{
+    const unsigned S = SDF_BRICK_SAMPLES;
+    for(unsigned b = begin; b < end; ++b)
+    {
+        if(d_brickIndex[b] < 0)
+            continue;
+
+        const unsigned bx = b % d_dims[0], by = (b / d_dims[0]) % d_dims[1], bz = b / (d_dims[0] * d_dims[1]);
+        int16_t* samples = &d_bricks[(size_t)d_brickIndex[b] * S * S * S];
+        for(unsigned k = 0; k < S; ++k)
+            for(unsigned j = 0; j < S; ++j)
+                for(unsigned i = 0; i < S; ++i)
+                {
+                    const vector3f p = d_origin + vector3f((float)(bx * SDF_BRICK_CELLS + i),
+                                                           (float)(by * SDF_BRICK_CELLS + j),
+                                                           (float)(bz * SDF_BRICK_CELLS + k)) * d_fVoxelSize;
+                    float dist;
+                    vector3f n;
+                    if(!closestPoint(p, HUGE_VALF, dist, n))
+                        dist = d_fBand;
+                    float s = dist / d_fBand;
+                    s = s < -1.0f ? -1.0f : (s > 1.0f ? 1.0f : s);
+                    samples[(k * S + j) * S + i] = (int16_t)lrintf(s * 32767.0f);
+                }
+    }
+}
+
+//------------------------------------------------------------------------------
+// bool mapCache()
+//
+// Maps the cache file and points the data into it, if it was made from the
+// same OBJ with the same settings and nothing in it is out of bounds.
+//------------------------------------------------------------------------------
+bool C_MeshCollider::mapCache(const char* path, uint64_t key)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if(file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    HANDLE map = 0;
+    void* data = 0;
+    if(GetFileSizeEx(file, &size) && size.QuadPart >= (LONGLONG)sizeof(CacheHeader))
+        map = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+    if(map)
+        data = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+    if(!data)
+    {
+        if(map)
+            CloseHandle(map);
+        CloseHandle(file);
+        return false;
+    }
+    d_hFile = file;
+    d_hMap = map;
+    d_pMapping = data;
+    d_mappingSize = (size_t)size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(CacheHeader))
+        data = mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED)
+        return false;
+    d_pMapping = data;
+    d_mappingSize = (size_t)st.st_size;
+#endif
+
+    const char* base = static_cast<const char*>(d_pMapping);
+    const CacheHeader& h = *reinterpret_cast<const CacheHeader*>(base);
+    const size_t numBlocks = (size_t)h.dims[0] * h.dims[1] * h.dims[2];
+    const size_t brickBytes = (size_t)h.numBricks * SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES * sizeof(int16_t);
+    if(memcmp(h.magic, s_cacheMagic, sizeof(h.magic)) != 0 || h.version != MESH_CACHE_VERSION ||
+       h.headerSize != sizeof(CacheHeader) || h.triangleSize != sizeof(Triangle) || h.key != key ||
+       h.fileSize != d_mappingSize || !h.numNodes ||
+       h.nodeOffset + (uint64_t)h.numNodes * sizeof(Node) > d_mappingSize ||
+       h.triangleOffset + (uint64_t)h.numTriangles * sizeof(Triangle) > d_mappingSize ||
+       h.indexOffset + numBlocks * sizeof(int32_t) > d_mappingSize ||
+       h.brickOffset + brickBytes > d_mappingSize)
+    {
+        unmap();
+        return false;
+    }
+
+    d_pNodes = reinterpret_cast<const Node*>(base + h.nodeOffset);
+    d_pTriangles = reinterpret_cast<const Triangle*>(base + h.triangleOffset);
+    d_pBrickIndex = h.voxelSize > 0.0f ? reinterpret_cast<const int32_t*>(base + h.indexOffset) : 0;
+    d_pBricks = h.voxelSize > 0.0f ? reinterpret_cast<const int16_t*>(base + h.brickOffset) : 0;
+    d_uNumNodes = h.numNodes;
+    d_uNumTriangles = h.numTriangles;
+    d_uNumBricks = h.numBricks;
+    d_fVoxelSize = h.voxelSize;
+    d_fBand = h.band;
+    d_origin = vector3f(h.origin[0], h.origin[1], h.origin[2]);
+    for(unsigned a = 0; a < 3; ++a)
+        d_dims[a] = h.dims[a];
+    return true;
+}
+
+bool C_MeshCollider::writeCache(const char* path, uint64_t key) const
+{
+    CacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, s_cacheMagic, sizeof(h.magic));
+    h.version = MESH_CACHE_VERSION;
+    h.headerSize = sizeof(CacheHeader);
+    h.key = key;
+    h.numNodes = d_uNumNodes;
+    h.numTriangles = d_uNumTriangles;
+    h.numBricks = d_uNumBricks;
+    h.triangleSize = sizeof(Triangle);
+    h.voxelSize = d_fVoxelSize;
+    h.band = d_fBand;
+    h.origin[0] = d_origin.x;  h.origin[1] = d_origin.y;  h.origin[2] = d_origin.z;
+    for(unsigned a = 0; a < 3; ++a)
+        h.dims[a] = d_dims[a];
+
+    const size_t numBlocks = (size_t)d_dims[0] * d_dims[1] * d_dims[2];
+    const size_t brickBytes = (size_t)d_uNumBricks * SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES * sizeof(int16_t);
+    h.nodeOffset = alignUp(sizeof(CacheHeader));
+    h.triangleOffset = alignUp(h.nodeOffset + d_uNumNodes * sizeof(Node));
+    h.indexOffset = alignUp(h.triangleOffset + d_uNumTriangles * sizeof(Triangle));
+    h.brickOffset = alignUp(h.indexOffset + (hasDistanceField() ? numBlocks * sizeof(int32_t) : 0));
+    h.fileSize = h.brickOffset + (hasDistanceField() ? brickBytes : 0);
+
+    FILE* f = fopen(path, "wb");
+    if(!f)
+        return false;
+
+    // The arrays are padded out to their offsets with zeros
+    static const char zeros[16] = { 0 };
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && fwrite(zeros, 1, h.nodeOffset - sizeof(h), f) == h.nodeOffset - sizeof(h);
+    ok = ok && fwrite(d_pNodes, sizeof(Node), d_uNumNodes, f) == d_uNumNodes;
+    size_t at = h.nodeOffset + d_uNumNodes * sizeof(Node);
+    ok = ok && fwrite(zeros, 1, h.triangleOffset - at, f) == h.triangleOffset - at;
+    ok = ok && fwrite(d_pTriangles, sizeof(Triangle), d_uNumTriangles, f) == d_uNumTriangles;
+    at = h.triangleOffset + d_uNumTriangles * sizeof(Triangle);
+    ok = ok && fwrite(zeros, 1, h.indexOffset - at, f) == h.indexOffset - at;
+    if(hasDistanceField())
+    {
+        ok = ok && fwrite(d_pBrickIndex, sizeof(int32_t), numBlocks, f) == numBlocks;
+        at = h.indexOffset + numBlocks * sizeof(int32_t);
+        ok = ok && fwrite(zeros, 1, h.brickOffset - at, f) == h.brickOffset - at;
+        ok = ok && fwrite(d_pBricks, 1, brickBytes, f) == brickBytes;
+    }
+    ok = fclose(f) == 0 && ok;
+
+    // A broken file fails its size check on the next load, but is no use
+    if(!ok)
+        remove(path);
+    return ok;
+}
+
+void C_MeshCollider::unmap()
+{
+    if(!d_pMapping)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(d_pMapping);
+    CloseHandle(d_hMap);
+    CloseHandle(d_hFile);
+    d_hFile = d_hMap = 0;
+#else
+    munmap(d_pMapping, d_mappingSize);
+#endif
+    d_pMapping = 0;
+    d_mappingSize = 0;
+}
+
+void C_MeshCollider::useOwnData()
+{
+    d_pNodes = d_nodes.empty() ? 0 : &d_nodes[0];
+    d_pTriangles = d_triangles.empty() ? 0 : &d_triangles[0];
+    d_pBrickIndex = d_brickIndex.empty() ? 0 : &d_brickIndex[0];
+    d_pBricks = d_bricks.empty() ? 0 : &d_bricks[0];
+    d_uNumNodes = (uint32_t)d_nodes.size();
+    d_uNumTriangles = (uint32_t)d_triangles.size();
+}
+
+
+//==============================================================================
+// PUBLIC METHODS
+//==============================================================================
+
+void C_MeshCollider::clear()
+{
+    unmap();
+    d_nodes.clear();
+    d_triangles.clear();
+    d_brickIndex.clear();
+    d_bricks.clear();
+    d_pNodes = 0;
+    d_pTriangles = 0;
+    d_pBrickIndex = 0;
+    d_pBricks = 0;
+    d_uNumNodes = d_uNumTriangles = d_uNumBricks = 0;
+    d_fVoxelSize = d_fBand = 0;
+    d_dims[0] = d_dims[1] = d_dims[2] = 0;
+}
+
+//------------------------------------------------------------------------------
+// bool load()
+//
+// The cache key covers the OBJ's bytes and everything that changes what is
+// baked from them, so a cache is never used for the wrong mesh or settings.
+//------------------------------------------------------------------------------
+bool C_MeshCollider::load(const char* objPath, float voxelSize, const char* cachePath)
+{
+    clear();
+
+    std::vector<char> text;
+    if(!readTextFile(objPath, text))
+        return false;
+
+    const float voxel = voxelSize > 0.0f ? voxelSize : 0.0f;
+    const uint32_t settings[4] = { MESH_CACHE_VERSION, SDF_BRICK_CELLS, SDF_BAND_CELLS, MESH_LEAF_TRIANGLES };
+    uint64_t key = hashBytes(&text[0], text.size(), 14695981039346656037ull);
+    key = hashBytes(&voxel, sizeof(voxel), key);
+    key = hashBytes(settings, sizeof(settings), key);
+
+    if(cachePath && mapCache(cachePath, key))
+        return true;
+
+    ObjMesh obj;
+    if(!parseOBJ(&text[0], text.size() - 1, obj))
+        return false;
+    buildTriangles(obj.positions, obj.indices);
+    if(d_triangles.empty())
+        return false;
+
+    buildTree();
+    useOwnData();
+    if(voxel > 0.0f)
+        bake(voxel);
+
+    if(cachePath)
+        writeCache(cachePath, key);
+    return true;
+}
+
+vector3f C_MeshCollider::getMin() const
+{
+    return d_uNumNodes ? vector3f(d_pNodes[0].lo[0], d_pNodes[0].lo[1], d_pNodes[0].lo[2]) : vector3f();
+}
+
+vector3f C_MeshCollider::getMax() const
+{
+    return d_uNumNodes ? vector3f(d_pNodes[0].hi[0], d_pNodes[0].hi[1], d_pNodes[0].hi[2]) : vector3f();
+}
+
+//------------------------------------------------------------------------------
+// bool closestPoint()
+//
+// Walks the tree nearest child first and skips every node further away than
+// the closest point so far.
+//------------------------------------------------------------------------------
+bool C_MeshCollider::closestPoint(const vector3f& p, float maxDist, float& distance, vector3f& normal) const
+{
+    if(!d_uNumNodes)
+        return false;
+
+    float best2 = maxDist < HUGE_VALF ? maxDist * maxDist : HUGE_VALF;
+    const Triangle* bestTri = 0;
+    vector3f bestPoint;
+    unsigned bestFeature = 0;
+
+    uint32_t stack[MESH_STACK_SIZE], top = 0;
+    float entry[MESH_STACK_SIZE];
+    stack[top] = 0;
+    entry[top++] = boxDistance2(d_pNodes[0], p);
+    while(top)
+    {
+        --top;
+        if(entry[top] >= best2)
+            continue;
+        const Node& n = d_pNodes[stack[top]];
+
+        if(n.count)
+        {
+            for(uint32_t t = n.first; t < n.first + n.count; ++t)
+            {
+                unsigned feature;
+                const vector3f q = closestOnTriangle(d_pTriangles[t], p, feature);
+                const vector3f d = p - q;
+                const float d2 = d * d;
+                if(d2 < best2)
+                {
+                    best2 = d2;
+                    bestTri = &d_pTriangles[t];
+                    bestPoint = q;
+                    bestFeature = feature;
+                }
+            }
+            continue;
+        }
+
+        // Push the further child first so the nearer is walked next
+        const uint32_t left = (uint32_t)(&n - d_pNodes) + 1, right = n.first;
+        const float dl = boxDistance2(d_pNodes[left], p), dr = boxDistance2(d_pNodes[right], p);
+        if(top + 2 > MESH_STACK_SIZE)
+            continue;
+        const bool leftFirst = dl <= dr;
+        stack[top] = leftFirst ? right : left;
+        entry[top++] = leftFirst ? dr : dl;
+        stack[top] = leftFirst ? left : right;
+        entry[top++] = leftFirst ? dl : dr;
+    }
+
+    if(!bestTri)
+        return false;
+
+    const vector3f& pseudo = bestFeature == 0 ? bestTri->normal :
+                             (bestFeature < 4 ? bestTri->vertexNormal[bestFeature - 1] :
+                                                bestTri->edgeNormal[bestFeature - 4]);
+    const vector3f d = p - bestPoint;
+    const float len = sqrtf(best2);
+    const float sign = d * pseudo < 0.0f ? -1.0f : 1.0f;
+    distance = sign * len;
+    normal = len > 1e-12f ? d * (sign / len) : pseudo;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// bool sampleDistance()
+//
+// Blends the 8 samples around p, and takes the normal from the gradient of
+// the blend.
+//------------------------------------------------------------------------------
+bool C_MeshCollider::sampleDistance(const vector3f& p, float& distance, vector3f& normal) const
+{
+    if(!d_pBrickIndex)
+        return false;
+
+    const vector3f g = (p - d_origin) / d_fVoxelSize;
+    if(g.x < 0.0f || g.y < 0.0f || g.z < 0.0f)
+        return false;
+    const unsigned bx = (unsigned)(g.x / SDF_BRICK_CELLS), by = (unsigned)(g.y / SDF_BRICK_CELLS),
+                   bz = (unsigned)(g.z / SDF_BRICK_CELLS);
+    if(bx >= d_dims[0] || by >= d_dims[1] || bz >= d_dims[2])
+        return false;
+    const int32_t brick = d_pBrickIndex[((size_t)bz * d_dims[1] + by) * d_dims[0] + bx];
+    if(brick < 0)
+        return false;
+
+    const float lx = g.x - bx * SDF_BRICK_CELLS, ly = g.y - by * SDF_BRICK_CELLS, lz = g.z - bz * SDF_BRICK_CELLS;
+    const unsigned i = lx < SDF_BRICK_CELLS - 1 ? (unsigned)lx : SDF_BRICK_CELLS - 1;
+    const unsigned j = ly < SDF_BRICK_CELLS - 1 ? (unsigned)ly : SDF_BRICK_CELLS - 1;
+    const unsigned k = lz < SDF_BRICK_CELLS - 1 ? (unsigned)lz : SDF_BRICK_CELLS - 1;
+    const float tx = lx - i, ty = ly - j, tz = lz - k;
+
+    const unsigned S = SDF_BRICK_SAMPLES;
+    const int16_t* s = d_pBricks + (size_t)brick * S * S * S + (k * S + j) * S + i;
+    const float c000 = s[0], c100 = s[1], c010 = s[S], c110 = s[S + 1];
+    const float c001 = s[S*S], c101 = s[S*S + 1], c011 = s[S*S + S], c111 = s[S*S + S + 1];
+
+    const float c00 = c000 + (c100 - c000) * tx, c10 = c010 + (c110 - c010) * tx;
+    const float c01 = c001 + (c101 - c001) * tx, c11 = c011 + (c111 - c011) * tx;
+    const float c0 = c00 + (c10 - c00) * ty, c1 = c01 + (c11 - c01) * ty;
+
+    const float scale = d_fBand / 32767.0f;
+    distance = (c0 + (c1 - c0) * tz) * scale;
+
+    vector3f grad;
+    grad.x = ((c100 - c000) * (1 - ty) + (c110 - c010) * ty) * (1 - tz) +
+             ((c101 - c001) * (1 - ty) + (c111 - c011) * ty) * tz;
+    grad.y = (c10 - c00) * (1 - tz) + (c11 - c01) * tz;
+    grad.z = c1 - c0;
+    const float len = grad.magnitude();
+    normal = len > 0.0f ? grad / len : vector3f(0, 1, 0);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// bool raycast()
+//
+// Walks the tree nearest child first along the ray and skips every node that
+// starts beyond the nearest hit so far.  The triangles are tested with the
+// Moller-Trumbore test, from either side.
+//------------------------------------------------------------------------------
+bool C_MeshCollider::raycast(const vector3f& origin, const vector3f& dir, float maxT, float& t,
+                             vector3f& normal) const
+{
+    if(!d_uNumNodes)
+        return false;
+
+    const float org[3] = { origin.x, origin.y, origin.z };
+    const float inv[3] = { 1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z };
+    float best = maxT;
+    const Triangle* bestTri = 0;
+
+    uint32_t stack[MESH_STACK_SIZE], top = 0;
+    float entry[MESH_STACK_SIZE];
+    stack[top] = 0;
+    entry[top++] = boxEntry(d_pNodes[0], org, inv, best);
+    while(top)
+    {
+        --top;
+        if(entry[top] > best)
+            continue;
+        const Node& n = d_pNodes[stack[top]];
+
+        if(n.count)
+        {
+            for(uint32_t k = n.first; k < n.first + n.count; ++k)
+            {
+                const Triangle& tri = d_pTriangles[k];
+                const vector3f e1 = tri.v[1] - tri.v[0], e2 = tri.v[2] - tri.v[0];
+                const vector3f p = dir.crossProduct(e2);
+                const float det = e1 * p;
+                if(fabsf(det) < 1e-12f)
+                    continue;
+                const float invDet = 1.0f / det;
+                const vector3f s = origin - tri.v[0];
+                const float u = (s * p) * invDet;
+                if(u < 0.0f || u > 1.0f)
+                    continue;
+                const vector3f q = s.crossProduct(e1);
+                const float v = (dir * q) * invDet;
+                if(v < 0.0f || u + v > 1.0f)
+                    continue;
+                const float tHit = (e2 * q) * invDet;
+                if(tHit >= 0.0f && tHit < best)
+                {
+                    best = tHit;
+                    bestTri = &tri;
+                }
+            }
+            continue;
+        }
+
+        // Push the further child first so the nearer is walked next
+        const uint32_t left = (uint32_t)(&n - d_pNodes) + 1, right = n.first;
+        const float tl = boxEntry(d_pNodes[left], org, inv, best), tr = boxEntry(d_pNodes[right], org, inv, best);
+        if(top + 2 > MESH_STACK_SIZE)
+            continue;
+        const bool leftFirst = tl <= tr;
+        stack[top] = leftFirst ? right : left;
+        entry[top++] = leftFirst ? tr : tl;
+        stack[top] = leftFirst ? left : right;
+        entry[top++] = leftFirst ? tl : tr;
+    }
+
+    if(!bestTri)
+        return false;
+    t = best;
+    normal = bestTri->normal;
+    return true;
+}
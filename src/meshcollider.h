@@ -0,0 +1,171 @@
+/*==============================================================================
+/ meshcollider.h
+/ A static triangle mesh the cloth collides with, loaded from an OBJ file.
+/
+/ The triangles are put in a bounding volume hierarchy built with the surface
+/ area heuristic, which finds the closest point of the mesh to a particle.
+/ The mesh can also bake a narrow band signed distance field: the distance
+/ to the surface is sampled on a grid of voxelSize cells, only in the bricks
+/ of SDF_BRICK_CELLS cells that lie within SDF_BAND_CELLS of a triangle, so a
+/ particle near the surface costs one trilinear lookup instead of a walk of
+/ the tree.  Outside the band the field reports nothing.  The sign comes
+/ from the angle weighted normals of the closest feature, which needs a
+/ closed mesh; the tree alone works on open ones too.
+/
+/ Both can be cached in a file next to the OBJ.  The file is the tree, the
+/ triangles and the bricks as they sit in memory, so a later load maps it
+/ and points straight into it without parsing or building anything.  The
+/ cache holds a hash of the OBJ's bytes and the voxel size and is only used
+/ if both match.  It is written in the machine's byte order.
+/=============================================================================*/
+
+#ifndef _MESHCOLLIDER_
+#define _MESHCOLLIDER_
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "vector3.h"
+#include <stdint.h>
+#include <vector>
+
+// Most triangles in a leaf of the tree
+#define MESH_LEAF_TRIANGLES 4
+
+// Buckets the triangles are sorted into along each axis to find a split
+#define MESH_SAH_BINS 12
+
+// Cells along each side of a brick of the distance field, whose samples at
+// the cell corners are SDF_BRICK_CELLS + 1 to a side
+#define SDF_BRICK_CELLS 7
+
+// Cells either side of the surface the distance field covers
+#define SDF_BAND_CELLS 3
+
+//==============================================================================
+// CLASS DEFINITION
+//==============================================================================
+class C_MeshCollider
+{
+public:
+    // An inner node's first child follows it and its second is at first, a
+    // leaf has count triangles from first on
+    struct Node
+    {
+        float lo[3];
+        uint32_t first;
+        float hi[3];
+        uint32_t count;
+    };
+
+    // A triangle with the normals its faces, edges and corners are signed by
+    struct Triangle
+    {
+        vector3f v[3];
+        vector3f normal;
+        vector3f edgeNormal[3];     // Edge k runs from v[k] to v[k + 1]
+        vector3f vertexNormal[3];
+    };
+
+private:
+    struct CacheHeader;
+    struct BakeTask;
+
+    //----------------------------------------------------------------------
+    // Private Members
+    //----------------------------------------------------------------------
+
+    // Filled when the mesh is built here, empty when it was mapped
+    std::vector<Node> d_nodes;
+    std::vector<Triangle> d_triangles;
+    std::vector<int32_t> d_brickIndex;
+    std::vector<int16_t> d_bricks;
+
+    // The data in use, pointing into the vectors above or the mapped cache
+    const Node* d_pNodes;
+    const Triangle* d_pTriangles;
+    const int32_t* d_pBrickIndex;   // Brick of each block of the grid, -1 if none
+    const int16_t* d_pBricks;       // Samples as a share of the band, x fastest
+    uint32_t d_uNumNodes, d_uNumTriangles, d_uNumBricks;
+
+    float d_fVoxelSize, d_fBand;    // 0 when there is no distance field
+    vector3f d_origin;              // Corner of the grid
+    uint32_t d_dims[3];             // Bricks along each axis
+
+    void* d_pMapping;               // The mapped cache file
+    size_t d_mappingSize;
+#ifdef _WIN32
+    void *d_hFile, *d_hMap;
+#endif
+
+    // Not copyable, the pointers may point into its own vectors
+    C_MeshCollider(const C_MeshCollider&);
+    C_MeshCollider& operator=(const C_MeshCollider&);
+
+    //----------------------------------------------------------------------
+    // Private Methods
+    //----------------------------------------------------------------------
+    void buildTriangles(const std::vector<vector3f>& vertices, const std::vector<uint32_t>& indices);
+    void buildTree();
+    uint32_t buildNode(uint32_t* order, const vector3f* centers, uint32_t begin, uint32_t end);
+    void bake(float voxelSize);
+    void bakeBricks(unsigned begin, unsigned end);
+
+    bool mapCache(const char* path, uint64_t key);
+    bool writeCache(const char* path, uint64_t key) const;
+    void unmap();
+
+    // Points the data at the vectors
+    void useOwnData();
+
+public:
+        //----------------------------------------------------------------------
+        // Public Methods
+        //----------------------------------------------------------------------
+        C_MeshCollider();
+        ~C_MeshCollider();
+
+        // Loads the triangles of an OBJ file, polygons are split into fans.
+        // A voxelSize above zero also bakes a distance field.  With a cache
+        // path the cache is used if it matches and written if not.  Returns
+        // false if the file could not be read or had no triangles.
+        bool load(const char* objPath, float voxelSize = 0.0f, const char* cachePath = 0);
+
+        void clear();
+
+        bool isMapped() const { return d_pMapping != 0; }
+        bool hasDistanceField() const { return d_fVoxelSize > 0.0f; }
+        uint32_t getTriangleCount() const { return d_uNumTriangles; }
+        uint32_t getNodeCount() const { return d_uNumNodes; }
+        uint32_t getBrickCount() const { return d_uNumBricks; }
+        const Node* getNodes() const { return d_pNodes; }
+        const Triangle* getTriangles() const { return d_pTriangles; }
+
+        // The box around the mesh
+        vector3f getMin() const;
+        vector3f getMax() const;
+
+        // Finds the closest point of the mesh to p no further than maxDist.
+        // distance is negative inside a closed mesh and normal points away
+        // from the surface.  Returns false if nothing is that close.
+        bool closestPoint(const vector3f& p, float maxDist, float& distance, vector3f& normal) const;
+
+        // Looks p up in the distance field.  Returns false outside its band.
+        bool sampleDistance(const vector3f& p, float& distance, vector3f& normal) const;
+
+        // Finds the nearest triangle hit by the ray from origin along dir, no
+        // further than maxT times dir, from either side.  t is in units of
+        // dir and normal is the triangle's.  Returns false on a miss.
+        bool raycast(const vector3f& origin, const vector3f& dir, float maxT, float& t, vector3f& normal) const;
+
+        // The distance field if there is one, the tree otherwise
+        bool distance(const vector3f& p, float maxDist, float& distance, vector3f& normal) const
+        {
+            if(hasDistanceField())
+                return sampleDistance(p, distance, normal) && distance < maxDist;
+            return closestPoint(p, maxDist, distance, normal);
+        }
+};
+
+
+#endif
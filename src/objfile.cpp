@@ -0,0 +1,126 @@
+/*==============================================================================
+/ objfile.cpp
+/ Reads the geometry of Wavefront OBJ files.
+/=============================================================================*/
+
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "objfile.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+//==============================================================================
+// LOCAL FUNCTIONS
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// Turns a one based or negative OBJ index into a zero based one into a list
+// of count entries.  Returns false if it is out of range.
+//------------------------------------------------------------------------------
+static bool resolveIndex(long i, size_t count, uint32_t& index)
+{
+    if(i < 0)
+        i += (long)count;
+    else
+        --i;
+    if(i < 0 || i >= (long)count)
+        return false;
+    index = (uint32_t)i;
+    return true;
+}
+
+
+//==============================================================================
+// FUNCTIONS
+//==============================================================================
+
+bool readTextFile(const char* path, std::vector<char>& text)
+{
+    FILE* f = fopen(path, "rb");
+    if(!f)
+        return false;
+    text.clear();
+    char buffer[65536];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        text.insert(text.end(), buffer, buffer + n);
+    fclose(f);
+    text.push_back('\0');
+    return true;
+}
+
+bool parseOBJ(const char* text, size_t size, ObjMesh& mesh)
+{
+    const char* p = text;
+    const char* end = text + size;
+    std::vector<uint32_t> face, faceTex;
+    while(p < end)
+    {
+        const char* eol = p;
+        while(eol < end && *eol != '\n')
+            ++eol;
+
+        if(p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            char* q;
+            float x = strtof(p + 2, &q);
+            float y = strtof(q, &q);
+            float z = strtof(q, &q);
+            mesh.positions.push_back(vector3f(x, y, z));
+        }
+        else if(p[0] == 'v' && p[1] == 't' && (p[2] == ' ' || p[2] == '\t'))
+        {
+            char* q;
+            float u = strtof(p + 3, &q);
+            float v = strtof(q, &q);
+            mesh.texCoords.push_back(u);
+            mesh.texCoords.push_back(v);
+        }
+        else if(p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            face.clear();
+            faceTex.clear();
+            const char* q = p + 2;
+            while(q < eol)
+            {
+                char* next;
+                long i = strtol(q, &next, 10);
+                if(next == q)
+                    break;
+                uint32_t index, tex = OBJ_NO_TEXCOORD;
+                if(!resolveIndex(i, mesh.positions.size(), index))
+                    return false;
+                q = next;
+
+                // The texture index if there is one, the normal is skipped
+                if(q + 1 < eol && *q == '/' && (q[1] == '-' || (q[1] >= '0' && q[1] <= '9')))
+                {
+                    i = strtol(q + 1, &next, 10);
+                    if(!resolveIndex(i, mesh.texCoords.size() / 2, tex))
+                        return false;
+                    q = next;
+                }
+                face.push_back(index);
+                faceTex.push_back(tex);
+
+                while(q < eol && *q != ' ' && *q != '\t' && *q != '\r')
+                    ++q;
+                while(q < eol && (*q == ' ' || *q == '\t' || *q == '\r'))
+                    ++q;
+            }
+            for(size_t k = 2; k < face.size(); ++k)
+            {
+                mesh.indices.push_back(face[0]);
+                mesh.indices.push_back(face[k - 1]);
+                mesh.indices.push_back(face[k]);
+                mesh.texIndices.push_back(faceTex[0]);
+                mesh.texIndices.push_back(faceTex[k - 1]);
+                mesh.texIndices.push_back(faceTex[k]);
+            }
+        }
+        p = eol + 1;
+    }
+    return true;
+}
@@ -0,0 +1,45 @@
+/*==============================================================================
+/ objfile.h
+/ Reads the geometry of Wavefront OBJ files, shared by the mesh collider and
+/ the mesh cloth.  Only the v, vt and f lines are read, everything else is
+/ skipped.  Polygons are split into fans of triangles.
+/=============================================================================*/
+
+#ifndef _OBJFILE_
+#define _OBJFILE_
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "vector3.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Texture index of a face corner that was written without one
+#define OBJ_NO_TEXCOORD 0xffffffffu
+
+// The triangles of an OBJ file, three position indices a triangle in
+// indices and the texture indices of the same corners in texIndices
+struct ObjMesh
+{
+    std::vector<vector3f> positions;
+    std::vector<float> texCoords;       // u, v pairs
+    std::vector<uint32_t> indices, texIndices;
+};
+
+//==============================================================================
+// FUNCTIONS
+//==============================================================================
+
+// Reads a whole file into text and puts a terminating zero after it, which
+// is not counted by the parser.  Returns false if it could not be opened.
+bool readTextFile(const char* path, std::vector<char>& text);
+
+// Parses size bytes of OBJ text into mesh.  Face corners may be written v,
+// v/t, v//n or v/t/n and negative indices count back from the last vertex.
+// Returns false if a face refers to a vertex that does not exist.
+bool parseOBJ(const char* text, size_t size, ObjMesh& mesh);
+
+
+#endif
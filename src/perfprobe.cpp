@@ -0,0 +1,312 @@
+/*==============================================================================
+/ perfprobe.cpp
+/=============================================================================*/
+
+#include "perfprobe.h"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// Threads that may record, the pool workers plus the GUI thread fit easily
+#define PERF_MAX_THREADS 256
+
+//==============================================================================
+// RING REGISTRY
+//==============================================================================
+
+static std::mutex s_ringMutex;
+static C_PerfRing* s_rings[PERF_MAX_THREADS];
+static std::atomic<unsigned> s_numRings(0);
+
+// Rings outlive their threads so that samples can still be read after a
+// worker pool is resized.  Each thread leaks one ring at most.
+static thread_local C_PerfRing* t_ring = 0;
+
+static const char* s_stageNames[PERF_NUM_STAGES] =
+{
+    "stepSimulation",
+    "sumForces",
+    "integrate",
+    "applyConstraints",
+    "constraintIteration",
+    "paintGL",
+    "draw",
+    "upload",
+    "normals",
+    "tileBounds",
+    "selfCollision",
+    "bvhRefit",
+    "continuousCollision",
+    "tearing"
+};
+
+std::atomic<unsigned> C_PerfProbes::s_traceEpoch(0);
+static unsigned s_lastTraceEpoch = 0;       // The epoch of the current or last trace
+static uint64_t s_traceStart = 0;           // Timestamps of the current or last trace
+static uint64_t s_traceEnd = 0;
+
+//==============================================================================
+// C_PerfRing
+//==============================================================================
+
+C_PerfRing::C_PerfRing(unsigned threadIndex) : d_head(0), d_uThreadIndex(threadIndex),
+    d_traceCount(0), d_uTraceEpoch(0)
+{
+    snprintf(d_name, sizeof(d_name), "thread %u", threadIndex);
+    for(unsigned i = 0; i < PERF_TRACE_MAX_BLOCKS; ++i)
+        d_traceBlocks[i] = 0;
+}
+
+C_PerfRing::~C_PerfRing()
+{
+    for(unsigned i = 0; i < PERF_TRACE_MAX_BLOCKS; ++i)
+        delete [] d_traceBlocks[i];
+}
+
+void C_PerfRing::setName(const char* name)
+{
+    strncpy(d_name, name, sizeof(d_name) - 1);
+    d_name[sizeof(d_name) - 1] = 0;
+}
+
+//------------------------------------------------------------------------------
+// void appendTrace()
+//
+// Adds a sample to the trace log.  The first sample of a new trace restarts
+// the log, reusing the blocks of the previous one.  Once the log is full
+// further samples are dropped.
+//------------------------------------------------------------------------------
+void C_PerfRing::appendTrace(const PerfSample& s, unsigned epoch)
+{
+    if(d_uTraceEpoch != epoch)
+    {
+        d_traceCount.store(0, std::memory_order_relaxed);
+        d_uTraceEpoch = epoch;
+    }
+
+    uint64_t count = d_traceCount.load(std::memory_order_relaxed);
+    uint64_t block = count / PERF_TRACE_BLOCK_SIZE;
+    if(block >= PERF_TRACE_MAX_BLOCKS)
+        return;
+    if(!d_traceBlocks[block])
+        d_traceBlocks[block] = new PerfSample[PERF_TRACE_BLOCK_SIZE];
+
+    d_traceBlocks[block][count % PERF_TRACE_BLOCK_SIZE] = s;
+    d_traceCount.store(count + 1, std::memory_order_release);
+}
+
+unsigned C_PerfRing::read(PerfSample* out, unsigned max) const
+{
+    uint64_t head = d_head.load(std::memory_order_acquire);
+
+    // Leave a margin at the old end, the writer may be overwriting it
+    uint64_t avail = std::min<uint64_t>(head, PERF_RING_SIZE - 64);
+    if(avail > max)
+        avail = max;
+
+    uint64_t first = head - avail;
+    for(uint64_t i = first; i < head; ++i)
+        out[i - first] = d_samples[i & (PERF_RING_SIZE - 1)];
+
+    // Drop anything that was overwritten while copying
+    uint64_t after = d_head.load(std::memory_order_acquire);
+    uint64_t lost = 0;
+    if(after - first > PERF_RING_SIZE - 64)
+        lost = std::min<uint64_t>(avail, after - first - (PERF_RING_SIZE - 64));
+    if(lost)
+        std::copy(out + lost, out + avail, out);
+    return (unsigned)(avail - lost);
+}
+
+//==============================================================================
+// C_PerfProbes
+//==============================================================================
+
+uint64_t C_PerfProbes::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+C_PerfRing* C_PerfProbes::threadRing()
+{
+    if(!t_ring)
+    {
+        std::lock_guard<std::mutex> lock(s_ringMutex);
+        unsigned n = s_numRings.load(std::memory_order_relaxed);
+        t_ring = new C_PerfRing(n);
+        // Past the limit the thread still records, it just cannot be read
+        if(n < PERF_MAX_THREADS)
+        {
+            s_rings[n] = t_ring;
+            s_numRings.store(n + 1, std::memory_order_release);
+        }
+    }
+    return t_ring;
+}
+
+unsigned C_PerfProbes::getRings(C_PerfRing** out, unsigned max)
+{
+    unsigned n = std::min(s_numRings.load(std::memory_order_acquire), max);
+    for(unsigned i = 0; i < n; ++i)
+        out[i] = s_rings[i];
+    return n;
+}
+
+const char* C_PerfProbes::getStageName(PerfStage stage)
+{
+    return stage < PERF_NUM_STAGES ? s_stageNames[stage] : "unknown";
+}
+
+bool C_PerfProbes::getStats(PerfStage stage, double windowSeconds, PerfStageStats& stats)
+{
+    std::vector<double> durations;
+    std::vector<PerfSample> buf(PERF_RING_SIZE);
+    C_PerfRing* rings[PERF_MAX_THREADS];
+
+    const uint64_t cutoff = now() - (uint64_t)(windowSeconds * 1e9);
+    unsigned numRings = getRings(rings, PERF_MAX_THREADS);
+    for(unsigned r = 0; r < numRings; ++r)
+    {
+        unsigned n = rings[r]->read(&buf[0], PERF_RING_SIZE);
+        for(unsigned i = 0; i < n; ++i)
+            if(buf[i].stage == (uint32_t)stage && buf[i].end >= cutoff)
+                durations.push_back((buf[i].end - buf[i].start) * 1e-3);
+    }
+
+    stats.count = (unsigned)durations.size();
+    stats.meanUs = stats.p50Us = stats.p99Us = stats.maxUs = 0;
+    stats.perSecond = windowSeconds > 0 ? stats.count / windowSeconds : 0;
+    std::fill(stats.histogram, stats.histogram + PERF_HISTOGRAM_BINS, 0u);
+    if(durations.empty())
+        return false;
+
+    std::sort(durations.begin(), durations.end());
+    double sum = 0;
+    for(size_t i = 0; i < durations.size(); ++i)
+    {
+        double us = durations[i];
+        sum += us;
+
+        unsigned bin = 0;
+        for(double limit = 1.0; us >= limit && bin < PERF_HISTOGRAM_BINS - 1; limit *= 2.0)
+            ++bin;
+        stats.histogram[bin]++;
+    }
+
+    size_t last = durations.size() - 1;
+    stats.meanUs = sum / durations.size();
+    stats.p50Us = durations[(size_t)(last * 0.5 + 0.5)];
+    stats.p99Us = durations[(size_t)(last * 0.99 + 0.5)];
+    stats.maxUs = durations[last];
+    return true;
+}
+
+unsigned C_PerfProbes::getRecent(PerfStage stage, double* out, unsigned max)
+{
+    std::vector<PerfSample> all, buf(PERF_RING_SIZE);
+    C_PerfRing* rings[PERF_MAX_THREADS];
+
+    unsigned numRings = getRings(rings, PERF_MAX_THREADS);
+    for(unsigned r = 0; r < numRings; ++r)
+    {
+        unsigned n = rings[r]->read(&buf[0], PERF_RING_SIZE);
+        for(unsigned i = 0; i < n; ++i)
+            if(buf[i].stage == (uint32_t)stage)
+                all.push_back(buf[i]);
+    }
+
+    // Samples of different threads interleave, order them by end time
+    struct ByEnd
+    {
+        bool operator()(const PerfSample& a, const PerfSample& b) const { return a.end < b.end; }
+    };
+    std::sort(all.begin(), all.end(), ByEnd());
+
+    unsigned n = (unsigned)std::min<size_t>(all.size(), max);
+    size_t first = all.size() - n;
+    for(unsigned i = 0; i < n; ++i)
+        out[i] = (all[first + i].end - all[first + i].start) * 1e-3;
+    return n;
+}
+
+void C_PerfProbes::setThreadName(const char* name)
+{
+    threadRing()->setName(name);
+}
+
+//==============================================================================
+// TRACING
+//==============================================================================
+
+void C_PerfProbes::startTracing()
+{
+    if(++s_lastTraceEpoch == 0)
+        s_lastTraceEpoch = 1;
+    s_traceStart = now();
+    s_traceEnd = 0;
+    s_traceEpoch.store(s_lastTraceEpoch, std::memory_order_release);
+}
+
+void C_PerfProbes::stopTracing()
+{
+    if(!isTracing())
+        return;
+    s_traceEpoch.store(0, std::memory_order_release);
+    s_traceEnd = now();
+}
+
+// Writes the events of one thread
+struct TraceEventWriter
+{
+    FILE* file;
+    unsigned tid;
+    uint64_t start, end;
+
+    void operator()(const PerfSample& s)
+    {
+        if(s.start < start || (end && s.end > end))
+            return;
+
+        bool render = s.stage == PERF_PAINT || s.stage == PERF_DRAW || s.stage == PERF_UPLOAD ||
+                      s.stage == PERF_NORMALS;
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                      "\"ts\":%.3f,\"dur\":%.3f",
+                C_PerfProbes::getStageName((PerfStage)s.stage), render ? "render" : "sim",
+                tid, (s.start - start) * 1e-3, (s.end - s.start) * 1e-3);
+        if(s.stage == PERF_CONSTRAINT_ITER)
+            fprintf(file, ",\"args\":{\"iteration\":%u}", s.arg);
+        fprintf(file, "}");
+    }
+};
+
+bool C_PerfProbes::writeChromeTrace(const char* path)
+{
+    FILE* f = fopen(path, "w");
+    if(!f)
+        return false;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    fprintf(f, "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"cloth\"}}");
+
+    C_PerfRing* rings[PERF_MAX_THREADS];
+    unsigned numRings = getRings(rings, PERF_MAX_THREADS);
+    for(unsigned r = 0; r < numRings; ++r)
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                rings[r]->getThreadIndex(), rings[r]->getName());
+
+    TraceEventWriter writer = { f, 0, s_traceStart, isTracing() ? 0 : s_traceEnd };
+    for(unsigned r = 0; r < numRings; ++r)
+    {
+        writer.tid = rings[r]->getThreadIndex();
+        rings[r]->forEachTraced(s_lastTraceEpoch, writer);
+    }
+
+    fprintf(f, "\n]}\n");
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
@@ -0,0 +1,206 @@
+/*==============================================================================
+/ perfprobe.h
+/ Scoped timing probes for the simulation and render hot paths.
+/
+/ Probes are only compiled in when CLOTH_PROFILING is defined, otherwise the
+/ PERF_SCOPE macros expand to nothing.  Each probe reads the steady clock on
+/ entry and exit and writes one sample into a ring buffer owned by the
+/ calling thread, so recording never takes a lock.  The rings are read back
+/ by C_PerfProbes::getStats() as rolling per-stage statistics.
+/
+/ While tracing is switched on every sample is also appended to a per-thread
+/ trace log, which writeChromeTrace() saves as Chrome trace-event JSON for
+/ chrome://tracing or the Perfetto UI.
+/=============================================================================*/
+
+#ifndef _PERFPROBE_
+#define _PERFPROBE_
+
+#include <atomic>
+#include <stdint.h>
+
+// The stages a probe can time
+enum PerfStage
+{
+    PERF_STEP,              // I_ParticleSystem::stepSimulation()
+    PERF_SUMFORCES,
+    PERF_INTEGRATE,
+    PERF_CONSTRAINTS,       // All of applyConstraints()
+    PERF_CONSTRAINT_ITER,   // One solver iteration, the argument is its index
+    PERF_PAINT,             // GLViewPort::paintGL()
+    PERF_DRAW,              // Cloth draw calls inside paintGL()
+    PERF_UPLOAD,            // Handing the cloth's vertices to GL
+    PERF_NORMALS,           // C_Cloth::updateNormals()
+    PERF_BOUNDS,            // C_Cloth::updateTileBounds()
+    PERF_SELF_COLLISION,    // One pass of C_Cloth::solveSelfCollisions()
+    PERF_BVH,               // Refitting the triangle tree in C_Cloth::updateBVH()
+    PERF_CCD,               // C_Cloth::solveContinuousCollisions()
+    PERF_TEARING,           // Splitting and compacting in C_Cloth::tearSprings()
+    PERF_NUM_STAGES
+};
+
+// Samples kept per thread, a power of two
+#define PERF_RING_SIZE 8192
+
+// Samples per block of a thread's trace log, and the most blocks it may use
+#define PERF_TRACE_BLOCK_SIZE 16384
+#define PERF_TRACE_MAX_BLOCKS 64
+
+// Histogram bins, bin 0 is below 1us and bin k holds [2^(k-1), 2^k) us
+#define PERF_HISTOGRAM_BINS 20
+
+struct PerfSample
+{
+    uint64_t start, end;    // Nanoseconds on the steady clock
+    uint32_t stage;
+    uint32_t arg;
+};
+
+// Rolling statistics of one stage over a time window
+struct PerfStageStats
+{
+    unsigned count;
+    double meanUs, p50Us, p99Us, maxUs;
+    double perSecond;       // count divided by the window length
+    unsigned histogram[PERF_HISTOGRAM_BINS];
+};
+
+//------------------------------------------------------------------------------
+// The samples written by one thread.  Only that thread writes, any thread may
+// read with C_PerfProbes.
+//------------------------------------------------------------------------------
+class C_PerfRing
+{
+public:
+    C_PerfRing(unsigned threadIndex);
+    ~C_PerfRing();
+
+    void push(uint32_t stage, uint64_t start, uint64_t end, uint32_t arg, unsigned traceEpoch)
+    {
+        uint64_t h = d_head.load(std::memory_order_relaxed);
+        PerfSample& s = d_samples[h & (PERF_RING_SIZE - 1)];
+        s.start = start;
+        s.end = end;
+        s.stage = stage;
+        s.arg = arg;
+        d_head.store(h + 1, std::memory_order_release);
+
+        if(traceEpoch)
+            appendTrace(s, traceEpoch);
+    }
+
+    // Copies up to max of the newest samples into out, oldest first.
+    // Returns the number copied.
+    unsigned read(PerfSample* out, unsigned max) const;
+
+    // Calls f(sample) for each sample traced during the given epoch
+    template<class F>
+    void forEachTraced(unsigned epoch, F& f) const
+    {
+        if(d_uTraceEpoch != epoch)
+            return;
+        uint64_t count = d_traceCount.load(std::memory_order_acquire);
+        for(unsigned b = 0; count; ++b)
+        {
+            unsigned n = count < PERF_TRACE_BLOCK_SIZE ? (unsigned)count : PERF_TRACE_BLOCK_SIZE;
+            for(unsigned i = 0; i < n; ++i)
+                f(d_traceBlocks[b][i]);
+            count -= n;
+        }
+    }
+
+    unsigned getThreadIndex() const { return d_uThreadIndex; }
+
+    void setName(const char* name);
+    const char* getName() const { return d_name; }
+
+private:
+    void appendTrace(const PerfSample& s, unsigned epoch);
+
+    PerfSample d_samples[PERF_RING_SIZE];
+    std::atomic<uint64_t> d_head;       // Total samples ever pushed
+    unsigned d_uThreadIndex;            // Order in which the thread first recorded
+    char d_name[32];
+
+    // The trace log, blocks are kept and reused by later traces
+    PerfSample* d_traceBlocks[PERF_TRACE_MAX_BLOCKS];
+    std::atomic<uint64_t> d_traceCount; // Samples logged during d_uTraceEpoch
+    unsigned d_uTraceEpoch;
+};
+
+//------------------------------------------------------------------------------
+// Access to the probes of every thread
+//------------------------------------------------------------------------------
+class C_PerfProbes
+{
+public:
+    // The current time in nanoseconds on the steady clock
+    static uint64_t now();
+
+    // Records a sample in the calling thread's ring
+    static void record(PerfStage stage, uint64_t start, uint64_t end, uint32_t arg = 0)
+    {
+        threadRing()->push(stage, start, end, arg, s_traceEpoch.load(std::memory_order_relaxed));
+    }
+
+    // Statistics of the stage's samples that ended within the last
+    // windowSeconds, across all threads.  Returns false if there were none.
+    static bool getStats(PerfStage stage, double windowSeconds, PerfStageStats& stats);
+
+    // Durations in microseconds of the stage's newest samples, oldest first.
+    // Returns the number written to out.
+    static unsigned getRecent(PerfStage stage, double* out, unsigned max);
+
+    static const char* getStageName(PerfStage stage);
+
+    // The calling thread's ring, created on first use
+    static C_PerfRing* threadRing();
+
+    // The rings of every thread that has recorded so far
+    static unsigned getRings(C_PerfRing** out, unsigned max);
+
+    // Names the calling thread in traces
+    static void setThreadName(const char* name);
+
+    // Starts a new trace, dropping the previous one, or stops the current one
+    static void startTracing();
+    static void stopTracing();
+    static bool isTracing() { return s_traceEpoch.load(std::memory_order_relaxed) != 0; }
+
+    // Writes the current or last trace as Chrome trace-event JSON.  Should be
+    // called while no simulation step is running.  Returns false if the file
+    // could not be written.
+    static bool writeChromeTrace(const char* path);
+
+private:
+    // Non zero while tracing, identifies the trace being recorded
+    static std::atomic<unsigned> s_traceEpoch;
+};
+
+//------------------------------------------------------------------------------
+// Times the enclosing scope
+//------------------------------------------------------------------------------
+class C_PerfScope
+{
+public:
+    C_PerfScope(PerfStage stage, uint32_t arg = 0) : d_stage(stage), d_arg(arg), d_start(C_PerfProbes::now()) {}
+    ~C_PerfScope() { C_PerfProbes::record(d_stage, d_start, C_PerfProbes::now(), d_arg); }
+
+private:
+    PerfStage d_stage;
+    uint32_t d_arg;
+    uint64_t d_start;
+};
+
+#define PERF_CONCAT2(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT2(a, b)
+
+#ifdef CLOTH_PROFILING
+    #define PERF_SCOPE(stage) C_PerfScope PERF_CONCAT(perfScope, __LINE__)(stage)
+    #define PERF_SCOPE_ARG(stage, arg) C_PerfScope PERF_CONCAT(perfScope, __LINE__)(stage, arg)
+#else
+    #define PERF_SCOPE(stage)
+    #define PERF_SCOPE_ARG(stage, arg)
+#endif
+
+#endif
@@ -0,0 +1,210 @@
+/*==============================================================================
+/ spatialhash.cpp
+/ A hashed uniform grid of points, built over the worker threads.
+/=============================================================================*/
+
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "spatialhash.h"
+
+// Buckets summed by one chunk of the scan
+#define SCAN_BLOCK 4096
+
+// Points or buckets handed to a worker at a time
+#define HASH_GRAIN 4096
+
+//==============================================================================
+// WORKER TASKS
+//==============================================================================
+
+// Finds and counts the bucket of each point
+struct C_SpatialHash::KeyTask
+{
+    C_SpatialHash* hash;
+    const float* points;
+    unsigned stride;
+    void operator()(unsigned begin, unsigned end, unsigned)
+    {
+        for(unsigned i = begin; i < end; ++i)
+        {
+            const float* p = points + (size_t)i * stride;
+            unsigned b = hash->cellBucket(hash->cellCoord(p[0]), hash->cellCoord(p[1]), hash->cellCoord(p[2]));
+            hash->d_pKey[i] = b;
+            hash->d_pCount[b].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Sums the counts of blocks of buckets, the first pass writes each block's
+// local offsets and total, the second adds the totals of the blocks before
+struct C_SpatialHash::ScanTask
+{
+    C_SpatialHash* hash;
+    bool addBlocks;
+    void operator()(unsigned begin, unsigned end, unsigned)
+    {
+        for(unsigned blk = begin; blk < end; ++blk)
+        {
+            const unsigned first = blk * SCAN_BLOCK;
+            const unsigned last = first + SCAN_BLOCK < hash->d_uTableSize ? first + SCAN_BLOCK : hash->d_uTableSize;
+            if(addBlocks)
+            {
+                const unsigned offset = hash->d_pBlockSums[blk];
+                for(unsigned b = first; b < last; ++b)
+                    hash->d_pStart[b] += offset;
+                continue;
+            }
+
+            unsigned sum = 0;
+            for(unsigned b = first; b < last; ++b)
+            {
+                hash->d_pStart[b] = sum;
+                sum += hash->d_pCount[b].load(std::memory_order_relaxed);
+            }
+            hash->d_pBlockSums[blk] = sum;
+        }
+    }
+};
+
+// Writes each point into its bucket, counting the bucket back down to zero
+// for the next build
+struct C_SpatialHash::FillTask
+{
+    C_SpatialHash* hash;
+    const float* points;
+    unsigned stride;
+    void operator()(unsigned begin, unsigned end, unsigned)
+    {
+        for(unsigned i = begin; i < end; ++i)
+        {
+            const float* p = points + (size_t)i * stride;
+            const unsigned b = hash->d_pKey[i];
+            const unsigned slot = hash->d_pCount[b].fetch_sub(1, std::memory_order_relaxed) - 1;
+            Entry& e = hash->d_pEntries[hash->d_pStart[b] + slot];
+            e.index = i;
+            e.x = hash->cellCoord(p[0]);
+            e.y = hash->cellCoord(p[1]);
+            e.z = hash->cellCoord(p[2]);
+        }
+    }
+};
+
+// Sorts each bucket by point index, the threads filled them in any order
+struct C_SpatialHash::SortTask
+{
+    C_SpatialHash* hash;
+    void operator()(unsigned begin, unsigned end, unsigned)
+    {
+        Entry* e = hash->d_pEntries;
+        for(unsigned b = begin; b < end; ++b)
+        {
+            const unsigned first = hash->d_pStart[b], last = hash->d_pStart[b + 1];
+            for(unsigned i = first + 1; i < last; ++i)
+            {
+                Entry v = e[i];
+                unsigned j = i;
+                for(; j > first && e[j - 1].index > v.index; --j)
+                    e[j] = e[j - 1];
+                e[j] = v;
+            }
+        }
+    }
+};
+
+//==============================================================================
+// CONSTRUCTORS / DESTRUCTORS
+//==============================================================================
+
+C_SpatialHash::C_SpatialHash() : d_fCellSize(1.0f), d_fInvCellSize(1.0f), d_uTableSize(0),
+    d_uNumPoints(0), d_uCapacity(0), d_pKey(0), d_pStart(0), d_pBlockSums(0), d_pEntries(0),
+    d_pCount(0)
+{
+}
+
+C_SpatialHash::~C_SpatialHash()
+{
+    delete [] d_pKey;
+    delete [] d_pStart;
+    delete [] d_pEntries;
+    delete [] d_pBlockSums;
+    delete [] d_pCount;
+}
+
+
+//==============================================================================
+// PUBLIC METHODS
+//==============================================================================
+
+//------------------------------------------------------------------------------
+// void reserve()
+//
+// Makes room for n points in a table of at least twice as many buckets.
+// The arrays only ever grow.
+//------------------------------------------------------------------------------
+void C_SpatialHash::reserve(unsigned n)
+{
+    if(n <= d_uCapacity)
+        return;
+
+    delete [] d_pKey;
+    delete [] d_pStart;
+    delete [] d_pEntries;
+    delete [] d_pBlockSums;
+    delete [] d_pCount;
+
+    d_uTableSize = 1024;
+    while(d_uTableSize < n * 2)
+        d_uTableSize *= 2;
+
+    d_uCapacity = n;
+    d_pKey = new unsigned[n];
+    d_pEntries = new Entry[n];
+    d_pStart = new unsigned[d_uTableSize + 1];
+    d_pBlockSums = new unsigned[(d_uTableSize + SCAN_BLOCK - 1) / SCAN_BLOCK];
+    d_pCount = new std::atomic<unsigned>[d_uTableSize];
+    for(unsigned b = 0; b < d_uTableSize; ++b)
+        d_pCount[b].store(0, std::memory_order_relaxed);
+}
+
+
+//------------------------------------------------------------------------------
+// void build()
+//
+// Rebuilds the table from scratch.  The counts start and end every build at
+// zero, so nothing has to be cleared in between.
+//------------------------------------------------------------------------------
+void C_SpatialHash::build(const float* points, unsigned stride, unsigned n, float cellSize,
+                          C_WorkerPool& workers)
+{
+    reserve(n);
+    d_uNumPoints = n;
+    d_fCellSize = cellSize > 0.0f ? cellSize : 1.0f;
+    d_fInvCellSize = 1.0f / d_fCellSize;
+    if(!n)
+        return;
+
+    KeyTask keys = { this, points, stride };
+    workers.parallelFor(n, HASH_GRAIN, keys);
+
+    const unsigned numBlocks = (d_uTableSize + SCAN_BLOCK - 1) / SCAN_BLOCK;
+    ScanTask scan = { this, false };
+    workers.parallelFor(numBlocks, 1, scan);
+    unsigned sum = 0;
+    for(unsigned blk = 0; blk < numBlocks; ++blk)
+    {
+        unsigned s = d_pBlockSums[blk];
+        d_pBlockSums[blk] = sum;
+        sum += s;
+    }
+    scan.addBlocks = true;
+    workers.parallelFor(numBlocks, 1, scan);
+    d_pStart[d_uTableSize] = sum;
+
+    FillTask fill = { this, points, stride };
+    workers.parallelFor(n, HASH_GRAIN, fill);
+
+    SortTask sort = { this };
+    workers.parallelFor(d_uTableSize, HASH_GRAIN, sort);
+}
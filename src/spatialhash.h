@@ -0,0 +1,111 @@
+/*==============================================================================
+/ spatialhash.h
+/ Sorts points into a uniform grid of cubic cells that is hashed into a
+/ fixed size table, so the points near any position can be found without
+/ looking at the others.  The grid has no bounds, any point can be stored.
+/
+/ The table is built with a counting sort over the worker threads: each
+/ point's bucket is found and counted, the counts are summed into the first
+/ entry of each bucket, then the points are written into their buckets and
+/ each bucket is sorted so that a build always gives the same table.
+/ Several cells may share a bucket, so each entry keeps its cell and a query
+/ skips the entries of other cells.
+/=============================================================================*/
+
+#ifndef _SPATIALHASH_
+#define _SPATIALHASH_
+
+//==============================================================================
+// INCLUDED LIBRARIES AND FILES
+//==============================================================================
+#include "vector3.h"
+#include "C_WorkerPool.h"
+#include <atomic>
+#include <math.h>
+
+//==============================================================================
+// CLASS DEFINITION
+//==============================================================================
+class C_SpatialHash
+{
+private:
+    // Loop bodies handed to the worker pool, defined in spatialhash.cpp
+    struct KeyTask;
+    struct ScanTask;
+    struct FillTask;
+    struct SortTask;
+
+    // A point in the table and the cell it is in
+    struct Entry
+    {
+        unsigned index;
+        int x, y, z;
+    };
+
+    //----------------------------------------------------------------------
+    // Private Members
+    //----------------------------------------------------------------------
+    float d_fCellSize, d_fInvCellSize;
+    unsigned d_uTableSize,          // Buckets, a power of two
+             d_uNumPoints,
+             d_uCapacity;           // Points the arrays have room for
+
+    unsigned *d_pKey,               // The bucket of each point
+             *d_pStart,             // First entry of each bucket, one past the last bucket at the end
+             *d_pBlockSums;         // Partial sums of the scan
+    Entry *d_pEntries;              // The points grouped by bucket
+    std::atomic<unsigned> *d_pCount;    // Points per bucket while building
+
+    //----------------------------------------------------------------------
+    // Private Methods
+    //----------------------------------------------------------------------
+    unsigned cellBucket(int x, int y, int z) const
+    {
+        return ((unsigned)x * 73856093u ^ (unsigned)y * 19349663u ^ (unsigned)z * 83492791u) & (d_uTableSize - 1);
+    }
+
+    int cellCoord(float v) const { return (int)floorf(v * d_fInvCellSize); }
+
+public:
+        //----------------------------------------------------------------------
+        // Public Methods
+        //----------------------------------------------------------------------
+        C_SpatialHash();
+        ~C_SpatialHash();
+
+        // Sorts n points, whose coordinates start every stride floats from
+        // points, into cells of the given size
+        void build(const float* points, unsigned stride, unsigned n, float cellSize, C_WorkerPool& workers);
+
+        // Makes room for n points, so builds of up to that many never
+        // allocate.  build() calls it itself.
+        void reserve(unsigned n);
+
+        float getCellSize() const { return d_fCellSize; }
+        unsigned getPointCount() const { return d_uNumPoints; }
+
+        // Calls f(index) for every point stored in the 27 cells around p,
+        // which holds every point within one cell size of it
+        template<class F>
+        void forEachNear(const vector3f& p, F& f) const
+        {
+            if(!d_uNumPoints)
+                return;
+
+            const int cx = cellCoord(p.x), cy = cellCoord(p.y), cz = cellCoord(p.z);
+            for(int z = cz - 1; z <= cz + 1; ++z)
+                for(int y = cy - 1; y <= cy + 1; ++y)
+                    for(int x = cx - 1; x <= cx + 1; ++x)
+                    {
+                        const unsigned b = cellBucket(x, y, z);
+                        const Entry* e = d_pEntries + d_pStart[b];
+                        const Entry* last = d_pEntries + d_pStart[b + 1];
+                        for(; e != last; ++e)
+                            if(e->x == x && e->y == y && e->z == z)
+                                f(e->index);
+                    }
+        }
+};
+
+
+#endif